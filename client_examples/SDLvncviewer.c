@@ -56,8 +56,8 @@ static rfbBool resize(rfbClient* client) {
 	    rfbClientErr("resize: error creating surface: %s\n", SDL_GetError());
 
 	rfbClientSetClientData(client, SDL_Init, sdl);
-	client->width = sdl->pitch / (depth / 8);
 	client->frameBuffer=sdl->pixels;
+	client->frameBufferStride=sdl->pitch;
 
 	client->format.bitsPerPixel=depth;
 	client->format.redShift=sdl->format->Rshift;
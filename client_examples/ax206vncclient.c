@@ -19,14 +19,33 @@
  */
 
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <rfb/rfbclient.h>
 #include <stdbool.h>
 #include "libusb-1.0/libusb.h"
 
 // VNC stuff
 
-static rfbClient *cl;
-static bool framebuffer_allocated = FALSE;
+#define MAX_SOURCES 8           // Main source plus insets
+
+/*
+ * A VNC connection shown on the panel. Its remote desktop is scaled down
+ * by an integer factor to fit into the destination rectangle. Later
+ * sources are drawn on top of earlier ones, source 0 is the main one.
+ */
+typedef struct {
+    rfbClient *client;
+    int index;
+    int dx, dy, dw, dh;         // Destination rectangle on the panel
+    int scale;                  // Local downscale factor
+} Source;
+
+static Source sources[MAX_SOURCES];
+static int nsources;
+static unsigned char *owner;    // Index of the topmost source per panel pixel
+static int sourceTag;           // rfbClientGetClientData() tag
 
 
 static void ErrorLog (const char *format, ...);
@@ -51,6 +70,14 @@ static void DefaultLog (const char *format, ...);
 #define USBCMD_SETPROPERTY  0x01        // USB command: Set property
 #define USBCMD_BLIT         0x12        // USB command: Blit to screen
 
+// Transfer timeouts in ms, kept short: recovery does the retrying
+#define USB_CMD_TIMEOUT     500
+#define USB_DATA_TIMEOUT    1500        // A full 480x320 blit takes ~300ms
+#define USB_ACK_TIMEOUT     500
+#define USB_DRAIN_TIMEOUT   50
+
+#define USB_BACKOFF_MAX     8           // Longest wait between resets, in s
+
 /* Generic SCSI device stuff */
 
 #define DIR_IN  0
@@ -93,13 +120,45 @@ typedef
     libusb_device_handle *udev;
     unsigned int width;
     unsigned int height;
+    uint32_t tag;               // dCBWTag of the last command
 } DPFContext;
 
+/*
+ * All USB transfers are done by a thread of their own, so that neither a
+ * slow blit nor a panel that stopped answering holds up reading from VNC.
+ * flush() merely adds the dirty rectangle to the pending one. When a
+ * transfer fails, the thread steps through the recovery states, each of
+ * which costs at most a few short timeouts, and once the panel answers
+ * again it is sent in full, as it has missed any number of updates.
+ */
+typedef enum {
+    USB_OK,                     // Blitting
+    USB_CLEAR_HALT,             // Clear stalled endpoints, drop stale status
+    USB_RESYNC,                 // Check that commands and status line up
+    USB_RESET,                  // Reset the device, or open it again
+} UsbState;
+
+static struct {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t mutex;      // Guards lcdBuf, the dirty and pending rectangles
+    pthread_cond_t cond;
+    const char *device;         // Name to open it again by
+    UsbState state;
+    int backoff;                // Seconds to wait before the next reset
+    bool stop;
+
+    // Pending rectangle, not sent yet
+    int minx, maxx;
+    int miny, maxy;
+} usb;
+
 
 DPFAXHANDLE dpf_ax_open(const char *dev);
 void dpf_ax_close(DPFAXHANDLE h);
 static int wrap_scsi(DPFContext * h, unsigned char *cmd, int cmdlen, char out,
                      unsigned char *data, unsigned long block_len);
+static int dpf_ax_get_lcd_size(DPFContext * dpf);
 
 
 int DROWS, DCOLS;        /* display size */
@@ -154,6 +213,8 @@ DPFAXHANDLE dpf_ax_open(const char *dev)
         r = libusb_get_device_descriptor(devs[i], &desc);
         if (r < 0) {
             ErrorLog("dpf_ax_open: failed to get device descriptor");
+            libusb_free_device_list(devs, 1);
+            libusb_exit(NULL);
             return NULL;
         }
 
@@ -170,12 +231,16 @@ DPFAXHANDLE dpf_ax_open(const char *dev)
 
     if (!d) {
         ErrorLog("dpf_ax_open: no matching USB device '%s' found!\n", dev);
+        libusb_free_device_list(devs, 1);
+        libusb_exit(NULL);
         return NULL;
     }
 
     dpf = (DPFContext *) malloc(sizeof(DPFContext));
     if (!dpf) {
         ErrorLog("dpf_ax_open: error allocation memory.\n");
+        libusb_free_device_list(devs, 1);
+        libusb_exit(NULL);
         return NULL;
     }
 
@@ -183,6 +248,8 @@ DPFAXHANDLE dpf_ax_open(const char *dev)
     if ((r != 0) || (u == NULL)) {
         ErrorLog("dpf_ax_open: failed to open usb device '%s'!\n", dev);
         free(dpf);
+        libusb_free_device_list(devs, 1);
+        libusb_exit(NULL);
         return NULL;
     }
 
@@ -192,11 +259,30 @@ DPFAXHANDLE dpf_ax_open(const char *dev)
         ErrorLog("dpf_ax_open: failed to claim usb device, error %d = %s = %s\n", r, libusb_error_name(r), libusb_strerror(r));
         libusb_close(u);
         free(dpf);
+        libusb_exit(NULL);
         return NULL;
     }
 
     dpf->udev = u;
+    dpf->tag = 0;
+
+    if (dpf_ax_get_lcd_size(dpf) == 0) {
+        DefaultLog("dpf_ax_open: got LCD dimensions: %dx%d\n", dpf->width, dpf->height);
+    } else {
+        ErrorLog("dpf_ax_open: error reading LCD dimensions!\n");
+        dpf_ax_close(dpf);
+        return NULL;
+    }
+    return (DPFAXHANDLE) dpf;
+}
+
+
 
+/**
+ * Read the LCD dimensions, also a harmless command to test the link with.
+ */
+static int dpf_ax_get_lcd_size(DPFContext * dpf)
+{
     static unsigned char buf[5];
     static unsigned char cmd[16] = {
         0xcd, 0, 0, 0,
@@ -204,23 +290,20 @@ DPFAXHANDLE dpf_ax_open(const char *dev)
         0, 0, 0, 0,
         0, 0, 0, 0
     };
+    int r;
+
     cmd[5] = 2;                 // get LCD parameters
-    if (wrap_scsi(dpf, cmd, sizeof(cmd), DIR_IN, buf, 5) == 0) {
+    r = wrap_scsi(dpf, cmd, sizeof(cmd), DIR_IN, buf, 5);
+    if (r == 0) {
         dpf->width = (buf[0]) | (buf[1] << 8);
         dpf->height = (buf[2]) | (buf[3] << 8);
-        DefaultLog("dpf_ax_open: got LCD dimensions: %dx%d\n", dpf->width, dpf->height);
-    } else {
-        ErrorLog("dpf_ax_open: error reading LCD dimensions!\n");
-        dpf_ax_close(dpf);
-        return NULL;
     }
-    return (DPFAXHANDLE) dpf;
+    return r;
 }
 
 
-
 /**
- *  Close DPF device
+ *  Close DPF device, and the libusb_init() of dpf_ax_open() with it
  */
 void dpf_ax_close(DPFAXHANDLE h)
 {
@@ -229,6 +312,7 @@ void dpf_ax_close(DPFAXHANDLE h)
     libusb_release_interface(dpf->udev, 0);
     libusb_close(dpf->udev);
     free(dpf);
+    libusb_exit(NULL);
 }
 
 
@@ -295,8 +379,9 @@ unsigned char g_excmd[16] = {
  *
  * \param buf     buffer to 16 bpp RGB 565 image data
  * \param rect    rectangle tuple: [x0, y0, x1, y1]
+ * \return        0, or the libusb error or status of the panel
  */
-void dpf_ax_screen_blit(DPFAXHANDLE h, const unsigned char *buf, short rect[4])
+int dpf_ax_screen_blit(DPFAXHANDLE h, const unsigned char *buf, short rect[4])
 {
     unsigned long len = (rect[2] - rect[0]) * (rect[3] - rect[1]);
     len <<= 1;
@@ -313,7 +398,7 @@ void dpf_ax_screen_blit(DPFAXHANDLE h, const unsigned char *buf, short rect[4])
     cmd[14] = (rect[3] - 1) >> 8;
     cmd[15] = 0;
 
-    wrap_scsi((DPFContext *) h, cmd, sizeof(g_excmd), DIR_OUT, (unsigned char *) buf, len);
+    return wrap_scsi((DPFContext *) h, cmd, sizeof(g_excmd), DIR_OUT, (unsigned char *) buf, len);
 }
 
 
@@ -347,50 +432,237 @@ static int wrap_scsi(DPFContext * h, unsigned char *cmd, int cmdlen, char out,
     g_buf[14] = cmdlen;
     memcpy(&g_buf[15], cmd, cmdlen);
 
+    // A new tag per command tells its status from that of an earlier one
+    h->tag++;
+    g_buf[4] = h->tag;
+    g_buf[5] = h->tag >> 8;
+    g_buf[6] = h->tag >> 16;
+    g_buf[7] = h->tag >> 24;
+
     g_buf[8] = block_len;
     g_buf[9] = block_len >> 8;
     g_buf[10] = block_len >> 16;
     g_buf[11] = block_len >> 24;
 
-    ret = libusb_bulk_transfer(h->udev, ENDPT_OUT, g_buf, sizeof(g_buf), &transfered, 1000);
+    ret = libusb_bulk_transfer(h->udev, ENDPT_OUT, g_buf, sizeof(g_buf), &transfered, USB_CMD_TIMEOUT);
     if (ret != 0)
         return ret;
 
     if (out == DIR_OUT) {
         if (data) {
-            ret = libusb_bulk_transfer(h->udev, ENDPT_OUT, data, block_len, &transfered, 3000);
+            ret = libusb_bulk_transfer(h->udev, ENDPT_OUT, data, block_len, &transfered, USB_DATA_TIMEOUT);
             if ((ret != 0) || (transfered != (int) block_len)) {
                 fprintf(stderr, "dpf_ax ERROR: bulk write.\n");
-                return ret;
+                return ret != 0 ? ret : -1;
             }
         }
     } else if (data) {
-        ret = libusb_bulk_transfer(h->udev, ENDPT_IN, data, block_len, &transfered, 4000);
+        ret = libusb_bulk_transfer(h->udev, ENDPT_IN, data, block_len, &transfered, USB_DATA_TIMEOUT);
         if ((ret != 0) || (transfered != (int) block_len)) {
             fprintf(stderr, "dpf_ax ERROR: bulk read.\n");
-            return ret;
+            return ret != 0 ? ret : -1;
         }
     }
-    // get ACK:
+    // get ACK: a panel that does not answer is recovered by the caller, only
+    // the late status of a command that timed out before ours is skipped
     len = sizeof(ansbuf);
-    int retry = 0;
-    int timeout = 0;
-    do {
-        timeout = 0;
-        ret = libusb_bulk_transfer(h->udev, ENDPT_IN, ansbuf, len, &transfered, 5000);
+    int retry;
+    for (retry = 0; retry < 2; retry++) {
+        ret = libusb_bulk_transfer(h->udev, ENDPT_IN, ansbuf, len, &transfered, USB_ACK_TIMEOUT);
         if ((ret != 0) || (transfered != (int) len)) {
             fprintf(stderr, "dpf_ax ERROR: bulk ACK read. ret = %d transfered = %d expected %d\n", ret, transfered,
                     len);
-            timeout = 1;
+            return ret != 0 ? ret : -1;
         }
-        retry++;
-    } while (timeout && retry < 5);
-    if (strncmp((char *) ansbuf, "USBS", 4)) {
-        fprintf(stderr, "dpf_ax ERROR: got invalid reply\n.");
-        return -1;
+        if (strncmp((char *) ansbuf, "USBS", 4)) {
+            fprintf(stderr, "dpf_ax ERROR: got invalid reply\n.");
+            return -1;
+        }
+        // pass back return code set by peer:
+        if (memcmp(&ansbuf[4], &g_buf[4], 4) == 0)
+            return ansbuf[12];
+        // the status of a command that timed out earlier, ours may follow
+        fprintf(stderr, "dpf_ax ERROR: reply to an earlier command\n");
     }
-    // pass back return code set by peer:
-    return ansbuf[12];
+    return -1;
+}
+
+
+/*
+ * Wait for up to seconds, or until asked to stop. Returns false on stop.
+ */
+static bool usb_wait(int seconds)
+{
+    struct timespec until;
+    bool stop;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += seconds;
+    pthread_mutex_lock(&usb.mutex);
+    // flush() signals as well, so wait out the whole time
+    while (!usb.stop && pthread_cond_timedwait(&usb.cond, &usb.mutex, &until) != ETIMEDOUT)
+        ;
+    stop = usb.stop;
+    pthread_mutex_unlock(&usb.mutex);
+    return !stop;
+}
+
+
+/*
+ * One step of error recovery, from the cheapest to the most drastic. The
+ * panel has to answer a command with its own tag before it is used again.
+ */
+static void usb_recover(void)
+{
+    DPFContext *h = (DPFContext *) dpf.dpfh;
+    unsigned char ansbuf[13];
+    int transfered, i, r;
+
+    switch (usb.state) {
+    case USB_CLEAR_HALT:
+        libusb_clear_halt(h->udev, ENDPT_OUT);
+        libusb_clear_halt(h->udev, ENDPT_IN);
+        // Throw away status the panel may still have queued
+        for (i = 0; i < 4; i++)
+            if (libusb_bulk_transfer(h->udev, ENDPT_IN, ansbuf, sizeof(ansbuf), &transfered,
+                                     USB_DRAIN_TIMEOUT) != 0)
+                break;
+        usb.state = USB_RESYNC;
+        break;
+
+    case USB_RESYNC:
+        if (dpf_ax_get_lcd_size(h) != 0) {
+            usb.state = USB_RESET;
+            break;
+        }
+        DefaultLog("dpf: panel recovered\n");
+        usb.state = USB_OK;
+        usb.backoff = 0;
+        // It missed any number of updates, send all of it in one go
+        pthread_mutex_lock(&usb.mutex);
+        usb.minx = 0;
+        usb.maxx = dpf.pwidth - 1;
+        usb.miny = 0;
+        usb.maxy = dpf.pheight - 1;
+        pthread_mutex_unlock(&usb.mutex);
+        break;
+
+    case USB_RESET:
+        if (usb.backoff > 0 && !usb_wait(usb.backoff))
+            return;
+        usb.backoff = usb.backoff > 0 ? usb.backoff * 2 : 1;
+        if (usb.backoff > USB_BACKOFF_MAX)
+            usb.backoff = USB_BACKOFF_MAX;
+
+        r = h != NULL ? libusb_reset_device(h->udev) : LIBUSB_ERROR_NOT_FOUND;
+        if (r == 0) {
+            ErrorLog("dpf: reset the panel\n");
+            usb.state = USB_RESYNC;
+            break;
+        }
+        // It went away, or came back as a new device
+        ErrorLog("dpf: reset failed (%s), opening %s again\n", libusb_error_name(r), usb.device);
+        if (h != NULL)
+            dpf_ax_close(h);
+        dpf.dpfh = dpf_ax_open(usb.device);
+        if (dpf.dpfh != NULL)
+            usb.state = USB_RESYNC;
+        break;
+
+    case USB_OK:
+        break;
+    }
+}
+
+
+/*
+ * Send whatever is pending, recover when that fails.
+ */
+static void *usb_thread(void *arg)
+{
+    unsigned int cpylength;
+    unsigned char *ps, *pd;
+    short rect[4];
+    int ly, r;
+
+    pthread_mutex_lock(&usb.mutex);
+    while (!usb.stop) {
+        if (usb.state != USB_OK) {
+            pthread_mutex_unlock(&usb.mutex);
+            usb_recover();
+            pthread_mutex_lock(&usb.mutex);
+            continue;
+        }
+        if (usb.minx > usb.maxx || usb.miny > usb.maxy) {
+            pthread_cond_wait(&usb.cond, &usb.mutex);
+            continue;
+        }
+
+        // Copy data in pending rectangle from data buffer to temp transfer buffer
+        cpylength = (usb.maxx - usb.minx + 1) * DPF_BPP;
+        ps = dpf.lcdBuf + (usb.miny * dpf.pwidth + usb.minx) * DPF_BPP;
+        pd = dpf.xferBuf;
+        for (ly = usb.miny; ly <= usb.maxy; ly++) {
+            memcpy(pd, ps, cpylength);
+            ps += dpf.pwidth * DPF_BPP;
+            pd += cpylength;
+        }
+        rect[0] = usb.minx;
+        rect[1] = usb.miny;
+        rect[2] = usb.maxx + 1;
+        rect[3] = usb.maxy + 1;
+        usb.minx = dpf.pwidth - 1;
+        usb.maxx = 0;
+        usb.miny = dpf.pheight - 1;
+        usb.maxy = 0;
+        pthread_mutex_unlock(&usb.mutex);
+
+        r = dpf_ax_screen_blit(dpf.dpfh, dpf.xferBuf, rect);
+        if (r != 0) {
+            ErrorLog("dpf: blit failed (%d), recovering\n", r);
+            usb.state = USB_CLEAR_HALT;
+        }
+        pthread_mutex_lock(&usb.mutex);
+    }
+    pthread_mutex_unlock(&usb.mutex);
+    return NULL;
+}
+
+
+static bool usb_start(const char *device)
+{
+    usb.device = device;
+    usb.state = USB_OK;
+    usb.minx = dpf.pwidth - 1;
+    usb.maxx = 0;
+    usb.miny = dpf.pheight - 1;
+    usb.maxy = 0;
+    pthread_mutex_init(&usb.mutex, NULL);
+    pthread_cond_init(&usb.cond, NULL);
+    if (pthread_create(&usb.thread, NULL, usb_thread, NULL) != 0) {
+        ErrorLog("dpf: cannot create the USB thread\n");
+        return false;
+    }
+    usb.running = true;
+    return true;
+}
+
+
+/*
+ * Stop the USB thread and close the panel.
+ */
+static void close_panel(void)
+{
+    if (usb.running) {
+        pthread_mutex_lock(&usb.mutex);
+        usb.stop = true;
+        pthread_cond_signal(&usb.cond);
+        pthread_mutex_unlock(&usb.mutex);
+        pthread_join(usb.thread, NULL);
+        usb.running = false;
+    }
+    if (dpf.dpfh != NULL)
+        dpf_ax_close(dpf.dpfh);
 }
 
 
@@ -428,58 +700,118 @@ static void request_screen_refresh (GtkMenuItem *menuitem,
 }
 */
 
+/*
+ * Smallest integer factor that makes the remote desktop fit into the
+ * destination rectangle.
+ */
+static int fit_scale(Source *src)
+{
+    int sx = (src->client->width + src->dw - 1) / src->dw;
+    int sy = (src->client->height + src->dh - 1) / src->dh;
+
+    return sx > sy ? (sx > 0 ? sx : 1) : (sy > 0 ? sy : 1);
+}
+
+
 static rfbBool resize (rfbClient *client) {
-	static char first=TRUE;
-	int tmp_width, tmp_height;
-
-	if (first) {
-		first=FALSE;
-		DefaultLog("resize first %d x %d\n", client->width, client->height);
-		client->frameBuffer = malloc(client->width * client->height * 4);
-	} else {
-		DefaultLog("resize later %d x %d\n", client->width, client->height);
-		free(client->frameBuffer);
-		client->frameBuffer = malloc(client->width * client->height * 4);
-	}
+	Source *src = rfbClientGetClientData(client, &sourceTag);
+
+	DefaultLog("resize %d x %d\n", client->width, client->height);
+	free(client->frameBuffer);
+	client->frameBuffer = malloc(client->width * client->height * 4);
+	if (client->frameBuffer == NULL)
+		return FALSE;
+	src->scale = fit_scale(src);
 	return TRUE;
 }
 
 
+/*
+ * Mark which source owns each panel pixel, so that a source never paints
+ * over an inset lying on top of it.
+ */
+static void build_owner_map(void)
+{
+    int i, x, y;
+
+    owner = malloc(dpf.pwidth * dpf.pheight);
+    memset(owner, 0, dpf.pwidth * dpf.pheight);
+    for (i = 1; i < nsources; i++)
+        for (y = sources[i].dy; y < sources[i].dy + sources[i].dh && y < dpf.pheight; y++)
+            for (x = sources[i].dx; x < sources[i].dx + sources[i].dw && x < dpf.pwidth; x++)
+                owner[y * dpf.pwidth + x] = i;
+}
+
+
+/*
+ * Copy a damaged rectangle of a source into lcdBuf, sampling every
+ * scale'th pixel.
+ */
 static void update (rfbClient *cl, int x, int y, int w, int h) {
-    int lx, ly;
+    Source *src = rfbClientGetClientData(cl, &sourceTag);
+    int scale = src->scale;
+    int x0 = x / scale, y0 = y / scale;
+    int x1 = (x + w + scale - 1) / scale, y1 = (y + h + scale - 1) / scale;
+    int lx, ly, px, py;
+    unsigned char *p;
     RGBA pixel;
 
-    // Set pixels one by one
-    // Note: here is room for optimization :-)
-    for (ly = y; ly < y + h; ly++)
-        for (lx = x; lx < x + w; lx++) {
-            pixel.R = cl->frameBuffer[(ly * dpf.pwidth + lx) * 4];
-            pixel.G = cl->frameBuffer[(ly * dpf.pwidth + lx) * 4 + 1];
-            pixel.B = cl->frameBuffer[(ly * dpf.pwidth + lx) * 4 + 2];
-            drv_set_pixel(lx, ly, pixel);
+    if (x1 > src->dw)
+        x1 = src->dw;
+    if (y1 > src->dh)
+        y1 = src->dh;
+
+    pthread_mutex_lock(&usb.mutex);
+    for (ly = y0; ly < y1 && ly * scale < cl->height; ly++) {
+        py = src->dy + ly;
+        if (py >= dpf.pheight)
+            break;
+        for (lx = x0; lx < x1 && lx * scale < cl->width; lx++) {
+            px = src->dx + lx;
+            if (px >= dpf.pwidth)
+                break;
+            if (owner[py * dpf.pwidth + px] != src->index)
+                continue;
+            p = cl->frameBuffer + ((ly * scale) * cl->width + lx * scale) * 4;
+            pixel.R = p[0];
+            pixel.G = p[1];
+            pixel.B = p[2];
+            drv_set_pixel(px, py, pixel);
         }
+    }
+    pthread_mutex_unlock(&usb.mutex);
+}
+
+
+/*
+ * Hand the dirty rectangle of lcdBuf to the USB thread, once per update of
+ * any source. Whatever it has not sent yet is sent along with it.
+ */
+static void flush (rfbClient *cl) {
+    pthread_mutex_lock(&usb.mutex);
 
     // If nothing has changed, skip transfer
-    if (dpf.minx > dpf.maxx || dpf.miny > dpf.maxy)
+    if (dpf.minx > dpf.maxx || dpf.miny > dpf.maxy) {
+        pthread_mutex_unlock(&usb.mutex);
         return;
-
-    // Copy data in dirty rectangle from data buffer to temp transfer buffer
-    unsigned int cpylength = (dpf.maxx - dpf.minx + 1) * DPF_BPP;
-    unsigned char *ps = dpf.lcdBuf + (dpf.miny * dpf.pwidth + dpf.minx) * DPF_BPP;
-    unsigned char *pd = dpf.xferBuf;
-    for (ly = dpf.miny; ly <= dpf.maxy; ly++) {
-        memcpy(pd, ps, cpylength);
-        ps += dpf.pwidth * DPF_BPP;
-        pd += cpylength;
     }
 
-    // Send the buffer
-    short rect[4];
-    rect[0] = dpf.minx;
-    rect[1] = dpf.miny;
-    rect[2] = dpf.maxx + 1;
-    rect[3] = dpf.maxy + 1;
-    dpf_ax_screen_blit(dpf.dpfh, dpf.xferBuf, rect);
+    if (usb.minx > usb.maxx || usb.miny > usb.maxy) {
+        usb.minx = dpf.minx;
+        usb.maxx = dpf.maxx;
+        usb.miny = dpf.miny;
+        usb.maxy = dpf.maxy;
+    } else {
+        if (dpf.minx < usb.minx)
+            usb.minx = dpf.minx;
+        if (dpf.maxx > usb.maxx)
+            usb.maxx = dpf.maxx;
+        if (dpf.miny < usb.miny)
+            usb.miny = dpf.miny;
+        if (dpf.maxy > usb.maxy)
+            usb.maxy = dpf.maxy;
+    }
+    pthread_cond_signal(&usb.cond);
 
     // Reset dirty rectangle
     dpf.minx = dpf.pwidth - 1;
@@ -487,6 +819,7 @@ static void update (rfbClient *cl, int x, int y, int w, int h) {
     dpf.miny = dpf.pheight - 1;
     dpf.maxy = 0;
 
+    pthread_mutex_unlock(&usb.mutex);
 }
 
 
@@ -531,21 +864,96 @@ static void DefaultLog (const char *format, ...)
 
 
 
+static rfbClient *new_client (void)
+{
+	rfbClient *client = rfbGetClient (8, 3, 4);  // TODO: Work out the correct values we need
+
+	client->MallocFrameBuffer = resize;
+	client->canHandleNewFBSize = FALSE;
+	client->GotFrameBufferUpdate = update;
+	client->FinishedFrameBufferUpdate = flush;
+	client->GotXCutText = got_cut_text;
+	client->HandleKeyboardLedState = kbd_leds;
+	client->HandleTextChat = text_chat;
+	client->GetPassword = get_password;
+	return client;
+}
+
+
+/*
+ * Parse "host[:port],x,y,w,h" and connect the inset.
+ */
+static bool add_inset (char *progname, const char *spec)
+{
+	Source *src = &sources[nsources];
+	const char *comma = strchr (spec, ',');
+	char *host;
+	char *args[2];
+	int argcount = 2;
+	int scale;
+
+	if (nsources >= MAX_SOURCES) {
+		ErrorLog("Too many insets, at most %d are supported\n", MAX_SOURCES - 1);
+		return false;
+	}
+	if (comma == NULL ||
+	    sscanf (comma + 1, "%d,%d,%d,%d", &src->dx, &src->dy, &src->dw, &src->dh) != 4 ||
+	    src->dx < 0 || src->dy < 0 || src->dw <= 0 || src->dh <= 0) {
+		ErrorLog("Invalid inset '%s', expected host[:port],x,y,w,h\n", spec);
+		return false;
+	}
+
+	host = strndup (spec, comma - spec);
+	args[0] = progname;
+	args[1] = host;
+
+	src->index = nsources;
+	src->client = new_client ();
+	// Insets are small, trade quality for CPU and bandwidth
+	src->client->canHandleNewFBSize = TRUE;
+	src->client->appData.qualityLevel = 2;
+	src->client->appData.compressLevel = 9;
+	rfbClientSetClientData (src->client, &sourceTag, src);
+
+	DefaultLog("Inset %d: %s at %dx%d+%d+%d\n", nsources, host, src->dw, src->dh, src->dx, src->dy);
+	if (!rfbInitClient (src->client, &argcount, args)) {
+		// rfbInitClient() has cleaned up the client already
+		free (host);
+		return false;
+	}
+	free (host);
+
+	// Ask servers that can scale for a desktop that already fits
+	scale = fit_scale (src);
+	if (scale > 1)
+		SendScaleSetting (src->client, scale);
+
+	nsources++;
+	return true;
+}
+
+
+
 int main (int argc, char *argv[])
 {
-	int    i;
-	bool   debug;
+	int    i, j;
     int    vncargc;
     char **vncargv;
+    fd_set fds;
+    int    maxfd;
+    struct timeval timeout;
+    int    vx, vy, vw = 0, vh = 0;
 
 // Try to open the USB display
 
     if (argc < 2) {
         ErrorLog("No dpf device or VNC service specified\n");
         DefaultLog("Usage:\n");
-        DefaultLog("%s dpf server\n", argv[0]);
+        DefaultLog("%s dpf [--viewport x,y,w,h] [--inset host[:port],x,y,w,h]... server\n", argv[0]);
         DefaultLog("e.g:\n");
         DefaultLog("%s usb0 server.domain:port\n", argv[0]);
+        DefaultLog("%s usb0 --inset other.domain,320,200,160,120 server.domain:port\n", argv[0]);
+        DefaultLog("%s usb0 --viewport 1440,0,480,320 server.domain:port\n", argv[0]);
         return -1;
     }
 
@@ -575,49 +983,99 @@ int main (int argc, char *argv[])
     DROWS = dpf.pheight;
     DCOLS = dpf.pwidth;
 
-    vncargc = argc - 1;
-    vncargv = &argv[1];
-
-
     rfbClientLog = DefaultLog;
     rfbClientErr = ErrorLog;
 
-	cl = rfbGetClient (8, 3, 4);  // TODO: Work out the correct values we need
-	cl->MallocFrameBuffer = resize;
-	cl->canHandleNewFBSize = FALSE;
-	cl->GotFrameBufferUpdate = update;
-	cl->GotXCutText = got_cut_text;
-	cl->HandleKeyboardLedState = kbd_leds;
-	cl->HandleTextChat = text_chat;
-	cl->GetPassword = get_password;
+    if (!usb_start(argv[1])) {
+        dpf_ax_close(dpf.dpfh);
+        return -1;
+    }
+
+    // The main source covers the whole panel, insets go on top of it
+    nsources = 1;
+    sources[0].index = 0;
+    sources[0].dw = dpf.pwidth;
+    sources[0].dh = dpf.pheight;
+
+    // Take our own options out, the rest is for rfbInitClient()
+    vncargc = 1;
+    vncargv = malloc(argc * sizeof(char *));
+    vncargv[0] = argv[1];
+    for (i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--inset") == 0 && i + 1 < argc) {
+            if (!add_inset(argv[1], argv[++i])) {
+                close_panel();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--viewport") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &vx, &vy, &vw, &vh) != 4 ||
+                vx < 0 || vy < 0 || vw <= 0 || vh <= 0) {
+                ErrorLog("Invalid viewport '%s', expected x,y,w,h\n", argv[i]);
+                close_panel();
+                return 1;
+            }
+        } else
+            vncargv[vncargc++] = argv[i];
+    }
+    build_owner_map();
+
+	sources[0].client = new_client ();
+	rfbClientSetClientData (sources[0].client, &sourceTag, &sources[0]);
+	// Only the viewport is requested, kept and converted
+	if (vw > 0)
+		rfbClientSetViewport (sources[0].client, vx, vy, vw, vh);
 
 //	show_connect_window (argc, argv);
 
-	if (!rfbInitClient (cl, &vncargc, vncargv)) {
-        dpf_ax_close(dpf.dpfh);
+	if (!rfbInitClient (sources[0].client, &vncargc, vncargv)) {
+        close_panel();
         return 1;
     }
 
 
-    debug = true;
     while (1) {
-      i = WaitForMessage (cl, 500);
-      if (debug) {
-        debug = false;
+        FD_ZERO(&fds);
+        maxfd = -1;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 500000;
+        for (j = 0; j < nsources; j++)
+            if (sources[j].client) {
+                FD_SET(sources[j].client->sock, &fds);
+                if (sources[j].client->sock > maxfd)
+                    maxfd = sources[j].client->sock;
+                // Buffered data is handled right away, only poll the sockets
+                if (sources[j].client->buffered > 0)
+                    timeout.tv_usec = 0;
+            }
+        i = select(maxfd + 1, &fds, NULL, NULL, &timeout);
+        if (i < 0) {
+            ErrorLog("Exiting because i = %d\n", i);
+            close_panel();
+            return 1;
+        }
+
+        for (j = 0; j < nsources; j++) {
+            rfbClient *client = sources[j].client;
+
+            // Data may be left over in the client's buffer from the last read
+            if (client == NULL || (!FD_ISSET(client->sock, &fds) && client->buffered == 0))
+                continue;
+            if (HandleRFBServerMessage(client))
+                continue;
+
+            if (j == 0) {
+                ErrorLog("Exiting because HandleRFBServerMessage() unhappy\n");
+                close_panel();
+                return 2;
+            }
+            // A lost inset keeps showing its last picture
+            ErrorLog("Inset %d disconnected\n", j);
+            free(client->frameBuffer);
+            rfbClientCleanup(client);
+            sources[j].client = NULL;
+        }
     }
-    if (i < 0) {
-       ErrorLog("Exiting because i = %d\n", i);
-       dpf_ax_close(dpf.dpfh);
-       return 1;
-   }
-   if (i)
-       if (!HandleRFBServerMessage(cl)) {
-         ErrorLog("Exiting because HandleRFBServerMessage() unhappy\n");
-         dpf_ax_close(dpf.dpfh);
-         return 2;
-     }
- }
-
- dpf_ax_close(dpf.dpfh);
+
+ close_panel();
  return 0;
 }
@@ -44,6 +44,7 @@ static gboolean expose_event (GtkWidget      *widget,
 		                                widget->allocation.height);
 
 		cl->frameBuffer= image->mem;
+		cl->frameBufferStride = image->bpl;
 
 		cl->width  = widget->allocation.width;
 		cl->height = widget->allocation.height;
@@ -19,7 +19,7 @@ static void SaveFramebufferAsPPM(rfbClient* client, int x, int y, int w, int h)
 	int i,j;
 	rfbPixelFormat* pf=&client->format;
 	int bpp=pf->bitsPerPixel/8;
-	int row_stride=client->width*bpp;
+	int row_stride=(int)rfbClientFrameBufferStride(client);
 
 	/* save one picture only if the last is older than 2 seconds */
 	t1=time(NULL);
@@ -3,9 +3,9 @@
  * An example of an RFB client tunneled through SSH by using libssh2.
  * This is based on https://www.libssh2.org/examples/direct_tcpip.html
  * with the following changes:
- *  - the listening is split out into a separate thread function
- *  - the listener gets closed immediately once a connection was accepted
- *  - the listening port is chosen by the OS, SO_REUSEADDR removed
+ *  - no local proxy: the direct-tcpip channel is plugged into libvncclient
+ *    with the ReadFromTransport, WriteToTransport and WaitForTransport hooks,
+ *    so the RFB data never takes a detour over a loopback socket
  *  - global variables moved into SshData helper structure
  *  - added name resolution for the ssh host
  */
@@ -13,6 +13,7 @@
 #include <rfb/rfbclient.h>
 #include <libssh2.h>
 #include <arpa/inet.h>
+#include <sys/select.h>
 #include <netdb.h>
 #include <signal.h>
 #include <errno.h>
@@ -25,137 +26,83 @@ typedef struct
 {
     rfbClient *client;
     LIBSSH2_SESSION *session;
-#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
-    pthread_t thread;
-#elif defined(LIBVNCSERVER_HAVE_WIN32THREADS)
-    uintptr_t thread;
-#endif
+    LIBSSH2_CHANNEL *channel;
     int ssh_sock;
-    int local_listensock;
-    int local_listenport;
     const char *remote_desthost;
     int remote_destport;
 } SshData;
 
 
-THREAD_ROUTINE_RETURN_TYPE ssh_proxy_loop(void *arg)
-{
-    SshData *data = arg;
-    int rc, i;
-    struct sockaddr_in sin;
-    socklen_t sinlen;
-    LIBSSH2_CHANNEL *channel = NULL;
-    const char *shost;
-    int sport;
-    fd_set fds;
-    struct timeval tv;
-    ssize_t len, wr;
-    char buf[16384];
-    int proxy_sock = RFB_INVALID_SOCKET;
-
-    proxy_sock = accept(data->local_listensock, (struct sockaddr *)&sin, &sinlen);
-    if(proxy_sock == RFB_INVALID_SOCKET) {
-        fprintf(stderr, "ssh_proxy_loop: accept: %s\n", strerror(errno));
-        goto shutdown;
-    }
+#define SSH_DATA(client) ((SshData *)rfbClientGetClientData(client, (void*)42))
 
-    /* Close listener once a connection got accepted */
-    rfbCloseSocket(data->local_listensock);
 
-    shost = inet_ntoa(sin.sin_addr);
-    sport = ntohs(sin.sin_port);
+/* Waits until the SSH socket is ready for what libssh2 is blocked on, or usecs passed. */
+static int ssh_wait_socket(SshData *data, rfbBool forReading, unsigned int usecs)
+{
+    fd_set readfds, writefds;
+    struct timeval tv;
+    int dir = libssh2_session_block_directions(data->session);
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    if(forReading || (dir & LIBSSH2_SESSION_BLOCK_INBOUND))
+        FD_SET(data->ssh_sock, &readfds);
+    if(dir & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+        FD_SET(data->ssh_sock, &writefds);
+    tv.tv_sec = usecs / 1000000;
+    tv.tv_usec = usecs % 1000000;
+    return select(data->ssh_sock + 1, &readfds, &writefds, NULL, &tv);
+}
 
-    printf("ssh_proxy_loop: forwarding connection from %s:%d here to remote %s:%d\n",
-        shost, sport, data->remote_desthost, data->remote_destport);
 
-    channel = libssh2_channel_direct_tcpip_ex(data->session, data->remote_desthost,
-        data->remote_destport, shost, sport);
-    if(!channel) {
-        fprintf(stderr, "ssh_proxy_loop: Could not open the direct-tcpip channel!\n"
-                "(Note that this can be a problem at the server!"
-                " Please review the server logs.)\n");
-        goto shutdown;
+static int ssh_read(rfbClient *client, char *buf, int len)
+{
+    SshData *data = SSH_DATA(client);
+    ssize_t n = libssh2_channel_read(data->channel, buf, len);
+
+    if(n == LIBSSH2_ERROR_EAGAIN) {
+        if(libssh2_channel_eof(data->channel))
+            return 0;
+        errno = EAGAIN;
+        return -1;
     }
-
-    /* Must use non-blocking IO hereafter due to the current libssh2 API */
-    libssh2_session_set_blocking(data->session, 0);
-
-    while(1) {
-        FD_ZERO(&fds);
-        FD_SET(proxy_sock, &fds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-        rc = select(proxy_sock + 1, &fds, NULL, NULL, &tv);
-        if(-1 == rc) {
-            fprintf(stderr, "ssh_proxy_loop: select: %s\n", strerror(errno));
-            goto shutdown;
-        }
-        if(rc && FD_ISSET(proxy_sock, &fds)) {
-            len = recv(proxy_sock, buf, sizeof(buf), 0);
-            if(len < 0) {
-                fprintf(stderr, "read: %s\n", strerror(errno));
-                goto shutdown;
-            }
-            else if(0 == len) {
-                fprintf(stderr, "ssh_proxy_loop: the client at %s:%d disconnected!\n", shost,
-                    sport);
-                goto shutdown;
-            }
-            wr = 0;
-            while(wr < len) {
-                i = libssh2_channel_write(channel, buf + wr, len - wr);
-                if(LIBSSH2_ERROR_EAGAIN == i) {
-                    continue;
-                }
-                if(i < 0) {
-                    fprintf(stderr, "ssh_proxy_loop: libssh2_channel_write: %d\n", i);
-                    goto shutdown;
-                }
-                wr += i;
-            }
-        }
-        while(1) {
-            len = libssh2_channel_read(channel, buf, sizeof(buf));
-            if(LIBSSH2_ERROR_EAGAIN == len)
-                break;
-            else if(len < 0) {
-                fprintf(stderr, "ssh_proxy_loop: libssh2_channel_read: %d\n", (int)len);
-                goto shutdown;
-            }
-            wr = 0;
-            while(wr < len) {
-                i = send(proxy_sock, buf + wr, len - wr, 0);
-                if(i <= 0) {
-                    fprintf(stderr, "ssh_proxy_loop: write: %s\n", strerror(errno));
-                    goto shutdown;
-                }
-                wr += i;
-            }
-            if(libssh2_channel_eof(channel)) {
-                fprintf(stderr, "ssh_proxy_loop: the server at %s:%d disconnected!\n",
-                    data->remote_desthost, data->remote_destport);
-                goto shutdown;
-            }
-        }
+    if(n < 0) {
+        fprintf(stderr, "ssh_read: libssh2_channel_read: %d\n", (int)n);
+        errno = EIO;
+        return -1;
     }
+    return (int)n;
+}
 
- shutdown:
-
-    printf("ssh_proxy_loop: shutting down\n");
-
-    rfbCloseSocket(proxy_sock);
 
-    if(channel)
-        libssh2_channel_free(channel);
+static int ssh_write(rfbClient *client, const char *buf, int len)
+{
+    SshData *data = SSH_DATA(client);
+    ssize_t n;
+
+    while((n = libssh2_channel_write(data->channel, buf, len)) == LIBSSH2_ERROR_EAGAIN)
+        if(ssh_wait_socket(data, FALSE, 1000000) < 0 && errno != EINTR)
+            return -1;
+    if(n < 0) {
+        fprintf(stderr, "ssh_write: libssh2_channel_write: %d\n", (int)n);
+        errno = EIO;
+        return -1;
+    }
+    return (int)n;
+}
 
-    libssh2_session_disconnect(data->session, "Client disconnecting normally");
-    libssh2_session_free(data->session);
 
-    rfbCloseSocket(data->ssh_sock);
+static int ssh_wait(rfbClient *client, unsigned int usecs)
+{
+    SshData *data = SSH_DATA(client);
 
-    return THREAD_ROUTINE_RETURN_VALUE;
+    /* libssh2 may have read ahead already */
+    if(libssh2_poll_channel_read(data->channel, 0) || libssh2_channel_eof(data->channel))
+        return 1;
+    return ssh_wait_socket(data, TRUE, usecs);
 }
 
+
 /**
    Decide whether or not the SSH tunnel setup should continue
    based on the current host and its fingerprint.
@@ -178,7 +125,7 @@ int ssh_fingerprint_check(const char *fingerprint, size_t fingerprint_len,
 
 
 /**
-   Creates an SSH tunnel and a local proxy and returns the port the proxy is listening on.
+   Creates an SSH tunnel to the RFB server and makes the client talk through it.
    @return A pointer to an SshData structure or NULL on error.
  */
 SshData* ssh_tunnel_open(const char *ssh_host,
@@ -191,9 +138,8 @@ SshData* ssh_tunnel_open(const char *ssh_host,
 			 int rfb_port,
 			 rfbClient *client)
 {
-    int rc, i;
+    int rc;
     struct sockaddr_in sin;
-    socklen_t sinlen;
     const char *fingerprint;
     char *userauthlist;
     struct addrinfo hints, *res;
@@ -284,50 +230,24 @@ SshData* ssh_tunnel_open(const char *ssh_host,
         goto error;
     }
 
-    /* Create and bind the local listening socket */
-    data->local_listensock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(data->local_listensock == RFB_INVALID_SOCKET) {
-        fprintf(stderr, "ssh_tunnel_open: socket: %s\n", strerror(errno));
-        return NULL;
-    }
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(0); /* let the OS choose the port */
-    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
-    if(INADDR_NONE == sin.sin_addr.s_addr) {
-        fprintf(stderr, "ssh_tunnel_open: inet_addr: %s\n", strerror(errno));
-        goto error;
-    }
-    sinlen = sizeof(sin);
-    if(-1 == bind(data->local_listensock, (struct sockaddr *)&sin, sinlen)) {
-        fprintf(stderr, "bind: %s\n", strerror(errno));
-        goto error;
-    }
-    if(-1 == listen(data->local_listensock, 1)) {
-        fprintf(stderr, "listen: %s\n", strerror(errno));
-        goto error;
-    }
+    printf("ssh_tunnel_open: forwarding to remote %s:%d\n",
+        data->remote_desthost, data->remote_destport);
 
-    /* get info back from OS */
-    if (getsockname(data->local_listensock, (struct sockaddr *)&sin, &sinlen ) == -1){
-	fprintf(stderr, "ssh_tunnel_open: getsockname: %s\n", strerror(errno));
-	goto error;
+    data->channel = libssh2_channel_direct_tcpip(data->session, data->remote_desthost,
+        data->remote_destport);
+    if(!data->channel) {
+        fprintf(stderr, "ssh_tunnel_open: Could not open the direct-tcpip channel!\n"
+                "(Note that this can be a problem at the server!"
+                " Please review the server logs.)\n");
+        goto error;
     }
 
-    data->local_listenport = ntohs(sin.sin_port);
-
-    printf("ssh_tunnel_open: waiting for TCP connection on %s:%d...\n",
-        inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-
+    /* libvncclient waits itself, see ssh_wait() */
+    libssh2_session_set_blocking(data->session, 0);
 
-    /* Create the proxy thread */
-#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
-    if (pthread_create(&data->thread, NULL, ssh_proxy_loop, data) != 0) {
-#elif defined(LIBVNCSERVER_HAVE_WIN32THREADS)
-    if(data->thread = _beginthread(proxy_loop, 0, data) == 0);
-#endif
-	fprintf(stderr, "ssh_tunnel_open: proxy thread creation failed\n");
-	goto error;
-    }
+    client->ReadFromTransport = ssh_read;
+    client->WriteToTransport = ssh_write;
+    client->WaitForTransport = ssh_wait;
 
     return data;
 
@@ -337,7 +257,6 @@ SshData* ssh_tunnel_open(const char *ssh_host,
 	libssh2_session_free(data->session);
     }
 
-    rfbCloseSocket(data->local_listensock);
     rfbCloseSocket(data->ssh_sock);
 
     free(data);
@@ -350,9 +269,10 @@ void ssh_tunnel_close(SshData *data) {
     if(!data)
 	return;
 
-    /* the proxy thread does the internal cleanup as it can be
-       ended due to external reasons */
-    THREAD_JOIN(data->thread);
+    libssh2_channel_free(data->channel);
+    libssh2_session_disconnect(data->session, "Client disconnecting normally");
+    libssh2_session_free(data->session);
+    rfbCloseSocket(data->ssh_sock);
 
     free(data);
 
@@ -397,10 +317,12 @@ int main(int argc, char *argv[])
     /*
       The actual VNC connection setup.
      */
-    client->serverHost = strdup("127.0.0.1");
-    if(data) // might be NULL if ssh setup failed
-	client->serverPort = data->local_listenport;
     rfbClientSetClientData(client, (void*)42, data);
+    if(data) { // might be NULL if ssh setup failed
+	/* only for the messages, the tunnel is connected already */
+	client->serverHost = strdup(data->remote_desthost);
+	client->serverPort = data->remote_destport;
+    }
 
     if (!data || !rfbInitClient(client,NULL,NULL))
 	return EXIT_FAILURE;
@@ -418,10 +340,6 @@ int main(int argc, char *argv[])
 		break;
     }
 
-    /* Disconnect client inside tunnel */
-    if(client && client->sock != RFB_INVALID_SOCKET)
-	    rfbCloseSocket(client->sock);
-
     /* Close the tunnel and clean up */
     ssh_tunnel_close(rfbClientGetClientData(client, (void*)42));
 
@@ -393,12 +393,14 @@ rfbBool vnc_malloc_fb(rfbClient* client) {
         	signal(SIGQUIT,signal_handler);
 	#endif
         signal(SIGABRT,signal_handler);
-        /* These assignments assumes the AVFrame buffer is contigous. This is true in current ffmpeg versions for
-         * most non-HW accelerated bits, but may not be true globally. */
-        if(video_st.tmp_frame)
+        /* The AVFrame's rows may be padded, so pass on its line size as well. */
+        if(video_st.tmp_frame) {
                	client->frameBuffer=video_st.tmp_frame->data[0];
-        else
+               	client->frameBufferStride=video_st.tmp_frame->linesize[0];
+        } else {
             	client->frameBuffer=video_st.frame->data[0];
+            	client->frameBufferStride=video_st.frame->linesize[0];
+        }
         return TRUE;
 }
 
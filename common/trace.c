@@ -0,0 +1,424 @@
+/*
+ *  trace.c - timeline traces of the update pipeline of both libraries,
+ *  see rfb/rfbtrace.h.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Every thread that records an event gets a buffer of its own, found
+ * through a thread specific key and put on a list that is only ever
+ * pushed to, with a compare and swap. A buffer is a ring with a single
+ * producer, the thread, and a single consumer, the exporter thread, each
+ * of which only moves its own counter. The exporter writes the rings out
+ * every TRACE_EXPORT_MS and frees the buffers of threads that are gone;
+ * being the only one to take buffers off the list, it needs no lock for
+ * that either, except for the head, which it has to swap.
+ *
+ * Events keep pointers to their strings, which are literals, so the
+ * exporter formats them and the recording threads only copy a few words.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sockets.h"
+#include "trace.h"
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && defined(__GNUC__)
+#define TRACE_THREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* events per thread, dropped beyond that until the exporter comes by */
+#define TRACE_RING_SIZE 4096
+#define TRACE_EXPORT_MS 50
+
+volatile int rfbTraceActive;
+
+#ifdef TRACE_THREAD
+
+#define LOAD(p) __atomic_load_n(&(p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_SEQ_CST)
+
+typedef struct {
+  uint64_t start, end;
+  uint64_t id;
+  const char *cat, *name, *encoding;
+  int x, y, w, h;
+  long bytes;
+  char flow;
+} TraceEvent;
+
+typedef struct _TraceBuffer {
+  struct _TraceBuffer *next;
+  int tid;
+  char name[64];
+  int named;                    /* name is set, by the thread */
+  int nameWritten;              /* to the current file, by the exporter */
+  int dead;                     /* the thread is gone */
+  size_t head;                  /* events recorded, moved by the thread */
+  size_t tail;                  /* events written, moved by the exporter */
+  unsigned long dropped;        /* by the thread */
+  unsigned long droppedWritten; /* by the exporter */
+  TraceEvent ring[TRACE_RING_SIZE];
+} TraceBuffer;
+
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t traceKey;
+static TraceBuffer *traceBuffers;
+static int traceNextTid;
+
+/* the running trace, with traceMutex held or by the exporter */
+static int traceUsers;
+static FILE *traceFile;
+static uint64_t traceEpoch;
+static int tracePid;
+static pthread_t traceThread;
+static int traceStop;
+
+
+static void
+threadGone(void *data)
+{
+  TraceBuffer *buffer = (TraceBuffer *)data;
+
+  STORE(buffer->dead, 1);
+}
+
+
+static void
+createKey(void)
+{
+  pthread_key_create(&traceKey, threadGone);
+}
+
+
+static TraceBuffer *
+threadBuffer(void)
+{
+  TraceBuffer *buffer;
+
+  pthread_once(&traceOnce, createKey);
+  buffer = (TraceBuffer *)pthread_getspecific(traceKey);
+  if (buffer != NULL)
+    return buffer;
+
+  buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+  if (buffer == NULL)
+    return NULL;
+  buffer->tid = __atomic_add_fetch(&traceNextTid, 1, __ATOMIC_SEQ_CST);
+  buffer->next = LOAD(traceBuffers);
+  while (!__atomic_compare_exchange_n(&traceBuffers, &buffer->next, buffer, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    ;
+  pthread_setspecific(traceKey, buffer);
+  return buffer;
+}
+
+#endif
+
+
+uint64_t
+rfbTraceNow(void)
+{
+#ifdef TRACE_THREAD
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + 1;
+#else
+  return 0;
+#endif
+}
+
+
+void
+rfbTraceSlice(const char *cat, const char *name, uint64_t start,
+              uint64_t id, char flow, const char *encoding,
+              int x, int y, int w, int h, long bytes)
+{
+#ifdef TRACE_THREAD
+  TraceBuffer *buffer;
+  TraceEvent *event;
+  size_t head;
+
+  if (!rfbTraceActive || start == 0 || (buffer = threadBuffer()) == NULL)
+    return;
+  head = buffer->head;
+  if (head - LOAD(buffer->tail) >= TRACE_RING_SIZE) {
+    STORE(buffer->dropped, buffer->dropped + 1);
+    return;
+  }
+  event = &buffer->ring[head % TRACE_RING_SIZE];
+  event->start = start;
+  event->end = rfbTraceNow();
+  event->id = id;
+  event->cat = cat;
+  event->name = name;
+  event->encoding = encoding;
+  event->x = x;
+  event->y = y;
+  event->w = w;
+  event->h = h;
+  event->bytes = bytes;
+  event->flow = id != 0 ? flow : 0;
+  STORE(buffer->head, head + 1);
+#endif
+}
+
+
+void
+rfbTraceThreadName(const char *name)
+{
+#ifdef TRACE_THREAD
+  TraceBuffer *buffer;
+
+  if (!rfbTraceActive || (buffer = threadBuffer()) == NULL || buffer->named)
+    return;
+  strncpy(buffer->name, name, sizeof(buffer->name) - 1);
+  STORE(buffer->named, 1);
+#endif
+}
+
+
+const char *
+rfbTraceEncodingName(int encoding)
+{
+  switch ((uint32_t)encoding) {
+  case rfbEncodingRaw:          return "raw";
+  case rfbEncodingCopyRect:     return "copyrect";
+  case rfbEncodingRRE:          return "rre";
+  case rfbEncodingCoRRE:        return "corre";
+  case rfbEncodingHextile:      return "hextile";
+  case rfbEncodingZlib:         return "zlib";
+  case rfbEncodingTight:        return "tight";
+  case rfbEncodingTightPng:     return "tightpng";
+  case rfbEncodingZlibHex:      return "zlibhex";
+  case rfbEncodingUltra:        return "ultra";
+  case rfbEncodingUltraZip:     return "ultrazip";
+  case rfbEncodingTRLE:         return "trle";
+  case rfbEncodingZRLE:         return "zrle";
+  case rfbEncodingZYWRLE:       return "zywrle";
+  case rfbEncodingH264:         return "h264";
+  case rfbEncodingXCursor:      return "xcursor";
+  case rfbEncodingRichCursor:   return "richcursor";
+  case rfbEncodingPointerPos:   return "pointerpos";
+  case rfbEncodingLastRect:     return "lastrect";
+  case rfbEncodingNewFBSize:    return "newfbsize";
+  case rfbEncodingExtDesktopSize: return "extdesktopsize";
+  default:                      return "other";
+  }
+}
+
+
+uint32_t
+rfbTraceSocketKey(rfbSocket sock, rfbBool peer)
+{
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+
+  if (sock == RFB_INVALID_SOCKET)
+    return 0;
+  memset(&addr, 0, sizeof(addr));
+  if ((peer ? getpeername(sock, (struct sockaddr *)&addr, &len)
+            : getsockname(sock, (struct sockaddr *)&addr, &len)) != 0)
+    return 0;
+  if (addr.ss_family == AF_INET)
+    return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+#ifdef AF_INET6
+  if (addr.ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+#endif
+  return 0;
+}
+
+
+#ifdef TRACE_THREAD
+
+static double
+micros(uint64_t ns)
+{
+  return (double)(ns - traceEpoch) / 1000;
+}
+
+
+static void
+writeEvent(TraceBuffer *buffer, const TraceEvent *event)
+{
+  FILE *f = traceFile;
+
+  if (event->flow) {
+    fprintf(f, ",\n{\"ph\":\"%c\",\"cat\":\"rfb\",\"name\":\"update\",\"id\":%llu,"
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s}",
+            event->flow, (unsigned long long)event->id, micros(event->start),
+            tracePid, buffer->tid, event->flow == 's' ? "" : ",\"bp\":\"e\"");
+  }
+  fprintf(f, ",\n{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"ts\":%.3f,\"dur\":%.3f,"
+          "\"pid\":%d,\"tid\":%d,\"args\":{",
+          event->cat, event->name, micros(event->start),
+          (double)(event->end - event->start) / 1000, tracePid, buffer->tid);
+  fprintf(f, "\"update\":%llu", (unsigned long long)event->id);
+  if (event->encoding)
+    fprintf(f, ",\"encoding\":\"%s\"", event->encoding);
+  if (event->w > 0)
+    fprintf(f, ",\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d", event->x, event->y, event->w, event->h);
+  if (event->bytes >= 0)
+    fprintf(f, ",\"bytes\":%ld", event->bytes);
+  fputs("}}", f);
+}
+
+
+/* the first event of a file, so that every other one starts with a comma */
+static void
+writeProcess(void)
+{
+  fprintf(traceFile, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":0,"
+          "\"args\":{\"name\":\"rfb %d\"}}", tracePid, tracePid);
+}
+
+
+/* writes out what the threads recorded and frees the buffers of the gone ones */
+static void
+drain(void)
+{
+  TraceBuffer *buffer, *next, *expected, **link = &traceBuffers;
+  uint64_t now = rfbTraceNow();
+  unsigned long dropped;
+  size_t head, tail;
+  int dead;
+
+  for (buffer = LOAD(traceBuffers); buffer != NULL; buffer = next) {
+    next = buffer->next;
+    dead = LOAD(buffer->dead);
+
+    if (!buffer->nameWritten && LOAD(buffer->named)) {
+      fprintf(traceFile, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+              "\"args\":{\"name\":\"%s\"}}", tracePid, buffer->tid, buffer->name);
+      buffer->nameWritten = 1;
+    }
+    head = LOAD(buffer->head);
+    for (tail = buffer->tail; tail != head; tail++)
+      writeEvent(buffer, &buffer->ring[tail % TRACE_RING_SIZE]);
+    STORE(buffer->tail, head);
+    dropped = LOAD(buffer->dropped);
+    if (dropped != buffer->droppedWritten) {
+      fprintf(traceFile, ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"events dropped\",\"ts\":%.3f,"
+              "\"pid\":%d,\"tid\":%d,\"args\":{\"count\":%lu}}",
+              micros(now), tracePid, buffer->tid, dropped - buffer->droppedWritten);
+      buffer->droppedWritten = dropped;
+    }
+
+    if (dead) {
+      /* new buffers only ever go in front of the head */
+      if (link != &traceBuffers) {
+        *link = next;
+        free(buffer);
+        continue;
+      }
+      expected = buffer;
+      if (__atomic_compare_exchange_n(&traceBuffers, &expected, next, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        free(buffer);
+        continue;
+      }
+    }
+    link = &buffer->next;
+  }
+  fflush(traceFile);
+}
+
+
+static void *
+exporter(void *data)
+{
+  struct timespec pause;
+
+  pause.tv_sec = 0;
+  pause.tv_nsec = TRACE_EXPORT_MS * 1000000L;
+  while (!LOAD(traceStop)) {
+    drain();
+    nanosleep(&pause, NULL);
+  }
+  drain();
+  return NULL;
+}
+
+#endif
+
+
+rfbBool
+rfbTraceStart(const char *fileName)
+{
+#ifdef TRACE_THREAD
+  TraceBuffer *buffer;
+  rfbBool result = TRUE;
+
+  pthread_mutex_lock(&traceMutex);
+  if (traceUsers == 0) {
+    traceFile = fopen(fileName, "w");
+    if (traceFile == NULL) {
+      pthread_mutex_unlock(&traceMutex);
+      return FALSE;
+    }
+    /* what was left over from an earlier trace goes */
+    for (buffer = LOAD(traceBuffers); buffer != NULL; buffer = buffer->next) {
+      STORE(buffer->tail, LOAD(buffer->head));
+      buffer->droppedWritten = LOAD(buffer->dropped);
+      buffer->nameWritten = 0;
+    }
+    traceEpoch = rfbTraceNow();
+    tracePid = (int)getpid();
+    traceStop = 0;
+    fputs("[\n", traceFile);
+    writeProcess();
+    if (pthread_create(&traceThread, NULL, exporter, NULL) != 0) {
+      fclose(traceFile);
+      traceFile = NULL;
+      result = FALSE;
+    } else {
+      STORE(rfbTraceActive, 1);
+    }
+  }
+  if (result)
+    traceUsers++;
+  pthread_mutex_unlock(&traceMutex);
+  return result;
+#else
+  return FALSE;
+#endif
+}
+
+
+void
+rfbTraceStop(void)
+{
+#ifdef TRACE_THREAD
+  pthread_mutex_lock(&traceMutex);
+  if (traceUsers > 0 && --traceUsers == 0) {
+    STORE(rfbTraceActive, 0);
+    STORE(traceStop, 1);
+    pthread_join(traceThread, NULL);
+    fputs("\n]\n", traceFile);
+    fclose(traceFile);
+    traceFile = NULL;
+  }
+  pthread_mutex_unlock(&traceMutex);
+#endif
+}
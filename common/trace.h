@@ -0,0 +1,69 @@
+/*
+ *  LibVNCServer/LibVNCClient internal functions for the update traces,
+ *  see rfb/rfbtrace.h.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef _RFB_COMMON_TRACE_H
+#define _RFB_COMMON_TRACE_H
+
+#include "rfb/rfbtrace.h"
+
+/* the id of the seq'th update on the connection with the given key */
+#define RFB_TRACE_ID(key, seq) (((uint64_t)(key) << 32) | (uint32_t)(seq))
+
+/*
+   Set while a trace runs. Take the start time of a slice only if it is,
+   and record the slice only if the start time is not 0.
+ */
+extern volatile int rfbTraceActive;
+
+/*
+   Nanoseconds on a monotonic clock, never 0.
+ */
+uint64_t rfbTraceNow(void);
+
+/*
+   Records a slice from start till now on the calling thread, of category
+   cat, "server" or "client". If id is not 0 it is the update the slice
+   belongs to, and flow, if not 0, is the phase of the update's flow that
+   the slice is part of: 's' where it starts, 't' on the way, 'f' where it
+   ends. encoding may be NULL, a w of 0 leaves out the rectangle and
+   bytes below 0 the size. The strings have to stay valid.
+ */
+void rfbTraceSlice(const char *cat, const char *name, uint64_t start,
+                   uint64_t id, char flow, const char *encoding,
+                   int x, int y, int w, int h, long bytes);
+
+/*
+   Names the calling thread in the running trace; only the first name
+   counts.
+ */
+void rfbTraceThreadName(const char *name);
+
+/*
+   A name for a pseudo encoding or encoding, for rfbTraceSlice().
+ */
+const char *rfbTraceEncodingName(int encoding);
+
+/*
+   The port of the client's end of a connection, from the server's side
+   with peer set and from the client's without, 0 if there is none.
+ */
+uint32_t rfbTraceSocketKey(rfbSocket sock, rfbBool peer);
+
+#endif /* _RFB_COMMON_TRACE_H */
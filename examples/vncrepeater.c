@@ -0,0 +1,567 @@
+/**
+ * @example vncrepeater.c
+ * A repeater for many server-viewer pairs at once, for Linux.
+ *
+ * It speaks the UltraVNC repeater's "mode II": servers connect to the
+ * server port (5500) and viewers to the viewer port (5900), both send a
+ * 250 byte "ID:<number>" string, the viewers after the repeater greeted
+ * them with the version 000.000. A server and a viewer with the same ID
+ * are paired and from then on everything is relayed between them, which
+ * is what examples/repeater.c and ConnectToRFBRepeater() expect.
+ *
+ * The relaying is done with splice() through a pipe per direction, so
+ * the data is never copied to user space, and all connections are served
+ * by one epoll loop. A pair that moved no data for the idle timeout is
+ * closed, as is a connection that did not send its ID in that time. For
+ * every pair the bytes in each direction are counted and logged when it
+ * is closed; SIGUSR1 logs the pairs that are open, SIGINT and SIGTERM
+ * end the repeater after logging the totals.
+ *
+ * Usage: vncrepeater [-serverport port] [-viewerport port] [-idle seconds] [-quiet]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <rfb/rfb.h>
+
+#define ID_LEN 250
+#define ID_BUCKETS 4096
+/* what is spliced into a pipe at once, its default capacity */
+#define PIPE_CHUNK 65536
+/* splices per direction and wakeup, so that one busy pair cannot starve the others */
+#define PUMP_ROUNDS 4
+#define MAX_EVENTS 256
+
+enum { LISTEN_SERVER, LISTEN_VIEWER, SERVER, VIEWER };
+static const char *kindName[] = { "server listener", "viewer listener", "server", "viewer" };
+
+typedef struct Conn {
+  int kind;
+  int fd;
+  struct Conn *peer;    /* NULL until paired */
+  char id[ID_LEN + 1];
+  int idLen;
+  int pipe[2];          /* what was read from fd and is not written to peer yet */
+  size_t pending;
+  uint64_t bytes;       /* read from fd */
+  uint32_t events;      /* as registered with epoll */
+  rfbBool eof, closed;
+  time_t start, lastActive;
+  struct Conn *hashNext;
+  struct Conn *prev, *next;  /* in the active list, least recently active first */
+} Conn;
+
+static int epfd;
+static int idleTimeout = 600;
+static rfbBool quiet;
+/* connections waiting for a partner, by kind and ID */
+static Conn *waiting[2][ID_BUCKETS];
+static Conn *activeHead, *activeTail;
+static Conn *graveyard;
+static unsigned long pairsOpen, pairsTotal;
+static uint64_t totalToServer, totalToViewer;
+static volatile sig_atomic_t stop, dump;
+
+
+static time_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+
+static unsigned int hashId(const char *id)
+{
+  unsigned int h = 2166136261u;
+
+  while (*id)
+    h = (h ^ (unsigned char)*id++) * 16777619u;
+  return h % ID_BUCKETS;
+}
+
+
+static void unlinkActive(Conn *c)
+{
+  if (c->prev)
+    c->prev->next = c->next;
+  else if (activeHead == c)
+    activeHead = c->next;
+  else
+    return;             /* not in the list */
+  if (c->next)
+    c->next->prev = c->prev;
+  else
+    activeTail = c->prev;
+  c->prev = c->next = NULL;
+}
+
+
+static void touch(Conn *c, time_t t)
+{
+  c->lastActive = t;
+  if (activeTail == c)
+    return;
+  unlinkActive(c);
+  c->prev = activeTail;
+  if (activeTail)
+    activeTail->next = c;
+  else
+    activeHead = c;
+  activeTail = c;
+}
+
+
+static void unlinkWaiting(Conn *c)
+{
+  Conn **p = &waiting[c->kind - SERVER][hashId(c->id)];
+
+  for (; *p; p = &(*p)->hashNext)
+    if (*p == c) {
+      *p = c->hashNext;
+      break;
+    }
+  c->hashNext = NULL;
+}
+
+
+static rfbBool setEvents(Conn *c, uint32_t events)
+{
+  struct epoll_event ev;
+
+  if (events == c->events)
+    return TRUE;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+    rfbLogPerror("vncrepeater: epoll_ctl");
+    return FALSE;
+  }
+  c->events = events;
+  return TRUE;
+}
+
+
+/* reads from fd only while its pipe is empty, writes to it while the peer's is not */
+static rfbBool updateEvents(Conn *c)
+{
+  uint32_t events = 0;
+
+  if (c->pending == 0 && !c->eof)
+    events |= EPOLLIN;
+  if (c->peer->pending > 0)
+    events |= EPOLLOUT;
+  return setEvents(c, events);
+}
+
+
+/* freed after the current batch of events, which may still mention c */
+static void release(Conn *c)
+{
+  unlinkActive(c);
+  close(c->fd);
+  if (c->pipe[0] >= 0) {
+    close(c->pipe[0]);
+    close(c->pipe[1]);
+  }
+  c->closed = TRUE;
+  c->next = graveyard;
+  graveyard = c;
+}
+
+
+/* closes c, and its peer if it has one */
+static void closeConn(Conn *c, const char *why)
+{
+  Conn *server, *viewer;
+
+  if (c->closed)
+    return;
+
+  if (c->peer) {
+    server = c->kind == SERVER ? c : c->peer;
+    viewer = c->kind == VIEWER ? c : c->peer;
+    if (!quiet)
+      rfbLog("%s: %s, %llu bytes to the server, %llu to the viewer in %lds\n",
+             c->id, why, (unsigned long long)viewer->bytes,
+             (unsigned long long)server->bytes, (long)(now() - c->start));
+    totalToServer += viewer->bytes;
+    totalToViewer += server->bytes;
+    pairsOpen--;
+    server->peer = viewer->peer = NULL;
+    release(c == server ? viewer : server);
+  } else if (c->idLen == ID_LEN) {
+    unlinkWaiting(c);
+    if (!quiet)
+      rfbLog("%s: waiting %s %s\n", c->id, kindName[c->kind], why);
+  }
+
+  release(c);
+}
+
+
+static void pair(Conn *server, Conn *viewer)
+{
+  time_t t = now();
+
+  if (pipe2(server->pipe, O_NONBLOCK | O_CLOEXEC) < 0 ||
+      pipe2(viewer->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    rfbLogPerror("vncrepeater: pipe2");
+    closeConn(server, "out of pipes");
+    closeConn(viewer, "out of pipes");
+    return;
+  }
+  server->peer = viewer;
+  viewer->peer = server;
+  server->start = viewer->start = t;
+  touch(server, t);
+  touch(viewer, t);
+  pairsOpen++;
+  pairsTotal++;
+  if (!quiet)
+    rfbLog("%s: paired\n", server->id);
+
+  /* the server's greeting may be waiting already */
+  if (!updateEvents(server) || !updateEvents(viewer))
+    closeConn(server, "failed");
+}
+
+
+static void gotId(Conn *c)
+{
+  int side = c->kind - SERVER, other = !side;
+  unsigned int h;
+  Conn **p;
+
+  c->id[ID_LEN] = '\0';
+  if (strncmp(c->id, "ID:", 3) != 0) {
+    rfbLog("vncrepeater: a %s sent no ID, only mode II is supported\n", kindName[c->kind]);
+    c->idLen = 0;
+    closeConn(c, "no ID");
+    return;
+  }
+
+  h = hashId(c->id);
+  for (p = &waiting[other][h]; *p; p = &(*p)->hashNext)
+    if (strcmp((*p)->id, c->id) == 0) {
+      Conn *partner = *p;
+
+      *p = partner->hashNext;
+      partner->hashNext = NULL;
+      if (side == 0)
+        pair(c, partner);
+      else
+        pair(partner, c);
+      return;
+    }
+
+  /* the newer one of two with the same ID wins */
+  for (p = &waiting[side][h]; *p; p = &(*p)->hashNext)
+    if (strcmp((*p)->id, c->id) == 0) {
+      closeConn(*p, "replaced");
+      break;
+    }
+
+  /* waits without timeout; only its hangup is of interest, the data stays for the peer */
+  unlinkActive(c);
+  c->hashNext = waiting[side][h];
+  waiting[side][h] = c;
+  if (!setEvents(c, EPOLLRDHUP))
+    closeConn(c, "failed");
+}
+
+
+static void readId(Conn *c)
+{
+  ssize_t n = recv(c->fd, c->id + c->idLen, ID_LEN - c->idLen, 0);
+
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    closeConn(c, "gone before sending its ID");
+    return;
+  }
+  if (n > 0)
+    c->idLen += (int)n;
+  if (c->idLen == ID_LEN)
+    gotId(c);
+}
+
+
+/* moves data from c to its peer */
+static rfbBool pump(Conn *c)
+{
+  Conn *to = c->peer;
+  ssize_t n;
+  int i;
+  rfbBool moved;
+
+  for (i = 0; i < PUMP_ROUNDS; i++) {
+    moved = FALSE;
+    if (c->pending == 0 && !c->eof) {
+      n = splice(c->fd, NULL, c->pipe[1], NULL, PIPE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        c->pending = n;
+        c->bytes += n;
+        moved = TRUE;
+      } else if (n == 0) {
+        c->eof = TRUE;
+      } else if (errno != EAGAIN && errno != EINTR) {
+        return FALSE;
+      }
+    }
+    if (c->pending > 0) {
+      n = splice(c->pipe[0], NULL, to->fd, NULL, c->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        c->pending -= n;
+        moved = TRUE;
+      } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        return FALSE;
+      }
+    }
+    if (!moved || c->pending > 0)
+      break;
+  }
+  return TRUE;
+}
+
+
+static void relay(Conn *c, uint32_t events)
+{
+  Conn *peer = c->peer;
+  time_t t;
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    closeConn(c, c->kind == SERVER ? "server failed" : "viewer failed");
+    return;
+  }
+  if ((events & EPOLLIN) && !pump(c)) {
+    closeConn(c, "read error");
+    return;
+  }
+  if ((events & EPOLLOUT) && !pump(peer)) {
+    closeConn(c, "write error");
+    return;
+  }
+  /* the pair ends when one side did and all it sent has been passed on */
+  if ((c->eof && c->pending == 0) || (peer->eof && peer->pending == 0)) {
+    closeConn(c, (c->eof && c->kind == SERVER) || (peer->eof && peer->kind == SERVER) ?
+              "server left" : "viewer left");
+    return;
+  }
+  if (!updateEvents(c) || !updateEvents(peer)) {
+    closeConn(c, "failed");
+    return;
+  }
+  t = now();
+  if (c->lastActive != t) {
+    touch(c, t);
+    touch(peer, t);
+  }
+}
+
+
+static void acceptAll(Conn *listener)
+{
+  static const char greeting[] = "RFB 000.000\n";
+  struct epoll_event ev;
+  Conn *c;
+  int fd, one = 1;
+
+  while ((fd = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+    if (!rfbSetNonBlocking(fd)) {
+      close(fd);
+      continue;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+    c = (Conn *)calloc(1, sizeof(Conn));
+    if (c == NULL) {
+      close(fd);
+      continue;
+    }
+    c->kind = listener->kind == LISTEN_SERVER ? SERVER : VIEWER;
+    c->fd = fd;
+    c->pipe[0] = c->pipe[1] = -1;
+    c->events = EPOLLIN;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      rfbLogPerror("vncrepeater: epoll_ctl");
+      close(fd);
+      free(c);
+      continue;
+    }
+    c->start = now();
+    touch(c, c->start);
+    /* a fresh socket's buffer always takes it */
+    if (c->kind == VIEWER && send(fd, greeting, strlen(greeting), 0) != (ssize_t)strlen(greeting))
+      closeConn(c, "gone before the greeting");
+  }
+  if (errno != EAGAIN && errno != EINTR)
+    rfbLogPerror("vncrepeater: accept");
+}
+
+
+static Conn *listenOn(int kind, int port)
+{
+  struct epoll_event ev;
+  Conn *c;
+  int fd;
+
+  fd = rfbListenOnTCPPort(port, htonl(INADDR_ANY));
+  if (fd == RFB_INVALID_SOCKET) {
+    rfbLogPerror("vncrepeater: listen");
+    return NULL;
+  }
+  /* lots of connections may come in at once */
+  listen(fd, SOMAXCONN);
+  rfbSetNonBlocking(fd);
+  c = (Conn *)calloc(1, sizeof(Conn));
+  if (c == NULL)
+    return NULL;
+  c->kind = kind;
+  c->fd = fd;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    rfbLogPerror("vncrepeater: epoll_ctl");
+    return NULL;
+  }
+  rfbLog("vncrepeater: %ss connect to port %d\n", kindName[kind == LISTEN_SERVER ? SERVER : VIEWER], port);
+  return c;
+}
+
+
+static void expire(void)
+{
+  time_t t = now();
+
+  while (activeHead && t - activeHead->lastActive >= idleTimeout)
+    closeConn(activeHead, activeHead->peer ? "idle" : "sent no ID in time");
+}
+
+
+static void logOpenPairs(void)
+{
+  Conn *c;
+
+  rfbLog("vncrepeater: %lu pairs open, %lu relayed so far\n", pairsOpen, pairsTotal);
+  for (c = activeHead; c; c = c->next)
+    if (c->kind == SERVER && c->peer)
+      rfbLog("%s: %llu bytes to the server, %llu to the viewer in %lds\n", c->id,
+             (unsigned long long)c->peer->bytes, (unsigned long long)c->bytes,
+             (long)(now() - c->start));
+}
+
+
+static void onSignal(int sig)
+{
+  if (sig == SIGUSR1)
+    dump = 1;
+  else
+    stop = 1;
+}
+
+
+int main(int argc, char **argv)
+{
+  struct epoll_event events[MAX_EVENTS];
+  struct rlimit limit;
+  struct sigaction sa;
+  int serverPort = 5500, viewerPort = 5900, i, n;
+  Conn *c;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-serverport") == 0 && i + 1 < argc)
+      serverPort = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-viewerport") == 0 && i + 1 < argc)
+      viewerPort = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-idle") == 0 && i + 1 < argc)
+      idleTimeout = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-quiet") == 0)
+      quiet = TRUE;
+    else {
+      fprintf(stderr, "Usage: %s [-serverport port] [-viewerport port] [-idle seconds] [-quiet]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (idleTimeout < 1)
+    idleTimeout = 1;
+
+  /* a pair takes two sockets and four pipe ends */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = onSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    rfbLogPerror("vncrepeater: epoll_create1");
+    return 1;
+  }
+  if (!listenOn(LISTEN_SERVER, serverPort) || !listenOn(LISTEN_VIEWER, viewerPort))
+    return 1;
+
+  while (!stop) {
+    n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+    if (n < 0 && errno != EINTR) {
+      rfbLogPerror("vncrepeater: epoll_wait");
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      c = (Conn *)events[i].data.ptr;
+      if (c->closed)
+        continue;
+      if (c->kind == LISTEN_SERVER || c->kind == LISTEN_VIEWER)
+        acceptAll(c);
+      else if (c->peer)
+        relay(c, events[i].events);
+      else if (c->idLen < ID_LEN)
+        readId(c);
+      else
+        closeConn(c, "left");
+    }
+    expire();
+    while (graveyard) {
+      c = graveyard;
+      graveyard = c->next;
+      free(c);
+    }
+    if (dump) {
+      dump = 0;
+      logOpenPairs();
+    }
+  }
+
+  for (c = activeHead; c; c = c->next)
+    if (c->kind == SERVER && c->peer) {
+      totalToServer += c->peer->bytes;
+      totalToViewer += c->bytes;
+    }
+  rfbLog("vncrepeater: %lu pairs, %llu bytes to the servers, %llu bytes to the viewers\n",
+         pairsTotal, (unsigned long long)totalToServer, (unsigned long long)totalToViewer);
+  return 0;
+}
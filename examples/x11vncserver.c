@@ -0,0 +1,40 @@
+/**
+ * @example x11vncserver.c
+ * Serves an X display, view only: x11vncserver [-display :0] [rfb options]
+ */
+#include <string.h>
+#include <rfb/rfb.h>
+
+int main(int argc,char** argv)
+{
+  rfbX11Capture* capture;
+  rfbScreenInfoPtr server;
+  const char* display=NULL;
+  int i;
+
+  for(i=1;i<argc-1;i++)
+    if(!strcmp(argv[i],"-display")) {
+      display=argv[i+1];
+      memmove(argv+i,argv+i+2,(argc-i-1)*sizeof(char*));
+      argc-=2;
+      break;
+    }
+
+  capture=rfbX11CaptureNew(&argc,argv,display);
+  if(!capture)
+    return 1;
+  server=rfbX11CaptureGetScreen(capture);
+  server->desktopName="X11";
+  server->alwaysShared=TRUE;
+  rfbInitServer(server);
+
+  while(rfbIsActive(server)) {
+    if(!rfbX11CaptureProcessEvents(capture,10000))
+      break;
+    rfbProcessEvents(server,0);
+  }
+
+  rfbShutdownServer(server,TRUE);
+  rfbX11CaptureFree(capture);
+  return 0;
+}
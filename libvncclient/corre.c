@@ -37,16 +37,18 @@ HandleCoRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     CARDBPP pix;
     uint8_t *ptr;
     int x, y, w, h;
+    char head[sz_rfbRREHeader + sizeof(CARDBPP)];
+    FillRectsBatch batch;
 
-    if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbRREHeader))
+    if (!ReadFromRFBServer(client, head, sizeof(head)))
 	return FALSE;
 
+    memcpy(&hdr, head, sz_rfbRREHeader);
     hdr.nSubrects = rfbClientSwap32IfLE(hdr.nSubrects);
+    memcpy(&pix, head + sz_rfbRREHeader, sizeof(pix));
 
-    if (!ReadFromRFBServer(client, (char *)&pix, sizeof(pix)))
-	return FALSE;
-
-    client->GotFillRect(client, rx, ry, rw, rh, pix);
+    batch.count = 0;
+    AddFillRect(client, &batch, rx, ry, rw, rh, pix);
 
     if (hdr.nSubrects > RFB_BUFFER_SIZE / (4 + (BPP / 8)) || !ReadFromRFBServer(client, client->buffer, hdr.nSubrects * (4 + (BPP / 8))))
 	return FALSE;
@@ -54,16 +56,18 @@ HandleCoRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     ptr = (uint8_t *)client->buffer;
 
     for (i = 0; i < hdr.nSubrects; i++) {
-	pix = *(CARDBPP *)ptr;
+	memcpy(&pix, ptr, sizeof(pix));
 	ptr += BPP/8;
 	x = *ptr++;
 	y = *ptr++;
 	w = *ptr++;
 	h = *ptr++;
 
-	client->GotFillRect(client, rx+x, ry+y, w, h, pix);
+	AddFillRect(client, &batch, rx+x, ry+y, w, h, pix);
     }
 
+    FlushFillRects(client, &batch);
+
     return TRUE;
 }
 
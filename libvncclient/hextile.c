@@ -32,13 +32,19 @@
 static rfbBool
 HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 {
-  CARDBPP bg = 0, fg;
+  CARDBPP bg = 0, fg = 0;
   int i;
   uint8_t *ptr;
   int x, y, w, h;
   int sx, sy, sw, sh;
   uint8_t subencoding;
   uint8_t nSubrects;
+  /* background, foreground and subrect count of a tile, read at once */
+  uint8_t head[2 * (BPP / 8) + 1];
+  int headLen;
+  FillRectsBatch batch;
+
+  batch.count = 0;
 
   for (y = ry; y < ry+rh; y += 16) {
     for (x = rx; x < rx+rw; x += 16) {
@@ -55,27 +61,40 @@ HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 	if (!ReadFromRFBServer(client, client->buffer, w * h * (BPP / 8)))
 	  return FALSE;
 
+	FlushFillRects(client, &batch);
 	client->GotBitmap(client, (uint8_t *)client->buffer, x, y, w, h);
 
 	continue;
       }
 
+      headLen = 0;
       if (subencoding & rfbHextileBackgroundSpecified)
-	if (!ReadFromRFBServer(client, (char *)&bg, sizeof(bg)))
-	  return FALSE;
+	headLen += sizeof(bg);
+      if (subencoding & rfbHextileForegroundSpecified)
+	headLen += sizeof(fg);
+      if (subencoding & rfbHextileAnySubrects)
+	headLen++;
+      if (headLen > 0 && !ReadFromRFBServer(client, (char *)head, headLen))
+	return FALSE;
 
-      client->GotFillRect(client, x, y, w, h, bg);
+      ptr = head;
+      if (subencoding & rfbHextileBackgroundSpecified) {
+	memcpy(&bg, ptr, sizeof(bg));
+	ptr += sizeof(bg);
+      }
 
-      if (subencoding & rfbHextileForegroundSpecified)
-	if (!ReadFromRFBServer(client, (char *)&fg, sizeof(fg)))
-	  return FALSE;
+      AddFillRect(client, &batch, x, y, w, h, bg);
+
+      if (subencoding & rfbHextileForegroundSpecified) {
+	memcpy(&fg, ptr, sizeof(fg));
+	ptr += sizeof(fg);
+      }
 
       if (!(subencoding & rfbHextileAnySubrects)) {
 	continue;
       }
 
-      if (!ReadFromRFBServer(client, (char *)&nSubrects, 1))
-	return FALSE;
+      nSubrects = *ptr;
 
       ptr = (uint8_t*)client->buffer;
 
@@ -100,7 +119,7 @@ HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 	  sh = rfbHextileExtractH(*ptr);
 	  ptr++;
 
-	  client->GotFillRect(client, x+sx, y+sy, sw, sh, fg);
+	  AddFillRect(client, &batch, x+sx, y+sy, sw, sh, fg);
 	}
 
       } else {
@@ -115,12 +134,19 @@ HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 	  sh = rfbHextileExtractH(*ptr);
 	  ptr++;
 
-	  client->GotFillRect(client, x+sx, y+sy, sw, sh, fg);
+	  AddFillRect(client, &batch, x+sx, y+sy, sw, sh, fg);
 	}
       }
     }
+
+    if (BandsWanted(client)) {
+      FlushFillRects(client, &batch);
+      BandDecoded(client, rx, rw, y + h);
+    }
   }
 
+  FlushFillRects(client, &batch);
+
   return TRUE;
 }
 
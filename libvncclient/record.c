@@ -0,0 +1,313 @@
+/*
+ *  record.c - records sessions in the vncrec format that -play replays.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Whatever ReadFromRFBServer() hands to the decoders is copied into a ring
+ * buffer, with a timestamp in front of every server message like vncrec
+ * writes them. A background thread writes the ring to the file, through
+ * zlib if asked to, so the decoding thread never waits for the disk; only
+ * if the writer falls a whole ring behind does it have to wait for room.
+ *
+ * The ring has a single producer and a single consumer, each of which only
+ * moves its own counter, so neither takes a lock unless the other one
+ * sleeps. Without pthreads or the GCC atomic builtins the data is written
+ * right away instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+#include <rfb/rfbclient.h>
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+#include <zlib.h>
+#endif
+#include "record.h"
+#include "stats.h"
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && defined(__GNUC__)
+#define RECORD_THREAD
+#endif
+
+/* enough for a few full screen raw updates */
+#define RECORD_RING_SIZE (4 * 1024 * 1024)
+
+struct _rfbClientRecorder {
+  FILE *file;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  gzFile gz;
+#endif
+  rfbBool messageStart;
+  int failed;
+#ifdef RECORD_THREAD
+  char *ring;
+  size_t head;          /* bytes put in so far, moved by the decoding thread */
+  size_t tail;          /* bytes written so far, moved by the writer */
+  pthread_t thread;
+  MUTEX(mutex);
+  COND(cond);
+  int writerWaiting;    /* for data */
+  int producerWaiting;  /* for room */
+  int stop;
+  unsigned long stalls;
+#endif
+};
+
+static rfbBool
+writeOut(rfbClientRecorder *rec, const char *buf, size_t len)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  if (rec->gz != NULL)
+    return gzwrite(rec->gz, buf, (unsigned int)len) == (int)len;
+#endif
+  return fwrite(buf, 1, len, rec->file) == len;
+}
+
+
+static void
+closeFile(rfbClientRecorder *rec)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  if (rec->gz != NULL && gzclose(rec->gz) != Z_OK)
+    rec->failed = TRUE;
+#endif
+  if (rec->file != NULL && fclose(rec->file) != 0)
+    rec->failed = TRUE;
+}
+
+
+#ifdef RECORD_THREAD
+
+#define LOAD(p) __atomic_load_n(&(p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_SEQ_CST)
+
+static void
+wake(rfbClientRecorder *rec, int *waiting)
+{
+  if (!LOAD(*waiting))
+    return;
+  LOCK(rec->mutex);
+  TSIGNAL(rec->cond);
+  UNLOCK(rec->mutex);
+}
+
+
+static void *
+recordThread(void *arg)
+{
+  rfbClientRecorder *rec = (rfbClientRecorder *)arg;
+  size_t head, n;
+
+  for (;;) {
+    head = LOAD(rec->head);
+    if (head != rec->tail) {
+      n = head - rec->tail;
+      if (n > RECORD_RING_SIZE - rec->tail % RECORD_RING_SIZE)
+        n = RECORD_RING_SIZE - rec->tail % RECORD_RING_SIZE;
+      /* after an error the data is still taken, so that nobody waits for room */
+      if (!LOAD(rec->failed) && !writeOut(rec, rec->ring + rec->tail % RECORD_RING_SIZE, n)) {
+        rfbClientErr("Writing the recording failed, stopped recording\n");
+        STORE(rec->failed, TRUE);
+      }
+      STORE(rec->tail, rec->tail + n);
+      wake(rec, &rec->producerWaiting);
+      continue;
+    }
+    if (LOAD(rec->stop))
+      break;
+
+    LOCK(rec->mutex);
+    STORE(rec->writerWaiting, TRUE);
+    if (LOAD(rec->head) == rec->tail && !LOAD(rec->stop))
+      WAIT(rec->cond, rec->mutex);
+    STORE(rec->writerWaiting, FALSE);
+    UNLOCK(rec->mutex);
+  }
+
+  return NULL;
+}
+
+
+static void
+put(rfbClientRecorder *rec, const char *buf, size_t len)
+{
+  size_t room, n;
+
+  while (len > 0) {
+    room = RECORD_RING_SIZE - (rec->head - LOAD(rec->tail));
+    if (room == 0) {
+      rec->stalls++;
+      LOCK(rec->mutex);
+      STORE(rec->producerWaiting, TRUE);
+      if (LOAD(rec->tail) + RECORD_RING_SIZE == rec->head)
+        WAIT(rec->cond, rec->mutex);
+      STORE(rec->producerWaiting, FALSE);
+      UNLOCK(rec->mutex);
+      continue;
+    }
+    n = len;
+    if (n > room)
+      n = room;
+    if (n > RECORD_RING_SIZE - rec->head % RECORD_RING_SIZE)
+      n = RECORD_RING_SIZE - rec->head % RECORD_RING_SIZE;
+    memcpy(rec->ring + rec->head % RECORD_RING_SIZE, buf, n);
+    STORE(rec->head, rec->head + n);
+    buf += n;
+    len -= n;
+  }
+
+  wake(rec, &rec->writerWaiting);
+}
+
+#else
+
+static void
+put(rfbClientRecorder *rec, const char *buf, size_t len)
+{
+  if (!rec->failed && !writeOut(rec, buf, len)) {
+    rfbClientErr("Writing the recording failed, stopped recording\n");
+    rec->failed = TRUE;
+  }
+}
+
+#endif
+
+
+rfbBool
+rfbClientStartRecording(rfbClient *client, const char *fileName, rfbBool compress)
+{
+  rfbClientRecorder *rec;
+  static const char magic[] = "vncLog0.0";
+
+  if (client->recorder != NULL) {
+    rfbClientErr("rfbClientStartRecording: already recording\n");
+    return FALSE;
+  }
+
+  rec = (rfbClientRecorder *)calloc(1, sizeof(rfbClientRecorder));
+  if (rec == NULL)
+    return FALSE;
+
+  if (compress) {
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    /* fast rather than small, it runs alongside the session */
+    rec->gz = gzopen(fileName, "wb1");
+    if (rec->gz == NULL) {
+      rfbClientErr("rfbClientStartRecording: cannot open %s\n", fileName);
+      free(rec);
+      return FALSE;
+    }
+#else
+    rfbClientErr("rfbClientStartRecording: built without zlib, cannot compress\n");
+    free(rec);
+    return FALSE;
+#endif
+  } else {
+    rec->file = fopen(fileName, "wb");
+    if (rec->file == NULL) {
+      rfbClientErr("rfbClientStartRecording: cannot open %s\n", fileName);
+      free(rec);
+      return FALSE;
+    }
+  }
+
+#ifdef RECORD_THREAD
+  rec->ring = (char *)malloc(RECORD_RING_SIZE);
+  if (rec->ring == NULL) {
+    closeFile(rec);
+    free(rec);
+    return FALSE;
+  }
+  INIT_MUTEX(rec->mutex);
+  INIT_COND(rec->cond);
+  if (pthread_create(&rec->thread, NULL, recordThread, rec) != 0) {
+    rfbClientErr("rfbClientStartRecording: cannot create thread\n");
+    TINI_COND(rec->cond);
+    TINI_MUTEX(rec->mutex);
+    closeFile(rec);
+    free(rec->ring);
+    free(rec);
+    return FALSE;
+  }
+#endif
+
+  put(rec, magic, strlen(magic));
+  client->recorder = rec;
+  return TRUE;
+}
+
+
+void
+rfbClientRecordMessage(rfbClient *client)
+{
+  client->recorder->messageStart = TRUE;
+}
+
+
+void
+rfbClientRecord(rfbClient *client, const char *buf, unsigned int len)
+{
+  rfbClientRecorder *rec = client->recorder;
+
+  /* the time the message's first bytes came in, in what -play reads */
+  if (rec->messageStart) {
+    struct timeval tv;
+    uint64_t now = rfbClientStatNow() / 1000;
+
+    memset(&tv, 0, sizeof(tv));
+    tv.tv_sec = rfbClientSwap32IfLE((uint32_t)(now / 1000000));
+    tv.tv_usec = rfbClientSwap32IfLE((uint32_t)(now % 1000000));
+    put(rec, (const char *)&tv, sizeof(tv));
+    rec->messageStart = FALSE;
+  }
+
+  put(rec, buf, len);
+}
+
+
+rfbBool
+rfbClientStopRecording(rfbClient *client)
+{
+  rfbClientRecorder *rec = client->recorder;
+  rfbBool ok;
+
+  if (rec == NULL)
+    return TRUE;
+  client->recorder = NULL;
+
+#ifdef RECORD_THREAD
+  LOCK(rec->mutex);
+  STORE(rec->stop, TRUE);
+  TSIGNAL(rec->cond);
+  UNLOCK(rec->mutex);
+  pthread_join(rec->thread, NULL);
+  TINI_COND(rec->cond);
+  TINI_MUTEX(rec->mutex);
+  if (rec->stalls > 0)
+    rfbClientLog("The recording's writer fell behind %lu times\n", rec->stalls);
+  free(rec->ring);
+#endif
+
+  closeFile(rec);
+  ok = !rec->failed;
+  free(rec);
+  return ok;
+}
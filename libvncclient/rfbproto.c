@@ -56,6 +56,7 @@
 #include <time.h>
 
 #include "crypto.h"
+#include "trace.h"
 
 #include "sasl.h"
 #ifdef LIBVNCSERVER_HAVE_LZO
@@ -64,6 +65,11 @@
 #include "minilzo.h"
 #endif
 #include "tls.h"
+#include "stats.h"
+#include "shm.h"
+#include "viewport.h"
+#include "sendqueue.h"
+#include "record.h"
 
 #define MAX_TEXTCHAT_SIZE 10485760 /* 10MB */
 
@@ -182,6 +188,31 @@ static rfbBool HandleZRLE24Down(rfbClient* client, int rx, int ry, int rw, int r
 static rfbBool HandleZRLE32(rfbClient* client, int rx, int ry, int rw, int rh);
 #endif
 
+/*
+ * Progressive updates, see rfbClient.GotFrameBufferBand. Decoders that
+ * can tell call BandDecoded() with the first row of their rect that is
+ * not decoded yet, and read their data in portions of BAND_READ_SIZE so
+ * that a slow link does not hold back what arrived already.
+ */
+#define BAND_READ_SIZE 16384
+
+static rfbBool
+BandsWanted(rfbClient* client)
+{
+  /* rects crossing the viewport's border are clipped while decoded */
+  return client->bandHeight > 0 && client->GotFrameBufferBand != NULL &&
+    !client->viewportClipping;
+}
+
+static void
+BandDecoded(rfbClient* client, int rx, int rw, int y)
+{
+  if (!BandsWanted(client) || y - client->bandStart < client->bandHeight)
+    return;
+  client->GotFrameBufferBand(client, rx, client->bandStart, rw, y - client->bandStart);
+  client->bandStart = y;
+}
+
 /*
  * Server Capability Functions
  */
@@ -1330,7 +1361,9 @@ SetFormatAndEncodings(rfbClient* client)
       } else if ((strncasecmp(encStr,"ultra",encStrLen) == 0) || (strncasecmp(encStr,"ultrazip",encStrLen) == 0)) {
         /* There are 2 encodings used in 'ultra' */
         encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltra);
-        encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltraZip);
+        /* UltraZip rects are no rects, see rfbClientViewportBeginRect() */
+        if (!client->viewportMode)
+          encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltraZip);
       } else if (strncasecmp(encStr,"corre",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingCoRRE);
       } else if (strncasecmp(encStr,"rre",encStrLen) == 0) {
@@ -1382,7 +1415,8 @@ SetFormatAndEncodings(rfbClient* client)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingZYWRLE);
 #endif
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltra);
-    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltraZip);
+    if (!client->viewportMode)
+      encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltraZip);
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingCoRRE);
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingRRE);
 
@@ -1504,6 +1538,8 @@ SendFramebufferUpdateRequest(rfbClient* client, int x, int y, int w, int h, rfbB
   if (!WriteToRFBServer(client, (char *)&fur, sz_rfbFramebufferUpdateRequestMsg))
     return FALSE;
 
+  rfbClientStatRecordRequest(client);
+
   return TRUE;
 }
 
@@ -1553,14 +1589,7 @@ rfbBool TextChatSend(rfbClient* client, char *text)
     chat.length = (uint32_t)count;
     chat.length = rfbClientSwap32IfLE(chat.length);
 
-    if (!WriteToRFBServer(client, (char *)&chat, sz_rfbTextChatMsg))
-        return FALSE;
-
-    if (count>0) {
-        if (!WriteToRFBServer(client, text, count))
-            return FALSE;
-    }
-    return TRUE;
+    return WriteMessageToRFBServer(client, (char *)&chat, sz_rfbTextChatMsg, text, count);
 }
 
 rfbBool TextChatOpen(rfbClient* client)
@@ -1659,6 +1688,10 @@ SendPointerEvent(rfbClient* client,int x, int y, int buttonMask)
 
   pe.type = rfbPointerEvent;
   pe.buttonMask = buttonMask;
+  if (client->viewportMode) {
+    x += client->viewport.x;
+    y += client->viewport.y;
+  }
   if (x < 0) x = 0;
   if (y < 0) y = 0;
 
@@ -1675,11 +1708,7 @@ SendPointerEvent(rfbClient* client,int x, int y, int buttonMask)
 static rfbBool
 ResizeClientBuffer(rfbClient* client, int width, int height)
 {
-  client->width = width;
-  client->height = height;
-  client->updateRect.x = client->updateRect.y = 0;
-  client->updateRect.w = client->width;
-  client->updateRect.h = client->height;
+  rfbClientViewportResize(client, width, height);
   return client->MallocFrameBuffer(client);
 }
 
@@ -1708,8 +1737,8 @@ SendExtDesktopSize(rfbClient* client, uint16_t width, uint16_t height)
     screen.width = rfbClientSwap16IfLE(width);
     screen.height = rfbClientSwap16IfLE(height);
 
-    if (!WriteToRFBServer(client, (char *)&sdm, sz_rfbSetDesktopSizeMsg)) return FALSE;
-    if (!WriteToRFBServer(client, (char *)&screen, sz_rfbExtDesktopScreen)) return FALSE;
+    if (!WriteMessageToRFBServer(client, (char *)&sdm, sz_rfbSetDesktopSizeMsg,
+                                 (char *)&screen, sz_rfbExtDesktopScreen)) return FALSE;
 
     client->screen.width = screen.width;
     client->screen.height = screen.height;
@@ -1783,8 +1812,7 @@ SendClientCutText(rfbClient* client, char *str, int len)
   memset(&cct, 0, sizeof(cct));
   cct.type = rfbClientCutText;
   cct.length = rfbClientSwap32IfLE(len);
-  return  (WriteToRFBServer(client, (char *)&cct, sz_rfbClientCutTextMsg) &&
-	   WriteToRFBServer(client, str, len));
+  return WriteMessageToRFBServer(client, (char *)&cct, sz_rfbClientCutTextMsg, str, len);
 }
 
 
@@ -1797,9 +1825,12 @@ rfbBool
 HandleRFBServerMessage(rfbClient* client)
 {
   rfbServerToClientMsg msg;
+  uint64_t syscallsAtStart = client->stats ? client->stats->syscalls : 0;
 
   if (client->serverPort==-1)
     client->vncRec->readTimestamp = TRUE;
+  if (client->recorder)
+    rfbClientRecordMessage(client);
   if (!ReadFromRFBServer(client, (char *)&msg, 1))
     return FALSE;
 
@@ -1840,6 +1871,9 @@ HandleRFBServerMessage(rfbClient* client)
     int linesToRead;
     int bytesPerLine;
     int i;
+    uint64_t rectStart = 0, rectBytesStart = 0;
+    uint64_t traceStart = 0, rectTraceStart = 0, finishTraceStart, traceId = 0;
+    rfbRectangle remote;
 
     if (!ReadFromRFBServer(client, ((char *)&msg.fu) + 1,
 			   sz_rfbFramebufferUpdateMsg - 1))
@@ -1847,6 +1881,15 @@ HandleRFBServerMessage(rfbClient* client)
 
     msg.fu.nRects = rfbClientSwap16IfLE(msg.fu.nRects);
 
+    /* counted like the server does, see rfb/rfbtrace.h */
+    client->traceUpdateSeq++;
+    if (rfbTraceActive) {
+      traceStart = rfbTraceNow();
+      if (client->traceKey == 0)
+        client->traceKey = rfbTraceSocketKey(client->sock, FALSE);
+      traceId = RFB_TRACE_ID(client->traceKey, client->traceUpdateSeq);
+    }
+
     for (i = 0; i < msg.fu.nRects; i++) {
       if (!ReadFromRFBServer(client, (char *)&rect, sz_rfbFramebufferUpdateRectHeader))
 	return FALSE;
@@ -1873,7 +1916,9 @@ HandleRFBServerMessage(rfbClient* client)
       }
 
       if (rect.encoding == rfbEncodingPointerPos) {
-	if (!client->HandleCursorPos(client,rect.r.x, rect.r.y)) {
+	if (!client->HandleCursorPos(client,
+				     rect.r.x - (client->viewportMode ? client->viewport.x : 0),
+				     rect.r.y - (client->viewportMode ? client->viewport.y : 0))) {
 	  return FALSE;
 	}
 	continue;
@@ -1892,7 +1937,8 @@ HandleRFBServerMessage(rfbClient* client)
       if (rect.encoding == rfbEncodingNewFBSize) {
 	if(!ResizeClientBuffer(client, rect.r.w, rect.r.h))
 	  return FALSE;
-	SendFramebufferUpdateRequest(client, 0, 0, rect.r.w, rect.r.h, FALSE);
+	SendFramebufferUpdateRequest(client, client->updateRect.x, client->updateRect.y,
+				     client->updateRect.w, client->updateRect.h, FALSE);
 	rfbClientLog("Got new framebuffer size: %dx%d\n", rect.r.w, rect.r.h);
 	continue;
       }
@@ -1921,7 +1967,8 @@ HandleRFBServerMessage(rfbClient* client)
           }
         }
 
-        if (!invalidScreen && (client->width != rect.r.w || client->height != rect.r.h)) {
+        if (!invalidScreen && (client->si.framebufferWidth != rect.r.w ||
+                               client->si.framebufferHeight != rect.r.h)) {
           if(!ResizeClientBuffer(client, rect.r.w, rect.r.h)) {
             return FALSE;
           }
@@ -1990,11 +2037,16 @@ HandleRFBServerMessage(rfbClient* client)
           continue;
       }
 
+      if (client->viewportMode && !rfbClientViewportBeginRect(client, &rect, &remote))
+        return FALSE;
+
       /* rfbEncodingUltraZip is a collection of subrects.   x = # of subrects, and h is always 0 */
       if (rect.encoding != rfbEncodingUltraZip)
       {
-        if ((rect.r.x + rect.r.w > client->width) ||
-	    (rect.r.y + rect.r.h > client->height))
+        /* those crossing the viewport's border were checked against the remote desktop */
+        if (!client->viewportClipping &&
+            ((rect.r.x + rect.r.w > client->width) ||
+	     (rect.r.y + rect.r.h > client->height)))
 	    {
 	      rfbClientLog("Rect too large: %dx%d at (%d, %d)\n",
 	  	  rect.r.w, rect.r.h, rect.r.x, rect.r.y);
@@ -2016,6 +2068,15 @@ HandleRFBServerMessage(rfbClient* client)
         client->SoftCursorLockArea(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
       }
 
+      client->bandStart = rect.r.y;
+
+      if (client->stats) {
+        rectStart = rfbClientStatNow();
+        rectBytesStart = client->stats->bytesRcvd - sz_rfbFramebufferUpdateRectHeader;
+      }
+      if (traceStart)
+        rectTraceStart = rfbTraceNow();
+
       switch (rect.encoding) {
 
       case rfbEncodingRaw: {
@@ -2026,6 +2087,8 @@ HandleRFBServerMessage(rfbClient* client)
 	   usually during GPU accel. */
 	/* Regardless of cause, do not divide by zero. */
 	linesToRead = bytesPerLine ? (RFB_BUFFER_SIZE / bytesPerLine) : 0;
+	if (linesToRead > client->bandHeight && BandsWanted(client))
+	  linesToRead = client->bandHeight;
 
 	while (linesToRead && h > 0) {
 	  if (linesToRead > h)
@@ -2040,6 +2103,7 @@ HandleRFBServerMessage(rfbClient* client)
 	  h -= linesToRead;
 	  y += linesToRead;
 
+	  BandDecoded(client, rect.r.x, rect.r.w, y);
 	}
 	break;
       } 
@@ -2057,6 +2121,12 @@ HandleRFBServerMessage(rfbClient* client)
 	/* If RichCursor encoding is used, we should extend our
 	   "cursor lock area" (previously set to destination
 	   rectangle) to the source rectangle as well. */
+	if (client->viewportMode) {
+	  if (!rfbClientViewportCopyRect(client, cr.srcX, cr.srcY, &remote, &rect.r))
+	    return FALSE;
+	  break;
+	}
+
 	client->SoftCursorLockArea(client,
 				   cr.srcX, cr.srcY, rect.r.w, rect.r.h);
 
@@ -2307,17 +2377,59 @@ HandleRFBServerMessage(rfbClient* client)
 	 }
       }
 
+      /* the rest of a rect that was reported in bands */
+      if (BandsWanted(client) && client->bandStart > rect.r.y &&
+          client->bandStart < rect.r.y + rect.r.h)
+        client->GotFrameBufferBand(client, rect.r.x, client->bandStart, rect.r.w,
+                                   rect.r.y + rect.r.h - client->bandStart);
+
+      if (client->stats)
+        rfbClientStatRecordRect(client, rect.encoding,
+                                client->stats->bytesRcvd - rectBytesStart,
+                                sz_rfbFramebufferUpdateRectHeader +
+                                (rect.encoding == rfbEncodingUltraZip ? 0 :
+                                 (uint64_t)rect.r.w * rect.r.h * client->format.bitsPerPixel / 8),
+                                rfbClientStatNow() - rectStart);
+      if (rectTraceStart)
+        rfbTraceSlice("client", "decode", rectTraceStart, traceId, 0,
+                      rfbTraceEncodingName(rect.encoding),
+                      rect.r.x, rect.r.y, rect.r.w, rect.r.h,
+                      client->stats ? (long)(client->stats->bytesRcvd - rectBytesStart) : -1);
+
+      if (client->viewportMode)
+        rfbClientViewportEndRect(client, &rect, &remote);
+
       /* Now we may discard "soft cursor locks". */
       client->SoftCursorUnlockScreen(client);
 
+      if (rect.r.w == 0 && rect.r.h == 0 && client->viewportMode)
+        continue;
+
       client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+
+      /* UltraZip rects carry the subrect count instead of a size */
+      if (rect.encoding == rfbEncodingUltraZip)
+        rfbClientShmDamage(client, 0, 0, client->width, client->height);
+      else
+        rfbClientShmDamage(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
     }
 
+    /* taken here: the next request is sent before the update is finished */
+    rfbClientStatRecordUpdate(client, syscallsAtStart);
+
     if (!SendIncrementalFramebufferUpdateRequest(client))
       return FALSE;
 
+    rfbClientShmFrameDone(client);
+
+    finishTraceStart = traceStart ? rfbTraceNow() : 0;
     if (client->FinishedFrameBufferUpdate)
       client->FinishedFrameBufferUpdate(client);
+    if (finishTraceStart) {
+      rfbTraceSlice("client", "FinishedFrameBufferUpdate", finishTraceStart, traceId, 'f', NULL,
+                    0, 0, 0, 0, -1);
+      rfbTraceSlice("client", "update", traceStart, traceId, 't', NULL, 0, 0, 0, 0, -1);
+    }
 
     break;
   }
@@ -2427,15 +2539,13 @@ HandleRFBServerMessage(rfbClient* client)
     if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
                            sz_rfbResizeFrameBufferMsg -1))
       return FALSE;
-    client->width = rfbClientSwap16IfLE(msg.rsfb.framebufferWidth);
-    client->height = rfbClientSwap16IfLE(msg.rsfb.framebufferHeigth);
-    client->updateRect.x = client->updateRect.y = 0;
-    client->updateRect.w = client->width;
-    client->updateRect.h = client->height;
+    rfbClientViewportResize(client, rfbClientSwap16IfLE(msg.rsfb.framebufferWidth),
+                            rfbClientSwap16IfLE(msg.rsfb.framebufferHeigth));
     if (!client->MallocFrameBuffer(client))
       return FALSE;
 
-    SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+    SendFramebufferUpdateRequest(client, client->updateRect.x, client->updateRect.y,
+                                 client->updateRect.w, client->updateRect.h, FALSE);
     rfbClientLog("Got new framebuffer size: %dx%d\n", client->width, client->height);
     break;
   }
@@ -2445,14 +2555,12 @@ HandleRFBServerMessage(rfbClient* client)
     if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
                            sz_rfbPalmVNCReSizeFrameBufferMsg -1))
       return FALSE;
-    client->width = rfbClientSwap16IfLE(msg.prsfb.buffer_w);
-    client->height = rfbClientSwap16IfLE(msg.prsfb.buffer_h);
-    client->updateRect.x = client->updateRect.y = 0;
-    client->updateRect.w = client->width;
-    client->updateRect.h = client->height;
+    rfbClientViewportResize(client, rfbClientSwap16IfLE(msg.prsfb.buffer_w),
+                            rfbClientSwap16IfLE(msg.prsfb.buffer_h));
     if (!client->MallocFrameBuffer(client))
       return FALSE;
-    SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+    SendFramebufferUpdateRequest(client, client->updateRect.x, client->updateRect.y,
+                                 client->updateRect.w, client->updateRect.h, FALSE);
     rfbClientLog("Got new framebuffer size: %dx%d\n", client->width, client->height);
     break;
   }
@@ -2479,6 +2587,41 @@ HandleRFBServerMessage(rfbClient* client)
 }
 
 
+/*
+ * Solid rects collected by the Hextile, RRE and CoRRE decoders and handed
+ * to GotFillRects in batches instead of one GotFillRect call each.
+ */
+#define FILL_RECTS_BATCH 256
+
+typedef struct {
+  rfbClientFillRect rects[FILL_RECTS_BATCH];
+  int count;
+} FillRectsBatch;
+
+static void
+FlushFillRects(rfbClient* client, FillRectsBatch* batch)
+{
+  if (batch->count > 0)
+    client->GotFillRects(client, batch->rects, batch->count);
+  batch->count = 0;
+}
+
+static void
+AddFillRect(rfbClient* client, FillRectsBatch* batch, int x, int y, int w, int h, uint32_t colour)
+{
+  rfbClientFillRect* r;
+
+  if (batch->count == FILL_RECTS_BATCH)
+    FlushFillRects(client, batch);
+  r = &batch->rects[batch->count++];
+  r->x = x;
+  r->y = y;
+  r->w = w;
+  r->h = h;
+  r->colour = colour;
+}
+
+
 #define GET_PIXEL8(pix, ptr) ((pix) = *(ptr)++)
 
 #define GET_PIXEL16(pix, ptr) (((uint8_t*)&(pix))[0] = *(ptr)++, \
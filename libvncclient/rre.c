@@ -33,35 +33,50 @@ static rfbBool
 HandleRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 {
   rfbRREHeader hdr;
-  int i;
+  uint32_t i, n;
   CARDBPP pix;
   rfbRectangle subrect;
+  char head[sz_rfbRREHeader + sizeof(CARDBPP)];
+  char *ptr;
+  FillRectsBatch batch;
 
-  if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbRREHeader))
+  if (!ReadFromRFBServer(client, head, sizeof(head)))
     return FALSE;
 
+  memcpy(&hdr, head, sz_rfbRREHeader);
   hdr.nSubrects = rfbClientSwap32IfLE(hdr.nSubrects);
+  memcpy(&pix, head + sz_rfbRREHeader, sizeof(pix));
 
-  if (!ReadFromRFBServer(client, (char *)&pix, sizeof(pix)))
-    return FALSE;
-
-  client->GotFillRect(client, rx, ry, rw, rh, pix);
+  batch.count = 0;
+  AddFillRect(client, &batch, rx, ry, rw, rh, pix);
 
-  for (i = 0; i < hdr.nSubrects; i++) {
-    if (!ReadFromRFBServer(client, (char *)&pix, sizeof(pix)))
+  /* the subrects, as many at a time as fit into the buffer */
+  while (hdr.nSubrects > 0) {
+    n = RFB_BUFFER_SIZE / (sizeof(pix) + sz_rfbRectangle);
+    if (n > hdr.nSubrects)
+      n = hdr.nSubrects;
+    if (!ReadFromRFBServer(client, client->buffer, n * (sizeof(pix) + sz_rfbRectangle)))
       return FALSE;
 
-    if (!ReadFromRFBServer(client, (char *)&subrect, sz_rfbRectangle))
-      return FALSE;
+    ptr = client->buffer;
+    for (i = 0; i < n; i++) {
+      memcpy(&pix, ptr, sizeof(pix));
+      ptr += sizeof(pix);
+      memcpy(&subrect, ptr, sz_rfbRectangle);
+      ptr += sz_rfbRectangle;
 
-    subrect.x = rfbClientSwap16IfLE(subrect.x);
-    subrect.y = rfbClientSwap16IfLE(subrect.y);
-    subrect.w = rfbClientSwap16IfLE(subrect.w);
-    subrect.h = rfbClientSwap16IfLE(subrect.h);
+      subrect.x = rfbClientSwap16IfLE(subrect.x);
+      subrect.y = rfbClientSwap16IfLE(subrect.y);
+      subrect.w = rfbClientSwap16IfLE(subrect.w);
+      subrect.h = rfbClientSwap16IfLE(subrect.h);
 
-    client->GotFillRect(client, rx+subrect.x, ry+subrect.y, subrect.w, subrect.h, pix);
+      AddFillRect(client, &batch, rx+subrect.x, ry+subrect.y, subrect.w, subrect.h, pix);
+    }
+    hdr.nSubrects -= n;
   }
 
+  FlushFillRects(client, &batch);
+
   return TRUE;
 }
 
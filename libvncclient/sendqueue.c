@@ -0,0 +1,268 @@
+/*
+ *  sendqueue.c - a writer thread, so that input can be sent from any
+ *  thread while another one decodes.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Once the thread runs, WriteToRFBServer() called from any other thread
+ * only copies the message into a node and appends it to a list, with a
+ * single atomic exchange: the queue is the usual multiple producer, single
+ * consumer one where the producers swap themselves in as the head and link
+ * the previous head to them afterwards. The writer thread takes the nodes
+ * off the other end in order and is the only one writing to the socket,
+ * so TLS and SASL state are only ever touched by it on the sending side.
+ *
+ * The writer only blocks on the condition when it found the list empty
+ * after announcing so in waiting; a producer that sees waiting set takes
+ * the mutex to signal it, which is the only time posting may block.
+ *
+ * Messages made of several writes, like ClientCutText, are queued as one
+ * with WriteMessageToRFBServer(), so those of other threads never end up
+ * in between.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "sendqueue.h"
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && defined(__GNUC__)
+
+#include <sched.h>
+
+typedef struct _rfbClientSendMessage {
+  struct _rfbClientSendMessage *next;
+  unsigned int length;
+  char data[1];
+} rfbClientSendMessage;
+
+struct _rfbClientSendQueue {
+  rfbClientSendMessage *head;   /* posted last, swapped in by the producers */
+  rfbClientSendMessage *tail;   /* written last, the writer's only */
+  pthread_t thread;
+  MUTEX(mutex);
+  COND(cond);
+  int waiting;
+  int stop;
+  int failed;
+};
+
+/* the client the calling thread is the writer of */
+static __thread rfbClient *writerOf;
+
+#define LOAD(p) __atomic_load_n(&(p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_SEQ_CST)
+
+
+static rfbClientSendMessage *
+newMessage(unsigned int length)
+{
+  rfbClientSendMessage *msg;
+
+  msg = (rfbClientSendMessage *)malloc(sizeof(rfbClientSendMessage) + length);
+  if (msg == NULL)
+    return NULL;
+  msg->next = NULL;
+  msg->length = length;
+  return msg;
+}
+
+
+/* the writer's side: the next message, NULL if there is none (yet) */
+static rfbClientSendMessage *
+takeMessage(rfbClientSendQueue *q)
+{
+  rfbClientSendMessage *next = __atomic_load_n(&q->tail->next, __ATOMIC_ACQUIRE);
+
+  if (next == NULL)
+    return NULL;
+  /* the old tail was written already, next becomes the new one */
+  free(q->tail);
+  q->tail = next;
+  return next;
+}
+
+
+static void *
+sendThread(void *arg)
+{
+  rfbClient *client = (rfbClient *)arg;
+  rfbClientSendQueue *q = client->sendQueue;
+  rfbClientSendMessage *msg;
+
+  writerOf = client;
+
+  for (;;) {
+    msg = takeMessage(q);
+    if (msg != NULL) {
+      if (!LOAD(q->failed) && !WriteToRFBServer(client, msg->data, msg->length))
+        STORE(q->failed, TRUE);
+      continue;
+    }
+    /* a producer is between swapping the head and linking it */
+    if (LOAD(q->head) != q->tail) {
+      sched_yield();
+      continue;
+    }
+    if (LOAD(q->stop))
+      break;
+
+    LOCK(q->mutex);
+    STORE(q->waiting, TRUE);
+    if (LOAD(q->head) == q->tail && !LOAD(q->stop))
+      WAIT(q->cond, q->mutex);
+    STORE(q->waiting, FALSE);
+    UNLOCK(q->mutex);
+  }
+
+  return NULL;
+}
+
+
+static void
+wakeWriter(rfbClientSendQueue *q)
+{
+  if (!LOAD(q->waiting))
+    return;
+  LOCK(q->mutex);
+  TSIGNAL(q->cond);
+  UNLOCK(q->mutex);
+}
+
+
+rfbBool
+rfbClientSendQueued(rfbClient *client)
+{
+  return client->sendQueue != NULL && writerOf != client;
+}
+
+
+rfbBool
+rfbClientQueueSend(rfbClient *client, const char *head, unsigned int headLen,
+                   const char *body, unsigned int bodyLen)
+{
+  rfbClientSendQueue *q = client->sendQueue;
+  rfbClientSendMessage *msg, *prev;
+
+  if (LOAD(q->failed))
+    return FALSE;
+
+  msg = newMessage(headLen + bodyLen);
+  if (msg == NULL) {
+    rfbClientErr("rfbClientQueueSend: out of memory\n");
+    return FALSE;
+  }
+  memcpy(msg->data, head, headLen);
+  if (bodyLen > 0)
+    memcpy(msg->data + headLen, body, bodyLen);
+
+  prev = __atomic_exchange_n(&q->head, msg, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+
+  wakeWriter(q);
+  return TRUE;
+}
+
+
+rfbBool
+rfbClientStartSendThread(rfbClient *client)
+{
+  rfbClientSendQueue *q;
+
+  if (client->sendQueue != NULL)
+    return TRUE;
+
+  q = (rfbClientSendQueue *)calloc(1, sizeof(rfbClientSendQueue));
+  if (q == NULL)
+    return FALSE;
+  /* an empty queue holds one message that counts as written */
+  q->head = q->tail = newMessage(0);
+  if (q->head == NULL) {
+    free(q);
+    return FALSE;
+  }
+  INIT_MUTEX(q->mutex);
+  INIT_COND(q->cond);
+
+  client->sendQueue = q;
+  if (pthread_create(&q->thread, NULL, sendThread, client) != 0) {
+    rfbClientErr("rfbClientStartSendThread: cannot create thread\n");
+    client->sendQueue = NULL;
+    TINI_COND(q->cond);
+    TINI_MUTEX(q->mutex);
+    free(q->head);
+    free(q);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+void
+rfbClientStopSendThread(rfbClient *client)
+{
+  rfbClientSendQueue *q = client->sendQueue;
+
+  if (q == NULL)
+    return;
+
+  LOCK(q->mutex);
+  STORE(q->stop, TRUE);
+  TSIGNAL(q->cond);
+  UNLOCK(q->mutex);
+  pthread_join(q->thread, NULL);
+
+  client->sendQueue = NULL;
+  TINI_COND(q->cond);
+  TINI_MUTEX(q->mutex);
+  free(q->tail);
+  free(q);
+}
+
+#else
+
+rfbBool
+rfbClientSendQueued(rfbClient *client)
+{
+  return FALSE;
+}
+
+
+rfbBool
+rfbClientQueueSend(rfbClient *client, const char *head, unsigned int headLen,
+                   const char *body, unsigned int bodyLen)
+{
+  return FALSE;
+}
+
+
+rfbBool
+rfbClientStartSendThread(rfbClient *client)
+{
+  rfbClientErr("rfbClientStartSendThread: not supported on this platform\n");
+  return FALSE;
+}
+
+
+void
+rfbClientStopSendThread(rfbClient *client)
+{
+}
+
+#endif
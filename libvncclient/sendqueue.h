@@ -0,0 +1,35 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef LIBVNCCLIENT_SENDQUEUE_H
+#define LIBVNCCLIENT_SENDQUEUE_H
+
+#include <rfb/rfbclient.h>
+
+/* Internal interface of sendqueue.c, used by sockets.c and rfbproto.c. */
+
+/* TRUE if the calling thread's writes are to go through the queue */
+rfbBool rfbClientSendQueued(rfbClient *client);
+/* queues head and body as one message, FALSE once writing has failed */
+rfbBool rfbClientQueueSend(rfbClient *client, const char *head, unsigned int headLen,
+                           const char *body, unsigned int bodyLen);
+
+/* sockets.c: writes a message in two parts no other thread's message gets between */
+rfbBool WriteMessageToRFBServer(rfbClient *client, const char *head, unsigned int headLen,
+                                const char *body, unsigned int bodyLen);
+
+#endif
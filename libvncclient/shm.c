@@ -0,0 +1,317 @@
+/*
+ *  shm.c - export the framebuffer to other processes through shared memory.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * The decoders write into a private framebuffer and every rectangle is
+ * copied into the segment once it is complete. Decoding waits for the
+ * network, so the seqlock is only held for that copy and readers never
+ * wait for a round trip. The layout and the reader's side of the protocol
+ * are described in rfb/rfbshm.h.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create() */
+#endif
+
+#include <rfb/rfbclient.h>
+#include <rfb/rfbshm.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(LIBVNCSERVER_HAVE_MMAP) && !defined(WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define RFB_HAVE_SHM_EXPORT
+#endif
+#include "shm.h"
+
+#ifdef RFB_HAVE_SHM_EXPORT
+
+#define SHM_PAGE_SIZE 4096
+#define SHM_ROUND(x) (((x) + SHM_PAGE_SIZE - 1) & ~(uint64_t)(SHM_PAGE_SIZE - 1))
+#define SHM_HEADER_SIZE SHM_ROUND(sizeof(rfbShmHeader))
+
+#ifdef __GNUC__
+#define SHM_BARRIER() __sync_synchronize()
+#else
+#define SHM_BARRIER() do { } while (0)
+#endif
+
+struct _rfbClientShmExport {
+  int fd;
+  char *name;            /* shm_open() name, unlinked on cleanup */
+  rfbShmHeader *header;
+  uint64_t mapSize;
+  uint8_t *frameBuffer;  /* what the decoders write to */
+};
+
+
+static void
+beginWrite(rfbClientShmExport *shm)
+{
+  shm->header->seq++;
+  SHM_BARRIER();
+}
+
+
+static void
+endWrite(rfbClientShmExport *shm)
+{
+  SHM_BARRIER();
+  shm->header->seq++;
+}
+
+
+static void
+pushDamage(rfbShmHeader *header, int x, int y, int w, int h)
+{
+  rfbShmRect *r = &header->damage[header->damageCount % RFB_SHM_DAMAGE_SLOTS];
+
+  r->x = x;
+  r->y = y;
+  r->w = w;
+  r->h = h;
+  header->damageCount++;
+}
+
+
+/*
+ * Replaces the default MallocFrameBuffer(). The segment only ever grows,
+ * readers holding an old, smaller mapping can still look at the header.
+ * The private framebuffer is allocated anew, like the default one.
+ */
+
+static rfbBool
+ShmMallocFrameBuffer(rfbClient *client)
+{
+  rfbClientShmExport *shm = client->shmExport;
+  rfbShmHeader *header;
+  uint64_t stride = (uint64_t)client->width * client->format.bitsPerPixel / 8;
+  uint64_t size = SHM_ROUND(SHM_HEADER_SIZE + stride * client->height);
+  void *map;
+
+  if (size >= SIZE_MAX) {
+    rfbClientErr("CRITICAL: cannot allocate frameBuffer, requested size is too large\n");
+    return FALSE;
+  }
+
+  if (size > shm->mapSize) {
+    if (ftruncate(shm->fd, (off_t)size) < 0) {
+      rfbClientErr("ShmMallocFrameBuffer: cannot resize segment: %s\n", strerror(errno));
+      return FALSE;
+    }
+    map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (map == MAP_FAILED) {
+      rfbClientErr("ShmMallocFrameBuffer: mmap failed: %s\n", strerror(errno));
+      return FALSE;
+    }
+    if (shm->header != NULL)
+      munmap(shm->header, (size_t)shm->mapSize);
+    shm->header = (rfbShmHeader *)map;
+    shm->mapSize = size;
+  }
+
+  free(shm->frameBuffer);
+  client->frameBuffer = NULL;
+  if ((shm->frameBuffer = (uint8_t *)malloc((size_t)(stride * client->height))) == NULL) {
+    rfbClientErr("CRITICAL: frameBuffer allocation failed, requested size too large or not enough memory?\n");
+    return FALSE;
+  }
+
+  header = shm->header;
+  beginWrite(shm);
+  if (header->magic != RFB_SHM_MAGIC) {
+    header->magic = RFB_SHM_MAGIC;
+    header->version = RFB_SHM_VERSION;
+    header->headerSize = (uint32_t)SHM_HEADER_SIZE;
+  }
+  header->mapSize = shm->mapSize;
+  header->width = client->width;
+  header->height = client->height;
+  header->stride = (uint32_t)stride;
+  header->bitsPerPixel = client->format.bitsPerPixel;
+  header->depth = client->format.depth;
+  header->bigEndian = client->format.bigEndian;
+  header->trueColour = client->format.trueColour;
+  header->redMax = client->format.redMax;
+  header->greenMax = client->format.greenMax;
+  header->blueMax = client->format.blueMax;
+  header->redShift = client->format.redShift;
+  header->greenShift = client->format.greenShift;
+  header->blueShift = client->format.blueShift;
+  pushDamage(header, 0, 0, client->width, client->height);
+  endWrite(shm);
+
+  client->frameBuffer = shm->frameBuffer;
+  client->frameBufferStride = 0;
+  return TRUE;
+}
+
+
+rfbBool
+rfbClientExportFrameBuffer(rfbClient *client, const char *name)
+{
+  rfbClientShmExport *shm;
+  int fd = -1;
+
+  if (client->shmExport != NULL)
+    return TRUE;
+
+  if (client->frameBuffer != NULL) {
+    rfbClientErr("rfbClientExportFrameBuffer: must be called before the framebuffer is allocated\n");
+    return FALSE;
+  }
+
+  if (name == NULL) {
+#ifdef LIBVNCSERVER_HAVE_MEMFD_CREATE
+    fd = memfd_create("libvncclient-framebuffer", MFD_CLOEXEC);
+#else
+    errno = ENOSYS;
+#endif
+  } else {
+#ifdef LIBVNCSERVER_HAVE_SHM_OPEN
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+#else
+    errno = ENOSYS;
+#endif
+  }
+  if (fd < 0) {
+    rfbClientErr("rfbClientExportFrameBuffer: cannot create segment %s: %s\n",
+                 name ? name : "(memfd)", strerror(errno));
+    return FALSE;
+  }
+
+  if ((shm = (rfbClientShmExport *)calloc(1, sizeof(rfbClientShmExport))) == NULL) {
+    close(fd);
+    return FALSE;
+  }
+  shm->fd = fd;
+  if (name != NULL)
+    shm->name = strdup(name);
+
+  client->shmExport = shm;
+  client->MallocFrameBuffer = ShmMallocFrameBuffer;
+  return TRUE;
+}
+
+
+int
+rfbClientGetExportFd(rfbClient *client)
+{
+  return client->shmExport ? client->shmExport->fd : -1;
+}
+
+
+void
+rfbClientShmDamage(rfbClient *client, int x, int y, int w, int h)
+{
+  rfbClientShmExport *shm = client->shmExport;
+  rfbShmHeader *header;
+  int bpp = client->format.bitsPerPixel / 8;
+  int srcStride = rfbClientFrameBufferStride(client);
+  uint8_t *src, *dst;
+  int j;
+
+  if (shm == NULL || shm->header == NULL || client->frameBuffer != shm->frameBuffer)
+    return;
+
+  header = shm->header;
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > (int)header->width) w = (int)header->width - x;
+  if (y + h > (int)header->height) h = (int)header->height - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  src = client->frameBuffer + (size_t)y * srcStride + (size_t)x * bpp;
+  dst = (uint8_t *)header + SHM_HEADER_SIZE + (size_t)y * header->stride + (size_t)x * bpp;
+
+  beginWrite(shm);
+  for (j = 0; j < h; j++)
+    memcpy(dst + (size_t)j * header->stride, src + (size_t)j * srcStride, (size_t)w * bpp);
+  pushDamage(header, x, y, w, h);
+  endWrite(shm);
+}
+
+
+void
+rfbClientShmFrameDone(rfbClient *client)
+{
+  rfbClientShmExport *shm = client->shmExport;
+
+  if (shm == NULL || shm->header == NULL)
+    return;
+
+  beginWrite(shm);
+  shm->header->frame++;
+  endWrite(shm);
+}
+
+
+void
+rfbClientShmFree(rfbClient *client)
+{
+  rfbClientShmExport *shm = client->shmExport;
+
+  if (shm == NULL)
+    return;
+
+  if (shm->header != NULL) {
+    beginWrite(shm);
+    shm->header->flags |= RFB_SHM_FLAG_CLOSED;
+    endWrite(shm);
+    munmap(shm->header, (size_t)shm->mapSize);
+  }
+  if (shm->frameBuffer != NULL && client->frameBuffer == shm->frameBuffer)
+    client->frameBuffer = NULL;
+  free(shm->frameBuffer);
+#ifdef LIBVNCSERVER_HAVE_SHM_OPEN
+  if (shm->name != NULL)
+    shm_unlink(shm->name);
+#endif
+  free(shm->name);
+  close(shm->fd);
+  free(shm);
+  client->shmExport = NULL;
+}
+
+#else
+
+rfbBool
+rfbClientExportFrameBuffer(rfbClient *client, const char *name)
+{
+  rfbClientErr("rfbClientExportFrameBuffer: not supported on this platform\n");
+  return FALSE;
+}
+
+
+int
+rfbClientGetExportFd(rfbClient *client)
+{
+  return -1;
+}
+
+
+void rfbClientShmDamage(rfbClient *client, int x, int y, int w, int h) { }
+void rfbClientShmFrameDone(rfbClient *client) { }
+void rfbClientShmFree(rfbClient *client) { }
+
+#endif /* RFB_HAVE_SHM_EXPORT */
@@ -0,0 +1,31 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef LIBVNCCLIENT_SHM_H
+#define LIBVNCCLIENT_SHM_H
+
+#include <rfb/rfbclient.h>
+
+/* Internal hooks of the shared memory export, no-ops if there is none. */
+
+/* called once the rectangle is in the framebuffer, copies it to the segment */
+void rfbClientShmDamage(rfbClient *client, int x, int y, int w, int h);
+/* called when a FramebufferUpdate is complete */
+void rfbClientShmFrameDone(rfbClient *client);
+void rfbClientShmFree(rfbClient *client);
+
+#endif
@@ -38,8 +38,12 @@
 #include <assert.h>
 #include <rfb/rfbclient.h>
 #include "sockets.h"
+#include "trace.h"
 #include "tls.h"
 #include "sasl.h"
+#include "stats.h"
+#include "sendqueue.h"
+#include "record.h"
 
 void PrintInHex(char *buf, int len);
 
@@ -59,8 +63,8 @@ rfbBool errorMessageOnReadFailure = TRUE;
  *    events are processed, as there is no XtAppMainLoop in the program.
  */
 
-rfbBool
-ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
+static rfbBool
+readFromRFBServer(rfbClient* client, char *out, unsigned int n)
 {
   const int USECS_WAIT_PER_RETRY = 100000;
   int retries = 0;
@@ -77,6 +81,9 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
   if(!out)
     return FALSE;
 
+  if (client->stats)
+    client->stats->bytesRcvd += n;
+
   if (client->serverPort==-1) {
     /* vncrec playing */
     rfbVNCRec* rec = client->vncRec;
@@ -134,6 +141,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 
     while (client->buffered < n) {
       int i;
+      STAT_SYSCALL(client);
       if (client->tlsSession)
         i = ReadFromTLS(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
       else
@@ -142,9 +150,12 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
         i = ReadFromSASL(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
       else {
 #endif /* LIBVNCSERVER_HAVE_SASL */
+      if (client->ReadFromTransport)
+        i = client->ReadFromTransport(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
+      else
         i = read(client->sock, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
 #ifdef WIN32
-	if (i < 0) errno=WSAGetLastError();
+	if (i < 0 && !client->ReadFromTransport) errno=WSAGetLastError();
 #endif
 #ifdef LIBVNCSERVER_HAVE_SASL
       }
@@ -153,6 +164,8 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
       if (i <= 0) {
 	if (i < 0) {
 	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	    uint64_t traceStart;
+
 	    if (client->readTimeout > 0 &&
 		++retries > (client->readTimeout * 1000 * 1000 / USECS_WAIT_PER_RETRY))
 	    {
@@ -162,7 +175,10 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	    /* TODO:
 	       ProcessXtEvents();
 	    */
+	    traceStart = rfbTraceActive ? rfbTraceNow() : 0;
 	    WaitForMessage(client, USECS_WAIT_PER_RETRY);
+	    if (traceStart)
+	      rfbTraceSlice("client", "receive wait", traceStart, 0, 0, NULL, 0, 0, 0, 0, -1);
 	    i = 0;
 	  } else {
 	    rfbClientErr("read (%d: %s)\n",errno,strerror(errno));
@@ -186,6 +202,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 
     while (n > 0) {
       int i;
+      STAT_SYSCALL(client);
       if (client->tlsSession)
         i = ReadFromTLS(client, out, n);
       else
@@ -194,14 +211,20 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
         i = ReadFromSASL(client, out, n);
       else
 #endif
+      if (client->ReadFromTransport)
+        i = client->ReadFromTransport(client, out, n);
+      else
         i = read(client->sock, out, n);
 
       if (i <= 0) {
 	if (i < 0) {
 #ifdef WIN32
-	  errno=WSAGetLastError();
+	  if (!client->ReadFromTransport)
+	    errno=WSAGetLastError();
 #endif
 	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	    uint64_t traceStart;
+
 	    if (client->readTimeout > 0 &&
 		++retries > (client->readTimeout * 1000 * 1000 / USECS_WAIT_PER_RETRY))
 	    {
@@ -211,7 +234,10 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	    /* TODO:
 	       ProcessXtEvents();
 	    */
+	    traceStart = rfbTraceActive ? rfbTraceNow() : 0;
 	    WaitForMessage(client, USECS_WAIT_PER_RETRY);
+	    if (traceStart)
+	      rfbTraceSlice("client", "receive wait", traceStart, 0, 0, NULL, 0, 0, 0, 0, -1);
 	    i = 0;
 	  } else {
 	    rfbClientErr("read (%s)\n",strerror(errno));
@@ -242,6 +268,17 @@ hexdump:
 }
 
 
+rfbBool
+ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
+{
+  if (!readFromRFBServer(client, out, n))
+    return FALSE;
+  if (client->recorder)
+    rfbClientRecord(client, out, n);
+  return TRUE;
+}
+
+
 /*
  * Write an exact number of bytes, and don't return until you've sent them.
  */
@@ -262,7 +299,14 @@ WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
   if (client->serverPort==-1)
     return TRUE; /* vncrec playing */
 
+  if (rfbClientSendQueued(client))
+    return rfbClientQueueSend(client, buf, n, NULL, 0);
+
+  if (client->stats)
+    client->stats->bytesSent += n;
+
   if (client->tlsSession) {
+    STAT_SEND_SYSCALL(client);
     /* WriteToTLS() will guarantee either everything is written, or error/eof returns */
     i = WriteToTLS(client, buf, n);
     if (i <= 0) return FALSE;
@@ -285,6 +329,32 @@ WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
 #endif /* LIBVNCSERVER_HAVE_SASL */
 
   while (i < n) {
+    STAT_SEND_SYSCALL(client);
+    if (client->WriteToTransport) {
+      j = client->WriteToTransport(client, obuf + i, (n - i));
+      if (j > 0) {
+        i += j;
+        continue;
+      }
+      if (j == 0) {
+        rfbClientErr("write to transport wrote nothing\n");
+        return FALSE;
+      }
+      if (errno != EINTR && errno != EWOULDBLOCK && errno != EAGAIN) {
+        rfbClientErr("write to transport (%s)\n", strerror(errno));
+        return FALSE;
+      }
+      /* WaitForTransport only waits for reading, so give a transport
+         that does not block after all a moment instead of spinning */
+      if (errno != EINTR) {
+#ifndef WIN32
+        usleep(1000);
+#else
+        Sleep(1);
+#endif
+      }
+      continue;
+    }
     j = write(client->sock, obuf + i, (n - i));
     if (j <= 0) {
       if (j < 0) {
@@ -299,6 +369,7 @@ WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
 	  FD_ZERO(&fds);
 	  FD_SET(client->sock,&fds);
 
+	  STAT_SEND_SYSCALL(client);
 	  if (select(client->sock+1, NULL, &fds, NULL, NULL) <= 0) {
 	    rfbClientErr("select\n");
 	    return FALSE;
@@ -319,6 +390,18 @@ WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
 }
 
 
+rfbBool
+WriteMessageToRFBServer(rfbClient* client, const char *head, unsigned int headLen,
+			const char *body, unsigned int bodyLen)
+{
+  if (client->serverPort!=-1 && rfbClientSendQueued(client))
+    return rfbClientQueueSend(client, head, headLen, body, bodyLen);
+
+  return WriteToRFBServer(client, head, headLen) &&
+    (bodyLen == 0 || WriteToRFBServer(client, body, bodyLen));
+}
+
+
 rfbSocket
 ConnectClientToTcpAddr(unsigned int host, int port)
 {
@@ -854,6 +937,11 @@ int WaitForMessage(rfbClient* client,unsigned int usecs)
   if (client->serverPort==-1)
     /* playing back vncrec file */
     return 1;
+
+  if (client->WaitForTransport) {
+    STAT_SYSCALL(client);
+    return client->WaitForTransport(client, usecs);
+  }
   
   timeout.tv_sec=(usecs/1000000);
   timeout.tv_usec=(usecs%1000000);
@@ -861,6 +949,7 @@ int WaitForMessage(rfbClient* client,unsigned int usecs)
   FD_ZERO(&fds);
   FD_SET(client->sock,&fds);
 
+  STAT_SYSCALL(client);
   num=select(client->sock+1, &fds, NULL, NULL, &timeout);
   if(num<0) {
 #ifdef WIN32
@@ -0,0 +1,294 @@
+/*
+ *  stats.c - client side statistics: what the server sends and what it
+ *  costs to decode.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * The counters are updated from the places doing the work: ReadFromRFBServer()
+ * and WriteToRFBServer() count bytes and system calls, HandleRFBServerMessage()
+ * times every rectangle and every update. Note that the decoding time of a
+ * rectangle includes waiting for the part of its data that has not arrived
+ * yet, so on a slow link it is dominated by the network.
+ */
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "stats.h"
+
+/* Encoding names must be <=16 characters, like in libvncserver's stats.c */
+static const char *
+encodingName(uint32_t type, char *buf, int len)
+{
+  switch (type) {
+  case rfbEncodingRaw:      return "raw";
+  case rfbEncodingCopyRect: return "copyRect";
+  case rfbEncodingRRE:      return "RRE";
+  case rfbEncodingCoRRE:    return "CoRRE";
+  case rfbEncodingHextile:  return "hextile";
+  case rfbEncodingZlib:     return "zlib";
+  case rfbEncodingTight:    return "tight";
+  case rfbEncodingZlibHex:  return "zlibhex";
+  case rfbEncodingUltra:    return "ultra";
+  case rfbEncodingUltraZip: return "ultraZip";
+  case rfbEncodingTRLE:     return "TRLE";
+  case rfbEncodingZRLE:     return "ZRLE";
+  case rfbEncodingZYWRLE:   return "ZYWRLE";
+  default:
+    snprintf(buf, len, "Enc(0x%08X)", type);
+    return buf;
+  }
+}
+
+
+uint64_t
+rfbClientStatNow(void)
+{
+#ifdef WIN32
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+static void
+histogramAdd(rfbClientStatHistogram *h, uint64_t value)
+{
+  int bucket = 0;
+
+  while (bucket < RFB_CLIENT_STAT_BUCKETS - 1 && (value >> (bucket + 1)) != 0)
+    bucket++;
+
+  h->buckets[bucket]++;
+  if (h->count == 0 || value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+  h->count++;
+  h->sum += value;
+}
+
+
+uint64_t
+rfbClientStatPercentile(const rfbClientStatHistogram *h, int percent)
+{
+  uint64_t wanted, seen = 0;
+  int i;
+
+  if (h == NULL || h->count == 0)
+    return 0;
+
+  wanted = ((uint64_t)h->count * percent + 99) / 100;
+  for (i = 0; i < RFB_CLIENT_STAT_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= wanted && seen > 0) {
+      /* upper bound of the bucket, but never beyond what was seen */
+      uint64_t bound = ((uint64_t)2 << i) - 1;
+      return bound < h->max ? bound : h->max;
+    }
+  }
+  return h->max;
+}
+
+
+rfbClientStats *
+rfbClientStatInit(void)
+{
+  return (rfbClientStats *)calloc(1, sizeof(rfbClientStats));
+}
+
+
+static void
+freeEncodingList(rfbClientStats *stats)
+{
+  rfbClientEncodingStats *ptr, *next;
+
+  for (ptr = stats->encodings; ptr != NULL; ptr = next) {
+    next = ptr->next;
+    free(ptr);
+  }
+  stats->encodings = NULL;
+}
+
+
+void
+rfbClientStatFree(rfbClient *client)
+{
+  if (client->stats == NULL)
+    return;
+
+  freeEncodingList(client->stats);
+  free(client->stats);
+  client->stats = NULL;
+}
+
+
+rfbClientStats *
+rfbClientGetStats(rfbClient *client)
+{
+  return client ? client->stats : NULL;
+}
+
+
+rfbClientEncodingStats *
+rfbClientStatLookupEncoding(rfbClient *client, uint32_t encoding)
+{
+  rfbClientEncodingStats *ptr;
+
+  if (client == NULL || client->stats == NULL)
+    return NULL;
+
+  for (ptr = client->stats->encodings; ptr != NULL; ptr = ptr->next)
+    if (ptr->encoding == encoding)
+      return ptr;
+
+  return NULL;
+}
+
+
+void
+rfbClientResetStats(rfbClient *client)
+{
+  if (client == NULL || client->stats == NULL)
+    return;
+
+  freeEncodingList(client->stats);
+  memset(client->stats, 0, sizeof(rfbClientStats));
+}
+
+
+void
+rfbClientStatRecordRect(rfbClient *client, uint32_t encoding,
+                        uint64_t bytes, uint64_t bytesIfRaw, uint64_t ns)
+{
+  rfbClientEncodingStats *ptr;
+
+  if (client->stats == NULL)
+    return;
+
+  if ((ptr = rfbClientStatLookupEncoding(client, encoding)) == NULL) {
+    ptr = (rfbClientEncodingStats *)calloc(1, sizeof(rfbClientEncodingStats));
+    if (ptr == NULL)
+      return;
+    ptr->encoding = encoding;
+    ptr->next = client->stats->encodings;
+    client->stats->encodings = ptr;
+  }
+
+  ptr->rects++;
+  ptr->bytes += bytes;
+  ptr->bytesIfRaw += bytesIfRaw;
+  histogramAdd(&ptr->decodeNs, ns);
+}
+
+
+/*
+ * Only the oldest unanswered request counts: the server may well merge
+ * several of them into one update.
+ */
+
+void
+rfbClientStatRecordRequest(rfbClient *client)
+{
+  if (client->stats != NULL && client->stats->requestTime == 0)
+    client->stats->requestTime = rfbClientStatNow();
+}
+
+
+void
+rfbClientStatRecordUpdate(rfbClient *client, uint64_t syscallsAtStart)
+{
+  rfbClientStats *stats = client->stats;
+
+  if (stats == NULL)
+    return;
+
+  stats->updates++;
+  histogramAdd(&stats->syscallsPerUpdate, stats->syscalls - syscallsAtStart);
+
+  if (stats->requestTime != 0) {
+    histogramAdd(&stats->updateLatencyNs, rfbClientStatNow() - stats->requestTime);
+    stats->requestTime = 0;
+  }
+}
+
+
+void
+rfbClientPrintStats(rfbClient *client)
+{
+  rfbClientStats *stats = rfbClientGetStats(client);
+  rfbClientEncodingStats *ptr;
+  char encBuf[64];
+  double savings;
+  uint32_t totalRects = 0;
+  double totalBytes = 0.0;
+  double totalBytesIfRaw = 0.0;
+
+  if (stats == NULL)
+    return;
+
+  rfbClientLog("%-16.16s  %8.8s  %10.10s/%10.10s (%6.6s)  %8.8s %8.8s %8.8s\n",
+               "Statistics", "rects", "Received", "RawEquiv", "saved",
+               "us/rect", "p50", "p99");
+  for (ptr = stats->encodings; ptr != NULL; ptr = ptr->next) {
+    savings = 0.0;
+    if (ptr->bytesIfRaw > 0)
+      savings = 100.0 - (((double)ptr->bytes / (double)ptr->bytesIfRaw) * 100.0);
+    rfbClientLog(" %-16.16s %8u  %10.0f/%10.0f (%5.1f%%)  %8.1f %8.1f %8.1f\n",
+                 encodingName(ptr->encoding, encBuf, sizeof(encBuf)),
+                 ptr->rects, (double)ptr->bytes, (double)ptr->bytesIfRaw, savings,
+                 ptr->decodeNs.count ? (double)ptr->decodeNs.sum / ptr->decodeNs.count / 1000.0 : 0.0,
+                 (double)rfbClientStatPercentile(&ptr->decodeNs, 50) / 1000.0,
+                 (double)rfbClientStatPercentile(&ptr->decodeNs, 99) / 1000.0);
+    totalRects += ptr->rects;
+    totalBytes += (double)ptr->bytes;
+    totalBytesIfRaw += (double)ptr->bytesIfRaw;
+  }
+  savings = 0.0;
+  if (totalBytesIfRaw > 0.0)
+    savings = 100.0 - ((totalBytes / totalBytesIfRaw) * 100.0);
+  rfbClientLog(" %-16.16s %8u  %10.0f/%10.0f (%5.1f%%)\n",
+               "TOTALS", totalRects, totalBytes, totalBytesIfRaw, savings);
+
+  rfbClientLog("Total bytes received %.0f, sent %.0f, %.0f syscalls to receive, %.0f to send\n",
+               (double)stats->bytesRcvd, (double)stats->bytesSent,
+               (double)stats->syscalls, (double)stats->sendSyscalls);
+  if (stats->updates > 0)
+    rfbClientLog("%u updates: %.1f syscalls/update (p99 %.0f), latency %.2f ms (p50 %.2f, p99 %.2f)\n",
+                 stats->updates,
+                 (double)stats->syscallsPerUpdate.sum / stats->syscallsPerUpdate.count,
+                 (double)rfbClientStatPercentile(&stats->syscallsPerUpdate, 99),
+                 stats->updateLatencyNs.count ?
+                   (double)stats->updateLatencyNs.sum / stats->updateLatencyNs.count / 1e6 : 0.0,
+                 (double)rfbClientStatPercentile(&stats->updateLatencyNs, 50) / 1e6,
+                 (double)rfbClientStatPercentile(&stats->updateLatencyNs, 99) / 1e6);
+}
@@ -0,0 +1,44 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ *  Internal interface of stats.c, used by rfbproto.c and sockets.c.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfbclient.h>
+
+/* Count one system call to receive on the connection of client. */
+#define STAT_SYSCALL(client) \
+  do { if ((client)->stats) (client)->stats->syscalls++; } while (0)
+
+/* Count one system call to send, made by the writer thread once it runs. */
+#define STAT_SEND_SYSCALL(client) \
+  do { if ((client)->stats) (client)->stats->sendSyscalls++; } while (0)
+
+/* Monotonic time in nanoseconds. */
+uint64_t rfbClientStatNow(void);
+
+rfbClientStats* rfbClientStatInit(void);
+void rfbClientStatFree(rfbClient* client);
+
+void rfbClientStatRecordRect(rfbClient* client, uint32_t encoding,
+                             uint64_t bytes, uint64_t bytesIfRaw, uint64_t ns);
+void rfbClientStatRecordRequest(rfbClient* client);
+void rfbClientStatRecordUpdate(rfbClient* client, uint64_t syscallsAtStart);
+
+#endif /* STATS_H */
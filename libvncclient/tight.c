@@ -47,6 +47,7 @@
 #define FilterCopyBPP CONCAT2E(FilterCopy,BPP)
 #define FilterPaletteBPP CONCAT2E(FilterPalette,BPP)
 #define FilterGradientBPP CONCAT2E(FilterGradient,BPP)
+#define FilterRowsBPP CONCAT2E(FilterRows,BPP)
 
 #if BPP != 8
 #define DecompressJpegRectBPP CONCAT2E(DecompressJpegRect,BPP)
@@ -86,6 +87,7 @@ static int InitFilterGradientBPP (rfbClient* client, int rw, int rh);
 static void FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows);
 static void FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows);
 static void FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows);
+static rfbBool FilterRowsBPP (rfbClient* client, filterPtrBPP filterFn, int srcx, int srcy, int numRows);
 
 #if BPP != 8
 static rfbBool DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h);
@@ -108,7 +110,9 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   if (client->frameBuffer == NULL)
     return FALSE;
 
-  if (rx + rw > client->width || ry + rh > client->height) {
+  /* rects crossing the viewport's border keep their remote coordinates */
+  if (!client->viewportClipping &&
+      (rx + rw > client->width || ry + rh > client->height)) {
     rfbClientLog("Rect out of bounds: %dx%d at (%d, %d)\n", rx, ry, rw, rh);
     return FALSE;
   }
@@ -213,9 +217,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     if (!ReadFromRFBServer(client, (char*)client->buffer, rh * rowSize))
       return FALSE;
 
-    filterFn(client, rx, ry, rh);
-
-    return TRUE;
+    return FilterRowsBPP(client, filterFn, rx, ry, rh);
   }
 
   /* Read the length (1..3 bytes) of compressed data following. */
@@ -233,9 +235,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     if (!ReadFromRFBServer(client, (char*)client->buffer, compressedLen))
       return FALSE;
 
-    filterFn(client, rx, ry, rh);
-
-    return TRUE;
+    return FilterRowsBPP(client, filterFn, rx, ry, rh);
   }
 
   /* Now let's initialize compression stream if needed. */
@@ -271,6 +271,8 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
       portionLen = ZLIB_BUFFER_SIZE;
     else
       portionLen = compressedLen;
+    if (portionLen > BAND_READ_SIZE && BandsWanted(client))
+      portionLen = BAND_READ_SIZE;
 
     if (!ReadFromRFBServer(client, (char*)client->zlib_buffer, portionLen))
       return FALSE;
@@ -298,13 +300,15 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 
       numRows = (bufferSize - zs->avail_out) / rowSize;
 
-      filterFn(client, rx, ry+rowsProcessed, numRows);
+      if (!FilterRowsBPP(client, filterFn, rx, ry+rowsProcessed, numRows))
+	return FALSE;
 
       extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
       if (extraBytes > 0)
 	memcpy(client->buffer, &client->buffer[numRows * rowSize], extraBytes);
 
       rowsProcessed += numRows;
+      BandDecoded(client, rx, rw, ry + rowsProcessed);
     }
     while (zs->avail_out == 0);
   }
@@ -323,6 +327,21 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
  *
  */
 
+/*
+ * Draws numRows rows of client->rectWidth pixels from client->buffer,
+ * through a scratch buffer if they cross the viewport's border.
+ */
+
+static rfbBool
+FilterRowsBPP (rfbClient* client, filterPtrBPP filterFn, int srcx, int srcy, int numRows)
+{
+  if (!rfbClientViewportBeginStrip(client, &srcx, &srcy, client->rectWidth, numRows))
+    return FALSE;
+  filterFn(client, srcx, srcy, numRows);
+  rfbClientViewportEndStrip(client);
+  return TRUE;
+}
+
 static int
 InitFilterCopyBPP (rfbClient* client, int rw, int rh)
 {
@@ -345,7 +364,8 @@ static void
 FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
 {
   CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
+    (CARDBPP *)&client->frameBuffer[srcy * rfbClientFrameBufferStride(client) + srcx * BPP / 8];
+  size_t stride = rfbClientFrameBufferStride(client) / (BPP / 8);
   int y;
 
 #if BPP == 32
@@ -354,7 +374,7 @@ FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
   if (client->cutZeros) {
     for (y = 0; y < numRows; y++) {
       for (x = 0; x < client->rectWidth; x++) {
-	dst[y*client->width+x] =
+	dst[y*stride+x] =
 	  RGB24_TO_PIXEL32(client->buffer[(y*client->rectWidth+x)*3],
 			   client->buffer[(y*client->rectWidth+x)*3+1],
 			   client->buffer[(y*client->rectWidth+x)*3+2]);
@@ -365,7 +385,7 @@ FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
 #endif
 
   for (y = 0; y < numRows; y++)
-    memcpy (&dst[y*client->width],
+    memcpy (&dst[y*stride],
             &client->buffer[y * client->rectWidth * (BPP / 8)],
             client->rectWidth * (BPP / 8));
 }
@@ -390,7 +410,8 @@ static void
 FilterGradient24 (rfbClient* client, int srcx, int srcy, int numRows)
 {
   CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
+    (CARDBPP *)&client->frameBuffer[srcy * rfbClientFrameBufferStride(client) + srcx * BPP / 8];
+  size_t stride = rfbClientFrameBufferStride(client) / (BPP / 8);
   int x, y, c;
   uint8_t thisRow[2048*3];
   uint8_t pix[3];
@@ -403,7 +424,7 @@ FilterGradient24 (rfbClient* client, int srcx, int srcy, int numRows)
       pix[c] = client->tightPrevRow[c] + client->buffer[y*client->rectWidth*3+c];
       thisRow[c] = pix[c];
     }
-    dst[y*client->width] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+    dst[y*stride] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
 
     /* Remaining pixels of a row */
     for (x = 1; x < client->rectWidth; x++) {
@@ -418,7 +439,7 @@ FilterGradient24 (rfbClient* client, int srcx, int srcy, int numRows)
 	pix[c] = (uint8_t)est[c] + client->buffer[(y*client->rectWidth+x)*3+c];
 	thisRow[x*3+c] = pix[c];
       }
-      dst[y*client->width+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+      dst[y*stride+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
     }
 
     memcpy(client->tightPrevRow, thisRow, client->rectWidth * 3);
@@ -431,7 +452,8 @@ static void
 FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
 {
   CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
+    (CARDBPP *)&client->frameBuffer[srcy * rfbClientFrameBufferStride(client) + srcx * BPP / 8];
+  size_t stride = rfbClientFrameBufferStride(client) / (BPP / 8);
   int x, y, c;
   CARDBPP *src = (CARDBPP *)client->buffer;
   uint16_t *thatRow = (uint16_t *)client->tightPrevRow;
@@ -463,7 +485,7 @@ FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
       pix[c] = (uint16_t)(((src[y*client->rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
       thisRow[c] = pix[c];
     }
-    dst[y*client->width] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
+    dst[y*stride] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
 
     /* Remaining pixels of a row */
     for (x = 1; x < client->rectWidth; x++) {
@@ -477,7 +499,7 @@ FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
 	pix[c] = (uint16_t)(((src[y*client->rectWidth+x] >> shift[c]) + est[c]) & max[c]);
 	thisRow[x*3+c] = pix[c];
       }
-      dst[y*client->width+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
+      dst[y*stride+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
     }
     memcpy(thatRow, thisRow, client->rectWidth * 3 * sizeof(uint16_t));
   }
@@ -526,7 +548,8 @@ FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows)
 {
   int x, y, b, w;
   CARDBPP *dst =
-    (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
+    (CARDBPP *)&client->frameBuffer[srcy * rfbClientFrameBufferStride(client) + srcx * BPP / 8];
+  size_t stride = rfbClientFrameBufferStride(client) / (BPP / 8);
   uint8_t *src = (uint8_t *)client->buffer;
   CARDBPP *palette = (CARDBPP *)client->tightPalette;
 
@@ -535,16 +558,16 @@ FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows)
     for (y = 0; y < numRows; y++) {
       for (x = 0; x < client->rectWidth / 8; x++) {
 	for (b = 7; b >= 0; b--)
-	  dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
+	  dst[y*stride+x*8+7-b] = palette[src[y*w+x] >> b & 1];
       }
       for (b = 7; b >= 8 - client->rectWidth % 8; b--) {
-	dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
+	dst[y*stride+x*8+7-b] = palette[src[y*w+x] >> b & 1];
       }
     }
   } else {
     for (y = 0; y < numRows; y++)
       for (x = 0; x < client->rectWidth; x++)
-	dst[y*client->width+x] = palette[(int)src[y*client->rectWidth+x]];
+	dst[y*stride+x] = palette[(int)src[y*client->rectWidth+x]];
   }
 }
 
@@ -591,6 +614,11 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     }
   }
 
+  if (!rfbClientViewportBeginStrip(client, &x, &y, w, h)) {
+    free(compressedData);
+    return FALSE;
+  }
+
 #if BPP == 16
   flags = 0;
   pixelSize = 3;
@@ -602,13 +630,14 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     flags |= TJ_BGR;
   if (client->format.bigEndian) flags ^= TJ_BGR;
   pixelSize = BPP / 8;
-  pitch = client->width * pixelSize;
-  dst = &client->frameBuffer[y * pitch + x * pixelSize];
+  pitch = (int)rfbClientFrameBufferStride(client);
+  dst = &client->frameBuffer[(size_t)y * pitch + x * pixelSize];
 #endif
 
   if (tjDecompress(client->tjhnd, compressedData, (unsigned long)compressedLen,
                    dst, w, pitch, h, pixelSize, flags)==-1) {
     rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
+    rfbClientViewportEndStrip(client);
     free(compressedData);
     return FALSE;
   }
@@ -617,8 +646,8 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
 
 #if BPP == 16
   pixelSize = BPP / 8;
-  pitch = client->width * pixelSize;
-  dst = &client->frameBuffer[y * pitch + x * pixelSize];
+  pitch = (int)rfbClientFrameBufferStride(client);
+  dst = &client->frameBuffer[(size_t)y * pitch + x * pixelSize];
   {
     CARDBPP *dst16=(CARDBPP *)dst, *dst2;
     char *src = client->buffer;
@@ -628,11 +657,12 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
       for (i = 0, dst2 = dst16; i < w; i++, dst2++, src += 3) {
         *dst2 = RGB24_TO_PIXEL(BPP, src[0], src[1], src[2]);
       }
-      dst16 += client->width;
+      dst16 = (CARDBPP *)((uint8_t *)dst16 + pitch);
     }
   }
 #endif
 
+  rfbClientViewportEndStrip(client);
   return TRUE;
 }
 
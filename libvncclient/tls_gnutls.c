@@ -189,7 +189,10 @@ PushTLS(gnutls_transport_ptr_t transport, const void *data, size_t len)
 
   while (1)
   {
-    ret = write(client->sock, data, len);
+    if (client->WriteToTransport)
+      ret = client->WriteToTransport(client, data, len);
+    else
+      ret = write(client->sock, data, len);
     if (ret < 0)
     {
 #ifdef WIN32
@@ -211,7 +214,10 @@ PullTLS(gnutls_transport_ptr_t transport, void *data, size_t len)
 
   while (1)
   {
-    ret = read(client->sock, data, len);
+    if (client->ReadFromTransport)
+      ret = client->ReadFromTransport(client, data, len);
+    else
+      ret = read(client->sock, data, len);
     if (ret < 0)
     {
 #ifdef WIN32
@@ -232,7 +238,10 @@ PullTimeout(gnutls_transport_ptr_t transport, unsigned int timeout)
 
   while (1)
   {
-    ret = gnutls_system_recv_timeout((gnutls_transport_ptr_t)(long)client->sock, timeout);
+    if (client->WaitForTransport)
+      ret = client->WaitForTransport(client, timeout == GNUTLS_INDEFINITE_TIMEOUT ? 0xffffffff : timeout * 1000);
+    else
+      ret = gnutls_system_recv_timeout((gnutls_transport_ptr_t)(long)client->sock, timeout);
 
     if (ret < 0)
     {
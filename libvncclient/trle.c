@@ -51,13 +51,14 @@
 #endif
 
 static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
-  int x, y, w, h;
+  int tx, ty, x, y, w, h;
   uint8_t type, last_type = 0;
   int min_buffer_size = 16 * 16 * (REALBPP / 8) * 2;
   uint8_t *buffer;
   CARDBPP palette[128];
   int bpp = 0, mask = 0, divider = 0;
   CARDBPP color = 0;
+  int stride;
 
   /* First make sure we have a large enough raw buffer to hold the
    * decompressed data.  In practice, with a fixed REALBPP, fixed frame
@@ -78,13 +79,19 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 
   rfbClientLog("Update %d %d %d %d\n", rx, ry, rw, rh);
 
-  for (y = ry; y < ry + rh; y += 16) {
-    for (x = rx; x < rx + rw; x += 16) {
+  for (ty = ry; ty < ry + rh; ty += 16) {
+    for (tx = rx; tx < rx + rw; tx += 16) {
       w = h = 16;
-      if (rx + rw - x < 16)
-        w = rx + rw - x;
-      if (ry + rh - y < 16)
-        h = ry + rh - y;
+      if (rx + rw - tx < 16)
+        w = rx + rw - tx;
+      if (ry + rh - ty < 16)
+        h = ry + rh - ty;
+
+      x = tx;
+      y = ty;
+      if (!rfbClientViewportBeginStrip(client, &x, &y, w, h))
+        return FALSE;
+      stride = (int)(rfbClientFrameBufferStride(client) / (BPP / 8));
 
       if (!ReadFromRFBServer(client, (char *)(&type), 1))
         return FALSE;
@@ -98,8 +105,8 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
 #if REALBPP != BPP
         int i, j;
 
-        for (j = y * client->width; j < (y + h) * client->width;
-             j += client->width)
+        for (j = y * stride; j < (y + h) * stride;
+             j += stride)
           for (i = x; i < x + w; i++, buffer += REALBPP / 8)
             ((CARDBPP *)client->frameBuffer)[j + i] = UncompressCPixel(buffer);
 #else
@@ -146,8 +153,8 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
               return FALSE;
 
             /* read palettized pixels */
-            for (j = y * client->width; j < (y + h) * client->width;
-                 j += client->width) {
+            for (j = y * stride; j < (y + h) * stride;
+                 j += stride) {
               for (i = x, shift = 8 - bpp; i < x + w; i++) {
                 ((CARDBPP *)client->frameBuffer)[j + i] =
                     palette[((*buffer) >> shift) & mask];
@@ -188,7 +195,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           length += *buffer;
           buffer++;
           while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
+            ((CARDBPP *)client->frameBuffer)[(y + j) * stride + x + i] =
                 color;
             length--;
             i++;
@@ -234,7 +241,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
           }
           buffer++;
           while (j < h && length > 0) {
-            ((CARDBPP *)client->frameBuffer)[(y + j) * client->width + x + i] =
+            ((CARDBPP *)client->frameBuffer)[(y + j) * stride + x + i] =
                 color;
             length--;
             i++;
@@ -284,6 +291,7 @@ static rfbBool HandleTRLE(rfbClient *client, int rx, int ry, int rw, int rh) {
         } else
           return FALSE;
       }
+      rfbClientViewportEndStrip(client);
       last_type = type;
     }
   }
@@ -0,0 +1,443 @@
+/*
+ *  viewport.c - keep only a part of the remote desktop in the framebuffer.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * In viewport mode client->width and client->height are the size of the
+ * viewport, and so of client->frameBuffer, while client->si holds the size
+ * of the remote desktop. Only the viewport is requested from the server,
+ * but servers are free to send more, and a CopyRect may take its pixels
+ * from anywhere.
+ *
+ * Rects inside the viewport are simply moved. All others keep their remote
+ * coordinates while they are decoded, and GotBitmap, GotFillRect and
+ * GotFillRects are replaced by hooks that clip what is drawn to the
+ * viewport and hand it on in framebuffer coordinates. The decoders that
+ * write into frameBuffer themselves, ZRLE, TRLE and Tight, put each tile
+ * or run of rows between rfbClientViewportBeginStrip() and EndStrip(),
+ * which point frameBuffer, its stride, width and height to a scratch
+ * buffer the size of that strip if it crosses the border. So the memory
+ * needed does not grow with the rect, only Tight's JPEG rects are always
+ * decoded as a whole. What is outside the viewport is thrown away, but it
+ * had to be decoded nevertheless to keep the compression streams in sync.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "viewport.h"
+
+static void
+clipToViewport(rfbClient *client, const rfbRectangle *r, rfbRectangle *clipped)
+{
+  int x1 = r->x, y1 = r->y, x2 = r->x + r->w, y2 = r->y + r->h;
+  int vx2 = client->viewport.x + client->viewport.w;
+  int vy2 = client->viewport.y + client->viewport.h;
+
+  if (x1 < client->viewport.x) x1 = client->viewport.x;
+  if (y1 < client->viewport.y) y1 = client->viewport.y;
+  if (x2 > vx2) x2 = vx2;
+  if (y2 > vy2) y2 = vy2;
+
+  if (x1 >= x2 || y1 >= y2) {
+    clipped->x = clipped->y = clipped->w = clipped->h = 0;
+    return;
+  }
+  clipped->x = x1;
+  clipped->y = y1;
+  clipped->w = x2 - x1;
+  clipped->h = y2 - y1;
+}
+
+
+static void ClipGotBitmap(rfbClient *client, const uint8_t *buffer, int x, int y, int w, int h);
+static void ClipGotFillRect(rfbClient *client, int x, int y, int w, int h, uint32_t colour);
+static void ClipGotFillRects(rfbClient *client, const rfbClientFillRect *rects, int count);
+
+/* the clipping hooks, or the application's while drawing in framebuffer coordinates */
+static void
+useClippingHooks(rfbClient *client, rfbBool clipping)
+{
+  if (clipping) {
+    client->GotBitmap = ClipGotBitmap;
+    client->GotFillRect = ClipGotFillRect;
+    client->GotFillRects = ClipGotFillRects;
+    /* a JPEG cannot be clipped without decoding it */
+    client->GotJpeg = NULL;
+  } else {
+    client->GotBitmap = client->viewportGotBitmap;
+    client->GotFillRect = client->viewportGotFillRect;
+    client->GotFillRects = client->viewportGotFillRects;
+    client->GotJpeg = client->viewportGotJpeg;
+  }
+}
+
+
+static void
+ClipGotBitmap(rfbClient *client, const uint8_t *buffer, int x, int y, int w, int h)
+{
+  rfbRectangle r, clipped;
+  size_t bpp = client->format.bitsPerPixel / 8;
+  const uint8_t *src;
+  int j;
+
+  r.x = x;
+  r.y = y;
+  r.w = w;
+  r.h = h;
+  clipToViewport(client, &r, &clipped);
+  if (clipped.w == 0)
+    return;
+
+  src = buffer + ((size_t)(clipped.y - y) * w + clipped.x - x) * bpp;
+  useClippingHooks(client, FALSE);
+  if (clipped.w == w)
+    client->GotBitmap(client, src, clipped.x - client->viewport.x, clipped.y - client->viewport.y,
+                      clipped.w, clipped.h);
+  else
+    for (j = 0; j < clipped.h; j++)
+      client->GotBitmap(client, src + (size_t)j * w * bpp, clipped.x - client->viewport.x,
+                        clipped.y - client->viewport.y + j, clipped.w, 1);
+  useClippingHooks(client, TRUE);
+}
+
+
+static void
+ClipGotFillRect(rfbClient *client, int x, int y, int w, int h, uint32_t colour)
+{
+  rfbRectangle r, clipped;
+
+  r.x = x;
+  r.y = y;
+  r.w = w;
+  r.h = h;
+  clipToViewport(client, &r, &clipped);
+  if (clipped.w == 0)
+    return;
+
+  useClippingHooks(client, FALSE);
+  client->GotFillRect(client, clipped.x - client->viewport.x, clipped.y - client->viewport.y,
+                      clipped.w, clipped.h, colour);
+  useClippingHooks(client, TRUE);
+}
+
+
+static void
+ClipGotFillRects(rfbClient *client, const rfbClientFillRect *rects, int count)
+{
+  rfbClientFillRect batch[64];
+  rfbRectangle r, clipped;
+  int i, n = 0;
+
+  useClippingHooks(client, FALSE);
+  for (i = 0; i < count; i++) {
+    r.x = rects[i].x;
+    r.y = rects[i].y;
+    r.w = rects[i].w;
+    r.h = rects[i].h;
+    clipToViewport(client, &r, &clipped);
+    if (clipped.w == 0)
+      continue;
+    batch[n].x = clipped.x - client->viewport.x;
+    batch[n].y = clipped.y - client->viewport.y;
+    batch[n].w = clipped.w;
+    batch[n].h = clipped.h;
+    batch[n].colour = rects[i].colour;
+    if (++n == (int)(sizeof(batch) / sizeof(batch[0]))) {
+      client->GotFillRects(client, batch, n);
+      n = 0;
+    }
+  }
+  if (n > 0)
+    client->GotFillRects(client, batch, n);
+  useClippingHooks(client, TRUE);
+}
+
+
+/* puts frameBuffer and the hooks back after a decoder gave up halfway */
+static void
+stopClipping(rfbClient *client)
+{
+  if (client->viewportFrameBuffer != NULL) {
+    client->frameBuffer = client->viewportFrameBuffer;
+    client->frameBufferStride = client->viewportFrameBufferStride;
+    client->viewportFrameBuffer = NULL;
+    client->width = client->viewport.w;
+    client->height = client->viewport.h;
+  }
+  if (client->viewportClipping)
+    useClippingHooks(client, FALSE);
+  client->viewportClipping = FALSE;
+  client->viewportInStrip = FALSE;
+}
+
+
+rfbBool
+rfbClientSetViewport(rfbClient *client, int x, int y, int w, int h)
+{
+  if (w <= 0 || h <= 0) {
+    client->viewportMode = FALSE;
+    x = y = w = h = 0;
+  } else {
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    client->viewportMode = TRUE;
+  }
+  client->viewportRequested.x = x;
+  client->viewportRequested.y = y;
+  client->viewportRequested.w = w;
+  client->viewportRequested.h = h;
+
+  /* not connected yet, rfbInitConnection() takes it from here */
+  if (client->frameBuffer == NULL)
+    return TRUE;
+
+  rfbClientViewportResize(client, client->si.framebufferWidth, client->si.framebufferHeight);
+  if (!client->MallocFrameBuffer(client))
+    return FALSE;
+  if (!SetFormatAndEncodings(client))
+    return FALSE;
+  return SendFramebufferUpdateRequest(client,
+                                      client->updateRect.x, client->updateRect.y,
+                                      client->updateRect.w, client->updateRect.h, FALSE);
+}
+
+
+void
+rfbClientViewportResize(rfbClient *client, int remoteWidth, int remoteHeight)
+{
+  rfbRectangle *v = &client->viewport;
+
+  client->si.framebufferWidth = remoteWidth;
+  client->si.framebufferHeight = remoteHeight;
+
+  if (!client->viewportMode) {
+    client->width = remoteWidth;
+    client->height = remoteHeight;
+    client->updateRect.x = client->updateRect.y = 0;
+    client->updateRect.w = client->width;
+    client->updateRect.h = client->height;
+    return;
+  }
+
+  /* keep the size if the desktop shrinks below the requested origin */
+  *v = client->viewportRequested;
+  if (v->w > remoteWidth) v->w = remoteWidth;
+  if (v->h > remoteHeight) v->h = remoteHeight;
+  if (v->x + v->w > remoteWidth) v->x = remoteWidth - v->w;
+  if (v->y + v->h > remoteHeight) v->y = remoteHeight - v->h;
+
+  client->width = v->w;
+  client->height = v->h;
+  client->updateRect.x = v->x;
+  client->updateRect.y = v->y;
+  client->updateRect.w = v->w;
+  client->updateRect.h = v->h;
+}
+
+
+rfbBool
+rfbClientViewportBeginRect(rfbClient *client, rfbFramebufferUpdateRectHeader *rect,
+                           rfbRectangle *remote)
+{
+  rfbRectangle *v = &client->viewport;
+
+  stopClipping(client);
+  *remote = rect->r;
+
+  if (rect->r.x + rect->r.w > client->si.framebufferWidth ||
+      rect->r.y + rect->r.h > client->si.framebufferHeight) {
+    rfbClientLog("Rect too large: %dx%d at (%d, %d)\n",
+                 rect->r.w, rect->r.h, rect->r.x, rect->r.y);
+    return FALSE;
+  }
+
+  if (rect->encoding == rfbEncodingCopyRect) {
+    clipToViewport(client, remote, &rect->r);
+    if (rect->r.w > 0) {
+      rect->r.x -= v->x;
+      rect->r.y -= v->y;
+    }
+    return TRUE;
+  }
+
+  if (rect->r.w == 0 || rect->r.h == 0) {
+    rect->r.x = rect->r.y = 0;
+    return TRUE;
+  }
+
+  if (rect->r.x >= v->x && rect->r.y >= v->y &&
+      rect->r.x + rect->r.w <= v->x + v->w &&
+      rect->r.y + rect->r.h <= v->y + v->h) {
+    rect->r.x -= v->x;
+    rect->r.y -= v->y;
+    return TRUE;
+  }
+
+  client->viewportGotBitmap = client->GotBitmap;
+  client->viewportGotFillRect = client->GotFillRect;
+  client->viewportGotFillRects = client->GotFillRects;
+  client->viewportGotJpeg = client->GotJpeg;
+  client->viewportClipping = TRUE;
+  useClippingHooks(client, TRUE);
+  return TRUE;
+}
+
+
+void
+rfbClientViewportEndRect(rfbClient *client, rfbFramebufferUpdateRectHeader *rect,
+                         const rfbRectangle *remote)
+{
+  rfbRectangle clipped;
+
+  if (!client->viewportClipping)
+    return;
+  stopClipping(client);
+
+  clipToViewport(client, remote, &clipped);
+  rect->r = clipped;
+  if (clipped.w > 0) {
+    rect->r.x -= client->viewport.x;
+    rect->r.y -= client->viewport.y;
+  }
+}
+
+
+rfbBool
+rfbClientViewportBeginStrip(rfbClient *client, int *x, int *y, int w, int h)
+{
+  rfbRectangle *v = &client->viewport;
+  size_t size;
+
+  if (!client->viewportClipping)
+    return TRUE;
+
+  useClippingHooks(client, FALSE);
+  client->viewportInStrip = TRUE;
+
+  if (w <= 0 || h <= 0) {
+    *x = *y = 0;
+    return TRUE;
+  }
+
+  if (*x >= v->x && *y >= v->y && *x + w <= v->x + v->w && *y + h <= v->y + v->h) {
+    *x -= v->x;
+    *y -= v->y;
+    return TRUE;
+  }
+
+  size = (size_t)w * h * client->format.bitsPerPixel / 8;
+  if (size > client->viewportBufferSize) {
+    uint8_t *buf = (uint8_t *)realloc(client->viewportBuffer, size);
+    if (buf == NULL) {
+      rfbClientErr("rfbClientViewportBeginStrip: out of memory\n");
+      return FALSE;
+    }
+    client->viewportBuffer = buf;
+    client->viewportBufferSize = size;
+  }
+
+  client->viewportStrip.x = *x;
+  client->viewportStrip.y = *y;
+  client->viewportStrip.w = w;
+  client->viewportStrip.h = h;
+  client->viewportFrameBuffer = client->frameBuffer;
+  client->viewportFrameBufferStride = client->frameBufferStride;
+  client->frameBuffer = client->viewportBuffer;
+  client->frameBufferStride = 0;
+  client->width = w;
+  client->height = h;
+  *x = *y = 0;
+  return TRUE;
+}
+
+
+void
+rfbClientViewportEndStrip(rfbClient *client)
+{
+  rfbRectangle *strip = &client->viewportStrip;
+  rfbRectangle clipped;
+  int bpp = client->format.bitsPerPixel / 8;
+  int j;
+
+  if (!client->viewportInStrip)
+    return;
+  client->viewportInStrip = FALSE;
+
+  if (client->viewportFrameBuffer != NULL) {
+    client->frameBuffer = client->viewportFrameBuffer;
+    client->frameBufferStride = client->viewportFrameBufferStride;
+    client->viewportFrameBuffer = NULL;
+    client->width = client->viewport.w;
+    client->height = client->viewport.h;
+
+    clipToViewport(client, strip, &clipped);
+    for (j = 0; j < clipped.h; j++)
+      memcpy(client->frameBuffer +
+               (size_t)(clipped.y - client->viewport.y + j) * rfbClientFrameBufferStride(client) +
+               (size_t)(clipped.x - client->viewport.x) * bpp,
+             client->viewportBuffer +
+               ((size_t)(clipped.y - strip->y + j) * strip->w + clipped.x - strip->x) * bpp,
+             (size_t)clipped.w * bpp);
+  }
+
+  useClippingHooks(client, TRUE);
+}
+
+
+/*
+ * Sources outside the viewport are not known here, so the destination is
+ * asked for again instead.
+ */
+
+rfbBool
+rfbClientViewportCopyRect(rfbClient *client, int srcX, int srcY,
+                          const rfbRectangle *remote, rfbRectangle *dest)
+{
+  rfbRectangle *v = &client->viewport;
+  int x, y;
+
+  if (dest->w == 0)
+    return TRUE;
+
+  /* source of the visible part of the destination */
+  x = srcX + (dest->x + v->x - remote->x);
+  y = srcY + (dest->y + v->y - remote->y);
+
+  if (x >= v->x && y >= v->y &&
+      x + dest->w <= v->x + v->w && y + dest->h <= v->y + v->h) {
+    client->GotCopyRect(client, x - v->x, y - v->y, dest->w, dest->h, dest->x, dest->y);
+    return TRUE;
+  }
+
+  if (!SendFramebufferUpdateRequest(client, dest->x + v->x, dest->y + v->y,
+                                    dest->w, dest->h, FALSE))
+    return FALSE;
+  dest->w = dest->h = 0;
+  return TRUE;
+}
+
+
+void
+rfbClientViewportFree(rfbClient *client)
+{
+  stopClipping(client);
+  free(client->viewportBuffer);
+  client->viewportBuffer = NULL;
+  client->viewportBufferSize = 0;
+}
@@ -0,0 +1,51 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef LIBVNCCLIENT_VIEWPORT_H
+#define LIBVNCCLIENT_VIEWPORT_H
+
+#include <rfb/rfbclient.h>
+
+/* Sets the remote desktop size and derives width, height and updateRect. */
+void rfbClientViewportResize(rfbClient *client, int remoteWidth, int remoteHeight);
+
+/*
+ * Translates rect into framebuffer coordinates before it is decoded. Rects
+ * not completely inside the viewport keep their remote coordinates and
+ * are drawn through clipping hooks, *remote keeps the original rect for
+ * rfbClientViewportEndRect().
+ */
+rfbBool rfbClientViewportBeginRect(rfbClient *client, rfbFramebufferUpdateRectHeader *rect,
+                                   rfbRectangle *remote);
+/* Puts the hooks back, rect->r becomes the visible part of the rect. */
+void rfbClientViewportEndRect(rfbClient *client, rfbFramebufferUpdateRectHeader *rect,
+                              const rfbRectangle *remote);
+/*
+ * For decoders that write into frameBuffer themselves: the part of the
+ * current rect at *x,*y of size w,h is about to be drawn. *x and *y become
+ * where to draw it, into a scratch buffer if it crosses the viewport's
+ * border. No-ops unless the rect does.
+ */
+rfbBool rfbClientViewportBeginStrip(rfbClient *client, int *x, int *y, int w, int h);
+/* Copies the visible part of a strip drawn into the scratch buffer. */
+void rfbClientViewportEndStrip(rfbClient *client);
+/* CopyRect whose destination, given by remote, was clipped into *dest. */
+rfbBool rfbClientViewportCopyRect(rfbClient *client, int srcX, int srcY,
+                                  const rfbRectangle *remote, rfbRectangle *dest);
+void rfbClientViewportFree(rfbClient *client);
+
+#endif
@@ -39,6 +39,9 @@
 #include <time.h>
 #include <rfb/rfbclient.h>
 #include "tls.h"
+#include "stats.h"
+#include "shm.h"
+#include "viewport.h"
 
 static void Dummy(rfbClient* client) {
 }
@@ -100,6 +103,7 @@ static rfbBool MallocFrameBuffer(rfbClient* client) {
   }
 
   client->frameBuffer=malloc( (size_t)allocSize );
+  client->frameBufferStride=0;
 
   if (client->frameBuffer == NULL)
     rfbClientErr("CRITICAL: frameBuffer allocation failed, requested size too large or not enough memory?\n");
@@ -113,9 +117,36 @@ static rfbBool CheckRect(rfbClient* client, int x, int y, int w, int h) {
   return x + w <= client->width && y + h <= client->height;
 }
 
-static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
+/*
+ * The first row is filled pixel by pixel, in a loop simple enough for the
+ * compiler to turn into vector stores, and copied into the rows below.
+ */
+#define FILL_RECT(BPP) \
+  { \
+    size_t stride=rfbClientFrameBufferStride(client); \
+    uint##BPP##_t* row=(uint##BPP##_t*)(client->frameBuffer+y*stride)+x; \
+    for(i=0;i<w;i++) \
+      row[i]=(uint##BPP##_t)colour; \
+    for(j=1;j<h;j++) \
+      memcpy((uint8_t*)row+j*stride,row,w*(BPP/8)); \
+  }
+
+static void FillRect(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
   int i,j;
 
+  if (w <= 0 || h <= 0)
+    return;
+
+  switch(client->format.bitsPerPixel) {
+  case  8: FILL_RECT(8);  break;
+  case 16: FILL_RECT(16); break;
+  case 32: FILL_RECT(32); break;
+  default:
+    rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
+  }
+}
+
+static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
   if (client->frameBuffer == NULL) {
       return;
   }
@@ -125,17 +156,29 @@ static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_
     return;
   }
 
-#define FILL_RECT(BPP) \
-    for(j=y*client->width;j<(y+h)*client->width;j+=client->width) \
-      for(i=x;i<x+w;i++) \
-	((uint##BPP##_t*)client->frameBuffer)[j+i]=colour;
+  FillRect(client, x, y, w, h, colour);
+}
 
-  switch(client->format.bitsPerPixel) {
-  case  8: FILL_RECT(8);  break;
-  case 16: FILL_RECT(16); break;
-  case 32: FILL_RECT(32); break;
-  default:
-    rfbClientLog("Unsupported bitsPerPixel: %d\n",client->format.bitsPerPixel);
+static void FillRectangles(rfbClient* client, const rfbClientFillRect* rects, int count) {
+  int i;
+
+  /* an application drawing elsewhere only knows about single rects */
+  if (client->GotFillRect != FillRectangle) {
+    for (i = 0; i < count; i++)
+      client->GotFillRect(client, rects[i].x, rects[i].y, rects[i].w, rects[i].h, rects[i].colour);
+    return;
+  }
+
+  if (client->frameBuffer == NULL) {
+      return;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (!CheckRect(client, rects[i].x, rects[i].y, rects[i].w, rects[i].h)) {
+      rfbClientLog("Rect out of bounds: %dx%d at (%d, %d)\n", rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+      continue;
+    }
+    FillRect(client, rects[i].x, rects[i].y, rects[i].w, rects[i].h, rects[i].colour);
   }
 }
 
@@ -153,9 +196,10 @@ static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y
 
 #define COPY_RECT(BPP) \
   { \
-    int rs = w * BPP / 8, rs2 = client->width * BPP / 8; \
-    for (j = ((x * (BPP / 8)) + (y * rs2)); j < (y + h) * rs2; j += rs2) { \
-      memcpy(client->frameBuffer + j, buffer, rs); \
+    size_t rs = w * BPP / 8, rs2 = rfbClientFrameBufferStride(client); \
+    uint8_t* row = client->frameBuffer + y * rs2 + x * (BPP / 8); \
+    for (j = 0; j < h; j++, row += rs2) { \
+      memcpy(row, buffer, rs); \
       buffer += rs; \
     } \
   }
@@ -171,7 +215,7 @@ static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y
 
 /* TODO: test */
 static void CopyRectangleFromRectangle(rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y) {
-  int i,j;
+  int j;
 
   if (client->frameBuffer == NULL) {
       return;
@@ -187,33 +231,18 @@ static void CopyRectangleFromRectangle(rfbClient* client, int src_x, int src_y,
     return;
   }
 
+/* row by row, starting at the end that is not overwritten before it is read */
 #define COPY_RECT_FROM_RECT(BPP) \
   { \
-    uint##BPP##_t* _buffer=((uint##BPP##_t*)client->frameBuffer)+(src_y-dest_y)*client->width+src_x-dest_x; \
+    size_t stride = rfbClientFrameBufferStride(client), rs = (size_t)w * (BPP / 8); \
+    uint8_t* dst = client->frameBuffer + dest_y * stride + dest_x * (BPP / 8); \
+    uint8_t* src = client->frameBuffer + src_y * stride + src_x * (BPP / 8); \
     if (dest_y < src_y) { \
-      for(j = dest_y*client->width; j < (dest_y+h)*client->width; j += client->width) { \
-        if (dest_x < src_x) { \
-          for(i = dest_x; i < dest_x+w; i++) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } else { \
-          for(i = dest_x+w-1; i >= dest_x; i--) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } \
-      } \
+      for (j = 0; j < h; j++) \
+        memmove(dst + j * stride, src + j * stride, rs); \
     } else { \
-      for(j = (dest_y+h-1)*client->width; j >= dest_y*client->width; j-=client->width) { \
-        if (dest_x < src_x) { \
-          for(i = dest_x; i < dest_x+w; i++) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } else { \
-          for(i = dest_x+w-1; i >= dest_x; i--) { \
-            ((uint##BPP##_t*)client->frameBuffer)[j+i]=_buffer[j+i]; \
-          } \
-        } \
-      } \
+      for (j = h - 1; j >= 0; j--) \
+        memmove(dst + j * stride, src + j * stride, rs); \
     } \
   }
 
@@ -331,6 +360,7 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   client->GotFrameBufferUpdate = DummyRect;
   client->GotCopyRect = CopyRectangleFromRectangle;
   client->GotFillRect = FillRectangle;
+  client->GotFillRects = FillRectangles;
   client->GotBitmap = CopyRectangle;
   client->FinishedFrameBufferUpdate = NULL;
   client->GetPassword = ReadPassword;
@@ -363,15 +393,17 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   client->screen.width = 0;
   client->screen.height = 0;
 
+  client->stats = rfbClientStatInit();
+
   return client;
 }
 
 static rfbBool rfbInitConnection(rfbClient* client)
 {
-  /* Unless we accepted an incoming connection, make a TCP connection to the
-     given VNC server */
+  /* Unless we accepted an incoming connection or were given a transport,
+     make a TCP connection to the given VNC server */
 
-  if (!client->listenSpecified) {
+  if (!client->listenSpecified && !client->ReadFromTransport) {
     if (!client->serverHost)
       return FALSE;
     if (client->destHost) {
@@ -388,8 +420,12 @@ static rfbBool rfbInitConnection(rfbClient* client)
   if (!InitialiseRFBConnection(client))
     return FALSE;
 
-  client->width=client->si.framebufferWidth;
-  client->height=client->si.framebufferHeight;
+  if (client->viewportMode) {
+    rfbClientViewportResize(client, client->si.framebufferWidth, client->si.framebufferHeight);
+  } else {
+    client->width=client->si.framebufferWidth;
+    client->height=client->si.framebufferHeight;
+  }
   if (!client->MallocFrameBuffer(client))
     return FALSE;
 
@@ -444,6 +480,20 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
       } else if (strcmp(argv[i], "-play") == 0) {
 	client->serverPort = -1;
 	j++;
+      } else if (i+1<*argc && strcmp(argv[i], "-record") == 0) {
+	if (!rfbClientStartRecording(client, argv[i+1], FALSE)) {
+	  rfbClientCleanup(client);
+	  return FALSE;
+	}
+	j+=2;
+      } else if (i+1<*argc && strcmp(argv[i], "-trace") == 0) {
+	if (!client->traceStarted && !rfbTraceStart(argv[i+1])) {
+	  rfbClientErr("Could not trace to %s\n", argv[i+1]);
+	  rfbClientCleanup(client);
+	  return FALSE;
+	}
+	client->traceStarted = TRUE;
+	j+=2;
       } else if (i+1<*argc && strcmp(argv[i], "-encodings") == 0) {
 	client->appData.encodingsString = argv[i+1];
 	j+=2;
@@ -510,6 +560,14 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
 void rfbClientCleanup(rfbClient* client) {
 #ifdef LIBVNCSERVER_HAVE_LIBZ
   int i;
+#endif
+
+  rfbClientStopSendThread(client);
+  rfbClientStopRecording(client);
+  if (client->traceStarted)
+    rfbTraceStop();
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
 
   for ( i = 0; i < 4; i++ ) {
     if (client->zlibStreamActive[i] == TRUE ) {
@@ -542,6 +600,10 @@ void rfbClientCleanup(rfbClient* client) {
 
   free(client->vncRec);
 
+  rfbClientStatFree(client);
+  rfbClientViewportFree(client);
+  rfbClientShmFree(client);
+
   if (client->sock != RFB_INVALID_SOCKET)
     rfbCloseSocket(client->sock);
   if (client->listenSock != RFB_INVALID_SOCKET)
@@ -34,12 +34,15 @@
 
 #if !defined(UNCOMP) || UNCOMP==0
 #define HandleZRLE CONCAT2E(HandleZRLE,REALBPP)
+#define HandleZRLETiles CONCAT2E(HandleZRLETiles,REALBPP)
 #define HandleZRLETile CONCAT2E(HandleZRLETile,REALBPP)
 #elif UNCOMP>0
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Down)
+#define HandleZRLETiles CONCAT3E(HandleZRLETiles,REALBPP,Down)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Down)
 #else
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Up)
+#define HandleZRLETiles CONCAT3E(HandleZRLETiles,REALBPP,Up)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Up)
 #endif
 #define CARDBPP CONCAT3E(uint,BPP,_t)
@@ -80,6 +83,44 @@ static int HandleZRLETile(rfbClient* client,
 	uint8_t* buffer,size_t buffer_length,
 	int x,int y,int w,int h);
 
+/*
+ * Decodes the tiles from number *tile on, whose data starts *used bytes
+ * into raw_buffer, as far as it is inflated already. With more to come,
+ * a tile failing to decode is taken to be incomplete and tried again
+ * later; otherwise its error is returned.
+ */
+static int
+HandleZRLETiles(rfbClient* client, int rx, int ry, int rw, int rh,
+		int* tile, int* used, rfbBool complete)
+{
+	int tilesPerRow = (rw+rfbZRLETileWidth-1)/rfbZRLETileWidth;
+	int tiles = tilesPerRow*((rh+rfbZRLETileHeight-1)/rfbZRLETileHeight);
+	int available = client->raw_buffer_size-client->decompStream.avail_out;
+
+	for(; *tile<tiles; (*tile)++) {
+		int i=(*tile%tilesPerRow)*rfbZRLETileWidth;
+		int j=(*tile/tilesPerRow)*rfbZRLETileHeight;
+		int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
+		int subHeight=(j+rfbZRLETileHeight>rh)?rh-j:rfbZRLETileHeight;
+		int tx=rx+i,ty=ry+j;
+		int result;
+
+		if(!rfbClientViewportBeginStrip(client,&tx,&ty,subWidth,subHeight))
+			return -1;
+		result=HandleZRLETile(client,(uint8_t *)client->raw_buffer+*used,available-*used,tx,ty,subWidth,subHeight);
+		rfbClientViewportEndStrip(client);
+
+		if(result<0)
+			return complete?result:0;
+
+		*used+=result;
+		if(i+subWidth==rw)
+			BandDecoded(client,rx,rw,ry+j+subHeight);
+	}
+
+	return 0;
+}
+
 static rfbBool
 HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 {
@@ -87,6 +128,7 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 	int remaining;
 	int inflateResult;
 	int toRead;
+	int tile = 0, used = 0;
 	int min_buffer_size = rw * rh * (REALBPP / 8) * 2;
 
 	/* First make sure we have a large enough raw buffer to hold the
@@ -151,6 +193,9 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 		else {
 			toRead = remaining;
 		}
+		if ( toRead > BAND_READ_SIZE && BandsWanted(client) ) {
+			toRead = BAND_READ_SIZE;
+		}
 
 		/* Fill the buffer, obtaining data from the server. */
 		if (!ReadFromRFBServer(client, client->buffer,toRead))
@@ -186,29 +231,20 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 
 		remaining -= toRead;
 
+		/* decode what is there while the rest is still on its way */
+		if ( remaining > 0 && inflateResult == Z_OK && BandsWanted(client) )
+			HandleZRLETiles(client, rx, ry, rw, rh, &tile, &used, FALSE);
+
 	} /* while ( remaining > 0 ) */
 
 	if ( inflateResult == Z_OK ) {
-		char* buf=client->raw_buffer;
-		int i,j;
+		int result=HandleZRLETiles(client, rx, ry, rw, rh, &tile, &used, TRUE);
 
-		remaining = client->raw_buffer_size-client->decompStream.avail_out;
-
-		for(j=0; j<rh; j+=rfbZRLETileHeight)
-			for(i=0; i<rw; i+=rfbZRLETileWidth) {
-				int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
-				int subHeight=(j+rfbZRLETileHeight>rh)?rh-j:rfbZRLETileHeight;
-				int result=HandleZRLETile(client,(uint8_t *)buf,remaining,rx+i,ry+j,subWidth,subHeight);
-
-				if(result<0) {
-					rfbClientLog("ZRLE decoding failed (%d)\n",result);
+		if(result<0) {
+			rfbClientLog("ZRLE decoding failed (%d)\n",result);
 return TRUE;
-					return FALSE;
-				}
-
-				buf+=result;
-				remaining-=result;
-			}
+			return FALSE;
+		}
 	}
 	else {
 
@@ -239,6 +275,7 @@ static int HandleZRLETile(rfbClient* client,
 	uint8_t* buffer_copy = buffer;
 	uint8_t* buffer_end = buffer+buffer_length;
 	uint8_t type;
+	int stride = (int)(rfbClientFrameBufferStride(client) / (BPP / 8));
 #if BPP!=8
 	uint8_t zywrle_level = (client->appData.qualityLevel & 0x80) ?
 		0 : (3 - client->appData.qualityLevel / 3);
@@ -253,7 +290,7 @@ static int HandleZRLETile(rfbClient* client,
 		if( type == 0 ) /* raw */
 #if BPP!=8
           if( zywrle_level > 0 ){
-			CARDBPP* pFrame = (CARDBPP*)client->frameBuffer + y*client->width+x;
+			CARDBPP* pFrame = (CARDBPP*)client->frameBuffer + y*stride+x;
 			int ret;
 			client->appData.qualityLevel |= 0x80;
 			ret = HandleZRLETile(client, buffer, buffer_end-buffer, x, y, w, h);
@@ -261,7 +298,7 @@ static int HandleZRLETile(rfbClient* client,
 			if( ret < 0 ){
 				return ret;
 			}
-			ZYWRLE_SYNTHESIZE( pFrame, pFrame, w, h, client->width, zywrle_level, (int*)client->zlib_buffer );
+			ZYWRLE_SYNTHESIZE( pFrame, pFrame, w, h, stride, zywrle_level, (int*)client->zlib_buffer );
 			buffer += ret;
 		  }else
 #endif
@@ -274,20 +311,24 @@ static int HandleZRLETile(rfbClient* client,
 				return -3;
 			}
 
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width)
+			for(j=y*stride; j<(y+h)*stride; j+=stride)
 				for(i=x; i<x+w; i++,buffer+=REALBPP/8)
 					((CARDBPP*)client->frameBuffer)[j+i] = UncompressCPixel(buffer);
 #else
+			if(1+w*h*REALBPP/8>buffer_length)
+				return -3;
+
 			client->GotBitmap(client, buffer, x, y, w, h);
 			buffer+=w*h*REALBPP/8;
 #endif
 		}
 		else if( type == 1 ) /* solid */
 		{
-			CARDBPP color = UncompressCPixel(buffer);
+			CARDBPP color;
 
 			if(1+REALBPP/8>buffer_length)
 				return -4;
+			color = UncompressCPixel(buffer);
 				
 			client->GotFillRect(client, x, y, w, h, color);
 
@@ -310,7 +351,7 @@ static int HandleZRLETile(rfbClient* client,
 				palette[i] = UncompressCPixel(buffer);
 
 			/* read palettized pixels */
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width) {
+			for(j=y*stride; j<(y+h)*stride; j+=stride) {
 				for(i=x,shift=8-bpp; i<x+w; i++) {
 					((CARDBPP*)client->frameBuffer)[j+i] = palette[((*buffer)>>shift)&mask];
 					shift-=bpp;
@@ -346,7 +387,7 @@ static int HandleZRLETile(rfbClient* client,
 				length+=*buffer;
 				buffer++;
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
+					((CARDBPP*)client->frameBuffer)[(y+j)*stride+x+i] = color;
 					length--;
 					i++;
 					if(i>=w) {
@@ -398,7 +439,7 @@ static int HandleZRLETile(rfbClient* client,
 				}
 				buffer++;
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
+					((CARDBPP*)client->frameBuffer)[(y+j)*stride+x+i] = color;
 					length--;
 					i++;
 					if(i>=w) {
@@ -418,6 +459,7 @@ static int HandleZRLETile(rfbClient* client,
 #undef CARDBPP
 #undef CARDREALBPP
 #undef HandleZRLE
+#undef HandleZRLETiles
 #undef HandleZRLETile
 #undef UncompressCPixel
 
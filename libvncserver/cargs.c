@@ -54,6 +54,12 @@ rfbUsage(void)
 #endif
     fprintf(stderr, "-enablehttpproxy       enable http proxy support\n");
     fprintf(stderr, "-progressive height    enable progressive updating for slow links\n");
+    fprintf(stderr, "-videofps fps          send areas showing video at most fps times a second\n"
+                    "                       and lossy if the client allows (default off)\n");
+    fprintf(stderr, "-focusquality radius   send Tight JPEG sharper within radius pixels of the\n"
+                    "                       pointer and keyboard focus, coarser elsewhere\n");
+    fprintf(stderr, "-uplinkrate kbytes     share kbytes per second among the clients' updates\n");
+    fprintf(stderr, "-trace file            write a timeline of the updates to file, see rfbtrace.h\n");
     fprintf(stderr, "-listen ipaddr         listen for connections only on network interface with\n");
     fprintf(stderr, "                       addr ipaddr. '-listen localhost' and hostname work too.\n");
 #ifdef LIBVNCSERVER_IPv6
@@ -81,6 +87,8 @@ rfbBool
 rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 {
     int i,i1;
+    /* only started once all arguments are good, rfbGetScreen() would not stop it */
+    char *traceFile = NULL;
 
     if(!argc) return TRUE;
     
@@ -140,6 +148,32 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->deferUpdateTime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-videofps") == 0) {  /* -videofps frames-per-second */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->handleVideoRegions = TRUE;
+            rfbScreen->videoFrameRate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-focusquality") == 0) {  /* -focusquality radius */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->focusQuality = TRUE;
+            rfbScreen->focusRadius = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-uplinkrate") == 0) {  /* -uplinkrate kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->uplinkRate = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-trace") == 0) {  /* -trace file */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            traceFile = argv[++i];
         } else if (strcmp(argv[i], "-deferptrupdate") == 0) {  /* -deferptrupdate milliseconds */
             if (i + 1 >= *argc) {
 		rfbUsage();
@@ -237,6 +271,13 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 	rfbPurgeArguments(argc,&i1,i-i1+1,argv);
 	i=i1;
     }
+    if (traceFile && !rfbScreen->traceStarted) {
+        if (!rfbTraceStart(traceFile)) {
+            rfbErr("Could not trace to %s\n", traceFile);
+            return FALSE;
+        }
+        rfbScreen->traceStarted = TRUE;
+    }
     return TRUE;
 }
 
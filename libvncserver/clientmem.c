@@ -0,0 +1,160 @@
+/*
+ * clientmem.c - what a client costs in memory, and giving it back while
+ * the client is idle.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Most of a client's memory is only needed while an update is encoded:
+ * the update buffer, the buffers of the encoders and their compressor
+ * contexts. All of it is set up on first use, and once a client has had
+ * no update for screen->encoderIdleTimeout milliseconds, whatever can be
+ * set up again without the client noticing is freed:
+ *
+ *  - the update buffer and the encoders' scratch buffers,
+ *  - the Tight zlib streams, whose reset the next Tight rect asks for,
+ *  - the JPEG compressor, the LZO work memory and the H.264 encoder,
+ *    which starts a new stream anyway.
+ *
+ * The Zlib and ZRLE streams stay, as their protocols cannot reset them.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+
+/* in front of every zlib allocation, aligned like malloc() would */
+typedef union {
+    size_t size;
+    double d;
+    void *p;
+} zlibAllocHeader;
+
+voidpf
+rfbZlibAlloc(voidpf opaque, uInt items, uInt size)
+{
+    rfbClientPtr cl = (rfbClientPtr)opaque;
+    size_t n = (size_t)items * size;
+    zlibAllocHeader *h = (zlibAllocHeader *)malloc(sizeof(zlibAllocHeader) + n);
+
+    if (h == NULL)
+        return Z_NULL;
+    h->size = n;
+    cl->zlibMemory += n;
+    return (voidpf)(h + 1);
+}
+
+
+void
+rfbZlibFree(voidpf opaque, voidpf address)
+{
+    rfbClientPtr cl = (rfbClientPtr)opaque;
+    zlibAllocHeader *h = (zlibAllocHeader *)address - 1;
+
+    cl->zlibMemory -= h->size;
+    free(h);
+}
+
+#endif
+
+
+rfbBool
+rfbAllocUpdateBuf(rfbClientPtr cl)
+{
+    if (cl->updateBuf != NULL)
+        return TRUE;
+    cl->updateBuf = (char *)malloc(UPDATE_BUF_SIZE);
+    if (cl->updateBuf == NULL) {
+        rfbErr("rfbAllocUpdateBuf: out of memory\n");
+        return FALSE;
+    }
+    cl->ublen = 0;
+    return TRUE;
+}
+
+
+void
+rfbReleaseIdleEncoders(rfbClientPtr cl)
+{
+    int timeout = cl->screen->encoderIdleTimeout;
+
+    if (timeout <= 0 || cl->lastUpdateMs == 0 ||
+        rfbNowMs() - cl->lastUpdateMs < (unsigned long)timeout)
+        return;
+
+    LOCK(cl->sendMutex);
+    /* an update may have gone out meanwhile */
+    if (cl->lastUpdateMs == 0 || rfbNowMs() - cl->lastUpdateMs < (unsigned long)timeout) {
+        UNLOCK(cl->sendMutex);
+        return;
+    }
+
+    if (cl->ublen == 0) {
+        free(cl->updateBuf);
+        cl->updateBuf = NULL;
+    }
+    free(cl->beforeEncBuf);
+    cl->beforeEncBuf = NULL;
+    cl->beforeEncBufSize = 0;
+    free(cl->afterEncBuf);
+    cl->afterEncBuf = NULL;
+    cl->afterEncBufSize = 0;
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    rfbReleaseZrleBuffers(cl);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    rfbReleaseTightData(cl);
+#endif
+#endif
+    rfbFreeUltraData(cl);
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    rfbFreeH264Data(cl);
+#endif
+
+    cl->lastUpdateMs = 0;
+    UNLOCK(cl->sendMutex);
+}
+
+
+size_t
+rfbClientMemoryUsage(rfbClientPtr cl)
+{
+    size_t n = sizeof(rfbClientRec);
+
+    LOCK(cl->sendMutex);
+    if (cl->updateBuf != NULL)
+        n += UPDATE_BUF_SIZE;
+    n += cl->beforeEncBufSize + cl->afterEncBufSize;
+    n += cl->zlibMemory;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    n += rfbZrleMemoryUsage(cl);
+#endif
+    n += rfbUltraMemoryUsage(cl);
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    n += rfbH264MemoryUsage(cl);
+#endif
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    if (cl->wsctx != NULL)
+        n += webSocketsMemoryUsage(cl);
+#endif
+    UNLOCK(cl->sendMutex);
+
+    return n;
+}
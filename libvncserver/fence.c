@@ -0,0 +1,274 @@
+/*
+ * fence.c - ContinuousUpdates and Fence, and the flow control built on them.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Once a client has enabled continuous updates, the area it asked for is
+ * requested again after every update, so the server no longer waits a
+ * round trip for each frame. Without requests pacing it, something else
+ * has to keep it from burying a slow link: if the client also knows
+ * fences, a Fence request follows every update, and the client answers it
+ * once it has dealt with everything before it.
+ *
+ * The time until the answer is the round trip time, the data answered per
+ * time the throughput. Their product is about what the link holds, and no
+ * further update goes out while more than twice that is unanswered.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <string.h>
+#include <rfb/rfb.h>
+#include "private.h"
+
+/* used until the first measurement */
+#define FENCE_INITIAL_WINDOW (256 * 1024)
+#define FENCE_MIN_WINDOW (64 * 1024)
+#define FENCE_MAX_WINDOW (16 * 1024 * 1024)
+/* smaller throughput samples are mostly noise */
+#define FENCE_MIN_SAMPLE (16 * 1024)
+
+static int
+buildFence(char *buf, uint32_t flags, int length, const char *data)
+{
+    rfbFenceMsg f;
+
+    memset((char *)&f, 0, sizeof(f));
+    f.type = rfbFence;
+    f.flags = Swap32IfLE(flags);
+    f.length = (uint8_t)length;
+    memcpy(buf, (char *)&f, sz_rfbFenceMsg);
+    if (length > 0)
+        memcpy(buf + sz_rfbFenceMsg, data, length);
+    return sz_rfbFenceMsg + length;
+}
+
+
+rfbBool
+rfbSendFence(rfbClientPtr cl, uint32_t flags, int length, const char *data)
+{
+    char buf[sz_rfbFenceMsg + rfbFenceMaxLength];
+    int len;
+
+    if (length < 0 || length > rfbFenceMaxLength) {
+        rfbErr("rfbSendFence: payload of %d bytes is too long\n", length);
+        return FALSE;
+    }
+    len = buildFence(buf, flags, length, data);
+
+    LOCK(cl->sendMutex);
+    if (rfbWriteExact(cl, buf, len) < 0) {
+        rfbLogPerror("rfbSendFence: write");
+        rfbCloseClient(cl);
+        UNLOCK(cl->sendMutex);
+        return FALSE;
+    }
+    UNLOCK(cl->sendMutex);
+
+    rfbStatRecordMessageSent(cl, rfbFence, len, len);
+    return TRUE;
+}
+
+
+rfbBool
+rfbSendEndOfContinuousUpdates(rfbClientPtr cl)
+{
+    rfbEndOfContinuousUpdatesMsg eocu;
+
+    eocu.type = rfbEndOfContinuousUpdates;
+
+    LOCK(cl->sendMutex);
+    if (rfbWriteExact(cl, (char *)&eocu, sz_rfbEndOfContinuousUpdatesMsg) < 0) {
+        rfbLogPerror("rfbSendEndOfContinuousUpdates: write");
+        rfbCloseClient(cl);
+        UNLOCK(cl->sendMutex);
+        return FALSE;
+    }
+    UNLOCK(cl->sendMutex);
+
+    rfbStatRecordMessageSent(cl, rfbEndOfContinuousUpdates,
+                             sz_rfbEndOfContinuousUpdatesMsg, sz_rfbEndOfContinuousUpdatesMsg);
+    return TRUE;
+}
+
+
+/*
+ * Puts a Fence request carrying the next ping id behind the update in
+ * cl->updateBuf. Called by rfbSendFramebufferUpdate() with sendMutex held.
+ */
+
+rfbBool
+rfbAppendFencePing(rfbClientPtr cl)
+{
+    rfbFencePing *ping;
+    unsigned long now = rfbNowMs();
+    uint32_t id;
+    int len;
+
+    if (cl->ublen + sz_rfbFenceMsg + 4 > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    LOCK(cl->updateMutex);
+    if (cl->fencePingCount == RFB_MAX_FENCE_PINGS) {
+        /* rfbFenceCongested() should not have let it get this far */
+        UNLOCK(cl->updateMutex);
+        return TRUE;
+    }
+    if (cl->fenceAckedMs == 0) {
+        /* nothing answered yet, count from here */
+        cl->fenceAckedBytes = (uint32_t)rfbStatGetSentBytes(cl);
+        cl->fenceAckedMs = now;
+    }
+    id = Swap32IfLE(cl->fenceNextId);
+    len = buildFence(&cl->updateBuf[cl->ublen],
+                     rfbFenceFlagRequest | rfbFenceFlagBlockBefore, 4, (char *)&id);
+    cl->ublen += len;
+    rfbStatRecordMessageSent(cl, rfbFence, len, len);
+
+    ping = &cl->fencePings[cl->fencePingCount++];
+    ping->id = cl->fenceNextId++;
+    ping->sentMs = now;
+    ping->sentBytes = (uint32_t)rfbStatGetSentBytes(cl);
+    ping->measurable = FALSE;
+    UNLOCK(cl->updateMutex);
+
+    return TRUE;
+}
+
+
+/*
+ * An answer to one of our fences. Fences of other origin, like the empty
+ * one announcing support, are ignored.
+ */
+
+void
+rfbHandleFenceResponse(rfbClientPtr cl, int length, const char *data)
+{
+    rfbFencePing ping;
+    unsigned long now, rtt, ms, sample;
+    uint32_t id, bytes;
+    int i;
+
+    if (length != 4)
+        return;
+    memcpy((char *)&id, data, 4);
+    id = Swap32IfLE(id);
+
+    LOCK(cl->updateMutex);
+    for (i = 0; i < cl->fencePingCount && cl->fencePings[i].id != id; i++)
+        ;
+    if (i == cl->fencePingCount) {
+        UNLOCK(cl->updateMutex);
+        return;
+    }
+
+    /* answers come in order, so the ones before are lost, if any */
+    ping = cl->fencePings[i];
+    cl->fencePingCount -= i + 1;
+    memmove(cl->fencePings, cl->fencePings + i + 1,
+            cl->fencePingCount * sizeof(rfbFencePing));
+
+    now = rfbNowMs();
+    rtt = now - ping.sentMs;
+    cl->rttMs = cl->rttMs < 0 ? (int)rtt : (int)((7 * (unsigned long)cl->rttMs + rtt) / 8);
+    if (cl->minRttMs < 0 || (int)rtt < cl->minRttMs)
+        cl->minRttMs = (int)rtt;
+
+    /*
+     * With fences answered back to back, what came in between them was
+     * delivered in the time between the answers. Otherwise all of it was
+     * on its way for the round trip, which underestimates a little.
+     */
+    bytes = ping.sentBytes - cl->fenceAckedBytes;
+    ms = ping.measurable ? now - cl->fenceAckedMs : rtt;
+    if (bytes >= FENCE_MIN_SAMPLE && ms > 0) {
+        sample = (unsigned long)((double)bytes * 1000 / ms);
+        cl->throughput = cl->throughput == 0 ? sample : (3 * cl->throughput + sample) / 4;
+    }
+    cl->fenceAckedBytes = ping.sentBytes;
+    cl->fenceAckedMs = now;
+
+    for (i = 0; i < cl->fencePingCount; i++)
+        cl->fencePings[i].measurable = TRUE;
+
+    TSIGNAL(cl->updateCond);
+    UNLOCK(cl->updateMutex);
+}
+
+
+static uint32_t
+fenceWindow(rfbClientPtr cl)
+{
+    double window;
+
+    if (cl->throughput == 0 || cl->minRttMs < 0)
+        return FENCE_INITIAL_WINDOW;
+
+    window = (double)cl->throughput * cl->minRttMs / 1000 * 2;
+    if (window < FENCE_MIN_WINDOW)
+        return FENCE_MIN_WINDOW;
+    if (window > FENCE_MAX_WINDOW)
+        return FENCE_MAX_WINDOW;
+    return (uint32_t)window;
+}
+
+
+/* Must be called with updateMutex held. */
+
+uint32_t
+rfbFenceBytesInFlight(rfbClientPtr cl)
+{
+    if (cl->fencePingCount == 0)
+        return 0;
+    return cl->fencePings[cl->fencePingCount - 1].sentBytes - cl->fenceAckedBytes;
+}
+
+
+/*
+ * Unanswered data in percent of what the link holds, 0 without fences.
+ * Must be called with updateMutex held.
+ */
+
+int
+rfbFenceLoad(rfbClientPtr cl)
+{
+    if (!cl->useFence || cl->fencePingCount == 0)
+        return 0;
+    return (int)((uint64_t)rfbFenceBytesInFlight(cl) * 100 / fenceWindow(cl));
+}
+
+
+/*
+ * Whether the next continuous update has to wait for answers. Must be
+ * called with updateMutex held.
+ */
+
+rfbBool
+rfbFenceCongested(rfbClientPtr cl)
+{
+    if (!cl->continuousUpdates || !cl->useFence || cl->fencePingCount == 0)
+        return FALSE;
+    if (cl->fencePingCount == RFB_MAX_FENCE_PINGS)
+        return TRUE;
+    return rfbFenceBytesInFlight(cl) > fenceWindow(cl);
+}
@@ -0,0 +1,168 @@
+/*
+ * focus.c - spend the JPEG quality where the user is looking.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * With screen->focusQuality set, the pixel data of an update to a Tight
+ * client asking for JPEG is cut into RFB_FOCUS_ZONES zones by distance
+ * from where the client is working: its last pointer position and its
+ * keyboard focus, which is either what the application told us with
+ * rfbSetKeyboardFocus() or where the pointer was at the last key press.
+ * The first zone reaches focusRadius pixels around them, every further
+ * one twice as far as the one before, the last one is the rest.
+ *
+ * The quality level the client asked for is the budget. Near the focus
+ * the level is raised by FOCUS_BOOST, up to lossless, far away it is
+ * lowered by FOCUS_DROP and the zones in between are interpolated, so the
+ * average stays about where the client wanted it. While the link is
+ * loaded, see rfbFenceLoad(), the boost goes and the far zones drop
+ * further, so most of the cut is taken where nobody looks.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+/* levels above the budget near the focus, 10 and more is lossless */
+#define FOCUS_BOOST 2
+/* levels below the budget in the last zone, and more once congested */
+#define FOCUS_DROP 3
+#define FOCUS_CONGESTED_DROP 3
+/* load in percent of the fence window at which the boost goes */
+#define FOCUS_BOOST_MAX_LOAD 50
+
+
+void
+rfbSetKeyboardFocus(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    LOCK(cl->updateMutex);
+    cl->keyFocusFromApp = w > 0 && h > 0;
+    if (cl->keyFocusFromApp) {
+        cl->keyFocusX = x;
+        cl->keyFocusY = y;
+        cl->keyFocusW = w;
+        cl->keyFocusH = h;
+    } else {
+        cl->keyFocusW = 0;
+    }
+    UNLOCK(cl->updateMutex);
+}
+
+
+/* Called for every pointer and key event of the client. */
+
+void
+rfbTrackFocus(rfbClientPtr cl, int x, int y, rfbBool keyPressed)
+{
+    LOCK(cl->updateMutex);
+    if (x >= 0) {
+        cl->focusPtrX = x;
+        cl->focusPtrY = y;
+    }
+    if (keyPressed && !cl->keyFocusFromApp && cl->focusPtrX >= 0) {
+        cl->keyFocusX = cl->focusPtrX;
+        cl->keyFocusY = cl->focusPtrY;
+        cl->keyFocusW = 1;
+        cl->keyFocusH = 1;
+    }
+    UNLOCK(cl->updateMutex);
+}
+
+
+/* the Tight quality level the client asked for, -1 if it wants no JPEG */
+
+static int
+requestedLevel(rfbClientPtr cl)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    if (cl->tightQualityLevel != -1)
+        return cl->tightQualityLevel;
+    /* only a fine quality level, about the same scale */
+    if (cl->turboQualityLevel != -1)
+        return cl->turboQualityLevel >= 100 ? 9 : cl->turboQualityLevel / 11;
+#endif
+    return -1;
+}
+
+
+static void
+addArea(sraRegionPtr area, int x, int y, int w, int h, int grow)
+{
+    sraRegionPtr rect = sraRgnCreateRect(x - grow, y - grow, x + w + grow, y + h + grow);
+
+    sraRgnOr(area, rect);
+    sraRgnDestroy(rect);
+}
+
+
+int
+rfbFocusZones(rfbClientPtr cl, sraRegionPtr region,
+              sraRegionPtr zones[RFB_FOCUS_ZONES], int levels[RFB_FOCUS_ZONES])
+{
+    int budget = requestedLevel(cl), high, low, load, grow, k;
+    int ptrX, ptrY, keyX, keyY, keyW, keyH;
+    sraRegionPtr rest, area;
+
+    if ((cl->preferredEncoding != rfbEncodingTight &&
+         cl->preferredEncoding != rfbEncodingTightPng) || budget < 0)
+        return 0;
+
+    LOCK(cl->updateMutex);
+    ptrX = cl->focusPtrX;
+    ptrY = cl->focusPtrY;
+    keyX = cl->keyFocusX;
+    keyY = cl->keyFocusY;
+    keyW = cl->keyFocusW;
+    keyH = cl->keyFocusH;
+    load = rfbFenceLoad(cl);
+    UNLOCK(cl->updateMutex);
+
+    if (ptrX < 0 && keyW <= 0)
+        return 0;
+    if (load > 100)
+        load = 100;
+
+    high = budget + (load < FOCUS_BOOST_MAX_LOAD ? FOCUS_BOOST : 0);
+    low = budget - FOCUS_DROP - FOCUS_CONGESTED_DROP * load / 100;
+    if (low < 0)
+        low = 0;
+
+    rest = sraRgnCreateRgn(region);
+    grow = cl->screen->focusRadius > 0 ? cl->screen->focusRadius : 1;
+    for (k = 0; k < RFB_FOCUS_ZONES; k++, grow *= 2) {
+        if (k < RFB_FOCUS_ZONES - 1) {
+            area = sraRgnCreate();
+            if (ptrX >= 0)
+                addArea(area, ptrX, ptrY, 1, 1, grow);
+            if (keyW > 0)
+                addArea(area, keyX, keyY, keyW, keyH, grow);
+            sraRgnAnd(area, rest);
+            sraRgnSubtract(rest, area);
+            zones[k] = area;
+        } else {
+            zones[k] = rest;
+        }
+        levels[k] = high - (high - low) * k / (RFB_FOCUS_ZONES - 1);
+        if (levels[k] > 9)
+            levels[k] = -1;
+    }
+
+    return RFB_FOCUS_ZONES;
+}
@@ -0,0 +1,386 @@
+/*
+ * h264.c - send the video region as H.264.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Only used for the video region (see videoregion.c) of clients which
+ * announce rfbEncodingH264, everything else still goes out in the client's
+ * preferred encoding. Each client has one encoder, coding the bounding box
+ * of its video region. When the box moves or changes size, the framebuffer
+ * is resized or the client asks for a full update, the encoder is thrown
+ * away and the next frame starts a new stream, which the client learns from
+ * rfbH264FlagResetAllContexts.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+
+typedef struct rfbH264Data {
+    AVCodecContext *ctx;
+    AVFrame *frame;
+    AVPacket *packet;
+    struct SwsContext *sws;
+    int x, y, w, h;                     /* the rectangle being coded */
+    int screenWidth, screenHeight;
+    int64_t pts;
+    int framesQueued;                   /* sent to the encoder, not out yet */
+    rfbBool newStream;                  /* no frame sent since the reset */
+    uint8_t *buf;                       /* the coded frame */
+    size_t bufSize;
+} rfbH264Data;
+
+
+/* Only 32 bit true colour with 8 bits per channel is supported. */
+static enum AVPixelFormat
+sourceFormat(const rfbPixelFormat *f)
+{
+    if (f->bitsPerPixel != 32 || !f->trueColour ||
+        f->redMax != 255 || f->greenMax != 255 || f->blueMax != 255)
+        return AV_PIX_FMT_NONE;
+    if (f->greenShift == 8 && f->redShift == 16 && f->blueShift == 0)
+        return f->bigEndian ? AV_PIX_FMT_0RGB : AV_PIX_FMT_BGR0;
+    if (f->greenShift == 8 && f->redShift == 0 && f->blueShift == 16)
+        return f->bigEndian ? AV_PIX_FMT_0BGR : AV_PIX_FMT_RGB0;
+    if (f->greenShift == 16 && f->redShift == 24 && f->blueShift == 8)
+        return f->bigEndian ? AV_PIX_FMT_RGB0 : AV_PIX_FMT_0BGR;
+    if (f->greenShift == 16 && f->redShift == 8 && f->blueShift == 24)
+        return f->bigEndian ? AV_PIX_FMT_BGR0 : AV_PIX_FMT_0RGB;
+    return AV_PIX_FMT_NONE;
+}
+
+
+static void
+closeEncoder(rfbH264Data *d)
+{
+    avcodec_free_context(&d->ctx);
+    av_frame_free(&d->frame);
+    av_packet_free(&d->packet);
+    sws_freeContext(d->sws);
+    d->sws = NULL;
+}
+
+
+/* Prefer software encoders, they are there everywhere and start fast. */
+static const AVCodec *
+findEncoder(void)
+{
+    const AVCodec *codec;
+
+    if ((codec = avcodec_find_encoder_by_name("libx264")) != NULL)
+        return codec;
+    if ((codec = avcodec_find_encoder_by_name("libopenh264")) != NULL)
+        return codec;
+    return avcodec_find_encoder(AV_CODEC_ID_H264);
+}
+
+
+static rfbBool
+openEncoder(rfbClientPtr cl, rfbH264Data *d, int x, int y, int w, int h)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    enum AVPixelFormat format = sourceFormat(&screen->serverFormat);
+    const AVCodec *codec = findEncoder();
+    int fps = screen->videoFrameRate > 0 ? screen->videoFrameRate : 25;
+    int level = screen->videoQualityLevel;
+    char crf[8];
+
+    if (format == AV_PIX_FMT_NONE || codec == NULL)
+        return FALSE;
+
+    if (level < 0) level = 0;
+    if (level > 9) level = 9;
+
+    if ((d->ctx = avcodec_alloc_context3(codec)) == NULL)
+        return FALSE;
+    d->ctx->width = w;
+    d->ctx->height = h;
+    d->ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    d->ctx->time_base.num = 1;
+    d->ctx->time_base.den = fps;
+    d->ctx->framerate.num = fps;
+    d->ctx->framerate.den = 1;
+    /* a key frame only when a new stream starts */
+    d->ctx->gop_size = fps * 60;
+    d->ctx->max_b_frames = 0;
+    d->ctx->thread_type = FF_THREAD_SLICE;
+    d->ctx->thread_count = 0;
+    av_opt_set(d->ctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(d->ctx->priv_data, "tune", "zerolatency", 0);
+    snprintf(crf, sizeof(crf), "%d", 40 - 2 * level);
+    if (av_opt_set(d->ctx->priv_data, "crf", crf, 0) < 0)
+        d->ctx->bit_rate = (int64_t)w * h * fps * (level + 1) / 40;
+
+    if (avcodec_open2(d->ctx, codec, NULL) < 0) {
+        rfbErr("H.264: cannot open encoder %s for %dx%d\n", codec->name, w, h);
+        closeEncoder(d);
+        return FALSE;
+    }
+
+    d->frame = av_frame_alloc();
+    d->packet = av_packet_alloc();
+    d->sws = sws_getContext(w, h, format, w, h, AV_PIX_FMT_YUV420P,
+                            SWS_POINT, NULL, NULL, NULL);
+    if (d->frame == NULL || d->packet == NULL || d->sws == NULL) {
+        closeEncoder(d);
+        return FALSE;
+    }
+    d->frame->format = AV_PIX_FMT_YUV420P;
+    d->frame->width = w;
+    d->frame->height = h;
+    if (av_frame_get_buffer(d->frame, 32) < 0) {
+        closeEncoder(d);
+        return FALSE;
+    }
+
+    d->x = x;
+    d->y = y;
+    d->w = w;
+    d->h = h;
+    d->screenWidth = screen->width;
+    d->screenHeight = screen->height;
+    d->pts = 0;
+    d->framesQueued = 0;
+    d->newStream = TRUE;
+    return TRUE;
+}
+
+
+/*
+ * Works out the rectangle to code for the region and makes sure there is
+ * an encoder for it. Returns FALSE if the region has to be sent some other
+ * way.
+ */
+
+rfbBool
+rfbH264SetupRegion(rfbClientPtr cl, sraRegionPtr region, sraRect *rect)
+{
+    rfbH264Data *d = (rfbH264Data *)cl->h264Data;
+    sraRegionPtr bbox;
+    int x, y, w, h;
+
+    if (cl->screen != cl->scaledScreen)
+        return FALSE;
+
+    bbox = sraRgnBBox(region);
+    if (!sraRgnPopRect(bbox, rect, 0)) {
+        sraRgnDestroy(bbox);
+        return FALSE;
+    }
+    sraRgnDestroy(bbox);
+
+    /* 4:2:0 wants even sizes, grow by a pixel if need be */
+    x = rect->x1;
+    y = rect->y1;
+    w = rect->x2 - x;
+    h = rect->y2 - y;
+    if (w & 1) {
+        if (x + w < cl->screen->width) w++;
+        else if (x > 0) { x--; w++; }
+        else return FALSE;
+    }
+    if (h & 1) {
+        if (y + h < cl->screen->height) h++;
+        else if (y > 0) { y--; h++; }
+        else return FALSE;
+    }
+    if (w < 16 || h < 16)
+        return FALSE;
+
+    if (d == NULL) {
+        if ((d = (rfbH264Data *)calloc(1, sizeof(rfbH264Data))) == NULL)
+            return FALSE;
+        cl->h264Data = d;
+    }
+
+    if (d->ctx != NULL &&
+        (cl->h264ResetPending || d->x != x || d->y != y || d->w != w || d->h != h ||
+         d->screenWidth != cl->screen->width || d->screenHeight != cl->screen->height))
+        closeEncoder(d);
+    cl->h264ResetPending = FALSE;
+
+    if (d->ctx == NULL && !openEncoder(cl, d, x, y, w, h))
+        return FALSE;
+
+    rect->x1 = x;
+    rect->y1 = y;
+    rect->x2 = x + w;
+    rect->y2 = y + h;
+    return TRUE;
+}
+
+
+static rfbBool
+appendPacket(rfbH264Data *d, size_t *len)
+{
+    if (*len + d->packet->size > d->bufSize) {
+        size_t size = (*len + d->packet->size) * 2;
+        uint8_t *buf = (uint8_t *)realloc(d->buf, size);
+
+        if (buf == NULL)
+            return FALSE;
+        d->buf = buf;
+        d->bufSize = size;
+    }
+    memcpy(d->buf + *len, d->packet->data, d->packet->size);
+    *len += d->packet->size;
+    return TRUE;
+}
+
+
+/* appends all packets the encoder has ready, returns the last result of
+   avcodec_receive_packet() */
+static int
+receivePackets(rfbH264Data *d, size_t *len)
+{
+    int ret;
+
+    while ((ret = avcodec_receive_packet(d->ctx, d->packet)) == 0) {
+        rfbBool ok = appendPacket(d, len);
+
+        av_packet_unref(d->packet);
+        if (!ok)
+            return AVERROR(ENOMEM);
+        d->framesQueued--;
+    }
+    return ret;
+}
+
+
+/*
+ * rfbSendRectEncodingH264 - send the rectangle set up by
+ * rfbH264SetupRegion() as the next frame of the client's stream.
+ */
+
+rfbBool
+rfbSendRectEncodingH264(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbH264Data *d = (rfbH264Data *)cl->h264Data;
+    rfbFramebufferUpdateRectHeader rect;
+    rfbH264Header hdr;
+    const uint8_t *src;
+    int srcStride = cl->screen->paddedWidthInBytes;
+    size_t len = 0, i;
+    int ret;
+
+    if (d == NULL || d->ctx == NULL || d->x != x || d->y != y || d->w != w || d->h != h) {
+        rfbErr("rfbSendRectEncodingH264: no encoder for %dx%d at %d,%d\n", w, h, x, y);
+        return FALSE;
+    }
+
+    if (av_frame_make_writable(d->frame) < 0)
+        return FALSE;
+    src = (const uint8_t *)cl->screen->frameBuffer + y * srcStride
+          + x * (cl->screen->serverFormat.bitsPerPixel / 8);
+    sws_scale(d->sws, &src, &srcStride, 0, h, d->frame->data, d->frame->linesize);
+    d->frame->pts = d->pts++;
+
+    if ((ret = avcodec_send_frame(d->ctx, d->frame)) < 0) {
+        rfbErr("rfbSendRectEncodingH264: avcodec_send_frame failed (%d)\n", ret);
+        return FALSE;
+    }
+    d->framesQueued++;
+    if ((ret = receivePackets(d, &len)) != AVERROR(EAGAIN)) {
+        rfbErr("rfbSendRectEncodingH264: avcodec_receive_packet failed (%d)\n", ret);
+        return FALSE;
+    }
+    /*
+     * With zerolatency every frame comes out right away. Should an encoder
+     * hold one back anyway, it is drained now, as there may be no next
+     * frame to push it out when the video stops, and the next frame
+     * starts a new stream.
+     */
+    if (d->framesQueued > 0) {
+        avcodec_send_frame(d->ctx, NULL);
+        if ((ret = receivePackets(d, &len)) != AVERROR_EOF) {
+            rfbErr("rfbSendRectEncodingH264: draining the encoder failed (%d)\n", ret);
+            return FALSE;
+        }
+        closeEncoder(d);
+    }
+
+    rfbStatRecordEncodingSent(cl, rfbEncodingH264,
+                              sz_rfbFramebufferUpdateRectHeader + sz_rfbH264Header + len,
+                              w * (cl->format.bitsPerPixel / 8) * h);
+
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbH264Header > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.r.x = Swap16IfLE(x);
+    rect.r.y = Swap16IfLE(y);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+    rect.encoding = Swap32IfLE(rfbEncodingH264);
+    memcpy(cl->updateBuf+cl->ublen, (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    hdr.length = Swap32IfLE((uint32_t)len);
+    hdr.flags = Swap32IfLE(d->newStream ? rfbH264FlagResetAllContexts : 0);
+    memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbH264Header);
+    cl->ublen += sz_rfbH264Header;
+    if (len > 0)
+        d->newStream = FALSE;
+
+    for (i = 0; i < len;) {
+        size_t bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+
+        if (i + bytesToCopy > len)
+            bytesToCopy = len - i;
+        memcpy(cl->updateBuf+cl->ublen, d->buf + i, bytesToCopy);
+        cl->ublen += bytesToCopy;
+        i += bytesToCopy;
+        if (cl->ublen == UPDATE_BUF_SIZE) {
+            if (!rfbSendUpdateBuf(cl))
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+void
+rfbFreeH264Data(rfbClientPtr cl)
+{
+    rfbH264Data *d = (rfbH264Data *)cl->h264Data;
+
+    if (d == NULL)
+        return;
+    closeEncoder(d);
+    free(d->buf);
+    free(d);
+    cl->h264Data = NULL;
+}
+
+
+/* what is ours, the encoder's own memory is not known */
+size_t
+rfbH264MemoryUsage(rfbClientPtr cl)
+{
+    rfbH264Data *d = (rfbH264Data *)cl->h264Data;
+
+    return d == NULL ? 0 : sizeof(rfbH264Data) + d->bufSize;
+}
@@ -16,6 +16,7 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "trace.h"
 
 #include <stdarg.h>
 #include <errno.h>
@@ -409,20 +410,52 @@ void rfbScheduleCopyRect(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2,int
   sraRgnDestroy(region);
 }
 
+/* the damage that starts the next update of a client, or any other, see rfb/rfbtrace.h */
+static void rfbTraceDamage(uint64_t start,uint64_t id,sraRegionPtr modRegion)
+{
+   sraRegionPtr box=sraRgnBBox(modRegion);
+   sraRectangleIterator* i=sraRgnGetIterator(box);
+   sraRect rect;
+
+   if(!sraRgnIteratorNext(i,&rect))
+     rect.x1=rect.y1=rect.x2=rect.y2=0;
+   sraRgnReleaseIterator(i);
+   sraRgnDestroy(box);
+   rfbTraceSlice("server","damage",start,id,'s',NULL,
+                 rect.x1,rect.y1,rect.x2-rect.x1,rect.y2-rect.y1,-1);
+}
+
 void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
+   uint64_t traceStart = rfbTraceActive ? rfbTraceNow() : 0;
+   uint64_t traceId;
+   rfbBool traced = FALSE;
+
+   rfbVideoTrackDamage(screen,modRegion);
 
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
+     traceId = 0;
      LOCK(cl->updateMutex);
      sraRgnOr(cl->modifiedRegion,modRegion);
+     if(traceStart && !cl->traceDamaged) {
+       cl->traceDamaged = TRUE;
+       traceId = RFB_TRACE_ID(cl->traceKey, cl->traceUpdateSeq + 1);
+     }
      TSIGNAL(cl->updateCond);
      UNLOCK(cl->updateMutex);
+     if(traceId) {
+       rfbTraceDamage(traceStart,traceId,modRegion);
+       traced = TRUE;
+     }
    }
 
    rfbReleaseClientIterator(iterator);
+
+   if(traceStart && !traced)
+     rfbTraceDamage(traceStart,0,modRegion);
 }
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
@@ -451,16 +484,45 @@ void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
 
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
 
+/* WAIT() for updateCond, but for at most ms */
+static void
+waitForUpdate(rfbClientPtr cl, int ms)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    struct timeval now;
+    struct timespec until;
+
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + ms / 1000;
+    until.tv_nsec = (now.tv_usec + (ms % 1000) * 1000L) * 1000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&cl->updateCond, &cl->updateMutex, &until);
+#else
+    SleepConditionVariableCS(&cl->updateCond, &cl->updateMutex, ms);
+#endif
+}
+
 static THREAD_ROUTINE_RETURN_TYPE
 clientOutput(void *data)
 {
     rfbClientPtr cl = (rfbClientPtr)data;
     rfbBool haveUpdate;
     sraRegion* updateRegion;
+    int pace, videoWait;
+    char traceName[64];
+
+    if (rfbTraceActive) {
+        snprintf(traceName, sizeof(traceName), "output %s:%u", cl->host, (unsigned int)cl->traceKey);
+        rfbTraceThreadName(traceName);
+    }
 
     while (1) {
         haveUpdate = false;
         while (!haveUpdate) {
+		pace = videoWait = 0;
 		if (cl->sock == RFB_INVALID_SOCKET || cl->state == RFB_SHUTDOWN) {
 			/* Client has disconnected. */
 			return THREAD_ROUTINE_RETURN_VALUE;
@@ -484,11 +546,32 @@ clientOutput(void *data)
 			}
 		}
 
-		if (!haveUpdate) {
-			WAIT(cl->updateCond, cl->updateMutex);
+		/* continuous updates wait for the client to catch up, see fence.c */
+		if (haveUpdate && rfbFenceCongested(cl))
+			haveUpdate = FALSE;
+
+		/* and for their turn on a shared uplink, see uplink.c */
+		if (haveUpdate && (pace = rfbUplinkDelay(cl)) > 0)
+			haveUpdate = FALSE;
+
+		/* and for the next frame if all there was to send is video, see videoregion.c */
+		if (haveUpdate && cl->videoFrameDeferred &&
+		    (videoWait = rfbVideoFrameWait(cl)) > 0)
+			haveUpdate = FALSE;
+		cl->videoFrameDeferred = FALSE;
+
+		if (!haveUpdate && pace == 0) {
+			rfbUplinkIdle(cl);
+			if (videoWait > 0)
+				waitForUpdate(cl, videoWait);
+			else
+				WAIT(cl->updateCond, cl->updateMutex);
 		}
 
 		UNLOCK(cl->updateMutex);
+
+		if (pace > 0)
+			THREAD_SLEEP_MS(pace);
         }
         
         /* OK, now, to save bandwidth, wait a little while for more
@@ -559,6 +642,11 @@ clientInput(void *data)
 
 	tv.tv_sec = 60; /* 1 minute */
 	tv.tv_usec = 0;
+	/* wake up in time to free the encoders of an idle client */
+	if (cl->screen->encoderIdleTimeout > 0 && cl->screen->encoderIdleTimeout < 60000) {
+	    tv.tv_sec = cl->screen->encoderIdleTimeout / 1000;
+	    tv.tv_usec = (cl->screen->encoderIdleTimeout % 1000) * 1000;
+	}
 
 	n = select(nfds + 1, &rfds, &wfds, &efds, &tv);
 
@@ -566,6 +654,8 @@ clientInput(void *data)
 	    rfbLogPerror("ReadExact: select");
 	    break;
 	}
+	rfbReleaseIdleEncoders(cl);
+
 	if (n == 0) /* timeout */
 	{
             rfbSendFileTransferChunk(cl);
@@ -646,6 +736,8 @@ listenerRun(void *data)
 	FD_SET(screen->pipe_notify_listener_thread[0], &listen_fds);
 	screen->maxFd = rfbMax(screen->maxFd, screen->pipe_notify_listener_thread[0]);
 #endif
+	if(screen->shmImport)
+	  FD_SET(rfbShmImportEventFd(screen), &listen_fds);
 
         if (select(screen->maxFd+1, &listen_fds, NULL, NULL, NULL) == -1) {
             rfbLogPerror("listenerRun: error in select");
@@ -663,6 +755,9 @@ listenerRun(void *data)
 	}
 #endif
 
+	if (rfbShmImportProcess(screen, &listen_fds))
+	    continue;
+
 	/* there is something on the listening sockets, handle new connections */
 	len = sizeof (peer);
 	if (FD_ISSET(screen->listenSock, &listen_fds)) 
@@ -996,6 +1091,18 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
 
    screen->permitFileTransfer = FALSE;
 
+   screen->handleVideoRegions = FALSE;
+   screen->videoFrameRate = 10;
+   screen->videoQualityLevel = 2;
+
+   screen->wsDeflateLevel = 1;
+   screen->wsDeflateWindowBits = 15;
+   screen->encoderIdleTimeout = 30000;
+   screen->corkUpdates = TRUE;
+   screen->focusQuality = FALSE;
+   screen->focusRadius = 64;
+   screen->uplinkRate = 0;
+
    if(!rfbProcessArguments(screen,argc,argv)) {
      free(screen);
      return NULL;
@@ -1023,6 +1130,7 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->dontConvertRichCursorToXCursor = FALSE;
    screen->cursor = &myCursor;
    INIT_MUTEX(screen->cursorMutex);
+   INIT_MUTEX(screen->uplinkMutex);
 
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
    screen->backgroundLoop = FALSE;
@@ -1051,6 +1159,8 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    /* initialize client list and iterator mutex */
    rfbClientListInit(screen);
 
+   rfbVideoTrackerInit(screen);
+
    return(screen);
 }
 
@@ -1161,6 +1271,12 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
   FREE_IF(colourMap.data.bytes);
   FREE_IF(underCursorBuffer);
   TINI_MUTEX(screen->cursorMutex);
+  TINI_MUTEX(screen->uplinkMutex);
+
+  rfbVideoTrackerFree(screen);
+  rfbShmImportFree(screen);
+  if(screen->traceStarted)
+      rfbTraceStop();
 
   if(screen->cursor != &myCursor)
       rfbFreeCursor(screen->cursor);
@@ -1314,6 +1430,8 @@ rfbUpdateClient(rfbClientPtr cl)
           rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
         }
       }
+    } else {
+      rfbUplinkIdle(cl);
     }
 
     if (!cl->viewOnly && cl->lastPtrX >= 0) {
@@ -1337,6 +1455,8 @@ rfbUpdateClient(rfbClientPtr cl)
       }
     }
 
+    rfbReleaseIdleEncoders(cl);
+
     return result;
 }
 
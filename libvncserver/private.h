@@ -1,6 +1,8 @@
 #ifndef RFB_PRIVATE_H
 #define RFB_PRIVATE_H
 
+#include <rfb/rfbregion.h>
+
 /* from cursor.c */
 
 void rfbShowCursor(rfbClientPtr cl);
@@ -11,15 +13,77 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
 
+/* from videoregion.c */
+
+typedef struct _rfbDamageTile {
+    uint32_t history;       /* bit n: changed n slots before slot */
+    unsigned long slot;
+    uint32_t count;         /* number of slots with changes */
+    char hot;
+    char video;
+} rfbDamageTile;
+
+typedef struct _rfbVideoTracker {
+    MUTEX(mutex);
+    int width, height;
+    int cols, rows;
+    rfbDamageTile *tiles;
+    unsigned long classifiedSlot;
+    sraRegionPtr videoRegion;
+} rfbVideoTracker;
+
+void rfbVideoTrackerInit(rfbScreenInfoPtr screen);
+void rfbVideoTrackerFree(rfbScreenInfoPtr screen);
+void rfbVideoTrackDamage(rfbScreenInfoPtr screen, sraRegionPtr region);
+rfbBool rfbVideoFrameDue(rfbClientPtr cl);
+/* ms until the client's next video frame is due */
+int rfbVideoFrameWait(rfbClientPtr cl);
+unsigned long rfbNowMs(void);
+
+/* fence.c */
+rfbBool rfbAppendFencePing(rfbClientPtr cl);
+void rfbHandleFenceResponse(rfbClientPtr cl, int length, const char *data);
+/* these three need updateMutex held */
+uint32_t rfbFenceBytesInFlight(rfbClientPtr cl);
+rfbBool rfbFenceCongested(rfbClientPtr cl);
+int rfbFenceLoad(rfbClientPtr cl);
+
+/* from focus.c */
+#define RFB_FOCUS_ZONES 4
+void rfbTrackFocus(rfbClientPtr cl, int x, int y, rfbBool keyPressed);
+/* splits region by distance from the client's focus, returns the number
+   of zones, 0 to send it all alike; levels -1 mean lossless */
+int rfbFocusZones(rfbClientPtr cl, sraRegionPtr region,
+                  sraRegionPtr zones[RFB_FOCUS_ZONES], int levels[RFB_FOCUS_ZONES]);
+
+/* from uplink.c */
+int rfbUplinkDelay(rfbClientPtr cl);
+void rfbUplinkCharge(rfbClientPtr cl, int bytes);
+void rfbUplinkIdle(rfbClientPtr cl);
+void rfbUplinkLeave(rfbClientPtr cl);
+
+/* from clientmem.c */
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/* zalloc and zfree of the client's zlib streams, opaque is the client */
+voidpf rfbZlibAlloc(voidpf opaque, uInt items, uInt size);
+void rfbZlibFree(voidpf opaque, voidpf address);
+#endif
+rfbBool rfbAllocUpdateBuf(rfbClientPtr cl);
+void rfbReleaseIdleEncoders(rfbClientPtr cl);
+
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 extern void rfbFreeTightData(rfbClientPtr cl);
+void rfbReleaseTightData(rfbClientPtr cl);
 #endif
 
 /* from zrle.c */
 void rfbFreeZrleData(rfbClientPtr cl);
+void rfbReleaseZrleBuffers(rfbClientPtr cl);
+size_t rfbZrleMemoryUsage(rfbClientPtr cl);
 
 #endif
 
@@ -27,6 +91,31 @@ void rfbFreeZrleData(rfbClientPtr cl);
 /* from ultra.c */
 
 extern void rfbFreeUltraData(rfbClientPtr cl);
+size_t rfbUltraMemoryUsage(rfbClientPtr cl);
+
+/* from h264.c */
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+rfbBool rfbH264SetupRegion(rfbClientPtr cl, sraRegionPtr region, sraRect *rect);
+void rfbFreeH264Data(rfbClientPtr cl);
+size_t rfbH264MemoryUsage(rfbClientPtr cl);
+#endif
+
+/* from websockets.c */
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+size_t webSocketsMemoryUsage(rfbClientPtr cl);
+#endif
+
+/* from shmimport.c */
+typedef struct _rfbShmImport rfbShmImport;
+/* drains the damage ring, TRUE if fds said the eventfd was readable */
+rfbBool rfbShmImportProcess(rfbScreenInfoPtr screen, fd_set *fds);
+int rfbShmImportEventFd(rfbScreenInfoPtr screen);
+void rfbShmImportFree(rfbScreenInfoPtr screen);
+
+/* from sockets.c */
+void rfbCorkSock(rfbClientPtr cl, rfbBool cork);
 
 #endif
 
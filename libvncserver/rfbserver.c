@@ -50,6 +50,7 @@
 #endif
 
 #include "sockets.h"
+#include "trace.h"
 
 #ifdef DEBUGPROTO
 #undef DEBUGPROTO
@@ -341,6 +342,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       size_t otherClientsCount = 0;
 
       getpeername(sock, (struct sockaddr *)&addr, &addrlen);
+      cl->traceKey = rfbTraceSocketKey(sock, TRUE);
 #ifdef LIBVNCSERVER_IPv6
       if(getnameinfo((struct sockaddr*)&addr, addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
 	rfbLogPerror("rfbNewClient: error in getnameinfo");
@@ -387,6 +389,9 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 #ifdef LIBVNCSERVER_HAVE_LIBZ
       cl->zrleData = NULL;
 #endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+      cl->h264Data = NULL;
+#endif
 
       cl->copyRegion = sraRgnCreate();
       cl->copyDX = 0;
@@ -399,6 +404,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       INIT_COND(cl->updateCond);
 
       cl->requestedRegion = sraRgnCreate();
+      cl->continuousRegion = sraRgnCreate();
+      cl->rttMs = cl->minRttMs = -1;
 
       cl->format = cl->screen->serverFormat;
       cl->translateFn = rfbTranslateNone;
@@ -463,6 +470,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->extensions = NULL;
 
       cl->lastPtrX = -1;
+      cl->focusPtrX = -1;
+      cl->uplinkWeight = 1;
 
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
       cl->pipe_notify_client_thread[0] = -1;
@@ -592,9 +601,20 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
     rfbFreeUltraData(cl);
 
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    rfbFreeH264Data(cl);
+#endif
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    webSocketsFree(cl);
+#endif
+
+    rfbUplinkLeave(cl);
+
     /* free buffers holding pixel data before and after encoding */
     free(cl->beforeEncBuf);
     free(cl->afterEncBuf);
+    free(cl->updateBuf);
 
     if(cl->sock != RFB_INVALID_SOCKET)
        FD_CLR(cl->sock,&(cl->screen->allFds));
@@ -625,6 +645,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
     sraRgnDestroy(cl->modifiedRegion);
     sraRgnDestroy(cl->requestedRegion);
+    sraRgnDestroy(cl->continuousRegion);
     sraRgnDestroy(cl->copyRegion);
 
     if (cl->translateLookupTable) free(cl->translateLookupTable);
@@ -1003,6 +1024,10 @@ rfbSendSupportedMessages(rfbClientPtr cl)
         rfbSetBit(msgs.client2server, rfbXvp);
         rfbSetBit(msgs.server2client, rfbXvp);
     }
+    rfbSetBit(msgs.client2server, rfbEnableContinuousUpdates);
+    rfbSetBit(msgs.server2client, rfbEndOfContinuousUpdates);
+    rfbSetBit(msgs.client2server, rfbFence);
+    rfbSetBit(msgs.server2client, rfbFence);
 
     memcpy(&cl->updateBuf[cl->ublen], (char *)&msgs, sz_rfbSupportedMessages);
     cl->ublen += sz_rfbSupportedMessages;
@@ -1042,6 +1067,9 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 	rfbEncodingTightPng,
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+	rfbEncodingH264,
 #endif
 	rfbEncodingUltra,
 	rfbEncodingUltraZip,
@@ -1203,9 +1231,18 @@ rfbBool rfbSendTextChatMessage(rfbClientPtr cl, uint32_t length, char *buffer)
             bytesToSend=rfbTextMaxSize;
     }
 
+    /* updateBuf is shared with the output thread, which may also free it,
+       see rfbReleaseIdleEncoders() */
+    LOCK(cl->sendMutex);
+    if (!rfbAllocUpdateBuf(cl)) {
+        UNLOCK(cl->sendMutex);
+        return FALSE;
+    }
     if (cl->ublen + sz_rfbTextChatMsg + bytesToSend > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
+        if (!rfbSendUpdateBuf(cl)) {
+            UNLOCK(cl->sendMutex);
             return FALSE;
+        }
     }
     
     memcpy(&cl->updateBuf[cl->ublen], (char *)&tc, sz_rfbTextChatMsg);
@@ -1216,8 +1253,11 @@ rfbBool rfbSendTextChatMessage(rfbClientPtr cl, uint32_t length, char *buffer)
     }
     rfbStatRecordMessageSent(cl, rfbTextChat, sz_rfbTextChatMsg+bytesToSend, sz_rfbTextChatMsg+bytesToSend);
 
-    if (!rfbSendUpdateBuf(cl))
+    if (!rfbSendUpdateBuf(cl)) {
+        UNLOCK(cl->sendMutex);
         return FALSE;
+    }
+    UNLOCK(cl->sendMutex);
         
     return TRUE;
 }
@@ -2317,6 +2357,9 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
         cl->enableSupportedMessages  = FALSE;
         cl->enableSupportedEncodings = FALSE;
         cl->enableServerIdentity     = FALSE;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+        cl->useH264                  = FALSE;
+#endif
 #if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
         cl->tightQualityLevel        = -1;
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
@@ -2444,6 +2487,26 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
                   cl->enableServerIdentity = TRUE;
                 }
                 break;
+            case rfbEncodingContinuousUpdates:
+                if (!cl->useContinuousUpdates) {
+                    rfbLog("Enabling ContinuousUpdates protocol extension for client "
+                           "%s\n", cl->host);
+                    cl->useContinuousUpdates = TRUE;
+                    /* tells the client it may send EnableContinuousUpdates */
+                    if (!rfbSendEndOfContinuousUpdates(cl))
+                        return;
+                }
+                break;
+            case rfbEncodingFence:
+                if (!cl->useFence) {
+                    rfbLog("Enabling Fence protocol extension for client "
+                           "%s\n", cl->host);
+                    cl->useFence = TRUE;
+                    /* an empty request tells the client fences are understood */
+                    if (!rfbSendFence(cl, rfbFenceFlagRequest, 0, NULL))
+                        return;
+                }
+                break;
             case rfbEncodingXvp:
                 if (cl->screen->xvpHook) {
                   rfbLog("Enabling Xvp protocol extension for client "
@@ -2454,6 +2517,16 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
                   }
                 }
                 break;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+            case rfbEncodingH264:
+                /* only for the video region, see h264.c */
+                if (!cl->useH264) {
+                    rfbLog("Enabling H.264 for the video region of client "
+                           "%s\n", cl->host);
+                    cl->useH264 = TRUE;
+                }
+                break;
+#endif
 #ifdef LIBVNCSERVER_HAVE_LIBZ
             case rfbEncodingExtendedClipboard:
                 if (!cl->enableExtendedClipboard) {
@@ -2635,6 +2708,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	    sraRgnSubtract(cl->copyRegion,tmpRegion);
             if (cl->useExtDesktopSize)
                 cl->newFBSizePending = TRUE;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+            /* the client may have lost its decoder state */
+            cl->h264ResetPending = TRUE;
+#endif
        }
        TSIGNAL(cl->updateCond);
        UNLOCK(cl->updateMutex);
@@ -2656,6 +2733,9 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 	rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbKeyEventMsg, sz_rfbKeyEventMsg);
 
+	if (cl->screen->focusQuality && msg.ke.down)
+	    rfbTrackFocus(cl, -1, -1, TRUE);
+
 	if(!cl->viewOnly) {
 	    cl->screen->kbdAddEvent(msg.ke.down, (rfbKeySym)Swap32IfLE(msg.ke.key), cl);
 	}
@@ -2683,6 +2763,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	else
 	    cl->screen->pointerClient = cl;
 
+	if (cl->screen->focusQuality)
+	    rfbTrackFocus(cl, ScaleX(cl->scaledScreen, cl->screen, Swap16IfLE(msg.pe.x)),
+			  ScaleY(cl->scaledScreen, cl->screen, Swap16IfLE(msg.pe.y)), FALSE);
+
 	if(!cl->viewOnly) {
 	    if (msg.pe.buttonMask != cl->lastPtrButtons ||
 		    cl->screen->deferPtrUpdateTime == 0) {
@@ -3000,6 +3084,99 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
       }
       return;
 
+    case rfbEnableContinuousUpdates:
+    {
+        sraRegionPtr tmpRegion;
+
+        if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+            sz_rfbEnableContinuousUpdatesMsg - 1)) <= 0) {
+            if (n != 0)
+              rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbEnableContinuousUpdatesMsg,
+                                 sz_rfbEnableContinuousUpdatesMsg);
+
+        /* only allowed once the server has answered the pseudo-encoding */
+        if (!cl->useContinuousUpdates) {
+            rfbLog("Warning, ignoring rfbEnableContinuousUpdates from client %s "
+                   "which did not ask for ContinuousUpdates\n", cl->host);
+            return;
+        }
+
+        if (!msg.ecu.enable) {
+            LOCK(cl->updateMutex);
+            cl->continuousUpdates = FALSE;
+            sraRgnMakeEmpty(cl->continuousRegion);
+            UNLOCK(cl->updateMutex);
+            rfbSendEndOfContinuousUpdates(cl);
+            return;
+        }
+
+        if (!rectSwapIfLEAndClip(&msg.ecu.x,&msg.ecu.y,&msg.ecu.w,&msg.ecu.h,cl)) {
+            rfbLog("Warning, ignoring rfbEnableContinuousUpdates: %dXx%dY-%dWx%dH\n",
+                   msg.ecu.x, msg.ecu.y, msg.ecu.w, msg.ecu.h);
+            return;
+        }
+
+        tmpRegion = sraRgnCreateRect(msg.ecu.x, msg.ecu.y,
+                                     msg.ecu.x + msg.ecu.w, msg.ecu.y + msg.ecu.h);
+        LOCK(cl->updateMutex);
+        if (!cl->continuousUpdates)
+            rfbLog("Enabling continuous updates for client %s\n", cl->host);
+        cl->continuousUpdates = TRUE;
+        sraRgnMakeEmpty(cl->continuousRegion);
+        sraRgnOr(cl->continuousRegion, tmpRegion);
+        sraRgnOr(cl->requestedRegion, tmpRegion);
+        TSIGNAL(cl->updateCond);
+        UNLOCK(cl->updateMutex);
+        sraRgnDestroy(tmpRegion);
+        return;
+    }
+
+    case rfbFence:
+    {
+        char data[rfbFenceMaxLength];
+        uint32_t flags;
+
+        if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+            sz_rfbFenceMsg - 1)) <= 0) {
+            if (n != 0)
+              rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        if (msg.f.length > rfbFenceMaxLength) {
+            rfbLog("Fence payload of %d bytes is too long, closing connection\n",
+                   msg.f.length);
+            rfbCloseClient(cl);
+            return;
+        }
+        if (msg.f.length > 0 &&
+            (n = rfbReadExact(cl, data, msg.f.length)) <= 0) {
+            if (n != 0)
+              rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbFenceMsg + msg.f.length,
+                                 sz_rfbFenceMsg + msg.f.length);
+
+        flags = Swap32IfLE(msg.f.flags);
+        if (flags & rfbFenceFlagRequest) {
+            /*
+             * Messages are handled one after the other and the answer
+             * waits for sendMutex, so it comes after any update in
+             * progress: all flags are honoured by just answering.
+             */
+            rfbSendFence(cl, flags & rfbFenceFlagsSupported & ~rfbFenceFlagRequest,
+                         msg.f.length, data);
+        } else
+            rfbHandleFenceResponse(cl, msg.f.length, data);
+        return;
+    }
+
     case rfbSetDesktopSize:
 
         if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
@@ -3095,20 +3272,287 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 /*
- * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
- * the RFB client.
- * givenUpdateRegion is not changed.
+ * Number of rectangles the region is sent as, 0xFFFF if it is not known
+ * in advance and a LastRect marker has to end the update.
  */
 
-rfbBool
-rfbSendFramebufferUpdate(rfbClientPtr cl,
-                         sraRegionPtr givenUpdateRegion)
+static int
+rfbCountUpdateRects(rfbClientPtr cl, sraRegionPtr updateRegion)
 {
-    sraRectangleIterator* i=NULL;
+    sraRectangleIterator* i;
     sraRect rect;
     int nUpdateRegionRects;
-    rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+
+    if (cl->preferredEncoding == rfbEncodingCoRRE) {
+        nUpdateRegionRects = 0;
+
+        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+	    int rectsPerRow, rows;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
+	    rows = (h-1)/cl->correMaxHeight+1;
+	    nUpdateRegionRects += rectsPerRow*rows;
+        }
+	sraRgnReleaseIterator(i);
+    } else if (cl->preferredEncoding == rfbEncodingUltra) {
+        nUpdateRegionRects = 0;
+        
+        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+            nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
+          }
+        sraRgnReleaseIterator(i);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    } else if (cl->preferredEncoding == rfbEncodingZlib) {
+	nUpdateRegionRects = 0;
+
+        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+	}
+	sraRgnReleaseIterator(i);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    } else if (cl->preferredEncoding == rfbEncodingTight) {
+	nUpdateRegionRects = 0;
+
+        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            int n;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (n == 0) {
+		nUpdateRegionRects = 0xFFFF;
+		break;
+	    }
+	    nUpdateRegionRects += n;
+	}
+	sraRgnReleaseIterator(i);
+#endif
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
+    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
+	nUpdateRegionRects = 0;
+
+        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            int n;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (n == 0) {
+		nUpdateRegionRects = 0xFFFF;
+		break;
+	    }
+	    nUpdateRegionRects += n;
+	}
+	sraRgnReleaseIterator(i);
+#endif
+    } else {
+        nUpdateRegionRects = sraRgnCountRects(updateRegion);
+    }
+
+    return nUpdateRegionRects;
+}
+
+
+/*
+ * Send the region as pixel data in the client's preferred encoding.
+ */
+
+static rfbBool
+rfbSendUpdateRegion(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+    sraRectangleIterator* i;
+    sraRect rect;
+
+    /* not compressed again for WebSockets clients, until the update is out */
+    switch (cl->preferredEncoding) {
+    case rfbEncodingUltra:
+    case rfbEncodingZlib:
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+    case rfbEncodingTight:
+    case rfbEncodingTightPng:
+        cl->compressedUpdate = TRUE;
+        break;
+    }
+
+    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+        int x = rect.x1;
+        int y = rect.y1;
+        int w = rect.x2 - x;
+        int h = rect.y2 - y;
+        uint64_t traceStart = rfbTraceActive ? rfbTraceNow() : 0;
+        int sentBefore = traceStart ? rfbStatGetSentBytes(cl) : 0;
+
+        /* We need to count the number of rects in the scaled screen */
+        if (cl->screen!=cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+
+        switch (cl->preferredEncoding) {
+	case -1:
+        case rfbEncodingRaw:
+            if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
+	        goto sendFailed;
+            break;
+        case rfbEncodingRRE:
+            if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
+	        goto sendFailed;
+            break;
+        case rfbEncodingCoRRE:
+            if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
+	        goto sendFailed;
+	    break;
+        case rfbEncodingHextile:
+            if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
+	        goto sendFailed;
+            break;
+        case rfbEncodingUltra:
+            if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
+                goto sendFailed;
+            break;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	case rfbEncodingZlib:
+	    if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
+	        goto sendFailed;
+	    break;
+       case rfbEncodingZRLE:
+       case rfbEncodingZYWRLE:
+           if (!rfbSendRectEncodingZRLE(cl, x, y, w, h))
+	       goto sendFailed;
+           break;
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+	case rfbEncodingTight:
+	    if (!rfbSendRectEncodingTight(cl, x, y, w, h))
+	        goto sendFailed;
+	    break;
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+	case rfbEncodingTightPng:
+	    if (!rfbSendRectEncodingTightPng(cl, x, y, w, h))
+	        goto sendFailed;
+	    break;
+#endif
+#endif
+        }
+        if (traceStart)
+            rfbTraceSlice("server", "encode", traceStart, cl->traceUpdateId, 0,
+                          rfbTraceEncodingName(cl->preferredEncoding),
+                          x, y, w, h, rfbStatGetSentBytes(cl) - sentBefore);
+    }
+    sraRgnReleaseIterator(i);
+    return TRUE;
+
+sendFailed:
+    sraRgnReleaseIterator(i);
+    return FALSE;
+}
+
+
+/*
+ * Send a region at another Tight quality level (0-9) to clients which
+ * accept JPEG. Unless raise is set the level is only used if it is below
+ * what they asked for; with raise, -1 sends the region lossless. The
+ * video region, see videoregion.c, goes at the screen's videoQualityLevel,
+ * the focus zones, see focus.c, at their own levels.
+ */
+
+static rfbBool
+rfbSendRegionAtLevel(rfbClientPtr cl, sraRegionPtr region, int level, rfbBool raise)
+{
+    rfbBool result;
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    int tightQualityLevel = cl->tightQualityLevel;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    int turboQualityLevel = cl->turboQualityLevel;
+    int turboSubsampLevel = cl->turboSubsampLevel;
+#endif
+    rfbBool lossless = raise && level < 0;
+
+    if (level < 0) level = 0;
+    if (level > 9) level = 9;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    if (lossless) {
+        cl->turboQualityLevel = -1;
+    } else if (cl->turboQualityLevel != -1 &&
+               (raise || tight2turbo_qual[level] < cl->turboQualityLevel)) {
+        cl->turboQualityLevel = tight2turbo_qual[level];
+        cl->turboSubsampLevel = tight2turbo_subsamp[level];
+    }
+#endif
+    if (lossless)
+        cl->tightQualityLevel = -1;
+    else if (cl->tightQualityLevel != -1 && (raise || level < cl->tightQualityLevel))
+        cl->tightQualityLevel = level;
+#endif
+
+    result = rfbSendUpdateRegion(cl, region);
+
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    cl->tightQualityLevel = tightQualityLevel;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    cl->turboQualityLevel = turboQualityLevel;
+    cl->turboSubsampLevel = turboSubsampLevel;
+#endif
+#endif
+    return result;
+}
+
+
+/* a FramebufferUpdate message begins, see rfb/rfbtrace.h */
+
+static void
+rfbTraceNextUpdate(rfbClientPtr cl)
+{
+    LOCK(cl->updateMutex);
+    cl->traceUpdateSeq++;
+    cl->traceDamaged = FALSE;
+    UNLOCK(cl->updateMutex);
+    cl->traceUpdateId = RFB_TRACE_ID(cl->traceKey, cl->traceUpdateSeq);
+}
+
+
+static rfbBool
+sendFramebufferUpdate(rfbClientPtr cl,
+                      sraRegionPtr givenUpdateRegion)
+{
+    int nUpdateRegionRects;
+    rfbFramebufferUpdateMsg *fu;
     sraRegionPtr updateRegion,updateCopyRegion,tmpRegion;
+    sraRegionPtr videoRegion = NULL;
+    sraRegionPtr focusZones[RFB_FOCUS_ZONES];
+    int focusLevels[RFB_FOCUS_ZONES], nFocusZones = 0, k;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    rfbBool videoH264 = FALSE;
+    sraRect h264Rect;
+#endif
     int dx, dy;
     rfbBool sendCursorShape = FALSE;
     rfbBool sendCursorPos = FALSE;
@@ -3117,8 +3561,25 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
     rfbBool result = TRUE;
+    rfbBool congested;
     
 
+    /*
+     * Continuous updates are not paced by requests but by the answers to
+     * fences, see fence.c.
+     */
+    LOCK(cl->updateMutex);
+    congested = rfbFenceCongested(cl);
+    UNLOCK(cl->updateMutex);
+    if (congested)
+      return TRUE;
+
+    /* freed while idle, see clientmem.c */
+    if (!rfbAllocUpdateBuf(cl))
+      return FALSE;
+    fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+    cl->lastUpdateMs = rfbNowMs();
+
     if(cl->screen->displayHook)
       cl->screen->displayHook(cl);
 
@@ -3131,6 +3592,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
       LOCK(cl->updateMutex);
       cl->newFBSizePending = FALSE;
       UNLOCK(cl->updateMutex);
+      rfbTraceNextUpdate(cl);
       fu->type = rfbFramebufferUpdate;
       fu->nRects = Swap16IfLE(1);
       cl->ublen = sz_rfbFramebufferUpdateMsg;
@@ -3297,6 +3759,38 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 
     sraRgnSubtract(updateRegion,updateCopyRegion);
 
+    /*
+     * Video is taken out of updateRegion and sent after everything else,
+     * or, if the client had a video frame too recently, left in
+     * modifiedRegion for a later update.
+     */
+
+    if (cl->screen->handleVideoRegions &&
+        (videoRegion = rfbGetVideoRegion(cl->screen)) != NULL) {
+        sraRgnAnd(videoRegion,updateRegion);
+        sraRgnSubtract(updateRegion,videoRegion);
+        if (sraRgnEmpty(videoRegion) || !rfbVideoFrameDue(cl)) {
+            rfbBool deferred = !sraRgnEmpty(videoRegion);
+
+            sraRgnDestroy(videoRegion);
+            videoRegion = NULL;
+            if (deferred && sraRgnEmpty(updateRegion) && sraRgnEmpty(updateCopyRegion) &&
+                (cl->enableCursorShapeUpdates ||
+                 (cl->cursorX == cl->screen->cursorX && cl->cursorY == cl->screen->cursorY)) &&
+                !sendCursorShape && !sendCursorPos && !sendKeyboardLedState &&
+                !sendSupportedMessages && !sendSupportedEncodings && !sendServerIdentity) {
+                /* nothing else to send, keep the request for the next frame */
+                sraRgnDestroy(updateRegion);
+                sraRgnDestroy(updateCopyRegion);
+                cl->videoFrameDeferred = TRUE;
+                UNLOCK(cl->updateMutex);
+                if(cl->screen->displayFinishedHook)
+                    cl->screen->displayFinishedHook(cl, TRUE);
+                return TRUE;
+            }
+        }
+    }
+
     /*
      * Finally we leave modifiedRegion to be the remainder (if any) of parts of
      * the screen which are modified but outside the requestedRegion.  We also
@@ -3307,8 +3801,12 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      sraRgnOr(cl->modifiedRegion,cl->copyRegion);
      sraRgnSubtract(cl->modifiedRegion,updateRegion);
      sraRgnSubtract(cl->modifiedRegion,updateCopyRegion);
+     if (videoRegion)
+         sraRgnSubtract(cl->modifiedRegion,videoRegion);
 
      sraRgnMakeEmpty(cl->requestedRegion);
+     if (cl->continuousUpdates)
+         sraRgnOr(cl->requestedRegion,cl->continuousRegion);
      sraRgnMakeEmpty(cl->copyRegion);
      cl->copyDX = 0;
      cl->copyDY = 0;
@@ -3332,101 +3830,33 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      */
     
     rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
-    if (cl->preferredEncoding == rfbEncodingCoRRE) {
-        nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-	    int rectsPerRow, rows;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
-	    rows = (h-1)/cl->correMaxHeight+1;
-	    nUpdateRegionRects += rectsPerRow*rows;
-        }
-	sraRgnReleaseIterator(i); i=NULL;
-    } else if (cl->preferredEncoding == rfbEncodingUltra) {
-        nUpdateRegionRects = 0;
-        
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-            nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
-          }
-        sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-    } else if (cl->preferredEncoding == rfbEncodingZlib) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-    } else if (cl->preferredEncoding == rfbEncodingTight) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    /* all of the video goes into one H.264 rect, covering its bounding box */
+    if (videoRegion && cl->useH264 &&
+        (videoH264 = rfbH264SetupRegion(cl, videoRegion, &h264Rect))) {
+        sraRegionPtr h264Region = sraRgnCreateRect(h264Rect.x1, h264Rect.y1,
+                                                   h264Rect.x2, h264Rect.y2);
+        sraRgnSubtract(updateRegion, h264Region);
+        /* all of the box is video now, also for the bounding box below */
+        sraRgnOr(videoRegion, h264Region);
+        sraRgnDestroy(h264Region);
+    }
 #endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
-    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
-	nUpdateRegionRects = 0;
 
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
+    /* Tight clients get it sharper where they work, see focus.c */
+    if (cl->screen->focusQuality)
+        nFocusZones = rfbFocusZones(cl, updateRegion, focusZones, focusLevels);
+    if (nFocusZones == 0) {
+        nUpdateRegionRects = rfbCountUpdateRects(cl, updateRegion);
     } else {
-        nUpdateRegionRects = sraRgnCountRects(updateRegion);
+        nUpdateRegionRects = 0;
+        for (k = 0; k < nFocusZones && nUpdateRegionRects != 0xFFFF; k++) {
+            int n = rfbCountUpdateRects(cl, focusZones[k]);
+            nUpdateRegionRects = n == 0xFFFF ? 0xFFFF : nUpdateRegionRects + n;
+        }
     }
 
+    rfbTraceNextUpdate(cl);
     fu->type = rfbFramebufferUpdate;
     if (nUpdateRegionRects != 0xFFFF) {
 	if(cl->screen->maxRectsPerUpdate>0
@@ -3450,8 +3880,22 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	    sraRegion* newUpdateRegion = sraRgnBBox(updateRegion);
 	    sraRgnDestroy(updateRegion);
 	    updateRegion = newUpdateRegion;
+	    if (videoRegion)
+		sraRgnSubtract(updateRegion,videoRegion);
 	    nUpdateRegionRects = sraRgnCountRects(updateRegion);
 	}
+	if (videoRegion) {
+	    int nVideoRects;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+	    if (videoH264)
+		nVideoRects = 1;
+	    else
+#endif
+	    nVideoRects = rfbCountUpdateRects(cl, videoRegion);
+	    nUpdateRegionRects = nVideoRects == 0xFFFF ? 0xFFFF : nUpdateRegionRects + nVideoRects;
+	}
+    }
+    if (nUpdateRegionRects != 0xFFFF) {
 	fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
 					   nUpdateRegionRects +
 					   !!sendCursorShape + !!sendCursorPos + !!sendKeyboardLedState +
@@ -3496,85 +3940,47 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	        goto updateFailed;
     }
 
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-        int x = rect.x1;
-        int y = rect.y1;
-        int w = rect.x2 - x;
-        int h = rect.y2 - y;
-
-        /* We need to count the number of rects in the scaled screen */
-        if (cl->screen!=cl->scaledScreen)
-            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-
-        switch (cl->preferredEncoding) {
-	case -1:
-        case rfbEncodingRaw:
-            if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingRRE:
-            if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingCoRRE:
-            if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-        case rfbEncodingHextile:
-            if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingUltra:
-            if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
+    if (nFocusZones > 0) {
+        for (k = 0; k < nFocusZones; k++)
+            if (!rfbSendRegionAtLevel(cl, focusZones[k], focusLevels[k], TRUE))
                 goto updateFailed;
-            break;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-	case rfbEncodingZlib:
-	    if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-       case rfbEncodingZRLE:
-       case rfbEncodingZYWRLE:
-           if (!rfbSendRectEncodingZRLE(cl, x, y, w, h))
-	       goto updateFailed;
-           break;
+    } else if (!rfbSendUpdateRegion(cl, updateRegion))
+        goto updateFailed;
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    if (videoH264) {
+        cl->compressedUpdate = TRUE;
+        if (!rfbSendRectEncodingH264(cl, h264Rect.x1, h264Rect.y1,
+                                     h264Rect.x2 - h264Rect.x1, h264Rect.y2 - h264Rect.y1))
+            goto updateFailed;
+    } else
 #endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
-	case rfbEncodingTight:
-	    if (!rfbSendRectEncodingTight(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#ifdef LIBVNCSERVER_HAVE_LIBPNG
-	case rfbEncodingTightPng:
-	    if (!rfbSendRectEncodingTightPng(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#endif
-#endif
-        }
-    }
-    if (i) {
-        sraRgnReleaseIterator(i);
-        i = NULL;
-    }
+    if (videoRegion && !rfbSendRegionAtLevel(cl, videoRegion, cl->screen->videoQualityLevel, FALSE))
+        goto updateFailed;
 
     if ( nUpdateRegionRects == 0xFFFF &&
 	 !rfbSendLastRectMarker(cl) )
 	    goto updateFailed;
 
+    if (cl->continuousUpdates && cl->useFence && !rfbAppendFencePing(cl))
+        goto updateFailed;
+
     if (!rfbSendUpdateBuf(cl)) {
 updateFailed:
 	result = FALSE;
     }
+    cl->compressedUpdate = FALSE;
 
     if (!cl->enableCursorShapeUpdates) {
       rfbHideCursor(cl);
     }
 
-    if(i)
-        sraRgnReleaseIterator(i);
     sraRgnDestroy(updateRegion);
     sraRgnDestroy(updateCopyRegion);
+    if (videoRegion)
+        sraRgnDestroy(videoRegion);
+    for (k = 0; k < nFocusZones; k++)
+        sraRgnDestroy(focusZones[k]);
 
     if(cl->screen->displayFinishedHook)
       cl->screen->displayFinishedHook(cl, result);
@@ -3582,6 +3988,44 @@ updateFailed:
 }
 
 
+/*
+ * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
+ * the RFB client.
+ * givenUpdateRegion is not changed.
+ *
+ * The update reaches the socket in pieces: the header, flushes of a full
+ * updateBuf and the rest. The socket stays corked meanwhile, so these go
+ * out in full segments instead of one small one each. Messages sent
+ * outside of updates, like Bell or ServerCutText, are never held back.
+ */
+
+rfbBool
+rfbSendFramebufferUpdate(rfbClientPtr cl,
+                         sraRegionPtr givenUpdateRegion)
+{
+    rfbBool result;
+    int sentBefore;
+    uint32_t seqBefore = cl->traceUpdateSeq;
+    uint64_t traceStart;
+
+    /* over its share of a shared uplink it waits, see uplink.c */
+    if (rfbUplinkDelay(cl) > 0)
+        return TRUE;
+    sentBefore = rfbStatGetSentBytes(cl);
+    traceStart = rfbTraceActive ? rfbTraceNow() : 0;
+
+    rfbCorkSock(cl, TRUE);
+    result = sendFramebufferUpdate(cl, givenUpdateRegion);
+    rfbCorkSock(cl, FALSE);
+
+    rfbUplinkCharge(cl, rfbStatGetSentBytes(cl) - sentBefore);
+    if (traceStart && cl->traceUpdateSeq != seqBefore)
+        rfbTraceSlice("server", "update", traceStart, cl->traceUpdateId, 't', NULL,
+                      0, 0, 0, 0, rfbStatGetSentBytes(cl) - sentBefore);
+    return result;
+}
+
+
 /*
  * Send the copy region as a string of CopyRect encoded rectangles.
  * The only slightly tricky thing is that we should send the messages in
@@ -0,0 +1,399 @@
+/*
+ * shmimport.c - serve a framebuffer another process renders into.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * The screen's framebuffer points into the producer's segment, so frames
+ * are never copied. The producer's side is described in rfb/rfbshm.h.
+ *
+ * The producer can write the header at any time, so its geometry, pixel
+ * format and buffer offsets are copied when the segment is imported and
+ * only the copies are used. The segment has to be a memfd sealed against
+ * shrinking, or a producer truncating it would make us crash on the next
+ * access.
+ *
+ * The damage ring is drained where the event loop waits anyway: in
+ * rfbCheckFds(), or in the listener thread when running in the
+ * background. A flip only swaps screen->frameBuffer, with every client's
+ * sendMutex held like rfbNewFramebuffer() does, so once front tells the
+ * producer it may draw into the old buffer, no encoder reads it any more.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* F_GET_SEALS */
+#endif
+#include <rfb/rfb.h>
+#include <rfb/rfbshm.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#include <errno.h>
+#include <string.h>
+#if defined(LIBVNCSERVER_HAVE_MMAP) && !defined(WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef F_GET_SEALS
+#define RFB_HAVE_SHM_IMPORT
+#endif
+#endif
+
+#ifdef RFB_HAVE_SHM_IMPORT
+
+#ifdef __GNUC__
+#define SHM_BARRIER() __sync_synchronize()
+#else
+#define SHM_BARRIER() do { } while (0)
+#endif
+
+struct _rfbShmImport {
+    int fd;
+    int eventFd;
+    rfbShmImportHeader *header;
+    size_t mapSize;
+    /* checked copies of the header */
+    char *buffer[2];
+    uint32_t width, height, stride, bitsPerPixel;
+    rfbPixelFormat format;
+    /* ours, header->tail only tells the producer */
+    uint32_t tail;
+    uint32_t overflows;
+    /* damage to the back buffer, shown with the next flip */
+    sraRegionPtr pending;
+};
+
+
+/* copies what the header says into import, then checks the copy */
+static rfbBool
+readHeader(rfbShmImport *import, rfbShmImportHeader *header, size_t size)
+{
+    uint64_t offset[2], bufferSize;
+    uint32_t headerSize;
+    int i;
+
+    if (size < sizeof(rfbShmImportHeader) || header->magic != RFB_SHM_IMPORT_MAGIC ||
+        header->version != RFB_SHM_IMPORT_VERSION) {
+        rfbErr("rfbShmImportFrameBuffer: not a framebuffer segment\n");
+        return FALSE;
+    }
+
+    headerSize = header->headerSize;
+    import->width = header->width;
+    import->height = header->height;
+    import->stride = header->stride;
+    import->bitsPerPixel = header->bitsPerPixel;
+    offset[0] = header->bufferOffset[0];
+    offset[1] = header->bufferOffset[1];
+    import->format.bitsPerPixel = header->bitsPerPixel;
+    import->format.depth = header->depth;
+    import->format.bigEndian = header->bigEndian;
+    import->format.trueColour = header->trueColour;
+    import->format.redMax = header->redMax;
+    import->format.greenMax = header->greenMax;
+    import->format.blueMax = header->blueMax;
+    import->format.redShift = header->redShift;
+    import->format.greenShift = header->greenShift;
+    import->format.blueShift = header->blueShift;
+
+    if ((import->bitsPerPixel != 8 && import->bitsPerPixel != 16 &&
+         import->bitsPerPixel != 32) || !import->format.trueColour) {
+        rfbErr("rfbShmImportFrameBuffer: unsupported pixel format\n");
+        return FALSE;
+    }
+    if (import->width == 0 || import->height == 0 || import->width > 0xffff ||
+        import->height > 0xffff ||
+        import->stride < (uint64_t)import->width * import->bitsPerPixel / 8) {
+        rfbErr("rfbShmImportFrameBuffer: bad size %ux%u, stride %u\n",
+               import->width, import->height, import->stride);
+        return FALSE;
+    }
+    bufferSize = (uint64_t)import->stride * import->height;
+    for (i = 0; i < 2; i++) {
+        if (offset[i] < headerSize || offset[i] > size || bufferSize > size - offset[i] ||
+            offset[i] % 4 != 0) {
+            rfbErr("rfbShmImportFrameBuffer: buffer %d is outside the segment\n", i);
+            return FALSE;
+        }
+        import->buffer[i] = (char *)header + offset[i];
+    }
+    return TRUE;
+}
+
+
+/* a producer must not be able to take pages away from under us */
+static rfbBool
+checkSeals(int fd)
+{
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    if (seals < 0) {
+        rfbLogPerror("rfbShmImportFrameBuffer: F_GET_SEALS");
+        return FALSE;
+    }
+    if (!(seals & F_SEAL_SHRINK)) {
+        rfbErr("rfbShmImportFrameBuffer: the segment is not sealed with F_SEAL_SHRINK\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* takes over the producer's pixel format, which may well differ from ours */
+static void
+setFormat(rfbScreenInfoPtr screen, rfbShmImport *import)
+{
+    rfbPixelFormat *format = &screen->serverFormat;
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr cl;
+
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)))
+        LOCK(cl->sendMutex);
+    rfbReleaseClientIterator(iterator);
+
+    screen->paddedWidthInBytes = import->stride;
+    screen->depth = import->format.depth;
+    format->depth = import->format.depth;
+    format->bigEndian = import->format.bigEndian;
+    format->trueColour = TRUE;
+    format->redMax = import->format.redMax;
+    format->greenMax = import->format.greenMax;
+    format->blueMax = import->format.blueMax;
+    format->redShift = import->format.redShift;
+    format->greenShift = import->format.greenShift;
+    format->blueShift = import->format.blueShift;
+
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator))) {
+        screen->setTranslateFunction(cl);
+        UNLOCK(cl->sendMutex);
+    }
+    rfbReleaseClientIterator(iterator);
+}
+
+
+static void
+freeImport(rfbScreenInfoPtr screen, rfbShmImport *import)
+{
+    FD_CLR(import->eventFd, &screen->allFds);
+    if (screen->frameBuffer == import->buffer[0] ||
+        screen->frameBuffer == import->buffer[1])
+        screen->frameBuffer = NULL;
+    munmap(import->header, import->mapSize);
+    close(import->eventFd);
+    close(import->fd);
+    sraRgnDestroy(import->pending);
+    free(import);
+}
+
+
+rfbBool
+rfbShmImportFrameBuffer(rfbScreenInfoPtr screen, int fd, int eventFd)
+{
+    rfbShmImport *import, *old;
+    rfbShmImportHeader *header;
+    struct stat st;
+    void *map;
+
+    if (!checkSeals(fd))
+        return FALSE;
+    if (fstat(fd, &st) < 0) {
+        rfbLogPerror("rfbShmImportFrameBuffer: fstat");
+        return FALSE;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        rfbLogPerror("rfbShmImportFrameBuffer: mmap");
+        return FALSE;
+    }
+    header = (rfbShmImportHeader *)map;
+
+    import = (rfbShmImport *)calloc(1, sizeof(rfbShmImport));
+    if (import == NULL) {
+        munmap(map, (size_t)st.st_size);
+        return FALSE;
+    }
+    if (!readHeader(import, header, (size_t)st.st_size)) {
+        munmap(map, (size_t)st.st_size);
+        free(import);
+        return FALSE;
+    }
+    import->header = header;
+    import->mapSize = (size_t)st.st_size;
+    import->fd = dup(fd);
+    import->eventFd = dup(eventFd);
+    if (import->fd < 0 || import->eventFd < 0) {
+        rfbLogPerror("rfbShmImportFrameBuffer: dup");
+        if (import->fd >= 0)
+            close(import->fd);
+        if (import->eventFd >= 0)
+            close(import->eventFd);
+        munmap(map, (size_t)st.st_size);
+        free(import);
+        return FALSE;
+    }
+    /* drained until there is nothing left, which must not block */
+    fcntl(import->eventFd, F_SETFL, fcntl(import->eventFd, F_GETFL) | O_NONBLOCK);
+    import->tail = header->tail;
+    import->overflows = header->overflows;
+    import->pending = sraRgnCreate();
+
+    old = screen->shmImport;
+    screen->shmImport = import;
+
+    header->front &= 1;
+    rfbNewFramebuffer(screen, import->buffer[header->front & 1],
+                      import->width, import->height, 8, 3, import->bitsPerPixel / 8);
+    setFormat(screen, import);
+    if (old != NULL)
+        freeImport(screen, old);
+
+    FD_SET(import->eventFd, &screen->allFds);
+    screen->maxFd = rfbMax(screen->maxFd, import->eventFd);
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    /* a listener thread has to select() on the eventfd as well */
+    if (screen->backgroundLoop && screen->pipe_notify_listener_thread[1] != -1 &&
+        write(screen->pipe_notify_listener_thread[1], "\x00", 1) < 0)
+        rfbLogPerror("rfbShmImportFrameBuffer: waking up the listener thread");
+#endif
+
+    rfbLog("Serving a %ux%u framebuffer from another process\n", import->width, import->height);
+    /* the producer may have started already */
+    rfbShmImportProcess(screen, NULL);
+    return TRUE;
+}
+
+
+int
+rfbShmImportEventFd(rfbScreenInfoPtr screen)
+{
+    return screen->shmImport ? screen->shmImport->eventFd : -1;
+}
+
+
+/* makes buffer index the front one */
+static void
+flip(rfbScreenInfoPtr screen, rfbShmImport *import, uint32_t index)
+{
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr cl;
+    char *buffer = import->buffer[index & 1];
+
+    if (screen->frameBuffer == buffer)
+        return;
+
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)))
+        LOCK(cl->sendMutex);
+    rfbReleaseClientIterator(iterator);
+    LOCK(screen->cursorMutex);
+
+    screen->frameBuffer = buffer;
+
+    UNLOCK(screen->cursorMutex);
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)))
+        UNLOCK(cl->sendMutex);
+    rfbReleaseClientIterator(iterator);
+}
+
+
+rfbBool
+rfbShmImportProcess(rfbScreenInfoPtr screen, fd_set *fds)
+{
+    rfbShmImport *import = screen->shmImport;
+    rfbShmImportHeader *header;
+    uint32_t head, tail;
+    uint64_t count;
+    rfbBool signalled;
+
+    if (import == NULL)
+        return FALSE;
+    signalled = fds != NULL && FD_ISSET(import->eventFd, fds);
+    if (signalled)
+        while (read(import->eventFd, &count, sizeof(count)) > 0)
+            ;
+
+    header = import->header;
+    head = header->head;
+    SHM_BARRIER();
+    /* a broken producer cannot have written more than the ring holds */
+    if (head - import->tail > RFB_SHM_RING_SLOTS)
+        head = import->tail + RFB_SHM_RING_SLOTS;
+
+    for (tail = import->tail; tail != head; tail++) {
+        rfbShmRect r = header->ring[tail % RFB_SHM_RING_SLOTS];
+
+        if (r.w == 0 && r.h == 0) {
+            if (import->overflows != header->overflows) {
+                import->overflows = header->overflows;
+                sraRgnDestroy(import->pending);
+                import->pending = sraRgnCreateRect(0, 0, screen->width, screen->height);
+            }
+            flip(screen, import, r.x);
+            if (!sraRgnEmpty(import->pending)) {
+                rfbMarkRegionAsModified(screen, import->pending);
+                sraRgnMakeEmpty(import->pending);
+            }
+            SHM_BARRIER();
+            header->front = r.x & 1;
+        } else {
+            sraRegionPtr rect = sraRgnCreateRect(r.x, r.y, r.x + r.w, r.y + r.h);
+            sraRegionPtr screenRect = sraRgnCreateRect(0, 0, screen->width, screen->height);
+
+            sraRgnAnd(rect, screenRect);
+            sraRgnOr(import->pending, rect);
+            sraRgnDestroy(screenRect);
+            sraRgnDestroy(rect);
+        }
+    }
+
+    SHM_BARRIER();
+    import->tail = header->tail = tail;
+
+    return signalled;
+}
+
+
+void
+rfbShmImportFree(rfbScreenInfoPtr screen)
+{
+    if (screen->shmImport == NULL)
+        return;
+    freeImport(screen, screen->shmImport);
+    screen->shmImport = NULL;
+}
+
+#else
+
+rfbBool
+rfbShmImportFrameBuffer(rfbScreenInfoPtr screen, int fd, int eventFd)
+{
+    rfbErr("rfbShmImportFrameBuffer: not supported on this platform\n");
+    return FALSE;
+}
+
+
+int rfbShmImportEventFd(rfbScreenInfoPtr screen) { return -1; }
+rfbBool rfbShmImportProcess(rfbScreenInfoPtr screen, fd_set *fds) { return FALSE; }
+void rfbShmImportFree(rfbScreenInfoPtr screen) { }
+
+#endif /* RFB_HAVE_SHM_IMPORT */
@@ -97,6 +97,8 @@ int deny_severity=LOG_WARNING;
 #endif
 
 #include "sockets.h"
+#include "private.h"
+#include "trace.h"
 
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
@@ -387,6 +389,9 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 
 	result += nfds;
 
+	if (rfbShmImportProcess(rfbScreen, &fds) && --nfds == 0)
+	    return result;
+
 	if (rfbScreen->listenSock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->listenSock, &fds)) {
 
 	    if (!rfbProcessNewConnection(rfbScreen))
@@ -877,6 +882,7 @@ rfbWriteExact(rfbClientPtr cl,
             return 0;
 
         } else {
+            uint64_t traceStart;
 #ifdef WIN32
 			errno = WSAGetLastError();
 #endif
@@ -896,7 +902,11 @@ rfbWriteExact(rfbClientPtr cl,
             FD_SET(sock, &fds);
             tv.tv_sec = 5;
             tv.tv_usec = 0;
+            traceStart = rfbTraceActive ? rfbTraceNow() : 0;
             n = select(sock+1, NULL, &fds, NULL /* &fds */, &tv);
+            if (traceStart)
+                rfbTraceSlice("server", "write stall", traceStart, cl->traceUpdateId, 0, NULL,
+                              0, 0, 0, 0, len);
 	    if (n < 0) {
 #ifdef WIN32
                 errno=WSAGetLastError();
@@ -1188,3 +1198,28 @@ rfbSetNonBlocking(rfbSocket sock)
 {
     return sock_set_nonblocking(sock, TRUE, rfbLog);
 }
+
+/*
+ * rfbCorkSock holds back partial segments while an update is written in
+ * pieces, and sends what is left at once when the cork is taken out
+ * again. Does nothing where there is no TCP_CORK or a working TCP_NOPUSH,
+ * or on sockets other than TCP.
+ */
+void
+rfbCorkSock(rfbClientPtr cl, rfbBool cork)
+{
+#if defined(TCP_CORK) || (defined(TCP_NOPUSH) && !defined(__APPLE__))
+    int value = cork ? 1 : 0;
+
+    if (cork == cl->corked || cl->sock == RFB_INVALID_SOCKET ||
+        (cork && !cl->screen->corkUpdates))
+        return;
+#ifdef TCP_CORK
+    if (setsockopt(cl->sock, IPPROTO_TCP, TCP_CORK, (const char *)&value, sizeof(value)) == 0)
+#else
+    /* unlike on macOS, clearing it pushes what is pending */
+    if (setsockopt(cl->sock, IPPROTO_TCP, TCP_NOPUSH, (const char *)&value, sizeof(value)) == 0)
+#endif
+        cl->corked = cork;
+#endif
+}
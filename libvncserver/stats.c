@@ -25,6 +25,8 @@
  */
 
 #include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
 
 char *messageNameServer2Client(uint32_t type, char *buf, int len);
 char *messageNameClient2Server(uint32_t type, char *buf, int len);
@@ -55,6 +57,8 @@ char *messageNameServer2Client(uint32_t type, char *buf, int len) {
     case rfbTextChat:                 snprintf(buf, len, "TextChat"); break;
     case rfbPalmVNCReSizeFrameBuffer: snprintf(buf, len, "PalmVNCReSize"); break;
     case rfbXvp:                      snprintf(buf, len, "XvpServerMessage"); break;
+    case rfbEndOfContinuousUpdates:   snprintf(buf, len, "EndOfContinuousUpdates"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
     default:
         snprintf(buf, len, "svr2cli-0x%08X", 0xFF);
     }
@@ -79,6 +83,8 @@ char *messageNameClient2Server(uint32_t type, char *buf, int len) {
     case rfbPalmVNCSetScaleFactor:    snprintf(buf, len, "PalmVNCSetScale"); break;
     case rfbXvp:                      snprintf(buf, len, "XvpClientMessage"); break;
     case rfbSetDesktopSize:           snprintf(buf, len, "SetDesktopSize"); break;
+    case rfbEnableContinuousUpdates:  snprintf(buf, len, "EnableContinuousUpdates"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
     default:
         snprintf(buf, len, "cli2svr-0x%08X", type);
 
@@ -106,6 +112,7 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingUltra:              snprintf(buf, len, "ultra");       break;
     case rfbEncodingZRLE:               snprintf(buf, len, "ZRLE");        break;
     case rfbEncodingZYWRLE:             snprintf(buf, len, "ZYWRLE");      break;
+    case rfbEncodingH264:               snprintf(buf, len, "H.264");       break;
     case rfbEncodingCache:              snprintf(buf, len, "cache");       break;
     case rfbEncodingCacheEnable:        snprintf(buf, len, "cacheEnable"); break;
     case rfbEncodingXOR_Zlib:           snprintf(buf, len, "xorZlib");     break;
@@ -128,6 +135,8 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingSupportedMessages:  snprintf(buf, len, "SupportedMessage");  break;
     case rfbEncodingSupportedEncodings: snprintf(buf, len, "SupportedEncoding"); break;
     case rfbEncodingServerIdentity:     snprintf(buf, len, "ServerIdentify");    break;
+    case rfbEncodingFence:              snprintf(buf, len, "Fence");       break;
+    case rfbEncodingContinuousUpdates:  snprintf(buf, len, "ContinuousUpdates"); break;
 
     /* The following lookups do not report in stats */
     case rfbEncodingCompressLevel0: snprintf(buf, len, "CompressLevel0");  break;
@@ -352,6 +361,95 @@ int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type)
   return 0;
 }
 
+int rfbStatGetRtt(rfbClientPtr cl)
+{
+  if (cl==NULL) return -1;
+  return cl->rttMs;
+}
+
+int rfbStatGetMinRtt(rfbClientPtr cl)
+{
+  if (cl==NULL) return -1;
+  return cl->minRttMs;
+}
+
+unsigned long rfbStatGetThroughput(rfbClientPtr cl)
+{
+  if (cl==NULL) return 0;
+  return cl->throughput;
+}
+
+int rfbStatGetBytesInFlight(rfbClientPtr cl)
+{
+  int bytes;
+  if (cl==NULL) return 0;
+  LOCK(cl->updateMutex);
+  bytes = (int)rfbFenceBytesInFlight(cl);
+  UNLOCK(cl->updateMutex);
+  return bytes;
+}
+
+
+int rfbStatGetDamageHeatmap(rfbScreenInfoPtr rfbScreen, uint32_t* counts, int maxTiles, int* cols, int* rows)
+{
+    rfbVideoTracker *tracker;
+    int i, n;
+
+    if (rfbScreen==NULL || (tracker = rfbScreen->videoTracker)==NULL) return 0;
+    LOCK(tracker->mutex);
+    n = tracker->cols * tracker->rows;
+    for (i = 0; counts!=NULL && i < n && i < maxTiles; i++)
+        counts[i] = tracker->tiles[i].count;
+    if (cols) *cols = tracker->cols;
+    if (rows) *rows = tracker->rows;
+    UNLOCK(tracker->mutex);
+    return n;
+}
+
+
+/* one character per tile, ' ' for never changed to '@' for the hottest */
+void rfbPrintDamageHeatmap(rfbScreenInfoPtr rfbScreen)
+{
+    static const char shades[] = " .:-=+*#%@";
+    rfbVideoTracker *tracker;
+    sraRegionPtr videoRegion;
+    uint32_t maxCount = 0;
+    char *line;
+    int x, y, n;
+
+    if (rfbScreen==NULL || (tracker = rfbScreen->videoTracker)==NULL) return;
+
+    /* brings the video flags up to date */
+    if ((videoRegion = rfbGetVideoRegion(rfbScreen)) != NULL)
+        sraRgnDestroy(videoRegion);
+
+    LOCK(tracker->mutex);
+    for (n = 0; n < tracker->cols * tracker->rows; n++)
+        if (tracker->tiles[n].count > maxCount)
+            maxCount = tracker->tiles[n].count;
+    if ((line = malloc(tracker->cols + 1)) == NULL) {
+        UNLOCK(tracker->mutex);
+        return;
+    }
+    rfbLog("Damage heat map, %dx%d tiles of %d pixels, V = video, max %u:\n",
+           tracker->cols, tracker->rows, RFB_DAMAGE_TILE_SIZE, maxCount);
+    for (y = 0; y < tracker->rows; y++) {
+        for (x = 0; x < tracker->cols; x++) {
+            rfbDamageTile *tile = &tracker->tiles[y * tracker->cols + x];
+            if (tile->video)
+                line[x] = 'V';
+            else if (maxCount == 0)
+                line[x] = shades[0];
+            else
+                line[x] = shades[(uint64_t)tile->count * (sizeof(shades) - 2) / maxCount];
+        }
+        line[x] = '\0';
+        rfbLog(" |%s|\n", line);
+    }
+    free(line);
+    UNLOCK(tracker->mutex);
+}
+
 
 
 
@@ -476,6 +574,9 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
-      
+
+    if (cl->rttMs >= 0)
+        rfbLog("Round trip %d ms (at least %d ms), throughput %lu bytes/s\n",
+            cl->rttMs, cl->minRttMs, cl->throughput);
 } 
 
@@ -128,6 +128,38 @@ void rfbFreeTightData (rfbClientPtr cl)
 }
 
 
+/*
+ * Frees the zlib streams as well, which the client is asked to reset
+ * by the next rect.
+ */
+
+void rfbReleaseTightData (rfbClientPtr cl)
+{
+    int i;
+
+    rfbFreeTightData(cl);
+    for (i = 0; i < 4; i++) {
+        if (cl->zsActive[i]) {
+            deflateEnd(&cl->zsStruct[i]);
+            cl->zsActive[i] = FALSE;
+            cl->tightResetStreams |= 1 << i;
+        }
+    }
+}
+
+
+/* Compression control byte, with the pending stream resets. */
+
+static char
+TightControl(rfbClientPtr cl, int control)
+{
+    char c = (char)(control << 4 | cl->tightResetStreams);
+
+    cl->tightResetStreams = 0;
+    return c;
+}
+
+
 /* Prototypes for static functions. */
 
 static rfbBool SendRectEncodingTight(rfbClientPtr cl, int x, int y,
@@ -789,7 +821,7 @@ SendSolidRect(rfbClientPtr cl)
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
+    cl->updateBuf[cl->ublen++] = TightControl(cl, rfbTightFill);
     memcpy (&cl->updateBuf[cl->ublen], cl->beforeEncBuf, len);
     cl->ublen += len;
 
@@ -831,9 +863,9 @@ SendMonoRect(rfbClientPtr cl,
     if (tightConf[cl->tightCompressLevel].monoZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+            TightControl(cl, rfbTightNoZlib | rfbTightExplicitFilter);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+        cl->updateBuf[cl->ublen++] = TightControl(cl, streamId | rfbTightExplicitFilter);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
     cl->updateBuf[cl->ublen++] = 1;
 
@@ -908,9 +940,9 @@ SendIndexedRect(palettePtr palette,
     if (tightConf[cl->tightCompressLevel].idxZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+            TightControl(cl, rfbTightNoZlib | rfbTightExplicitFilter);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+        cl->updateBuf[cl->ublen++] = TightControl(cl, streamId | rfbTightExplicitFilter);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
     cl->updateBuf[cl->ublen++] = (char)(palette->numColors - 1);
 
@@ -983,9 +1015,9 @@ SendFullColorRect(rfbClientPtr cl,
 
     if (tightConf[cl->tightCompressLevel].rawZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
-        cl->updateBuf[cl->ublen++] = (char)(rfbTightNoZlib << 4);
+        cl->updateBuf[cl->ublen++] = TightControl(cl, rfbTightNoZlib);
     else
-        cl->updateBuf[cl->ublen++] = 0x00;  /* stream id = 0, no flushing, no filter */
+        cl->updateBuf[cl->ublen++] = TightControl(cl, 0);  /* stream id = 0, no flushing, no filter */
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
     if (cl->tightUsePixelFormat24) {
@@ -1023,9 +1055,9 @@ CompressData(rfbClientPtr cl,
 
     /* Initialize compression stream if needed. */
     if (!cl->zsActive[streamId]) {
-        pz->zalloc = Z_NULL;
-        pz->zfree = Z_NULL;
-        pz->opaque = Z_NULL;
+        pz->zalloc = rfbZlibAlloc;
+        pz->zfree = rfbZlibFree;
+        pz->opaque = (voidpf)cl;
 
         err = deflateInit2 (pz, zlibLevel, Z_DEFLATED, MAX_WBITS,
                             MAX_MEM_LEVEL, zlibStrategy);
@@ -1639,7 +1671,7 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
+    cl->updateBuf[cl->ublen++] = TightControl(cl, rfbTightJpeg);
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
     return rfbSendCompressedDataTight(cl, cl->afterEncBuf, (int)size);
@@ -1876,7 +1908,7 @@ static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightPng << 4);
+    cl->updateBuf[cl->ublen++] = TightControl(cl, rfbTightPng);
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
     /* rfbLog("<< SendPngRect\n"); */
@@ -0,0 +1,439 @@
+/*
+ * filelistcache.c - cache of FileListData messages.
+ *
+ * Browsing a directory with the TightVNC file transfer dialog sends the
+ * same FileListRequest over and over, and every one of them used to cost
+ * a readdir() plus one stat() per entry. Here the finished response
+ * message is kept per (path, flags) and handed out again as long as the
+ * directory did not change.
+ *
+ * On Linux a directory is watched with inotify from the moment its listing
+ * is first built; any event on the watch drops the cached listings of that
+ * directory. A watch is shared by the listings with and without hidden
+ * files and by the requests building them, and removed once none of them
+ * needs it any more. Pending events are drained (non-blocking) on every
+ * lookup, so no extra thread is needed. Elsewhere the directory's mtime is compared instead, and listings
+ * of directories modified within the current second are not cached since
+ * a second change in the same second would go unnoticed.
+ */
+
+#include <rfb/rfbconfig.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef LIBVNCSERVER_HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <rfb/rfb.h>
+#include "rfbtightproto.h"
+#include "filetransfermsg.h"
+#include "filelistcache.h"
+
+#define FILE_LIST_CACHE_SIZE 32
+
+#if !defined(__GNUC__) && !defined(_MSC_VER)
+#define __FUNCTION__ "unknown"
+#endif
+
+#ifdef LIBVNCSERVER_HAVE_SYS_INOTIFY_H
+#define FILE_LIST_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+			      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+#ifdef LIBVNCSERVER_HAVE_SYS_INOTIFY_H
+/*
+ * One inotify watch, shared by all cache entries and tickets of the same
+ * directory and removed when the last of them lets go of it.
+ */
+typedef struct _FileListWatch {
+	struct _FileListWatch* next;
+	int wd;			/* -1 once the kernel dropped the watch */
+	unsigned long generation;	/* bumped for every event on the watch */
+	int refs;
+} FileListWatch;
+#endif
+
+typedef struct _FileListCacheEntry {
+	char* path;
+	char flags;
+	FileListCacheTicket ticket;
+	unsigned long lastUsed;
+	FileTransferMsg msg;
+} FileListCacheEntry;
+
+static pthread_mutex_t fileListCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static FileListCacheEntry fileListCache[FILE_LIST_CACHE_SIZE];
+static unsigned long fileListCacheClock = 0;
+#ifdef LIBVNCSERVER_HAVE_SYS_INOTIFY_H
+static int inotifyFD = -1;
+static FileListWatch* fileListWatches = NULL;
+#endif
+
+
+static FileTransferMsg
+CopyFileTransferMsg(FileTransferMsg ftm)
+{
+	FileTransferMsg copy;
+
+	memset(&copy, 0, sizeof(FileTransferMsg));
+	if((ftm.data == NULL) || (ftm.length == 0))
+		return copy;
+
+	if((copy.data = (char*) malloc(ftm.length)) == NULL)
+		return copy;
+
+	memcpy(copy.data, ftm.data, ftm.length);
+	copy.length = ftm.length;
+	return copy;
+}
+
+
+#ifdef LIBVNCSERVER_HAVE_SYS_INOTIFY_H
+
+static FileListWatch*
+FindFileListWatch(int wd)
+{
+	FileListWatch* watch = NULL;
+
+	for(watch = fileListWatches; watch != NULL; watch = watch->next)
+		if(watch->wd == wd)
+			return watch;
+
+	return NULL;
+}
+
+
+static void
+ReleaseFileListWatch(FileListWatch* watch)
+{
+	FileListWatch** link = &fileListWatches;
+
+	if((watch == NULL) || (--watch->refs > 0))
+		return;
+
+	if(watch->wd != -1)
+		inotify_rm_watch(inotifyFD, watch->wd);
+
+	while(*link != watch)
+		link = &(*link)->next;
+	*link = watch->next;
+	free(watch);
+}
+
+
+/*
+ * Watches path from now on, so any change after this call is noticed.
+ * The ticket holds a reference to the watch until it is dropped or
+ * handed over to a cache entry.
+ */
+
+static void
+TakeFileListTicket(char* path, FileListCacheTicket* ticket)
+{
+	FileListWatch* watch = NULL;
+	int wd = -1;
+
+	memset(ticket, 0, sizeof(FileListCacheTicket));
+	ticket->stamp = -1;
+
+	if(inotifyFD == -1) {
+		if((inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+			rfbLog("File [%s]: Method [%s]: inotify is not available, "
+					"file lists are not cached\n", __FILE__, __FUNCTION__);
+			return;
+		}
+	}
+
+	if((wd = inotify_add_watch(inotifyFD, path, FILE_LIST_WATCH_MASK)) == -1)
+		return;
+
+	/* the kernel hands out the same descriptor for the same directory */
+	if((watch = FindFileListWatch(wd)) == NULL) {
+		if((watch = (FileListWatch*) calloc(1, sizeof(FileListWatch))) == NULL) {
+			inotify_rm_watch(inotifyFD, wd);
+			return;
+		}
+		watch->wd = wd;
+		watch->next = fileListWatches;
+		fileListWatches = watch;
+	}
+	watch->refs++;
+
+	ticket->stamp = wd;
+	ticket->watch = watch;
+	ticket->generation = watch->generation;
+}
+
+
+static rfbBool
+IsFileListTicketValid(FileListCacheTicket* ticket)
+{
+	return (ticket->watch != NULL) && (ticket->watch->wd != -1) &&
+		(ticket->watch->generation == ticket->generation);
+}
+
+
+static void
+ReturnFileListTicket(FileListCacheTicket* ticket)
+{
+	ReleaseFileListWatch(ticket->watch);
+	ticket->watch = NULL;
+	ticket->stamp = -1;
+}
+
+
+static void
+FreeCacheEntry(FileListCacheEntry* entry)
+{
+	ReturnFileListTicket(&entry->ticket);
+	free(entry->path);
+	FreeFileTransferMsg(entry->msg);
+	memset(entry, 0, sizeof(FileListCacheEntry));
+}
+
+
+static void
+DrainFileListEvents()
+{
+	union {
+		struct inotify_event ev;
+		char buf[4096];
+	} events;
+	struct inotify_event* ev = NULL;
+	FileListWatch* watch = NULL;
+	ssize_t n = 0;
+	char* p = NULL;
+	int i;
+
+	if(inotifyFD == -1)
+		return;
+
+	while((n = read(inotifyFD, events.buf, sizeof(events.buf))) > 0) {
+		for(p = events.buf; p < events.buf + n;
+		    p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event*) p;
+			if((watch = FindFileListWatch(ev->wd)) == NULL)
+				continue;
+
+			/* tickets of this directory handed out so far are stale */
+			watch->generation++;
+			if(ev->mask & IN_IGNORED)
+				watch->wd = -1;
+
+			for(i = 0; i < FILE_LIST_CACHE_SIZE; i++)
+				if((fileListCache[i].path != NULL) &&
+				   (fileListCache[i].ticket.watch == watch))
+					FreeCacheEntry(&fileListCache[i]);
+		}
+	}
+}
+
+
+static rfbBool
+IsFileListEntryValid(FileListCacheEntry* entry)
+{
+	/* stale entries have been dropped by DrainFileListEvents() already */
+	return TRUE;
+}
+
+#else
+
+static void
+TakeFileListTicket(char* path, FileListCacheTicket* ticket)
+{
+	struct stat stat_buf;
+
+	memset(ticket, 0, sizeof(FileListCacheTicket));
+	ticket->stamp = -1;
+
+	if((stat(path, &stat_buf) < 0) || (stat_buf.st_mtime >= time(NULL)))
+		return;
+
+	ticket->stamp = (long) stat_buf.st_mtime;
+}
+
+
+static rfbBool
+IsFileListTicketValid(FileListCacheTicket* ticket)
+{
+	return ticket->stamp >= 0;
+}
+
+
+static void
+ReturnFileListTicket(FileListCacheTicket* ticket)
+{
+	ticket->stamp = -1;
+}
+
+
+static void
+FreeCacheEntry(FileListCacheEntry* entry)
+{
+	free(entry->path);
+	FreeFileTransferMsg(entry->msg);
+	memset(entry, 0, sizeof(FileListCacheEntry));
+}
+
+
+static void
+DrainFileListEvents()
+{
+}
+
+
+static rfbBool
+IsFileListEntryValid(FileListCacheEntry* entry)
+{
+	struct stat stat_buf;
+
+	return (stat(entry->path, &stat_buf) == 0) &&
+		((long) stat_buf.st_mtime == entry->ticket.stamp);
+}
+
+#endif /* LIBVNCSERVER_HAVE_SYS_INOTIFY_H */
+
+
+static FileListCacheEntry*
+FindFileListEntry(char* path, char flags)
+{
+	int i;
+
+	for(i = 0; i < FILE_LIST_CACHE_SIZE; i++)
+		if((fileListCache[i].path != NULL) &&
+		   (fileListCache[i].flags == flags) &&
+		   (strcmp(fileListCache[i].path, path) == 0))
+			return &fileListCache[i];
+
+	return NULL;
+}
+
+
+/*
+ * Returns a copy of the cached response for path, or an empty message if
+ * there is none. On a miss the ticket is filled in; this has to happen
+ * before the directory is read so no change can slip in unnoticed. The
+ * ticket has to go back to CacheFileListMsg() or DropFileListCacheTicket().
+ */
+
+FileTransferMsg
+GetCachedFileListMsg(char* path, char flags, FileListCacheTicket* ticket)
+{
+	FileTransferMsg fileListMsg;
+	FileListCacheEntry* entry = NULL;
+
+	memset(&fileListMsg, 0, sizeof(FileTransferMsg));
+	memset(ticket, 0, sizeof(FileListCacheTicket));
+	ticket->stamp = -1;
+
+	pthread_mutex_lock(&fileListCacheMutex);
+
+	DrainFileListEvents();
+
+	entry = FindFileListEntry(path, flags);
+	if((entry != NULL) && !IsFileListEntryValid(entry)) {
+		FreeCacheEntry(entry);
+		entry = NULL;
+	}
+
+	if(entry != NULL) {
+		entry->lastUsed = ++fileListCacheClock;
+		fileListMsg = CopyFileTransferMsg(entry->msg);
+	}
+	else
+		TakeFileListTicket(path, ticket);
+
+	pthread_mutex_unlock(&fileListCacheMutex);
+
+	return fileListMsg;
+}
+
+
+/*
+ * Stores a copy of msg for path and takes the ticket back. Nothing is
+ * stored if a change of the directory was noticed since the ticket was
+ * handed out: the listing may be stale.
+ */
+
+void
+CacheFileListMsg(char* path, char flags, FileListCacheTicket* ticket, FileTransferMsg msg)
+{
+	FileListCacheEntry* entry = NULL;
+	int i;
+
+	pthread_mutex_lock(&fileListCacheMutex);
+
+	DrainFileListEvents();
+
+	if(!IsFileListTicketValid(ticket) || (msg.data == NULL) || (msg.length == 0)) {
+		ReturnFileListTicket(ticket);
+		pthread_mutex_unlock(&fileListCacheMutex);
+		return;
+	}
+
+	if((entry = FindFileListEntry(path, flags)) == NULL) {
+		entry = &fileListCache[0];
+		for(i = 0; i < FILE_LIST_CACHE_SIZE; i++) {
+			if(fileListCache[i].path == NULL) {
+				entry = &fileListCache[i];
+				break;
+			}
+			if(fileListCache[i].lastUsed < entry->lastUsed)
+				entry = &fileListCache[i];
+		}
+	}
+
+	/* the ticket holds a reference too, so a shared watch stays alive */
+	if(entry->path != NULL)
+		FreeCacheEntry(entry);
+
+	entry->ticket = *ticket;
+	memset(ticket, 0, sizeof(FileListCacheTicket));
+	ticket->stamp = -1;
+
+	entry->path = strdup(path);
+	entry->flags = flags;
+	entry->lastUsed = ++fileListCacheClock;
+	entry->msg = CopyFileTransferMsg(msg);
+	if((entry->path == NULL) || (entry->msg.data == NULL))
+		FreeCacheEntry(entry);
+
+	pthread_mutex_unlock(&fileListCacheMutex);
+}
+
+
+/*
+ * Takes back the ticket of a listing that is not going to be cached.
+ */
+
+void
+DropFileListCacheTicket(FileListCacheTicket* ticket)
+{
+	pthread_mutex_lock(&fileListCacheMutex);
+	ReturnFileListTicket(ticket);
+	pthread_mutex_unlock(&fileListCacheMutex);
+}
+
+
+void
+FlushFileListCache()
+{
+	int i;
+
+	pthread_mutex_lock(&fileListCacheMutex);
+
+	for(i = 0; i < FILE_LIST_CACHE_SIZE; i++)
+		if(fileListCache[i].path != NULL)
+			FreeCacheEntry(&fileListCache[i]);
+
+	pthread_mutex_unlock(&fileListCacheMutex);
+}
@@ -0,0 +1,27 @@
+/*
+ * filelistcache.h - cache of FileListData messages, see filelistcache.c
+ */
+
+#ifndef FILE_LIST_CACHE_H
+#define FILE_LIST_CACHE_H
+
+#include "filetransfermsg.h"
+
+/*
+ * Handed out by GetCachedFileListMsg() on a miss and passed back to
+ * CacheFileListMsg() once the listing has been built, or to
+ * DropFileListCacheTicket() if it could not be. It lets the cache tell
+ * whether the directory changed while it was being read.
+ */
+typedef struct _FileListCacheTicket {
+	long stamp;		/* inotify watch descriptor or directory mtime, -1 if none */
+	struct _FileListWatch* watch;
+	unsigned long generation;
+} FileListCacheTicket;
+
+FileTransferMsg GetCachedFileListMsg(char* path, char flags, FileListCacheTicket* ticket);
+void CacheFileListMsg(char* path, char flags, FileListCacheTicket* ticket, FileTransferMsg msg);
+void DropFileListCacheTicket(FileListCacheTicket* ticket);
+void FlushFileListCache();
+
+#endif
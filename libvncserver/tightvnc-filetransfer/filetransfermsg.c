@@ -65,7 +65,9 @@
 #include <rfb/rfb.h>
 #include "rfbtightproto.h"
 #include "filelistinfo.h"
+#include "filelistcache.h"
 #include "filetransfermsg.h"
+#include "filetransferpool.h"
 #include "handlefiletransferrequest.h"
 
 #define SZ_RFBBLOCKSIZE 8192
@@ -103,11 +105,15 @@ GetFileListResponseMsg(char* path, char flags)
 {
 	FileTransferMsg fileListMsg;
 	FileListInfo fileListInfo;
+	FileListCacheTicket ticket;
 	int status = -1;
 	
 	memset(&fileListMsg, 0, sizeof(FileTransferMsg));
 	memset(&fileListInfo, 0, sizeof(FileListInfo));
 
+	fileListMsg = GetCachedFileListMsg(path, flags, &ticket);
+	if(fileListMsg.data != NULL)
+		return fileListMsg;
 	
 	 /* fileListInfo can have null data if the folder is Empty 
 	or if some error condition has occurred.
@@ -117,12 +123,14 @@ GetFileListResponseMsg(char* path, char flags)
 
 	if(status == FAILURE) {
 		fileListMsg = CreateFileListErrMsg(flags);
+		DropFileListCacheTicket(&ticket);
 	}
 	else {
 		/* DisplayFileList(fileListInfo); For Debugging  */
 		
 		fileListMsg = CreateFileListMsg(fileListInfo, flags);
 		FreeFileListInfo(fileListInfo);
+		CacheFileListMsg(path, flags, &ticket, fileListMsg);
 	}
 	
 	return fileListMsg;
@@ -445,15 +453,28 @@ GetFileDownloadLengthErrResponseMsg()
 }
 
 
+/*
+ * Reads the next FILE_TRANSFER_READ_SIZE bytes of the file with one read()
+ * and returns them as a run of SZ_RFBBLOCKSIZE data messages, followed by
+ * the zero size message carrying the modification time if the end of the
+ * file was reached.
+ */
+
 FileTransferMsg
 GetFileDownloadResponseMsgInBlocks(rfbClientPtr cl, rfbTightClientPtr rtcp)
 {
-	/* const unsigned int sz_rfbBlockSize = SZ_RFBBLOCKSIZE; */
-    int numOfBytesRead = 0;
-	char pBuf[SZ_RFBBLOCKSIZE];
+	FileTransferMsg fileDownloadMsg;
+	int numOfBytesRead = 0;
+	int n = 1;
+	int offset = 0;
+	int blockSize = 0;
+	unsigned int length = 0;
+	char* pBuf = NULL;
+	char* pData = NULL;
+	rfbFileDownloadDataMsg *pFDD = NULL;
 	char* path = rtcp->rcft.rcfd.fName;
 
-	memset(pBuf, 0, SZ_RFBBLOCKSIZE);
+	memset(&fileDownloadMsg, 0, sizeof(FileTransferMsg));
 
 	if((rtcp->rcft.rcfd.downloadInProgress == FALSE) && (rtcp->rcft.rcfd.downloadFD == -1)) {
 		if((rtcp->rcft.rcfd.downloadFD = open(path, O_RDONLY)) == -1) {
@@ -463,19 +484,84 @@ GetFileDownloadResponseMsgInBlocks(rfbClientPtr cl, rfbTightClientPtr rtcp)
 		}
 		rtcp->rcft.rcfd.downloadInProgress = TRUE;
 	}
-	if((rtcp->rcft.rcfd.downloadInProgress == TRUE) && (rtcp->rcft.rcfd.downloadFD != -1)) {
-		if( (numOfBytesRead = read(rtcp->rcft.rcfd.downloadFD, pBuf, SZ_RFBBLOCKSIZE)) <= 0) {
-			close(rtcp->rcft.rcfd.downloadFD);
-			rtcp->rcft.rcfd.downloadFD = -1;
-			rtcp->rcft.rcfd.downloadInProgress = FALSE;
-			if(numOfBytesRead == 0) {
-				return CreateFileDownloadZeroSizeDataMsg(rtcp->rcft.rcfd.mTime);
-			}			
-			return GetFileDownloadReadDataErrMsg();
-		}
-	return CreateFileDownloadBlockSizeDataMsg(numOfBytesRead, pBuf);
+	if((rtcp->rcft.rcfd.downloadInProgress != TRUE) || (rtcp->rcft.rcfd.downloadFD == -1))
+		return GetFileDownLoadErrMsg();
+
+	if((pBuf = (char*) malloc(FILE_TRANSFER_READ_SIZE)) == NULL) {
+		rfbLog("File [%s]: Method [%s]: pBuf is NULL\n",
+				__FILE__, __FUNCTION__);
+		close(rtcp->rcft.rcfd.downloadFD);
+		rtcp->rcft.rcfd.downloadFD = -1;
+		rtcp->rcft.rcfd.downloadInProgress = FALSE;
+		return GetFileDownloadReadDataErrMsg();
+	}
+
+	/* fill the whole buffer unless the end of the file is reached */
+	while(numOfBytesRead < FILE_TRANSFER_READ_SIZE) {
+		n = read(rtcp->rcft.rcfd.downloadFD, pBuf + numOfBytesRead,
+			 FILE_TRANSFER_READ_SIZE - numOfBytesRead);
+		if((n < 0) && (errno == EINTR))
+			continue;
+		if(n <= 0)
+			break;
+		numOfBytesRead += n;
 	}
-	return GetFileDownLoadErrMsg();
+
+	if(n < 0) {
+		close(rtcp->rcft.rcfd.downloadFD);
+		rtcp->rcft.rcfd.downloadFD = -1;
+		rtcp->rcft.rcfd.downloadInProgress = FALSE;
+		free(pBuf);
+		return GetFileDownloadReadDataErrMsg();
+	}
+
+	/* one header per block, plus the final zero size message */
+	length = numOfBytesRead + 
+		((numOfBytesRead + SZ_RFBBLOCKSIZE - 1) / SZ_RFBBLOCKSIZE) * sz_rfbFileDownloadDataMsg;
+	if(n == 0)
+		length += sz_rfbFileDownloadDataMsg + sizeof(uint32_t);
+
+	if((pData = (char*) calloc(length, sizeof(char))) == NULL) {
+		rfbLog("File [%s]: Method [%s]: pData is NULL\n",
+				__FILE__, __FUNCTION__);
+		close(rtcp->rcft.rcfd.downloadFD);
+		rtcp->rcft.rcfd.downloadFD = -1;
+		rtcp->rcft.rcfd.downloadInProgress = FALSE;
+		free(pBuf);
+		return GetFileDownloadReadDataErrMsg();
+	}
+	fileDownloadMsg.data = pData;
+	fileDownloadMsg.length = length;
+
+	for(offset = 0; offset < numOfBytesRead; offset += blockSize) {
+		blockSize = numOfBytesRead - offset;
+		if(blockSize > SZ_RFBBLOCKSIZE)
+			blockSize = SZ_RFBBLOCKSIZE;
+
+		pFDD = (rfbFileDownloadDataMsg *) pData;
+		pFDD->type = rfbFileDownloadData;
+		pFDD->compressLevel = 0;
+		pFDD->compressedSize = Swap16IfLE(blockSize);
+		pFDD->realSize = Swap16IfLE(blockSize);
+		memcpy(pData + sz_rfbFileDownloadDataMsg, pBuf + offset, blockSize);
+		pData += sz_rfbFileDownloadDataMsg + blockSize;
+	}
+	free(pBuf);
+
+	if(n == 0) {
+		close(rtcp->rcft.rcfd.downloadFD);
+		rtcp->rcft.rcfd.downloadFD = -1;
+		rtcp->rcft.rcfd.downloadInProgress = FALSE;
+
+		pFDD = (rfbFileDownloadDataMsg *) pData;
+		pFDD->type = rfbFileDownloadData;
+		pFDD->compressLevel = 0;
+		pFDD->compressedSize = Swap16IfLE(0);
+		pFDD->realSize = Swap16IfLE(0);
+		memcpy(pData + sz_rfbFileDownloadDataMsg, &rtcp->rcft.rcfd.mTime, sizeof(uint32_t));
+	}
+
+	return fileDownloadMsg;
 }
 
 
@@ -657,38 +743,66 @@ GetFileUploadCompressedLevelErrMsg()
 }
 
 
+/*
+ * The data is only collected here; it is written by the worker pool once
+ * FILE_TRANSFER_WRITE_SIZE bytes are together. A failed write is reported
+ * with the next data message or when the upload completes.
+ */
+
 FileTransferMsg
 ChkFileUploadWriteErr(rfbClientPtr cl, rfbTightClientPtr rtcp, char* pBuf)
 {
 	FileTransferMsg ftm;
-	unsigned long numOfBytesWritten = 0;
+	rfbClientFileUpload* rcfu = &rtcp->rcft.rcfu;
+	rfbBool writeError = FileUploadWriteFailed(rtcp);
 
 	memset(&ftm, 0, sizeof(FileTransferMsg));
 
-	numOfBytesWritten = write(rtcp->rcft.rcfu.uploadFD, pBuf, rtcp->rcft.rcfu.fSize);
+	if((writeError == FALSE) &&
+	   (rcfu->writeLen + rcfu->fSize > FILE_TRANSFER_WRITE_SIZE) &&
+	   (QueueFileUploadWrite(cl, rtcp) == FALSE))
+		writeError = TRUE;
+
+	if((writeError == FALSE) && (rcfu->writeBuf == NULL) &&
+	   ((rcfu->writeBuf = (char*) malloc(FILE_TRANSFER_WRITE_SIZE)) == NULL))
+		writeError = TRUE;
 
-	if(numOfBytesWritten != rtcp->rcft.rcfu.fSize) {		
+	if(writeError == TRUE) {
 		char reason[] = "Error writing file data";
 		int reasonLen = strlen(reason);
 		ftm = CreateFileUploadErrMsg(reason, reasonLen);
 		CloseUndoneFileUpload(cl, rtcp);
-	}		
+		return ftm;
+	}
+
+	memcpy(rcfu->writeBuf + rcfu->writeLen, pBuf, rcfu->fSize);
+	rcfu->writeLen += rcfu->fSize;
+
 	return ftm;
 }
 
 
-void
+FileTransferMsg
 FileUpdateComplete(rfbClientPtr cl, rfbTightClientPtr rtcp)
 {
 	/* Here we are settimg the modification and access time of the file */
 	/* Windows code stes mod/access/creation time of the file */
 	struct utimbuf utb;
+	FileTransferMsg ftm;
+	rfbBool writeError = FALSE;
 
-	utb.actime = utb.modtime = rtcp->rcft.rcfu.mTime;
-	if(utime(rtcp->rcft.rcfu.fName, &utb) == -1) {
-		rfbLog("File [%s]: Method [%s]: Setting the modification/access"
-				" time for the file <%s> failed\n", __FILE__, 
-				__FUNCTION__, rtcp->rcft.rcfu.fName);
+	memset(&ftm, 0, sizeof(FileTransferMsg));
+
+	writeError = (QueueFileUploadWrite(cl, rtcp) == FALSE);
+	if(WaitFileUploadWrites(rtcp) == FALSE)
+		writeError = TRUE;
+
+	if(writeError == TRUE) {
+		char reason[] = "Error writing file data";
+		int reasonLen = strlen(reason);
+		ftm = CreateFileUploadErrMsg(reason, reasonLen);
+		CloseUndoneFileUpload(cl, rtcp);
+		return ftm;
 	}
 
 	if(rtcp->rcft.rcfu.uploadFD != -1) {
@@ -696,6 +810,15 @@ FileUpdateComplete(rfbClientPtr cl, rfbTightClientPtr rtcp)
 		rtcp->rcft.rcfu.uploadFD = -1;
 		rtcp->rcft.rcfu.uploadInProgress = FALSE;
 	}
+
+	utb.actime = utb.modtime = rtcp->rcft.rcfu.mTime;
+	if(utime(rtcp->rcft.rcfu.fName, &utb) == -1) {
+		rfbLog("File [%s]: Method [%s]: Setting the modification/access"
+				" time for the file <%s> failed\n", __FILE__, 
+				__FUNCTION__, rtcp->rcft.rcfu.fName);
+	}
+
+	return ftm;
 }
 
 
@@ -742,6 +865,7 @@ CloseUndoneFileUpload(rfbClientPtr cl, rfbTightClientPtr rtcp)
 	if(cl == NULL)
 		return;
 
+	CancelFileUploadJobs(rtcp);
 	
 	if(rtcp->rcft.rcfu.uploadInProgress == TRUE) {
 		rtcp->rcft.rcfu.uploadInProgress = FALSE;
@@ -766,11 +890,12 @@ CloseUndoneFileDownload(rfbClientPtr cl, rfbTightClientPtr rtcp)
 {
 	if(cl == NULL)
 		return;
+
+	/* after this no worker touches the download any more */
+	CancelFileDownloadJobs(rtcp);
 	
 	if(rtcp->rcft.rcfd.downloadInProgress == TRUE) {
 		rtcp->rcft.rcfd.downloadInProgress = FALSE;
-		/* the thread will return if downloadInProgress is FALSE */
-		pthread_join(rtcp->rcft.rcfd.downloadThread, NULL);
 
 		if(rtcp->rcft.rcfd.downloadFD != -1) {			
 			close(rtcp->rcft.rcfd.downloadFD);
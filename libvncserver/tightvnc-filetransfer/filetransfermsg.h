@@ -50,7 +50,7 @@ FileTransferMsg ChkFileUploadErr(rfbClientPtr cl, rfbTightClientPtr data);
 FileTransferMsg ChkFileUploadWriteErr(rfbClientPtr cl, rfbTightClientPtr data, char* pBuf);
 
 void CreateDirectory(char* dirName);
-void FileUpdateComplete(rfbClientPtr cl, rfbTightClientPtr data);
+FileTransferMsg FileUpdateComplete(rfbClientPtr cl, rfbTightClientPtr data);
 void CloseUndoneFileUpload(rfbClientPtr cl, rfbTightClientPtr data);
 void CloseUndoneFileDownload(rfbClientPtr cl, rfbTightClientPtr data);
 
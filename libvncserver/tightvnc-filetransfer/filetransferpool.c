@@ -0,0 +1,574 @@
+/*
+ * filetransferpool.c - worker pool doing the file I/O of downloads and
+ * uploads.
+ *
+ * Downloads used to get a thread of their own, which read the file in
+ * 8 KiB pieces and held a global mutex while doing so, i.e. all downloads
+ * of all clients were serialised on the disk reads. Now a small, fixed
+ * number of workers is shared by all clients. A download is a job that
+ * sends one slice of FILE_TRANSFER_READ_SIZE bytes (a single read() turned
+ * into several data messages written in one go) and then goes back to the
+ * end of the queue, so many downloads share the workers round robin. The
+ * next slice is read right after the previous one was sent, while the job
+ * waits for its turn.
+ *
+ * Uploads are collected by the client thread into FILE_TRANSFER_WRITE_SIZE
+ * buffers, which are written by the pool while the client thread fills the
+ * next one. At most one write job per client is in flight, so the data is
+ * written in order without needing pwrite().
+ *
+ * Downloads are shaped per client so they cannot starve the framebuffer
+ * updates going out on the same socket: a slice is never sent while an
+ * update holds the send mutex (the job is postponed instead), and if a
+ * rate was set with -ftrate a token bucket limits the bytes per second.
+ *
+ * A client that does not read must not keep a worker, and with it the
+ * downloads of everybody else, waiting. So a slice goes out one data
+ * message at a time, each only if the socket is writable right now; when
+ * it is not, the job is postponed with the rest of the slice. Since the
+ * messages stay whole, framebuffer updates can still go in between.
+ */
+
+#include <rfb/rfbconfig.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <rfb/rfb.h>
+#include "rfbtightproto.h"
+#include "filetransfermsg.h"
+#include "filetransferpool.h"
+
+#if !defined(__GNUC__) && !defined(_MSC_VER)
+#define __FUNCTION__ "unknown"
+#endif
+
+/* how long a download slice waits if a framebuffer update is being sent */
+#define FILE_TRANSFER_YIELD_USEC 2000
+/* how long it waits if the client's socket does not take more data */
+#define FILE_TRANSFER_BLOCKED_USEC 10000
+
+#define FT_JOB_DOWNLOAD 0
+#define FT_JOB_UPLOAD   1
+
+typedef struct _FileTransferJob {
+	struct _FileTransferJob* next;
+	rfbClientPtr cl;
+	rfbTightClientPtr rtcp;
+	int type;
+	char* data;		/* slice to send or buffer to write */
+	unsigned int length;
+	unsigned int sent;	/* bytes of a slice sent already */
+	struct timeval notBefore;
+} FileTransferJob;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolJobQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolJobDone = PTHREAD_COND_INITIALIZER;
+static FileTransferJob* queueHead = NULL;
+static FileTransferJob* queueTail = NULL;
+static int numWorkers = 0;
+
+static int fileTransferRate = 0;
+
+
+void
+SetFileTransferRate(int bytesPerSecond)
+{
+	fileTransferRate = bytesPerSecond > 0 ? bytesPerSecond : 0;
+}
+
+
+int
+GetFileTransferRate()
+{
+	return fileTransferRate;
+}
+
+
+/******************************************************************************
+ * Job queue. All of these are called with poolMutex held.
+ ******************************************************************************/
+
+static void
+AppendJob(FileTransferJob* job)
+{
+	job->next = NULL;
+	if(queueTail != NULL)
+		queueTail->next = job;
+	else
+		queueHead = job;
+	queueTail = job;
+
+	pthread_cond_signal(&poolJobQueued);
+}
+
+
+static void
+UnlinkJob(FileTransferJob* job, FileTransferJob* prev)
+{
+	if(prev != NULL)
+		prev->next = job->next;
+	else
+		queueHead = job->next;
+	if(queueTail == job)
+		queueTail = prev;
+	job->next = NULL;
+}
+
+
+static void
+FinishJob(FileTransferJob* job)
+{
+	if(job->type == FT_JOB_DOWNLOAD)
+		job->rtcp->rcft.rcfd.jobsPending--;
+	else
+		job->rtcp->rcft.rcfu.jobsPending--;
+
+	free(job->data);
+	free(job);
+
+	pthread_cond_broadcast(&poolJobDone);
+}
+
+
+/*
+ * Takes the first job that may run now off the queue. If there is none,
+ * wakeup is set to the time the earliest postponed job becomes ready.
+ */
+
+static FileTransferJob*
+TakeReadyJob(struct timeval* now, struct timespec* wakeup)
+{
+	FileTransferJob* job = NULL;
+	FileTransferJob* prev = NULL;
+	struct timeval earliest;
+
+	earliest.tv_sec = 0;
+	earliest.tv_usec = 0;
+
+	for(job = queueHead; job != NULL; prev = job, job = job->next) {
+		if(!timercmp(&job->notBefore, now, >)) {
+			UnlinkJob(job, prev);
+			return job;
+		}
+		if((earliest.tv_sec == 0) || timercmp(&job->notBefore, &earliest, <))
+			earliest = job->notBefore;
+	}
+
+	wakeup->tv_sec = earliest.tv_sec;
+	wakeup->tv_nsec = earliest.tv_usec * 1000;
+	return NULL;
+}
+
+
+static void
+RemoveQueuedJobs(rfbTightClientPtr rtcp, int type)
+{
+	FileTransferJob* job = queueHead;
+	FileTransferJob* prev = NULL;
+	FileTransferJob* next = NULL;
+
+	while(job != NULL) {
+		next = job->next;
+		if((job->rtcp == rtcp) && (job->type == type)) {
+			UnlinkJob(job, prev);
+			FinishJob(job);
+		}
+		else
+			prev = job;
+		job = next;
+	}
+}
+
+
+/******************************************************************************
+ * Running the jobs.
+ ******************************************************************************/
+
+static void
+AddUsec(struct timeval* tv, long usec)
+{
+	tv->tv_usec += usec % 1000000;
+	tv->tv_sec += usec / 1000000 + tv->tv_usec / 1000000;
+	tv->tv_usec %= 1000000;
+}
+
+
+/*
+ * Token bucket: takes bytes from the client's allowance and sets notBefore
+ * to the time the allowance is positive again.
+ */
+
+static void
+ChargeFileTransferRate(rfbTightClientPtr rtcp, unsigned int bytes, struct timeval* notBefore)
+{
+	struct timeval now;
+	double elapsed = 0;
+	double burst = 2.0 * FILE_TRANSFER_READ_SIZE;
+	int rate = fileTransferRate;
+
+	gettimeofday(&now, NULL);
+	*notBefore = now;
+
+	if(rate <= 0)
+		return;
+
+	elapsed = (now.tv_sec - rtcp->rcft.lastRefill.tv_sec) +
+		(now.tv_usec - rtcp->rcft.lastRefill.tv_usec) / 1000000.0;
+	rtcp->rcft.lastRefill = now;
+
+	rtcp->rcft.tokens += elapsed * rate;
+	if(rtcp->rcft.tokens > burst)
+		rtcp->rcft.tokens = burst;
+	rtcp->rcft.tokens -= bytes;
+
+	if(rtcp->rcft.tokens < 0)
+		AddUsec(notBefore, (long) (-rtcp->rcft.tokens * 1000000.0 / rate));
+}
+
+
+static rfbBool
+IsClientWritable(rfbClientPtr cl)
+{
+	fd_set fds;
+	struct timeval tv;
+
+	FD_ZERO(&fds);
+	FD_SET(cl->sock, &fds);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+
+	return select(cl->sock + 1, NULL, &fds, NULL, &tv) > 0;
+}
+
+
+/*
+ * The length of the message at msg, of which left bytes remain, see
+ * GetFileDownloadResponseMsgInBlocks(). Anything but a data message is
+ * one of the error replies, which is always sent whole.
+ */
+
+static unsigned int
+GetDownloadDataMsgLength(char* msg, unsigned int left)
+{
+	rfbFileDownloadDataMsg fdd;
+	uint16_t size = 0;
+	unsigned int length = 0;
+
+	if((left < sz_rfbFileDownloadDataMsg) || ((uint8_t) msg[0] != rfbFileDownloadData))
+		return left;
+
+	memcpy(&fdd, msg, sz_rfbFileDownloadDataMsg);
+	size = Swap16IfLE(fdd.compressedSize);
+
+	/* the last one carries the modification time instead of data */
+	length = sz_rfbFileDownloadDataMsg + (size != 0 ? size : sizeof(uint32_t));
+	return length < left ? length : left;
+}
+
+
+/*
+ * Sends as much of the slice read last time as the socket takes and reads
+ * the next one once it is out. Returns TRUE if the job has to be queued
+ * again.
+ */
+
+static rfbBool
+RunDownloadJob(FileTransferJob* job)
+{
+	rfbClientPtr cl = job->cl;
+	rfbTightClientPtr rtcp = job->rtcp;
+	FileTransferMsg fileDownloadMsg;
+	unsigned int msgLength = 0;
+
+	if(job->data == NULL) {
+		fileDownloadMsg = GetFileDownloadResponseMsgInBlocks(cl, rtcp);
+		job->data = fileDownloadMsg.data;
+		job->length = fileDownloadMsg.length;
+		job->sent = 0;
+		if((job->data == NULL) || (job->length == 0))
+			return FALSE;
+	}
+
+	/* framebuffer updates go first */
+	if(pthread_mutex_trylock(&cl->sendMutex) != 0) {
+		gettimeofday(&job->notBefore, NULL);
+		AddUsec(&job->notBefore, FILE_TRANSFER_YIELD_USEC);
+		return TRUE;
+	}
+
+	while((job->sent < job->length) && IsClientWritable(cl)) {
+		msgLength = GetDownloadDataMsgLength(job->data + job->sent, job->length - job->sent);
+		if(rfbWriteExact(cl, job->data + job->sent, msgLength) < 0) {
+			rfbLog("File [%s]: Method [%s]: Error while writing to socket \n"
+					, __FILE__, __FUNCTION__);
+			UNLOCK(cl->sendMutex);
+			return FALSE;
+		}
+		job->sent += msgLength;
+	}
+	UNLOCK(cl->sendMutex);
+
+	if(job->sent < job->length) {
+		gettimeofday(&job->notBefore, NULL);
+		AddUsec(&job->notBefore, FILE_TRANSFER_BLOCKED_USEC);
+		return TRUE;
+	}
+
+	ChargeFileTransferRate(rtcp, job->length, &job->notBefore);
+
+	free(job->data);
+	job->data = NULL;
+	job->length = 0;
+	job->sent = 0;
+
+	if(rtcp->rcft.rcfd.downloadInProgress != TRUE)
+		return FALSE;
+
+	/* read ahead while waiting for the next turn */
+	fileDownloadMsg = GetFileDownloadResponseMsgInBlocks(cl, rtcp);
+	job->data = fileDownloadMsg.data;
+	job->length = fileDownloadMsg.length;
+
+	return (job->data != NULL) && (job->length != 0);
+}
+
+
+/* Returns FALSE if the data could not be written. */
+
+static rfbBool
+RunUploadJob(FileTransferJob* job)
+{
+	rfbTightClientPtr rtcp = job->rtcp;
+	char* pBuf = job->data;
+	unsigned int left = job->length;
+	ssize_t n = 0;
+
+	while(left > 0) {
+		n = write(rtcp->rcft.rcfu.uploadFD, pBuf, left);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0) {
+			rfbLog("File [%s]: Method [%s]: Error while writing file <%s>\n",
+					__FILE__, __FUNCTION__, rtcp->rcft.rcfu.fName);
+			return FALSE;
+		}
+		pBuf += n;
+		left -= n;
+	}
+
+	return TRUE;
+}
+
+
+static void*
+FileTransferWorker(void* arg)
+{
+	FileTransferJob* job = NULL;
+	struct timeval now;
+	struct timespec wakeup;
+	rfbBool requeue = FALSE;
+	rfbBool written = TRUE;
+
+	pthread_mutex_lock(&poolMutex);
+	for(;;) {
+		gettimeofday(&now, NULL);
+		if((job = TakeReadyJob(&now, &wakeup)) == NULL) {
+			if(queueHead == NULL)
+				pthread_cond_wait(&poolJobQueued, &poolMutex);
+			else
+				pthread_cond_timedwait(&poolJobQueued, &poolMutex, &wakeup);
+			continue;
+		}
+		pthread_mutex_unlock(&poolMutex);
+
+		requeue = FALSE;
+		written = TRUE;
+		if(job->type == FT_JOB_DOWNLOAD)
+			requeue = RunDownloadJob(job);
+		else
+			written = RunUploadJob(job);
+
+		pthread_mutex_lock(&poolMutex);
+		if(!written)
+			job->rtcp->rcft.rcfu.writeError = TRUE;
+		if(requeue && !job->rtcp->rcft.rcfd.cancelled)
+			AppendJob(job);
+		else
+			FinishJob(job);
+	}
+
+	return NULL;
+}
+
+
+/* Called with poolMutex held. */
+
+static rfbBool
+StartWorkers()
+{
+	pthread_t thread;
+
+	while(numWorkers < FILE_TRANSFER_WORKERS) {
+		if(pthread_create(&thread, NULL, FileTransferWorker, NULL) != 0) {
+			rfbLog("File [%s]: Method [%s]: Worker thread creation failed\n",
+					__FILE__, __FUNCTION__);
+			break;
+		}
+		pthread_detach(thread);
+		numWorkers++;
+	}
+
+	return numWorkers > 0;
+}
+
+
+/******************************************************************************
+ * Interface used by the request handlers.
+ ******************************************************************************/
+
+rfbBool
+QueueFileDownload(rfbClientPtr cl, rfbTightClientPtr rtcp)
+{
+	FileTransferJob* job = NULL;
+
+	pthread_mutex_lock(&poolMutex);
+
+	if(!StartWorkers() ||
+	   (job = (FileTransferJob*) calloc(1, sizeof(FileTransferJob))) == NULL) {
+		pthread_mutex_unlock(&poolMutex);
+		return FALSE;
+	}
+
+	job->cl = cl;
+	job->rtcp = rtcp;
+	job->type = FT_JOB_DOWNLOAD;
+	rtcp->rcft.rcfd.cancelled = FALSE;
+	rtcp->rcft.rcfd.jobsPending++;
+	AppendJob(job);
+
+	pthread_mutex_unlock(&poolMutex);
+	return TRUE;
+}
+
+
+/*
+ * Hands the collected upload data over to the pool. Blocks while the
+ * previous buffer of this client is still being written. Returns FALSE
+ * if that failed, or any write before.
+ */
+
+rfbBool
+QueueFileUploadWrite(rfbClientPtr cl, rfbTightClientPtr rtcp)
+{
+	FileTransferJob* job = NULL;
+
+	if((rtcp->rcft.rcfu.writeBuf == NULL) || (rtcp->rcft.rcfu.writeLen == 0))
+		return TRUE;
+
+	pthread_mutex_lock(&poolMutex);
+
+	while(rtcp->rcft.rcfu.jobsPending > 0)
+		pthread_cond_wait(&poolJobDone, &poolMutex);
+
+	if(rtcp->rcft.rcfu.writeError ||
+	   !StartWorkers() ||
+	   (job = (FileTransferJob*) calloc(1, sizeof(FileTransferJob))) == NULL) {
+		pthread_mutex_unlock(&poolMutex);
+		return FALSE;
+	}
+
+	job->cl = cl;
+	job->rtcp = rtcp;
+	job->type = FT_JOB_UPLOAD;
+	job->data = rtcp->rcft.rcfu.writeBuf;
+	job->length = rtcp->rcft.rcfu.writeLen;
+	rtcp->rcft.rcfu.writeBuf = NULL;
+	rtcp->rcft.rcfu.writeLen = 0;
+	rtcp->rcft.rcfu.jobsPending++;
+	AppendJob(job);
+
+	pthread_mutex_unlock(&poolMutex);
+	return TRUE;
+}
+
+
+/* Waits for the writes of the upload; returns FALSE if one failed. */
+
+rfbBool
+WaitFileUploadWrites(rfbTightClientPtr rtcp)
+{
+	rfbBool writeError = FALSE;
+
+	pthread_mutex_lock(&poolMutex);
+	while(rtcp->rcft.rcfu.jobsPending > 0)
+		pthread_cond_wait(&poolJobDone, &poolMutex);
+	writeError = rtcp->rcft.rcfu.writeError;
+	pthread_mutex_unlock(&poolMutex);
+
+	return !writeError;
+}
+
+
+rfbBool
+FileUploadWriteFailed(rfbTightClientPtr rtcp)
+{
+	rfbBool writeError = FALSE;
+
+	pthread_mutex_lock(&poolMutex);
+	writeError = rtcp->rcft.rcfu.writeError;
+	pthread_mutex_unlock(&poolMutex);
+
+	return writeError;
+}
+
+
+/*
+ * Drops the queued download jobs of a client and waits for a running one
+ * to finish. The download file descriptor may be closed afterwards.
+ */
+
+void
+CancelFileDownloadJobs(rfbTightClientPtr rtcp)
+{
+	pthread_mutex_lock(&poolMutex);
+
+	rtcp->rcft.rcfd.cancelled = TRUE;
+	for(;;) {
+		RemoveQueuedJobs(rtcp, FT_JOB_DOWNLOAD);
+		if(rtcp->rcft.rcfd.jobsPending == 0)
+			break;
+		pthread_cond_wait(&poolJobDone, &poolMutex);
+	}
+
+	pthread_mutex_unlock(&poolMutex);
+}
+
+
+void
+CancelFileUploadJobs(rfbTightClientPtr rtcp)
+{
+	pthread_mutex_lock(&poolMutex);
+
+	for(;;) {
+		RemoveQueuedJobs(rtcp, FT_JOB_UPLOAD);
+		if(rtcp->rcft.rcfu.jobsPending == 0)
+			break;
+		pthread_cond_wait(&poolJobDone, &poolMutex);
+	}
+	rtcp->rcft.rcfu.writeError = FALSE;
+
+	pthread_mutex_unlock(&poolMutex);
+
+	free(rtcp->rcft.rcfu.writeBuf);
+	rtcp->rcft.rcfu.writeBuf = NULL;
+	rtcp->rcft.rcfu.writeLen = 0;
+}
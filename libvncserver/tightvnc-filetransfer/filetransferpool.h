@@ -0,0 +1,29 @@
+/*
+ * filetransferpool.h - worker pool doing the file I/O of downloads and
+ * uploads, see filetransferpool.c
+ */
+
+#ifndef FILE_TRANSFER_POOL_H
+#define FILE_TRANSFER_POOL_H
+
+#include <rfb/rfb.h>
+#include "rfbtightproto.h"
+
+/* number of worker threads shared by all clients */
+#define FILE_TRANSFER_WORKERS 4
+/* bytes read from disk per download slice, sent as 8 KiB data messages */
+#define FILE_TRANSFER_READ_SIZE (64 * 1024)
+/* upload data is collected up to this size before it is written */
+#define FILE_TRANSFER_WRITE_SIZE (256 * 1024)
+
+void SetFileTransferRate(int bytesPerSecond);
+int GetFileTransferRate();
+
+rfbBool QueueFileDownload(rfbClientPtr cl, rfbTightClientPtr rtcp);
+rfbBool QueueFileUploadWrite(rfbClientPtr cl, rfbTightClientPtr rtcp);
+rfbBool WaitFileUploadWrites(rfbTightClientPtr rtcp);
+rfbBool FileUploadWriteFailed(rfbTightClientPtr rtcp);
+void CancelFileDownloadJobs(rfbTightClientPtr rtcp);
+void CancelFileUploadJobs(rfbTightClientPtr rtcp);
+
+#endif
@@ -43,6 +43,7 @@
 #include <rfb/rfb.h>
 #include "rfbtightproto.h"
 #include "filetransfermsg.h"
+#include "filetransferpool.h"
 #include "handlefiletransferrequest.h"
 
 #ifdef WIN32
@@ -53,8 +54,6 @@ typedef unsigned int uid_t;
 #endif /* WIN32 */
 
 
-static pthread_mutex_t fileDownloadMutex = PTHREAD_MUTEX_INITIALIZER;
-
 static rfbBool fileTransferEnabled = TRUE;
 static rfbBool fileTransferInitted = FALSE;
 static char ftproot[PATH_MAX];
@@ -369,7 +368,6 @@ void HandleFileDownload(rfbClientPtr cl, rfbTightClientPtr data);
 #ifdef TODO
 void HandleFileDownloadRequest(rfbClientPtr cl);
 void SendFileDownloadErrMsg(rfbClientPtr cl);
-void* RunFileDownloadThread(void* client);
 #endif
 
 /*
@@ -504,41 +502,6 @@ SendFileDownloadLengthErrMsg(rfbClientPtr cl)
 	FreeFileTransferMsg(fileDownloadErrMsg);
 }
 
-extern rfbTightClientPtr rfbGetTightClientData(rfbClientPtr cl);
-
-void*
-RunFileDownloadThread(void* client)
-{
-	rfbClientPtr cl = (rfbClientPtr) client;
-	rfbTightClientPtr rtcp = rfbGetTightClientData(cl);
-	FileTransferMsg fileDownloadMsg;
-
-	if(rtcp == NULL)
-		return NULL;
-
-	memset(&fileDownloadMsg, 0, sizeof(FileTransferMsg));
-	do {
-		pthread_mutex_lock(&fileDownloadMutex);
-		fileDownloadMsg = GetFileDownloadResponseMsgInBlocks(cl, rtcp);
-		pthread_mutex_unlock(&fileDownloadMutex);
-		
-		if((fileDownloadMsg.data != NULL) && (fileDownloadMsg.length != 0)) {
-		        LOCK(cl->sendMutex);
-			if(rfbWriteExact(cl, fileDownloadMsg.data, fileDownloadMsg.length) < 0)  {
-				rfbLog("File [%s]: Method [%s]: Error while writing to socket \n"
-						, __FILE__, __FUNCTION__);
-				FreeFileTransferMsg(fileDownloadMsg);
-				UNLOCK(cl->sendMutex);
-				return NULL;
-			}
-			UNLOCK(cl->sendMutex);
-			FreeFileTransferMsg(fileDownloadMsg);
-		}
-	} while(rtcp->rcft.rcfd.downloadInProgress == TRUE);
-	return NULL;
-}
-
-
 void
 HandleFileDownload(rfbClientPtr cl, rfbTightClientPtr rtcp)
 {
@@ -555,11 +518,11 @@ HandleFileDownload(rfbClientPtr cl, rfbTightClientPtr rtcp)
 	}
 	CloseUndoneFileDownload(cl, rtcp);
 
-	if(pthread_create(&rtcp->rcft.rcfd.downloadThread, NULL, RunFileDownloadThread, (void*)
-	cl) != 0) {
+	/* the file is read and sent in slices by the worker pool */
+	if(QueueFileDownload(cl, rtcp) == FALSE) {
 		FileTransferMsg ftm = GetFileDownLoadErrMsg();
 		
-		rfbLog("File [%s]: Method [%s]: Download thread creation failed\n",
+		rfbLog("File [%s]: Method [%s]: Queueing the download failed\n",
 				__FILE__, __FUNCTION__);
 		
 		if((ftm.data != NULL) && (ftm.length != 0)) {
@@ -628,9 +591,7 @@ HandleFileDownloadCancelRequest(rfbClientPtr cl, rfbTightClientPtr rtcp)
 	rfbLog("File [%s]: Method [%s]: File Download Cancel Request received:"
 					" reason <%s>\n", __FILE__, __FUNCTION__, reason);
 	
-	pthread_mutex_lock(&fileDownloadMutex);
 	CloseUndoneFileDownload(cl, rtcp);
-	pthread_mutex_unlock(&fileDownloadMutex);
 	
 	if(reason != NULL) {
 		free(reason);
@@ -781,6 +742,9 @@ HandleFileUpload(rfbClientPtr cl, rfbTightClientPtr rtcp)
 	FileTransferMsg fileUploadErrMsg;
 
 	memset(&fileUploadErrMsg, 0, sizeof(FileTransferMsg));
+
+	/* drop whatever is left of an upload that was never completed */
+	CancelFileUploadJobs(rtcp);
 	
 	rtcp->rcft.rcfu.uploadInProgress = FALSE;
 	rtcp->rcft.rcfu.uploadFD = -1;
@@ -830,6 +794,8 @@ HandleFileUploadDataRequest(rfbClientPtr cl, rfbTightClientPtr rtcp)
 	msg.fud.realSize = Swap16IfLE(msg.fud.realSize);
 	msg.fud.compressedSize = Swap16IfLE(msg.fud.compressedSize);
 	if((msg.fud.realSize == 0) && (msg.fud.compressedSize == 0)) {
+		FileTransferMsg ftm;
+
 		if((n = rfbReadExact(cl, (char*)&(rtcp->rcft.rcfu.mTime), 4)) <= 0) {
 			
 			if (n < 0)
@@ -840,7 +806,13 @@ HandleFileUploadDataRequest(rfbClientPtr cl, rfbTightClientPtr rtcp)
 		    return;
 		}
 
-		FileUpdateComplete(cl, rtcp);
+		ftm = FileUpdateComplete(cl, rtcp);
+		if((ftm.data != NULL) && (ftm.length != 0)) {
+		        LOCK(cl->sendMutex);
+			rfbWriteExact(cl, ftm.data, ftm.length);
+			UNLOCK(cl->sendMutex);
+			FreeFileTransferMsg(ftm);
+		}
 		return;
 	}
 
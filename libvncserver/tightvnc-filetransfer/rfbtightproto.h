@@ -148,7 +148,8 @@ typedef struct _rfbClientFileDownload {
 	int downloadInProgress;
 	unsigned long mTime;
 	int downloadFD;
-	pthread_t downloadThread;
+	int jobsPending;	/* download jobs queued or running in the pool */
+	int cancelled;
 } rfbClientFileDownload ;
 
 typedef struct _rfbClientFileUpload {
@@ -157,11 +158,18 @@ typedef struct _rfbClientFileUpload {
 	unsigned long mTime;
 	unsigned long fSize;
 	int uploadFD;
+	int jobsPending;	/* write jobs queued or running in the pool */
+	char* writeBuf;		/* upload data not yet handed to the pool */
+	unsigned int writeLen;
+	int writeError;		/* a write failed, guarded by the pool's mutex */
 } rfbClientFileUpload ;
 
 typedef struct _rfbClientFileTransfer {
 	rfbClientFileDownload rcfd;
 	rfbClientFileUpload rcfu;
+	/* download bandwidth shaping, see filetransferpool.c */
+	double tokens;
+	struct timeval lastRefill;
 } rfbClientFileTransfer;
 
 
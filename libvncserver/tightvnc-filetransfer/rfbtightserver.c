@@ -27,6 +27,8 @@
 #include "rfbtightproto.h"
 #include "handlefiletransferrequest.h"
 #include "filetransfermsg.h"
+#include "filetransferpool.h"
+#include "filelistcache.h"
 
 /*
  * Get my data!
@@ -461,6 +463,7 @@ rfbTightUsage(void) {
     fprintf(stderr, "\nlibvncserver-tight-extension options:\n");
     fprintf(stderr, "-disablefiletransfer   disable file transfer\n");
     fprintf(stderr, "-ftproot string        set ftp root\n");
+    fprintf(stderr, "-ftrate kbytes         limit downloads to kbytes/s per client\n");
     fprintf(stderr,"\n");
 }
 
@@ -484,6 +487,14 @@ rfbTightProcessArg(int argc, char *argv[]) {
 	    return 0;
 	}
 	return 2;
+    } else if (strcmp(argv[0], "-ftrate") == 0) { /* -ftrate kbytes */
+	if (2 > argc) {
+	    return 0;
+	}
+	SetFileTransferRate(atoi(argv[1]) * 1024);
+	rfbLog("file transfer rate is limited to %d bytes/s\n",
+	       GetFileTransferRate());
+	return 2;
     } else if (strcmp(argv[0], "-disablefiletransfer") == 0) {
 	EnableFileTransfer(FALSE);
 	return 1;
@@ -550,5 +561,6 @@ void
 rfbUnregisterTightVNCFileTransferExtension(void) {
 	rfbUnregisterProtocolExtension(&tightVncFileTransferExtension);
 	rfbUnregisterSecurityHandler(&tightVncSecurityHandler);
+	FlushFileListCache();
 }
 
@@ -38,6 +38,10 @@ void rfbFreeUltraData(rfbClientPtr cl) {
   }
 }
 
+size_t rfbUltraMemoryUsage(rfbClientPtr cl) {
+  return cl->compStreamInitedLZO ? sizeof(lzo_align_t) * (MAX_WRKMEM) : 0;
+}
+
 
 static rfbBool
 rfbSendOneRectEncodingUltra(rfbClientPtr cl,
@@ -106,7 +110,7 @@ rfbSendOneRectEncodingUltra(rfbClientPtr cl,
         /* Work-memory needed for compression. Allocate memory in units
          * of `lzo_align_t' (instead of `char') to make sure it is properly aligned.
          */  
-        cl->lzoWrkMem = malloc(sizeof(lzo_align_t) * (((LZO1X_1_MEM_COMPRESS) + (sizeof(lzo_align_t) - 1)) / sizeof(lzo_align_t)));
+        cl->lzoWrkMem = malloc(sizeof(lzo_align_t) * (MAX_WRKMEM));
     }
 
     /* Perform the compression here. */
@@ -0,0 +1,212 @@
+/*
+ * uplink.c - share the uplink fairly among the clients of a screen.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * With screen->uplinkRate set, the framebuffer updates of all clients
+ * together get about that many bytes per second, shared by deficit round
+ * robin: the clients with an update to send form a round, and each turn
+ * adds UPLINK_QUANTUM times the client's uplinkWeight to its deficit, as
+ * far as the budget the rate accrued since covers. A client may start an
+ * update while its deficit is positive. The size of an update is only
+ * known once it is encoded, so what it sent is taken off afterwards, and
+ * a big one leaves the client in debt for a few turns.
+ *
+ * A client whose turn has not come is paced, not blocked: its update is
+ * not started at all, and the region keeps collecting changes, so that
+ * later one current update goes out instead of a queue of stale ones.
+ *
+ * Between an update and the client's next request there is nothing to
+ * send every time, so a client only leaves the round after it had nothing
+ * for UPLINK_LINGER_MS. Until then it keeps its place and at most one
+ * turn of credit; once gone it gives up its credit, but not its debt.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+/* bytes a client of weight 1 gets per turn */
+#define UPLINK_QUANTUM (16 * 1024)
+/* the budget does not grow beyond this much of the rate while nobody takes it */
+#define UPLINK_BURST_MS 50
+/* longest a paced client waits before it asks again */
+#define UPLINK_MAX_DELAY_MS 50
+/* how long a client without anything to send keeps its place */
+#define UPLINK_LINGER_MS 100
+
+
+static long
+quantum(rfbClientPtr cl)
+{
+    return (long)UPLINK_QUANTUM * (cl->uplinkWeight > 0 ? cl->uplinkWeight : 1);
+}
+
+
+/* joins at the end of the current round, with uplinkMutex held */
+static void
+join(rfbScreenInfoPtr screen, rfbClientPtr cl)
+{
+    rfbClientPtr cursor = screen->uplinkCursor;
+
+    if (cursor == NULL) {
+        cl->uplinkNext = cl->uplinkPrev = cl;
+        screen->uplinkCursor = cl;
+    } else {
+        cl->uplinkNext = cursor;
+        cl->uplinkPrev = cursor->uplinkPrev;
+        cursor->uplinkPrev->uplinkNext = cl;
+        cursor->uplinkPrev = cl;
+    }
+    screen->uplinkClients++;
+    cl->uplinkQueued = TRUE;
+    cl->uplinkIdleMs = 0;
+}
+
+
+/* with uplinkMutex held */
+static void
+leave(rfbScreenInfoPtr screen, rfbClientPtr cl)
+{
+    if (cl->uplinkNext == cl) {
+        screen->uplinkCursor = NULL;
+    } else {
+        cl->uplinkPrev->uplinkNext = cl->uplinkNext;
+        cl->uplinkNext->uplinkPrev = cl->uplinkPrev;
+        if (screen->uplinkCursor == cl)
+            screen->uplinkCursor = cl->uplinkNext;
+    }
+    cl->uplinkNext = cl->uplinkPrev = NULL;
+    screen->uplinkClients--;
+    cl->uplinkQueued = FALSE;
+    if (cl->uplinkDeficit > 0)
+        cl->uplinkDeficit = 0;
+}
+
+
+/* hands out what the rate accrued since last time, turn by turn, with uplinkMutex held */
+static void
+serve(rfbScreenInfoPtr screen)
+{
+    unsigned long now = rfbNowMs();
+    double cap = (double)screen->uplinkRate * UPLINK_BURST_MS / 1000;
+    rfbClientPtr cl;
+    int satisfied = 0;
+
+    screen->uplinkBudget += (double)screen->uplinkRate * (now - screen->uplinkRefillMs) / 1000;
+    screen->uplinkRefillMs = now;
+    /* but enough for the next turn */
+    if (screen->uplinkCursor != NULL && cap < quantum(screen->uplinkCursor))
+        cap = quantum(screen->uplinkCursor);
+    if (screen->uplinkBudget > cap)
+        screen->uplinkBudget = cap;
+
+    while ((cl = screen->uplinkCursor) != NULL && satisfied < screen->uplinkClients) {
+        if (cl->uplinkIdleMs != 0 && now - cl->uplinkIdleMs > UPLINK_LINGER_MS) {
+            leave(screen, cl);
+            continue;
+        }
+        if (cl->uplinkDeficit > 0) {
+            /* still has credit from its last turn */
+            satisfied++;
+        } else {
+            if (screen->uplinkBudget < quantum(cl))
+                break;
+            screen->uplinkBudget -= quantum(cl);
+            cl->uplinkDeficit += quantum(cl);
+            satisfied = 0;
+        }
+        screen->uplinkCursor = cl->uplinkNext;
+    }
+}
+
+
+/*
+ * Milliseconds until the client should look again whether it may start an
+ * update, 0 if it may now. Joins the round if it is not in it yet.
+ */
+
+int
+rfbUplinkDelay(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    double missing;
+    int delay = 0;
+
+    if (screen->uplinkRate <= 0)
+        return 0;
+
+    LOCK(screen->uplinkMutex);
+    if (!cl->uplinkQueued)
+        join(screen, cl);
+    cl->uplinkIdleMs = 0;
+    serve(screen);
+    if (cl->uplinkDeficit <= 0) {
+        /* someone's turn comes once the budget covers it, maybe this one's */
+        missing = UPLINK_QUANTUM - screen->uplinkBudget;
+        delay = missing > 0 ? (int)(missing * 1000 / screen->uplinkRate) + 1 : 1;
+        if (delay > UPLINK_MAX_DELAY_MS)
+            delay = UPLINK_MAX_DELAY_MS;
+    }
+    UNLOCK(screen->uplinkMutex);
+
+    return delay;
+}
+
+
+/* Takes what an update cost off the client's deficit. */
+
+void
+rfbUplinkCharge(rfbClientPtr cl, int bytes)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+
+    LOCK(screen->uplinkMutex);
+    if (cl->uplinkQueued)
+        cl->uplinkDeficit -= bytes;
+    UNLOCK(screen->uplinkMutex);
+}
+
+
+/* The client has nothing to send for now, see UPLINK_LINGER_MS. */
+
+void
+rfbUplinkIdle(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+
+    LOCK(screen->uplinkMutex);
+    if (cl->uplinkQueued && cl->uplinkIdleMs == 0)
+        cl->uplinkIdleMs = rfbNowMs();
+    UNLOCK(screen->uplinkMutex);
+}
+
+
+/* Leaves the round for good, when the client is gone. */
+
+void
+rfbUplinkLeave(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+
+    LOCK(screen->uplinkMutex);
+    if (cl->uplinkQueued)
+        leave(screen, cl);
+    UNLOCK(screen->uplinkMutex);
+}
@@ -0,0 +1,291 @@
+/*
+ * videoregion.c - find the parts of the screen showing video.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * Every call of rfbMarkRegionAsModified() is recorded in a grid of
+ * RFB_DAMAGE_TILE_SIZE tiles. Time is cut into slots of VIDEO_SLOT_MS and
+ * each tile keeps a bit mask of the slots it changed in. A tile that
+ * changed in VIDEO_ENTER_SLOTS of the last VIDEO_WINDOW_SLOTS slots is
+ * hot, and stays hot until it changes in fewer than VIDEO_LEAVE_SLOTS.
+ * Hot tiles without hot neighbours are ignored, so a blinking cursor or
+ * somebody typing does not count as video; what is left is the video
+ * region.
+ *
+ * rfbSendFramebufferUpdate() sends the video region at most
+ * screen->videoFrameRate times a second and, to clients which accept
+ * JPEG, at screen->videoQualityLevel.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#define VIDEO_SLOT_MS 100
+#define VIDEO_WINDOW_SLOTS 20
+#define VIDEO_ENTER_SLOTS 8
+#define VIDEO_LEAVE_SLOTS 3
+#define VIDEO_MIN_NEIGHBOURS 2
+
+#define VIDEO_WINDOW_MASK ((uint32_t)((1UL << VIDEO_WINDOW_SLOTS) - 1))
+
+unsigned long
+rfbNowMs(void)
+{
+#ifdef WIN32
+    return GetTickCount();
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+
+static int
+countBits(uint32_t v)
+{
+    int n = 0;
+
+    for (; v; v &= v - 1)
+        n++;
+    return n;
+}
+
+
+/* shift the history of a tile up to the given slot */
+static void
+ageTile(rfbDamageTile *tile, unsigned long slot)
+{
+    unsigned long age = slot - tile->slot;
+
+    tile->history = age >= 32 ? 0 : tile->history << age;
+    tile->slot = slot;
+}
+
+
+/* must be called with the tracker locked */
+static rfbBool
+checkTiles(rfbVideoTracker *tracker, rfbScreenInfoPtr screen)
+{
+    int cols = (screen->width + RFB_DAMAGE_TILE_SIZE - 1) / RFB_DAMAGE_TILE_SIZE;
+    int rows = (screen->height + RFB_DAMAGE_TILE_SIZE - 1) / RFB_DAMAGE_TILE_SIZE;
+
+    if (tracker->tiles != NULL && tracker->width == screen->width &&
+        tracker->height == screen->height)
+        return TRUE;
+
+    /* new framebuffer, start over */
+    free(tracker->tiles);
+    tracker->tiles = (rfbDamageTile *)calloc((size_t)cols * rows, sizeof(rfbDamageTile));
+    if (tracker->tiles == NULL) {
+        tracker->cols = tracker->rows = 0;
+        return FALSE;
+    }
+    tracker->width = screen->width;
+    tracker->height = screen->height;
+    tracker->cols = cols;
+    tracker->rows = rows;
+    tracker->classifiedSlot = 0;
+    sraRgnMakeEmpty(tracker->videoRegion);
+    return TRUE;
+}
+
+
+void
+rfbVideoTrackerInit(rfbScreenInfoPtr screen)
+{
+    rfbVideoTracker *tracker = (rfbVideoTracker *)calloc(1, sizeof(rfbVideoTracker));
+
+    if (tracker == NULL)
+        return;
+    INIT_MUTEX(tracker->mutex);
+    tracker->videoRegion = sraRgnCreate();
+    screen->videoTracker = tracker;
+}
+
+
+void
+rfbVideoTrackerFree(rfbScreenInfoPtr screen)
+{
+    rfbVideoTracker *tracker = screen->videoTracker;
+
+    if (tracker == NULL)
+        return;
+    TINI_MUTEX(tracker->mutex);
+    sraRgnDestroy(tracker->videoRegion);
+    free(tracker->tiles);
+    free(tracker);
+    screen->videoTracker = NULL;
+}
+
+
+void
+rfbVideoTrackDamage(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    rfbVideoTracker *tracker = screen->videoTracker;
+    sraRectangleIterator *i;
+    sraRect rect;
+    unsigned long slot = rfbNowMs() / VIDEO_SLOT_MS;
+    rfbDamageTile *tile;
+    int tx, ty;
+
+    /* nothing to classify for, and the heat map goes with it */
+    if (tracker == NULL || !screen->handleVideoRegions)
+        return;
+
+    LOCK(tracker->mutex);
+    if (!checkTiles(tracker, screen)) {
+        UNLOCK(tracker->mutex);
+        return;
+    }
+
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        if (rect.x2 > tracker->width) rect.x2 = tracker->width;
+        if (rect.y2 > tracker->height) rect.y2 = tracker->height;
+        for (ty = rect.y1 / RFB_DAMAGE_TILE_SIZE;
+             ty <= (rect.y2 - 1) / RFB_DAMAGE_TILE_SIZE; ty++)
+            for (tx = rect.x1 / RFB_DAMAGE_TILE_SIZE;
+                 tx <= (rect.x2 - 1) / RFB_DAMAGE_TILE_SIZE; tx++) {
+                tile = &tracker->tiles[ty * tracker->cols + tx];
+                ageTile(tile, slot);
+                /* the heat map counts slots, not calls */
+                if (!(tile->history & 1)) {
+                    tile->history |= 1;
+                    tile->count++;
+                }
+            }
+    }
+    sraRgnReleaseIterator(i);
+
+    UNLOCK(tracker->mutex);
+}
+
+
+static void
+classifyTiles(rfbVideoTracker *tracker, unsigned long slot)
+{
+    rfbDamageTile *tile;
+    int tx, ty, x, y, n, neighbours, x1;
+
+    for (ty = 0; ty < tracker->rows; ty++)
+        for (tx = 0; tx < tracker->cols; tx++) {
+            tile = &tracker->tiles[ty * tracker->cols + tx];
+            ageTile(tile, slot);
+            n = countBits(tile->history & VIDEO_WINDOW_MASK);
+            tile->hot = n >= (tile->video ? VIDEO_LEAVE_SLOTS : VIDEO_ENTER_SLOTS);
+        }
+
+    for (ty = 0; ty < tracker->rows; ty++)
+        for (tx = 0; tx < tracker->cols; tx++) {
+            tile = &tracker->tiles[ty * tracker->cols + tx];
+            neighbours = 0;
+            if (tile->hot)
+                for (y = ty - 1; y <= ty + 1; y++)
+                    for (x = tx - 1; x <= tx + 1; x++)
+                        if ((x != tx || y != ty) && x >= 0 && y >= 0 &&
+                            x < tracker->cols && y < tracker->rows &&
+                            tracker->tiles[y * tracker->cols + x].hot)
+                            neighbours++;
+            tile->video = neighbours >= VIDEO_MIN_NEIGHBOURS;
+        }
+
+    /* one rect per run of video tiles in a row, sraRgnOr() merges them */
+    sraRgnMakeEmpty(tracker->videoRegion);
+    for (ty = 0; ty < tracker->rows; ty++)
+        for (tx = 0; tx < tracker->cols; tx++) {
+            if (!tracker->tiles[ty * tracker->cols + tx].video)
+                continue;
+            for (x1 = tx; x1 < tracker->cols && tracker->tiles[ty * tracker->cols + x1].video; x1++)
+                ;
+            {
+                sraRegionPtr run = sraRgnCreateRect(tx * RFB_DAMAGE_TILE_SIZE,
+                                                    ty * RFB_DAMAGE_TILE_SIZE,
+                                                    x1 * RFB_DAMAGE_TILE_SIZE,
+                                                    (ty + 1) * RFB_DAMAGE_TILE_SIZE);
+                sraRgnOr(tracker->videoRegion, run);
+                sraRgnDestroy(run);
+            }
+            tx = x1;
+        }
+    {
+        sraRegionPtr screenRect = sraRgnCreateRect(0, 0, tracker->width, tracker->height);
+        sraRgnAnd(tracker->videoRegion, screenRect);
+        sraRgnDestroy(screenRect);
+    }
+    tracker->classifiedSlot = slot;
+}
+
+
+sraRegionPtr
+rfbGetVideoRegion(rfbScreenInfoPtr screen)
+{
+    rfbVideoTracker *tracker = screen->videoTracker;
+    unsigned long slot = rfbNowMs() / VIDEO_SLOT_MS;
+    sraRegionPtr region = NULL;
+
+    if (tracker == NULL)
+        return NULL;
+
+    LOCK(tracker->mutex);
+    if (checkTiles(tracker, screen)) {
+        if (tracker->classifiedSlot != slot)
+            classifyTiles(tracker, slot);
+        if (!sraRgnEmpty(tracker->videoRegion))
+            region = sraRgnCreateRgn(tracker->videoRegion);
+    }
+    UNLOCK(tracker->mutex);
+
+    return region;
+}
+
+
+int
+rfbVideoFrameWait(rfbClientPtr cl)
+{
+    unsigned long interval, elapsed;
+
+    if (cl->screen->videoFrameRate <= 0 || cl->lastVideoFrameMs == 0)
+        return 0;
+
+    interval = 1000UL / cl->screen->videoFrameRate;
+    elapsed = rfbNowMs() - cl->lastVideoFrameMs;
+    return elapsed >= interval ? 0 : (int)(interval - elapsed);
+}
+
+
+rfbBool
+rfbVideoFrameDue(rfbClientPtr cl)
+{
+    if (rfbVideoFrameWait(cl) > 0)
+        return FALSE;
+
+    cl->lastVideoFrameMs = rfbNowMs();
+    return TRUE;
+}
@@ -66,17 +66,21 @@ Upgrade: websocket\r\n\
 Connection: Upgrade\r\n\
 Sec-WebSocket-Accept: %s\r\n\
 Sec-WebSocket-Protocol: %s\r\n\
+%s\
 \r\n"
 
 #define SERVER_HANDSHAKE_HYBI_NO_PROTOCOL "HTTP/1.1 101 Switching Protocols\r\n\
 Upgrade: websocket\r\n\
 Connection: Upgrade\r\n\
 Sec-WebSocket-Accept: %s\r\n\
+%s\
 \r\n"
 
 #define WEBSOCKETS_CLIENT_CONNECT_WAIT_MS 100
 #define WEBSOCKETS_CLIENT_SEND_WAIT_MS 100
 #define WEBSOCKETS_MAX_HANDSHAKE_LEN 4096
+/* longest server frame header, frames are not masked */
+#define WEBSOCKETS_MAX_SERVER_HEADER_LEN 10
 
 #if defined(__linux__) && defined(NEED_TIMEVAL)
 struct timeval
@@ -92,12 +96,122 @@ static int webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char
 
 static int ws_read(void *cl, char *buf, size_t len);
 
+static void webSocketsFreeContext(ws_ctx_t *wsctx);
+
 
 static int
 min (int a, int b) {
     return a < b ? a : b;
 }
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+static char *
+wsTrim(char *s)
+{
+    char *end;
+
+    while (*s == ' ' || *s == '\t')
+        s++;
+    end = s + strlen(s);
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+    return s;
+}
+
+/*
+ * Looks for a permessage-deflate offer we can accept in the value of
+ * Sec-WebSocket-Extensions, RFC 7692 section 7, and gets the window bits
+ * to compress with and whether the client wants every message compressed
+ * on its own. extensions is cut up on the way.
+ */
+static rfbBool
+webSocketsAcceptDeflate(char *extensions, int maxWindowBits,
+                        int *windowBits, int *noContextTakeover)
+{
+    char *offer, *nextOffer, *param, *nextParam, *value;
+    int bits, noTakeover, seen;
+
+    for (offer = extensions; offer; offer = nextOffer) {
+        if ((nextOffer = strchr(offer, ',')) != NULL)
+            *nextOffer++ = '\0';
+        if ((nextParam = strchr(offer, ';')) != NULL)
+            *nextParam++ = '\0';
+        if (strcasecmp(wsTrim(offer), "permessage-deflate") != 0)
+            continue;
+
+        bits = maxWindowBits;
+        noTakeover = FALSE;
+        seen = 0;
+        for (param = nextParam; param; param = nextParam) {
+            if ((nextParam = strchr(param, ';')) != NULL)
+                *nextParam++ = '\0';
+            if ((value = strchr(param, '=')) != NULL) {
+                *value++ = '\0';
+                value = wsTrim(value);
+                if (*value == '"' && strlen(value) >= 2) {
+                    value[strlen(value) - 1] = '\0';
+                    value++;
+                }
+            }
+            param = wsTrim(param);
+
+            if (strcasecmp(param, "server_no_context_takeover") == 0 && !value
+                && !(seen & 1)) {
+                noTakeover = TRUE;
+                seen |= 1;
+            } else if (strcasecmp(param, "client_no_context_takeover") == 0 && !value
+                       && !(seen & 2)) {
+                /* the inflater copes either way */
+                seen |= 2;
+            } else if (strcasecmp(param, "server_max_window_bits") == 0 && value
+                       && !(seen & 4)) {
+                int n = atoi(value);
+                /* zlib cannot do raw deflate with a window of 8 bits */
+                if (n < 9 || n > 15)
+                    break;
+                if (n < bits)
+                    bits = n;
+                seen |= 4;
+            } else if (strcasecmp(param, "client_max_window_bits") == 0
+                       && !(seen & 8)) {
+                /* we inflate with the largest window anyway */
+                if (value && (atoi(value) < 8 || atoi(value) > 15))
+                    break;
+                seen |= 8;
+            } else {
+                break;
+            }
+        }
+        if (param)
+            continue; /* something we did not like */
+
+        *windowBits = bits;
+        *noContextTakeover = noTakeover;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static rfbBool
+webSocketsInitDeflate(ws_ctx_t *wsctx, int level, int windowBits, int noContextTakeover)
+{
+    if (deflateInit2(&wsctx->deflateStream, level, Z_DEFLATED, -windowBits,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        rfbErr("webSocketsHandshake: deflateInit2 failed\n");
+        return FALSE;
+    }
+    if (inflateInit2(&wsctx->inflateStream, -15) != Z_OK) {
+        rfbErr("webSocketsHandshake: inflateInit2 failed\n");
+        deflateEnd(&wsctx->deflateStream);
+        return FALSE;
+    }
+    wsctx->deflate = TRUE;
+    wsctx->deflateNoContextTakeover = noContextTakeover;
+    wsctx->deflateWindowBits = windowBits;
+    return TRUE;
+}
+#endif
+
 static void webSocketsGenSha1Key(char *target, int size, char *key)
 {
     unsigned char hash[SHA1_HASH_SIZE];
@@ -165,6 +279,7 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
     int n, linestart = 0, len = 0, llen, base64 = FALSE;
     char *path = NULL, *host = NULL, *origin = NULL, *protocol = NULL;
     char *key1 = NULL, *key2 = NULL;
+    char *extensions = NULL, extensionsResponse[128] = "";
     char *sec_ws_origin = NULL;
     char *sec_ws_key = NULL;
     char sec_ws_version = 0;
@@ -260,6 +375,9 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
             } else if ((strncasecmp("sec-websocket-version: ", line, min(llen,23))) == 0) {
                 sec_ws_version = strtol(line+23, NULL, 10);
                 buf[len-2] = '\0';
+            } else if ((strncasecmp("sec-websocket-extensions: ", line, min(llen,26))) == 0) {
+                extensions = line+26;
+                buf[len-2] = '\0';
             }
 
             linestart = len;
@@ -302,6 +420,38 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
         }
     }
 
+    wsctx = calloc(1, sizeof(ws_ctx_t));
+    if (!wsctx) {
+        rfbErr("webSocketsHandshake: could not allocate memory for context\n");
+        free(response);
+        free(buf);
+        return FALSE;
+    }
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    /*
+     * Compressing base64 would need compressed text frames, which are not
+     * worth it for a protocol that is on its way out.
+     */
+    if (extensions && !base64 && cl->screen->wsDeflateLevel > 0) {
+        int windowBits, noContextTakeover, maxWindowBits = cl->screen->wsDeflateWindowBits;
+        char bitsParam[32] = "";
+
+        if (maxWindowBits < 9 || maxWindowBits > 15)
+            maxWindowBits = 15;
+        if (webSocketsAcceptDeflate(extensions, maxWindowBits, &windowBits, &noContextTakeover)
+            && webSocketsInitDeflate(wsctx, cl->screen->wsDeflateLevel, windowBits, noContextTakeover)) {
+            if (windowBits < 15)
+                snprintf(bitsParam, sizeof(bitsParam), "; server_max_window_bits=%d", windowBits);
+            snprintf(extensionsResponse, sizeof(extensionsResponse),
+                     "Sec-WebSocket-Extensions: permessage-deflate%s%s\r\n",
+                     noContextTakeover ? "; server_no_context_takeover" : "", bitsParam);
+            rfbLog("  - webSocketsHandshake: using permessage-deflate, %d window bits%s\n",
+                   windowBits, noContextTakeover ? ", no context takeover" : "");
+        }
+    }
+#endif
+
     /*
      * Generate the WebSockets server response based on the the headers sent
      * by the client.
@@ -312,27 +462,23 @@ webSocketsHandshake(rfbClientPtr cl, char *scheme)
 
     if(strlen(protocol) > 0) {
         len = snprintf(response, WEBSOCKETS_MAX_HANDSHAKE_LEN,
-                 SERVER_HANDSHAKE_HYBI, accept, protocol);
+                 SERVER_HANDSHAKE_HYBI, accept, protocol, extensionsResponse);
     } else {
         len = snprintf(response, WEBSOCKETS_MAX_HANDSHAKE_LEN,
-                       SERVER_HANDSHAKE_HYBI_NO_PROTOCOL, accept);
+                       SERVER_HANDSHAKE_HYBI_NO_PROTOCOL, accept, extensionsResponse);
     }
 
     if (rfbWriteExact(cl, response, len) < 0) {
         rfbErr("webSocketsHandshake: failed sending WebSockets response\n");
         free(response);
         free(buf);
+        webSocketsFreeContext(wsctx);
         return FALSE;
     }
     /* rfbLog("webSocketsHandshake: %s\n", response); */
     free(response);
     free(buf);
 
-    wsctx = calloc(1, sizeof(ws_ctx_t));
-    if (!wsctx) {
-        rfbErr("webSocketsHandshake: could not allocate memory for context\n");
-        return FALSE;
-    }
     wsctx->encode = webSocketsEncodeHybi;
     wsctx->decode = webSocketsDecodeHybi;
     wsctx->ctxInfo.readFunc = ws_read;
@@ -355,12 +501,64 @@ ws_read(void *ctxPtr, char *buf, size_t len)
     return n;
 }
 
+/* puts a frame header for a payload of blen bytes at dst, returns its length */
+static int
+webSocketsPutHeader(char *dst, unsigned char b0, int blen)
+{
+    ws_header_t *header = (ws_header_t *)dst;
+
+    header->b0 = b0;
+    if (blen <= 125) {
+      header->b1 = (uint8_t)blen;
+      return 2;
+    } else if (blen <= 65536) {
+      header->b1 = 0x7e;
+      header->u.s16.l16 = WS_HTON16((uint16_t)blen);
+      return 4;
+    } else {
+      header->b1 = 0x7f;
+      header->u.s64.l64 = WS_HTON64(blen);
+      return 10;
+    }
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/*
+ * Compresses one message into out, RFC 7692 section 7.2.1. Returns the
+ * compressed length, 0 if the message is better sent as it is, or -1.
+ */
+static int
+webSocketsDeflate(ws_ctx_t *wsctx, const char *src, int len, char *out, int outSize)
+{
+    z_stream *zs = &wsctx->deflateStream;
+    int n;
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *)out;
+    zs->avail_out = outSize;
+    if (deflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in > 0 || zs->avail_out == 0) {
+        rfbErr("%s: deflate failed\n", __func__);
+        return -1;
+    }
+    /* the 00 00 ff ff the flush ends with is left out */
+    n = outSize - zs->avail_out - 4;
+
+    if (wsctx->deflateNoContextTakeover) {
+        deflateReset(zs);
+        /* with no history to keep in step, the client does not mind */
+        if (n >= len)
+            return 0;
+    }
+    return n;
+}
+#endif
+
 static int
 webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
 {
     int blen, ret = -1, sz = 0;
     unsigned char opcode = '\0'; /* TODO: option! */
-    ws_header_t *header;
     ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
 
 
@@ -381,7 +579,31 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
       return -1;
     }
 
-    header = (ws_header_t *)wsctx->codeBufEncode;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    /*
+     * Data of encodings which compress themselves, see rfbClientRec's
+     * compressedUpdate, is not worth the effort. Compressed frames are put
+     * behind room for the longest header, which then goes right in front
+     * of them.
+     */
+    if (wsctx->deflate && !cl->compressedUpdate) {
+        char *payload = wsctx->codeBufEncode + WEBSOCKETS_MAX_SERVER_HEADER_LEN;
+
+        blen = webSocketsDeflate(wsctx, src, len, payload,
+                                 sizeof(wsctx->codeBufEncode) - WEBSOCKETS_MAX_SERVER_HEADER_LEN);
+        if (blen < 0)
+            return -1;
+        if (blen > 0) {
+            char tmp[WEBSOCKETS_MAX_SERVER_HEADER_LEN];
+
+            /* FIN, RSV1 for compressed */
+            sz = webSocketsPutHeader(tmp, 0x80 | 0x40 | WS_OPCODE_BINARY_FRAME, blen);
+            memcpy(payload - sz, tmp, sz);
+            *dst = payload - sz;
+            return sz + blen;
+        }
+    }
+#endif
 
     if (wsctx->base64) {
         opcode = WS_OPCODE_TEXT_FRAME;
@@ -392,19 +614,7 @@ webSocketsEncodeHybi(rfbClientPtr cl, const char *src, int len, char **dst)
         blen = len;
     }
 
-    header->b0 = 0x80 | (opcode & 0x0f);
-    if (blen <= 125) {
-      header->b1 = (uint8_t)blen;
-      sz = 2;
-    } else if (blen <= 65536) {
-      header->b1 = 0x7e;
-      header->u.s16.l16 = WS_HTON16((uint16_t)blen);
-      sz = 4;
-    } else {
-      header->b1 = 0x7f;
-      header->u.s64.l64 = WS_HTON64(blen);
-      sz = 10;
-    }
+    sz = webSocketsPutHeader(wsctx->codeBufEncode, 0x80 | (opcode & 0x0f), blen);
 
     if (wsctx->base64) {
         if (-1 == (ret = rfbBase64NtoP((unsigned char *)src, len, wsctx->codeBufEncode + sz, sizeof(wsctx->codeBufEncode) - sz))) {
@@ -438,6 +648,44 @@ webSocketsDecode(rfbClientPtr cl, char *dst, int len)
     return webSocketsDecodeHybi(wsctx, dst, len);
 }
 
+static void
+webSocketsFreeContext(ws_ctx_t *wsctx)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (wsctx->deflate) {
+        deflateEnd(&wsctx->deflateStream);
+        inflateEnd(&wsctx->inflateStream);
+    }
+    free(wsctx->inflateBuf);
+#endif
+    free(wsctx);
+}
+
+void
+webSocketsFree(rfbClientPtr cl)
+{
+    if (cl->wsctx) {
+        webSocketsFreeContext((ws_ctx_t *)cl->wsctx);
+        cl->wsctx = NULL;
+    }
+}
+
+/* the zlib streams are estimated as in zconf.h */
+size_t
+webSocketsMemoryUsage(rfbClientPtr cl)
+{
+    ws_ctx_t *wsctx = (ws_ctx_t *)cl->wsctx;
+    size_t n = sizeof(ws_ctx_t);
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (wsctx->deflate)
+        n += ((size_t)1 << (wsctx->deflateWindowBits + 2)) + ((size_t)1 << (8 + 9))
+             + ((size_t)1 << 15) + 7 * 1024;
+    n += wsctx->inflateBufSize;
+#endif
+    return n;
+}
+
 /**
  * This is a stub function that was once used for Hixie-encoding.
  * We keep it for API compatibility.
@@ -200,6 +200,22 @@ hybiReadHeader(ws_ctx_t *wsctx, int *sockRet, int *nPayload)
     }
   }
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  /* RSV1 marks a compressed message and is only set on its first frame */
+  if (wsctx->header.data->b0 & 0x40) {
+    if (!wsctx->deflate || isControlFrame(wsctx)
+        || (wsctx->header.data->b0 & 0x0f) == WS_OPCODE_CONTINUATION) {
+      rfbErr("%s: unexpected RSV1 bit; b0=%02x\n", __func__, wsctx->header.data->b0);
+      errno = EPROTO;
+      goto err_cleanup_state;
+    }
+    wsctx->compressedMessage = 1;
+  } else if (!isControlFrame(wsctx)
+             && (wsctx->header.data->b0 & 0x0f) != WS_OPCODE_CONTINUATION) {
+    wsctx->compressedMessage = 0;
+  }
+#endif
+
   wsctx->header.payloadLen = (uint64_t)(wsctx->header.data->b1 & 0x7f);
   ws_dbg("first header bytes received; opcode=%d lenbyte=%d fin=%d\n", wsctx->header.opcode, wsctx->header.payloadLen, wsctx->header.fin);
 
@@ -315,6 +331,68 @@ hybiPayloadStart(ws_ctx_t *wsctx)
 }
 
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/**
+ * Inflate len bytes into wsctx->inflateBuf behind the n bytes already
+ * there, growing it as needed.
+ *
+ * @return number of bytes in wsctx->inflateBuf or -1 on error
+ */
+static int
+hybiInflateInto(ws_ctx_t *wsctx, const unsigned char *src, int len, int n)
+{
+  z_stream *zs = &wsctx->inflateStream;
+  int ret;
+
+  zs->next_in = (Bytef *)src;
+  zs->avail_in = len;
+  do {
+    if (n == wsctx->inflateBufSize) {
+      int size = wsctx->inflateBufSize ? 2 * wsctx->inflateBufSize : 4096;
+      char *buf = realloc(wsctx->inflateBuf, size);
+      if (!buf) {
+        rfbErr("%s: out of memory\n", __func__);
+        return -1;
+      }
+      wsctx->inflateBuf = buf;
+      wsctx->inflateBufSize = size;
+    }
+    zs->next_out = (Bytef *)wsctx->inflateBuf + n;
+    zs->avail_out = wsctx->inflateBufSize - n;
+    ret = inflate(zs, Z_SYNC_FLUSH);
+    if (ret == Z_STREAM_END) {
+      /* a final block ends the message, the next one starts afresh */
+      inflateReset(zs);
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      rfbErr("%s: inflate failed; %d\n", __func__, ret);
+      return -1;
+    }
+    n = wsctx->inflateBufSize - zs->avail_out;
+  } while (zs->avail_in > 0 || zs->avail_out == 0);
+
+  return n;
+}
+
+/**
+ * Inflate the payload bytes of a compressed message that were just
+ * unmasked. The sender leaves out the 00 00 ff ff every message ends with,
+ * RFC 7692 7.2.2, so that is added after the last frame.
+ *
+ * @return number of inflated bytes in wsctx->inflateBuf or -1 on error
+ */
+static int
+hybiInflate(ws_ctx_t *wsctx, const unsigned char *src, int len)
+{
+  static const unsigned char tail[4] = { 0x00, 0x00, 0xff, 0xff };
+  int n = hybiInflateInto(wsctx, src, len, 0);
+
+  if (n >= 0 && wsctx->header.fin && hybiRemaining(wsctx) == 0)
+    n = hybiInflateInto(wsctx, tail, sizeof(tail), n);
+  return n;
+}
+#endif
+
+
 /**
  * Read the remaining payload bytes from associated raw socket.
  *
@@ -456,6 +534,15 @@ hybiReadAndDecode(ws_ctx_t *wsctx, char *dst, int len, int *sockRet, int nInBuf)
       }
       break;
     case WS_OPCODE_TEXT_FRAME:
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+      if (wsctx->compressedMessage) {
+        /* not negotiated together with base64, see websockets.c */
+        rfbErr("%s: compressed text frames are not supported\n", __func__);
+        errno = EPROTO;
+        *sockRet = -1;
+        return WS_HYBI_STATE_ERR;
+      }
+#endif
       data[toReturn] = '\0';
       ws_dbg("Initiate Base64 decoding in %p with max size %d and '\\0' at %p\n", data, bufsize, data + toReturn);
       if (-1 == (wsctx->readlen = rfbBase64PtoN((char *)data, data, bufsize))) {
@@ -464,6 +551,16 @@ hybiReadAndDecode(ws_ctx_t *wsctx, char *dst, int len, int *sockRet, int nInBuf)
       wsctx->writePos = hybiPayloadStart(wsctx);
       break;
     case WS_OPCODE_BINARY_FRAME:
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+      if (wsctx->compressedMessage) {
+        if (-1 == (toReturn = hybiInflate(wsctx, data, toReturn))) {
+          errno = EPROTO;
+          *sockRet = -1;
+          return WS_HYBI_STATE_ERR;
+        }
+        data = (unsigned char *)wsctx->inflateBuf;
+      }
+#endif
       wsctx->readlen = toReturn;
       wsctx->writePos = hybiPayloadStart(wsctx);
       ws_dbg("set readlen=%d writePos=%p\n", wsctx->readlen, wsctx->writePos);
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <rfb/rfb.h>
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #if defined(__APPLE__)
 
@@ -132,6 +135,17 @@ struct ws_ctx_s {
     wsEncodeFunc encode;
     wsDecodeFunc decode;
     ctxInfo_t ctxInfo;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    /* permessage-deflate, RFC 7692 */
+    int deflate;                           /* negotiated */
+    int deflateNoContextTakeover;
+    int deflateWindowBits;
+    int compressedMessage;                 /* RSV1 of the message being read */
+    z_stream deflateStream;
+    z_stream inflateStream;
+    char *inflateBuf;
+    int inflateBufSize;
+#endif
 };
 
 enum
@@ -0,0 +1,538 @@
+/*
+ * x11capture.c - serve what an X display shows.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * The DAMAGE extension tells which parts of the root window changed, so
+ * nothing has to be compared or read twice. With MIT-SHM the framebuffer
+ * is a shared memory segment the X server reads the damage into directly.
+ * XShmGetImage() cannot write with a stride, so the damaged rows are read
+ * at full width, one request per band of rows; only the damaged rects are
+ * marked as modified. Without MIT-SHM, as on remote displays, each damaged
+ * rect is read with XGetSubImage().
+ *
+ * The X server does not draw the cursor into what it returns, so XFIXES
+ * provides its image, which becomes an alpha blended rich cursor, and the
+ * pointer position is polled on every call of rfbX11CaptureProcessEvents().
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#define _SVID_SOURCE
+#endif
+#include <errno.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/select.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+
+struct _rfbX11Capture {
+    Display *dpy;
+    Window root;
+    rfbScreenInfoPtr screen;
+    int width, height;
+
+    int damageEventBase;
+    int fixesEventBase;
+    Damage damage;
+    XserverRegion damageParts;
+
+    /* covers the whole framebuffer */
+    XImage *image;
+    rfbBool useShm;
+    XShmSegmentInfo shm;
+
+    unsigned long cursorSerial;
+};
+
+static int trappedErrorCode;
+
+static int
+trapErrors(Display *dpy, XErrorEvent *error)
+{
+    trappedErrorCode = error->error_code;
+    return 0;
+}
+
+
+static int
+shiftOf(unsigned long mask)
+{
+    int shift = 0;
+
+    if (mask == 0)
+        return 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+
+static rfbBool
+createShmImage(rfbX11Capture *capture, Visual *visual, int depth)
+{
+    XErrorHandler oldHandler;
+
+    capture->image = XShmCreateImage(capture->dpy, visual, depth, ZPixmap, NULL,
+                                     &capture->shm, capture->width, capture->height);
+    if (capture->image == NULL)
+        return FALSE;
+
+    capture->shm.shmid = shmget(IPC_PRIVATE,
+                                (size_t)capture->image->bytes_per_line * capture->height,
+                                IPC_CREAT | 0600);
+    if (capture->shm.shmid < 0) {
+        rfbLogPerror("rfbX11CaptureNew: shmget");
+        XDestroyImage(capture->image);
+        capture->image = NULL;
+        return FALSE;
+    }
+    capture->shm.shmaddr = capture->image->data = (char *)shmat(capture->shm.shmid, NULL, 0);
+    if (capture->shm.shmaddr == (char *)-1) {
+        rfbLogPerror("rfbX11CaptureNew: shmat");
+        shmctl(capture->shm.shmid, IPC_RMID, NULL);
+        capture->image->data = NULL;
+        XDestroyImage(capture->image);
+        capture->image = NULL;
+        return FALSE;
+    }
+    capture->shm.readOnly = False;
+
+    /* a remote X server cannot attach, and says so with an error */
+    XSync(capture->dpy, False);
+    trappedErrorCode = 0;
+    oldHandler = XSetErrorHandler(trapErrors);
+    XShmAttach(capture->dpy, &capture->shm);
+    XSync(capture->dpy, False);
+    XSetErrorHandler(oldHandler);
+
+    /* gone once both sides have detached */
+    shmctl(capture->shm.shmid, IPC_RMID, NULL);
+
+    if (trappedErrorCode != 0) {
+        shmdt(capture->shm.shmaddr);
+        capture->image->data = NULL;
+        XDestroyImage(capture->image);
+        capture->image = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+static rfbBool
+createImage(rfbX11Capture *capture, Visual *visual, int depth)
+{
+    char *data;
+
+    capture->image = XCreateImage(capture->dpy, visual, depth, ZPixmap, 0, NULL,
+                                  capture->width, capture->height, 32, 0);
+    if (capture->image == NULL)
+        return FALSE;
+    data = (char *)malloc((size_t)capture->image->bytes_per_line * capture->height);
+    if (data == NULL) {
+        XDestroyImage(capture->image);
+        capture->image = NULL;
+        return FALSE;
+    }
+    capture->image->data = data;
+    return TRUE;
+}
+
+
+/* reads full width rows y1 to y2 straight into the framebuffer */
+static void
+readBand(rfbX11Capture *capture, int y1, int y2)
+{
+    XImage *image = capture->image;
+
+    image->height = y2 - y1;
+    image->data = capture->shm.shmaddr + (size_t)y1 * image->bytes_per_line;
+    XShmGetImage(capture->dpy, capture->root, image, 0, y1, AllPlanes);
+    image->data = capture->shm.shmaddr;
+    image->height = capture->height;
+}
+
+
+static void
+readRegion(rfbX11Capture *capture, sraRegionPtr region)
+{
+    sraRectangleIterator *i;
+    sraRegionPtr bands;
+    sraRect rect;
+
+    if (!capture->useShm) {
+        i = sraRgnGetIterator(region);
+        while (sraRgnIteratorNext(i, &rect))
+            XGetSubImage(capture->dpy, capture->root, rect.x1, rect.y1,
+                         rect.x2 - rect.x1, rect.y2 - rect.y1, AllPlanes, ZPixmap,
+                         capture->image, rect.x1, rect.y1);
+        sraRgnReleaseIterator(i);
+        return;
+    }
+
+    /* rects next to each other share their rows */
+    bands = sraRgnCreate();
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        sraRegionPtr band = sraRgnCreateRect(0, rect.y1, capture->width, rect.y2);
+        sraRgnOr(bands, band);
+        sraRgnDestroy(band);
+    }
+    sraRgnReleaseIterator(i);
+
+    i = sraRgnGetIterator(bands);
+    while (sraRgnIteratorNext(i, &rect))
+        readBand(capture, rect.y1, rect.y2);
+    sraRgnReleaseIterator(i);
+    sraRgnDestroy(bands);
+}
+
+
+/* collects what was damaged since the last call */
+static sraRegionPtr
+fetchDamage(rfbX11Capture *capture)
+{
+    sraRegionPtr region = sraRgnCreate();
+    XRectangle *rects;
+    int i, n;
+
+    XDamageSubtract(capture->dpy, capture->damage, None, capture->damageParts);
+    rects = XFixesFetchRegion(capture->dpy, capture->damageParts, &n);
+    if (rects == NULL)
+        return region;
+
+    for (i = 0; i < n; i++) {
+        sraRegionPtr r = sraRgnCreateRect(rects[i].x, rects[i].y,
+                                          rects[i].x + rects[i].width,
+                                          rects[i].y + rects[i].height);
+        sraRgnOr(region, r);
+        sraRgnDestroy(r);
+    }
+    XFree(rects);
+
+    {
+        sraRegionPtr screenRect = sraRgnCreateRect(0, 0, capture->width, capture->height);
+        sraRgnAnd(region, screenRect);
+        sraRgnDestroy(screenRect);
+    }
+    return region;
+}
+
+
+static void
+storePixel(rfbPixelFormat *format, unsigned char *dst, uint32_t pixel)
+{
+    int k, bpp = format->bitsPerPixel / 8;
+
+    for (k = 0; k < bpp; k++)
+        dst[format->bigEndian ? bpp - 1 - k : k] = (unsigned char)(pixel >> (8 * k));
+}
+
+
+static void
+updateCursorShape(rfbX11Capture *capture)
+{
+    rfbScreenInfoPtr screen = capture->screen;
+    rfbPixelFormat *format = &screen->serverFormat;
+    int bpp = format->bitsPerPixel / 8;
+    XFixesCursorImage *image;
+    rfbCursorPtr cursor;
+    int i, n;
+
+    image = XFixesGetCursorImage(capture->dpy);
+    if (image == NULL)
+        return;
+    if (image->cursor_serial == capture->cursorSerial && screen->cursor != NULL) {
+        XFree(image);
+        return;
+    }
+    capture->cursorSerial = image->cursor_serial;
+
+    n = image->width * image->height;
+    cursor = (rfbCursorPtr)calloc(1, sizeof(rfbCursor));
+    if (cursor == NULL) {
+        XFree(image);
+        return;
+    }
+    cursor->width = image->width;
+    cursor->height = image->height;
+    cursor->xhot = image->xhot;
+    cursor->yhot = image->yhot;
+    cursor->richSource = (unsigned char *)malloc((size_t)n * bpp);
+    cursor->alphaSource = (unsigned char *)malloc(n);
+    cursor->cleanup = cursor->cleanupRichSource = TRUE;
+    if (cursor->richSource == NULL || cursor->alphaSource == NULL) {
+        rfbFreeCursor(cursor);
+        XFree(image);
+        return;
+    }
+
+    /* XFixes hands out premultiplied ARGB in the low 32 bits of a long */
+    for (i = 0; i < n; i++) {
+        unsigned long argb = image->pixels[i];
+        uint32_t r = (argb >> 16) & 0xff, g = (argb >> 8) & 0xff, b = argb & 0xff;
+
+        storePixel(format, cursor->richSource + i * bpp,
+                   (r * format->redMax / 255) << format->redShift |
+                   (g * format->greenMax / 255) << format->greenShift |
+                   (b * format->blueMax / 255) << format->blueShift);
+        cursor->alphaSource[i] = (unsigned char)(argb >> 24);
+    }
+    cursor->alphaPreMultiplied = TRUE;
+
+    /* for clients without rich cursors */
+    cursor->mask = (unsigned char *)rfbMakeMaskFromAlphaSource(cursor->width, cursor->height,
+                                                               cursor->alphaSource);
+    cursor->cleanupMask = TRUE;
+    rfbMakeXCursorFromRichCursor(screen, cursor);
+
+    XFree(image);
+    rfbSetCursor(screen, cursor);
+}
+
+
+static void
+updateCursorPosition(rfbX11Capture *capture)
+{
+    rfbScreenInfoPtr screen = capture->screen;
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr cl;
+    Window root, child;
+    int x, y, winX, winY;
+    unsigned int mask;
+
+    if (!XQueryPointer(capture->dpy, capture->root, &root, &child, &x, &y,
+                       &winX, &winY, &mask))
+        return;
+    if (x == screen->cursorX && y == screen->cursorY)
+        return;
+
+    LOCK(screen->cursorMutex);
+    screen->cursorX = x;
+    screen->cursorY = y;
+    UNLOCK(screen->cursorMutex);
+
+    /* nothing was modified, so output threads have to be woken up */
+    iterator = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        LOCK(cl->updateMutex);
+        if (cl->enableCursorPosUpdates)
+            cl->cursorWasMoved = TRUE;
+        TSIGNAL(cl->updateCond);
+        UNLOCK(cl->updateMutex);
+    }
+    rfbReleaseClientIterator(iterator);
+}
+
+
+rfbX11Capture *
+rfbX11CaptureNew(int *argc, char **argv, const char *displayName)
+{
+    rfbX11Capture *capture;
+    XWindowAttributes attributes;
+    rfbPixelFormat *format;
+    rfbScreenInfoPtr screen;
+    int error, major, minor;
+    Bool sharedPixmaps;
+
+    capture = (rfbX11Capture *)calloc(1, sizeof(rfbX11Capture));
+    if (capture == NULL)
+        return NULL;
+
+    capture->dpy = XOpenDisplay(displayName);
+    if (capture->dpy == NULL) {
+        rfbErr("rfbX11CaptureNew: cannot open display %s\n", XDisplayName(displayName));
+        free(capture);
+        return NULL;
+    }
+    capture->root = DefaultRootWindow(capture->dpy);
+
+    if (!XDamageQueryExtension(capture->dpy, &capture->damageEventBase, &error) ||
+        !XDamageQueryVersion(capture->dpy, &major, &minor)) {
+        rfbErr("rfbX11CaptureNew: the display has no DAMAGE extension\n");
+        goto fail;
+    }
+    if (!XFixesQueryExtension(capture->dpy, &capture->fixesEventBase, &error) ||
+        !XFixesQueryVersion(capture->dpy, &major, &minor)) {
+        rfbErr("rfbX11CaptureNew: the display has no XFIXES extension\n");
+        goto fail;
+    }
+
+    XGetWindowAttributes(capture->dpy, capture->root, &attributes);
+    if (attributes.visual->class != TrueColor) {
+        rfbErr("rfbX11CaptureNew: only TrueColor displays are supported\n");
+        goto fail;
+    }
+    capture->width = attributes.width;
+    capture->height = attributes.height;
+
+    capture->useShm = XShmQueryVersion(capture->dpy, &major, &minor, &sharedPixmaps) &&
+                      createShmImage(capture, attributes.visual, attributes.depth);
+    if (!capture->useShm && !createImage(capture, attributes.visual, attributes.depth)) {
+        rfbErr("rfbX11CaptureNew: out of memory\n");
+        goto fail;
+    }
+    if (capture->image->bits_per_pixel != 8 && capture->image->bits_per_pixel != 16 &&
+        capture->image->bits_per_pixel != 32) {
+        rfbErr("rfbX11CaptureNew: %d bits per pixel are not supported\n",
+               capture->image->bits_per_pixel);
+        goto fail;
+    }
+    rfbLog("Capturing %dx%d at depth %d from %s%s\n", capture->width, capture->height,
+           attributes.depth, DisplayString(capture->dpy), capture->useShm ? " with MIT-SHM" : "");
+
+    screen = rfbGetScreen(argc, argv, capture->width, capture->height, 8, 3,
+                          capture->image->bits_per_pixel / 8);
+    if (screen == NULL)
+        goto fail;
+    capture->screen = screen;
+    screen->frameBuffer = capture->image->data;
+    screen->paddedWidthInBytes = capture->image->bytes_per_line;
+    screen->depth = capture->image->depth;
+
+    format = &screen->serverFormat;
+    format->depth = capture->image->depth;
+    format->bigEndian = capture->image->byte_order == MSBFirst;
+    format->trueColour = TRUE;
+    format->redShift = shiftOf(capture->image->red_mask);
+    format->greenShift = shiftOf(capture->image->green_mask);
+    format->blueShift = shiftOf(capture->image->blue_mask);
+    format->redMax = capture->image->red_mask >> format->redShift;
+    format->greenMax = capture->image->green_mask >> format->greenShift;
+    format->blueMax = capture->image->blue_mask >> format->blueShift;
+
+    /* damage from now on, then everything there is */
+    capture->damage = XDamageCreate(capture->dpy, capture->root, XDamageReportNonEmpty);
+    capture->damageParts = XFixesCreateRegion(capture->dpy, NULL, 0);
+    XFixesSelectCursorInput(capture->dpy, capture->root, XFixesDisplayCursorNotifyMask);
+    {
+        sraRegionPtr all = sraRgnCreateRect(0, 0, capture->width, capture->height);
+        readRegion(capture, all);
+        sraRgnDestroy(all);
+    }
+    updateCursorShape(capture);
+    updateCursorPosition(capture);
+
+    return capture;
+
+fail:
+    rfbX11CaptureFree(capture);
+    return NULL;
+}
+
+
+rfbScreenInfoPtr
+rfbX11CaptureGetScreen(rfbX11Capture *capture)
+{
+    return capture->screen;
+}
+
+
+int
+rfbX11CaptureGetFd(rfbX11Capture *capture)
+{
+    return ConnectionNumber(capture->dpy);
+}
+
+
+rfbBool
+rfbX11CaptureProcessEvents(rfbX11Capture *capture, long usec)
+{
+    rfbBool damaged = FALSE, cursorChanged = FALSE;
+    XEvent event;
+
+    if (usec > 0 && XPending(capture->dpy) == 0) {
+        int fd = ConnectionNumber(capture->dpy);
+        struct timeval tv;
+        fd_set fds;
+
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        tv.tv_sec = usec / 1000000;
+        tv.tv_usec = usec % 1000000;
+        if (select(fd + 1, &fds, NULL, NULL, &tv) < 0 && errno != EINTR) {
+            rfbLogPerror("rfbX11CaptureProcessEvents: select");
+            return FALSE;
+        }
+    }
+
+    while (XPending(capture->dpy) > 0) {
+        XNextEvent(capture->dpy, &event);
+        if (event.type == capture->damageEventBase + XDamageNotify)
+            damaged = TRUE;
+        else if (event.type == capture->fixesEventBase + XFixesCursorNotify)
+            cursorChanged = TRUE;
+    }
+
+    if (damaged) {
+        sraRegionPtr region = fetchDamage(capture);
+
+        if (!sraRgnEmpty(region)) {
+            readRegion(capture, region);
+            rfbMarkRegionAsModified(capture->screen, region);
+        }
+        sraRgnDestroy(region);
+    }
+    if (cursorChanged)
+        updateCursorShape(capture);
+    updateCursorPosition(capture);
+
+    return TRUE;
+}
+
+
+void
+rfbX11CaptureFree(rfbX11Capture *capture)
+{
+    if (capture == NULL)
+        return;
+
+    if (capture->screen != NULL) {
+        capture->screen->frameBuffer = NULL;
+        rfbScreenCleanup(capture->screen);
+    }
+    if (capture->damage)
+        XDamageDestroy(capture->dpy, capture->damage);
+    if (capture->damageParts)
+        XFixesDestroyRegion(capture->dpy, capture->damageParts);
+    if (capture->image != NULL) {
+        if (capture->useShm) {
+            XShmDetach(capture->dpy, &capture->shm);
+            XSync(capture->dpy, False);
+            shmdt(capture->shm.shmaddr);
+            capture->image->data = NULL;
+        }
+        XDestroyImage(capture->image);
+    }
+    XCloseDisplay(capture->dpy);
+    free(capture);
+}
@@ -31,6 +31,7 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 /*
  * cl->beforeEncBuf contains pixel data in the client's format.
@@ -146,9 +147,9 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
 
         cl->compStream.total_in = 0;
         cl->compStream.total_out = 0;
-        cl->compStream.zalloc = Z_NULL;
-        cl->compStream.zfree = Z_NULL;
-        cl->compStream.opaque = Z_NULL;
+        cl->compStream.zalloc = rfbZlibAlloc;
+        cl->compStream.zfree = rfbZlibFree;
+        cl->compStream.opaque = (voidpf)cl;
 
         deflateInit2( &(cl->compStream),
                         cl->zlibCompressLevel,
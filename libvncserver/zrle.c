@@ -28,6 +28,9 @@
 #include "private.h"
 #include "zrleoutstream.h"
 
+#define ZRLE_BEFORE_BUF_SIZE (rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4)
+#define ZYWRLE_BUF_SIZE (rfbZRLETileWidth * rfbZRLETileHeight * sizeof(int))
+
 
 #define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                                \
 {  char *fbptr = (cl->scaledScreen->frameBuffer                                   \
@@ -110,7 +113,9 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   char *zrleBeforeBuf;
 
   if (cl->zrleBeforeBuf == NULL) {
-	cl->zrleBeforeBuf = (char *) malloc(rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4);
+	cl->zrleBeforeBuf = (char *) malloc(ZRLE_BEFORE_BUF_SIZE);
+	if (cl->zrleBeforeBuf == NULL)
+		return FALSE;
   }
   zrleBeforeBuf = cl->zrleBeforeBuf;
 
@@ -127,8 +132,14 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   } else
 	  cl->zywrleLevel = 0;
 
+  if (cl->zywrleLevel > 0 && cl->zywrleBuf == NULL) {
+	cl->zywrleBuf = (int *) malloc(ZYWRLE_BUF_SIZE);
+	if (cl->zywrleBuf == NULL)
+		return FALSE;
+  }
+
   if (!cl->zrleData)
-    cl->zrleData = zrleOutStreamNew();
+    cl->zrleData = zrleOutStreamNew(rfbZlibAlloc, rfbZlibFree, cl);
   zos = cl->zrleData;
   zos->in.ptr = zos->in.start;
   zos->out.ptr = zos->out.start;
@@ -244,14 +255,41 @@ void rfbFreeZrleData(rfbClientPtr cl)
 	}
 	cl->zrleData = NULL;
 
-	if (cl->zrleBeforeBuf) {
-		free(cl->zrleBeforeBuf);
-	}
+	rfbReleaseZrleBuffers(cl);
+}
+
+
+/*
+ * Frees what is set up again with the next rect; the stream has to stay.
+ */
+
+void rfbReleaseZrleBuffers(rfbClientPtr cl)
+{
+	free(cl->zrleBeforeBuf);
 	cl->zrleBeforeBuf = NULL;
 
-	if (cl->paletteHelper) {
-		free(cl->paletteHelper);
-	}
+	free(cl->paletteHelper);
 	cl->paletteHelper = NULL;
+
+	free(cl->zywrleBuf);
+	cl->zywrleBuf = NULL;
+}
+
+
+size_t rfbZrleMemoryUsage(rfbClientPtr cl)
+{
+	zrleOutStream *zos = (zrleOutStream *)cl->zrleData;
+	size_t n = 0;
+
+	if (zos)
+		n += sizeof(zrleOutStream) + (zos->in.end - zos->in.start)
+			+ (zos->out.end - zos->out.start);
+	if (cl->zrleBeforeBuf)
+		n += ZRLE_BEFORE_BUF_SIZE;
+	if (cl->paletteHelper)
+		n += sizeof(zrlePaletteHelper);
+	if (cl->zywrleBuf)
+		n += ZYWRLE_BUF_SIZE;
+	return n;
 }
 
@@ -66,7 +66,7 @@ static rfbBool zrleBufferGrow(zrleBuffer *buffer, int size)
   return TRUE;
 }
 
-zrleOutStream *zrleOutStreamNew(void)
+zrleOutStream *zrleOutStreamNew(alloc_func zalloc, free_func zfree, voidpf opaque)
 {
   zrleOutStream *os;
 
@@ -85,9 +85,9 @@ zrleOutStream *zrleOutStreamNew(void)
     return NULL;
   }
 
-  os->zs.zalloc = Z_NULL;
-  os->zs.zfree  = Z_NULL;
-  os->zs.opaque = Z_NULL;
+  os->zs.zalloc = zalloc;
+  os->zs.zfree  = zfree;
+  os->zs.opaque = opaque;
   if (deflateInit(&os->zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
     zrleBufferFree(&os->in);
     free(os);
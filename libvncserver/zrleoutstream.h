@@ -40,7 +40,9 @@ typedef struct {
 
 #define ZRLE_BUFFER_LENGTH(b) ((b)->ptr - (b)->start)
 
-zrleOutStream *zrleOutStreamNew           (void);
+zrleOutStream *zrleOutStreamNew           (alloc_func     zalloc,
+					   free_func      zfree,
+					   voidpf         opaque);
 void           zrleOutStreamFree          (zrleOutStream *os);
 rfbBool        zrleOutStreamFlush         (zrleOutStream *os);
 void           zrleOutStreamWriteBytes    (zrleOutStream *os,
@@ -65,6 +65,7 @@ typedef UINT32 in_addr_t;
 #endif
 
 #include <rfb/threading.h>
+#include <rfb/rfbtrace.h>
 
 /* if you use pthreads, but don't define LIBVNCSERVER_HAVE_LIBPTHREAD, the structs
    get all mixed up. So this gives a linker error reminding you to compile
@@ -372,6 +373,48 @@ typedef struct _rfbScreenInfo
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     rfbSetXCutTextUTF8ProcPtr setXCutTextUTF8;
 #endif
+    /** If TRUE, areas detected as video, see rfbGetVideoRegion(), are sent at
+        most videoFrameRate times per second, and with the Tight quality level
+        videoQualityLevel (0-9) to clients that accept JPEG. Off per default. */
+    rfbBool handleVideoRegions;
+    int videoFrameRate;
+    int videoQualityLevel;
+    struct _rfbVideoTracker* videoTracker;
+    /** WebSockets clients offering permessage-deflate get their frames
+        compressed at this zlib level, 0 turns it off, and with at most
+        wsDeflateWindowBits (9-15) of window. Updates in encodings that
+        compress already, like Tight or ZRLE, are left alone. 1 and 15 per
+        default. */
+    int wsDeflateLevel;
+    int wsDeflateWindowBits;
+    /** milliseconds without an update after which the update buffer,
+        encoder buffers and those compressor contexts that can be reset
+        are freed, to be set up again with the next update. 0 keeps them.
+        30000 per default, see clientmem.c */
+    int encoderIdleTimeout;
+    /** the framebuffer of another process being served, see shmimport.c */
+    struct _rfbShmImport* shmImport;
+    /** hold back partial TCP segments while an update is written, so it
+        goes out in as few packets as possible. TRUE per default */
+    rfbBool corkUpdates;
+    /** If TRUE, Tight clients accepting JPEG get a higher quality level
+        within about focusRadius pixels of their pointer and keyboard focus
+        and a lower one further away, see focus.c. Off per default,
+        focusRadius is 64 */
+    rfbBool focusQuality;
+    int focusRadius;
+    /** If not 0, the framebuffer updates of all clients together are kept
+        to about this many bytes per second, shared in proportion to the
+        clients' uplinkWeight, see uplink.c. 0 per default */
+    int uplinkRate;
+    MUTEX(uplinkMutex);
+    struct _rfbClientRec* uplinkCursor;  /* whose turn is next */
+    int uplinkClients;
+    double uplinkBudget;
+    unsigned long uplinkRefillMs;
+    /** rfbTraceStart() was called for the -trace option, rfbScreenCleanup()
+        stops the trace again */
+    rfbBool traceStarted;
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -422,6 +465,15 @@ typedef struct _rfbStatList {
 typedef struct _rfbSslCtx rfbSslCtx;
 typedef struct _wsCtx wsCtx;
 
+/** a Fence sent after an update, to see when the client has it */
+#define RFB_MAX_FENCE_PINGS 16
+typedef struct _rfbFencePing {
+    uint32_t id;
+    unsigned long sentMs;
+    uint32_t sentBytes;                  /* rfbStatGetSentBytes() after it */
+    rfbBool measurable;                  /* waiting when the last answer came */
+} rfbFencePing;
+
 typedef struct _rfbClientRec {
 
     /** back pointer to the screen */
@@ -569,7 +621,9 @@ typedef struct _rfbClientRec {
 
 #define UPDATE_BUF_SIZE 32768
 
-    char updateBuf[UPDATE_BUF_SIZE];
+    /** allocated by rfbSendFramebufferUpdate(), and freed again while the
+        client is idle, see rfbScreenInfo.encoderIdleTimeout */
+    char *updateBuf;
     int ublen;
 
     /* statistics */
@@ -642,7 +696,7 @@ typedef struct _rfbClientRec {
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     void* zrleData;
     int zywrleLevel;
-    int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+    int *zywrleBuf;                   /* rfbZRLETileWidth * rfbZRLETileHeight */
 #endif
 
     /** if progressive updating is on, this variable holds the current
@@ -707,6 +761,64 @@ typedef struct _rfbClientRec {
     int tightPngDstDataLen;
 #endif
 #endif
+
+    /** when the video region was last sent, see rfbScreenInfo.handleVideoRegions */
+    unsigned long lastVideoFrameMs;
+    /** the last update was held back for the next video frame */
+    rfbBool videoFrameDeferred;
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    /** send the video region as H.264, see h264.c */
+    rfbBool useH264;
+    rfbBool h264ResetPending;
+    void* h264Data;
+#endif
+
+    /** ContinuousUpdates and Fence, see rfbserver.c */
+    rfbBool useContinuousUpdates;
+    rfbBool continuousUpdates;           /* enabled by the client */
+    sraRegionPtr continuousRegion;
+    rfbBool useFence;
+    /** fences sent after updates and not answered yet, oldest first */
+    rfbFencePing fencePings[RFB_MAX_FENCE_PINGS];
+    int fencePingCount;
+    uint32_t fenceNextId;
+    uint32_t fenceAckedBytes;            /* sent before the last answered fence */
+    unsigned long fenceAckedMs;
+    int rttMs, minRttMs;                 /* -1 until measured */
+    unsigned long throughput;            /* bytes per second, 0 until measured */
+
+    /** the update being sent is in an encoding that compresses, so
+        websockets.c does not try again */
+    rfbBool compressedUpdate;
+
+    /** when the last update was sent, 0 once the encoder state is freed */
+    unsigned long lastUpdateMs;
+    /** memory held by this client's zlib streams */
+    size_t zlibMemory;
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+    /** Tight streams freed while idle, the client is told to reset them */
+    int tightResetStreams;
+#endif
+    /** the socket is corked, see rfbCorkSock() */
+    rfbBool corked;
+    /** where the client works, see rfbScreenInfo.focusQuality */
+    int focusPtrX, focusPtrY;            /* -1 until the first pointer event */
+    int keyFocusX, keyFocusY, keyFocusW, keyFocusH;
+    rfbBool keyFocusFromApp;             /* set by rfbSetKeyboardFocus() */
+    /** the client's share of rfbScreenInfo.uplinkRate relative to the
+        other clients', 1 per default */
+    int uplinkWeight;
+    long uplinkDeficit;                  /* what it may still send, see uplink.c */
+    rfbBool uplinkQueued;
+    unsigned long uplinkIdleMs;          /* since when it had nothing to send, 0 if busy */
+    struct _rfbClientRec *uplinkNext, *uplinkPrev;
+    /** for rfb/rfbtrace.h: the port of the client's end, the updates
+        begun so far, the id of the current one, and whether the screen
+        changed since */
+    uint32_t traceKey;
+    uint32_t traceUpdateSeq;
+    uint64_t traceUpdateId;
+    rfbBool traceDamaged;
 } rfbClientRec, *rfbClientPtr;
 
 /**
@@ -778,6 +890,7 @@ extern rfbBool webSocketCheckDisconnect(rfbClientPtr cl);
 extern int webSocketsEncode(rfbClientPtr cl, const char *src, int len, char **dst);
 extern int webSocketsDecode(rfbClientPtr cl, char *dst, int len);
 extern rfbBool webSocketsHasDataInBuffer(rfbClientPtr cl);
+extern void webSocketsFree(rfbClientPtr cl);
 #endif
 
 /* rfbserver.c */
@@ -956,11 +1069,42 @@ extern void rfbDefaultPtrAddEvent(int buttonMask,int x,int y,rfbClientPtr cl);
 extern rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w,int h);
 #endif
 
+/* h264.c */
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+extern rfbBool rfbSendRectEncodingH264(rfbClientPtr cl, int x, int y, int w, int h);
+#endif
+
+/* fence.c */
+extern rfbBool rfbSendFence(rfbClientPtr cl, uint32_t flags, int length, const char *data);
+extern rfbBool rfbSendEndOfContinuousUpdates(rfbClientPtr cl);
+
 /* stats.c */
 
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
 
+/* videoregion.c */
+
+#define RFB_DAMAGE_TILE_SIZE 32
+
+/**
+ * Returns the part of the screen that has been changing several times per
+ * second for a while, or NULL if there is none. The caller has to
+ * sraRgnDestroy() it. Damage is only tracked while
+ * rfbScreenInfo.handleVideoRegions is on.
+ */
+extern sraRegionPtr rfbGetVideoRegion(rfbScreenInfoPtr rfbScreen);
+
+/* focus.c */
+
+/**
+ * Tells where the client's keyboard input goes, like the text cursor of
+ * the focused window, for rfbScreenInfo.focusQuality. Until this is called
+ * the pointer position at the last key press is used, a w or h of 0 goes
+ * back to that.
+ */
+extern void rfbSetKeyboardFocus(rfbClientPtr cl, int x, int y, int w, int h);
+
 /* font.c */
 
 typedef struct rfbFontData {
@@ -1109,6 +1253,74 @@ extern int rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type);
+/**
+ * Copies how often each tile of RFB_DAMAGE_TILE_SIZE x RFB_DAMAGE_TILE_SIZE
+ * pixels was modified, counted in slots of 100ms, row by row into counts.
+ * At most maxTiles are copied, the return value is the number of tiles.
+ * Like rfbGetVideoRegion(), only counts while handleVideoRegions is on.
+ */
+extern int rfbStatGetDamageHeatmap(rfbScreenInfoPtr rfbScreen, uint32_t* counts, int maxTiles, int* cols, int* rows);
+/** Logs the damage heat map using rfbLog(), video tiles are marked. */
+extern void rfbPrintDamageHeatmap(rfbScreenInfoPtr rfbScreen);
+/**
+ * Round trip time in ms, smoothed and the lowest seen, and throughput in
+ * bytes per second, as measured with fences during continuous updates.
+ * -1 and 0 respectively until measured.
+ */
+extern int rfbStatGetRtt(rfbClientPtr cl);
+extern int rfbStatGetMinRtt(rfbClientPtr cl);
+extern unsigned long rfbStatGetThroughput(rfbClientPtr cl);
+/** Bytes sent to the client and not yet acknowledged by a fence. */
+extern int rfbStatGetBytesInFlight(rfbClientPtr cl);
+
+/* clientmem.c */
+
+/** bytes of memory held by the client: the rfbClientRec, its buffers and
+    its compressor state, but not what libjpeg or libavcodec hold */
+extern size_t rfbClientMemoryUsage(rfbClientPtr cl);
+
+/* shmimport.c */
+
+/**
+ * Serves the framebuffer a producer process renders into, see rfb/rfbshm.h
+ * for the segment layout and the producer's side. The screen takes over
+ * size and pixel format of the segment, and its frameBuffer points into
+ * it from now on, so it must not be freed by the application.
+ * @param fd the segment, a memfd sealed with F_SEAL_SHRINK, with the header
+ * filled in. Its geometry, pixel format and buffer offsets are only read
+ * here, later changes to them are ignored.
+ * @param eventFd an eventfd or pipe the producer writes to after a flip.
+ * It is made non-blocking. Both descriptors are duplicated, the caller
+ * may close its own.
+ * @return true if the segment is sealed, could be mapped and makes sense
+ */
+extern rfbBool rfbShmImportFrameBuffer(rfbScreenInfoPtr screen, int fd, int eventFd);
+
+/* x11capture.c */
+#ifdef LIBVNCSERVER_HAVE_X11CAPTURE
+
+typedef struct _rfbX11Capture rfbX11Capture;
+
+/**
+ * Opens an X display (NULL for $DISPLAY) and creates a screen of its size
+ * and pixel format, with the root window already in the framebuffer. The
+ * display needs the DAMAGE and XFIXES extensions; MIT-SHM is used if the
+ * display is local. Returns NULL on failure.
+ */
+extern rfbX11Capture* rfbX11CaptureNew(int* argc, char** argv, const char* displayName);
+extern rfbScreenInfoPtr rfbX11CaptureGetScreen(rfbX11Capture* capture);
+/** the connection to the X server, to wait for with select() */
+extern int rfbX11CaptureGetFd(rfbX11Capture* capture);
+/**
+ * Waits up to usec microseconds for the X server, then copies what was
+ * damaged into the framebuffer and marks it, and follows the cursor's
+ * shape and position. Returns FALSE if waiting failed.
+ */
+extern rfbBool rfbX11CaptureProcessEvents(rfbX11Capture* capture, long usec);
+/** frees the framebuffer and the screen, so call rfbShutdownServer() first */
+extern void rfbX11CaptureFree(rfbX11Capture* capture);
+
+#endif
 
 /** Set which version you want to advertise 3.3, 3.6, 3.7 and 3.8 are currently supported*/
 extern void rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_);
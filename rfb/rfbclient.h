@@ -56,6 +56,7 @@
 #include <rfb/rfbproto.h>
 #include <rfb/keysym.h>
 #include <rfb/threading.h>
+#include <rfb/rfbtrace.h>
 
 #ifdef LIBVNCSERVER_HAVE_SASL
 #include <sasl/sasl.h>
@@ -108,6 +109,59 @@ typedef struct {
   rfbBool doNotSleep;
 } rfbVNCRec;
 
+/** shared memory framebuffer export, opaque, see rfbClientExportFrameBuffer() */
+typedef struct _rfbClientShmExport rfbClientShmExport;
+
+/** session recorder, opaque, see rfbClientStartRecording() */
+typedef struct _rfbClientRecorder rfbClientRecorder;
+
+/** outgoing message queue, opaque, see rfbClientStartSendThread() */
+typedef struct _rfbClientSendQueue rfbClientSendQueue;
+
+/** statistics, see stats.c */
+
+/** Number of buckets of a rfbClientStatHistogram */
+#define RFB_CLIENT_STAT_BUCKETS 32
+
+/**
+ * Log2 histogram: bucket i counts the values v with 2^i <= v < 2^(i+1),
+ * bucket 0 also counts 0 and the last bucket everything beyond.
+ */
+typedef struct {
+  uint32_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint32_t buckets[RFB_CLIENT_STAT_BUCKETS];
+} rfbClientStatHistogram;
+
+/** Per encoding counters, kept in a list in rfbClientStats */
+typedef struct _rfbClientEncodingStats {
+  uint32_t encoding;
+  uint32_t rects;
+  uint64_t bytes;       /**< bytes received, rectangle headers included */
+  uint64_t bytesIfRaw;  /**< the same rectangles in Raw encoding */
+  rfbClientStatHistogram decodeNs; /**< decoding time per rectangle */
+  struct _rfbClientEncodingStats *next;
+} rfbClientEncodingStats;
+
+/**
+ * The receiving and the sending side count on their own, as the writer
+ * thread of rfbClientStartSendThread() sends while another one receives.
+ */
+typedef struct {
+  uint64_t bytesRcvd;
+  uint64_t bytesSent;
+  uint64_t syscalls;    /**< read() and select() calls to receive */
+  uint64_t sendSyscalls; /**< write() and select() calls to send */
+  uint32_t updates;     /**< FramebufferUpdate messages */
+  rfbClientEncodingStats *encodings;
+  /** from sending the FramebufferUpdateRequest to FinishedFrameBufferUpdate */
+  rfbClientStatHistogram updateLatencyNs;
+  rfbClientStatHistogram syscallsPerUpdate;
+  uint64_t requestTime; /**< internal: when the pending request was sent */
+} rfbClientStats;
+
 /** client data */
 
 typedef struct rfbClientData {
@@ -206,6 +260,8 @@ typedef void (*SoftCursorUnlockScreenProc)(struct _rfbClient* client);
    @param h The heigth of the updated rectangle
  */
 typedef void (*GotFrameBufferUpdateProc)(struct _rfbClient* client, int x, int y, int w, int h);
+/** Called with the rows of a rect decoded so far, see rfbClient.GotFrameBufferBand. */
+typedef void (*GotFrameBufferBandProc)(struct _rfbClient* client, int x, int y, int w, int h);
 /**
    Callback indicating that a client has completely processed an rfbFramebufferUpdate
    message sent by a server.
@@ -229,7 +285,37 @@ typedef void (*GotCursorShapeProc)(struct _rfbClient* client, int xhot, int yhot
 typedef void (*GotCopyRectProc)(struct _rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y);
 typedef void (*GotFillRectProc)(struct _rfbClient* client, int x, int y, int w, int h, uint32_t colour);
 typedef void (*GotBitmapProc)(struct _rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h);
+/** A solid rect, as handed to GotFillRectsProc. */
+typedef struct {
+  int x, y, w, h;
+  uint32_t colour;
+} rfbClientFillRect;
+/**
+    Called with a batch of solid rects to fill. They are to be filled in order,
+    as later ones may paint over earlier ones.
+*/
+typedef void (*GotFillRectsProc)(struct _rfbClient* client, const rfbClientFillRect* rects, int count);
 typedef rfbBool (*GotJpegProc)(struct _rfbClient* client, const uint8_t* buffer, int length, int x, int y, int w, int h);
+/**
+    Custom transport, see rfbClient.ReadFromTransport: reads up to len bytes.
+    @return the number of bytes read, 0 at the end of the stream, or -1 with
+    errno set. EAGAIN means nothing is there yet, WaitForTransport is then
+    called before trying again.
+*/
+typedef int (*ReadFromTransportProc)(struct _rfbClient* client, char* buf, int len);
+/**
+    Custom transport: writes up to len bytes, blocking until at least one
+    could be written.
+    @return the number of bytes written, or -1 with errno set. 0 is an
+    error, EAGAIN is tried again after a millisecond.
+*/
+typedef int (*WriteToTransportProc)(struct _rfbClient* client, const char* buf, int len);
+/**
+    Custom transport: waits up to usecs microseconds until there is
+    something to read, like WaitForMessage().
+    @return > 0 if there is, 0 on timeout, < 0 on error
+*/
+typedef int (*WaitForTransportProc)(struct _rfbClient* client, unsigned int usecs);
 typedef rfbBool (*LockWriteToTLSProc)(struct _rfbClient* client);   /** @deprecated */
 typedef rfbBool (*UnlockWriteToTLSProc)(struct _rfbClient* client); /** @deprecated */
 
@@ -477,8 +563,109 @@ typedef struct _rfbClient {
          * Used for intended dimensions, rfbClient.width and rfbClient.height are used to manage the real framebuffer dimensions.
 	 */
 	rfbExtDesktopScreen screen;
+
+	/** Statistics, see rfbClientGetStats(). */
+	rfbClientStats *stats;
+
+	/** Shared memory export of the framebuffer, see rfbClientExportFrameBuffer(). */
+	rfbClientShmExport *shmExport;
+
+	/**
+	 * Viewport mode: frameBuffer only holds the part viewport of the remote
+	 * desktop, width and height are its size and all coordinates are
+	 * relative to it. The size of the remote desktop is in si. See
+	 * rfbClientSetViewport().
+	 */
+	rfbBool viewportMode;
+	rfbRectangle viewport;
+	/** For internal use only. */
+	rfbRectangle viewportRequested;
+	uint8_t* viewportBuffer;
+	size_t viewportBufferSize;
+	uint8_t* viewportFrameBuffer;
+
+	/**
+	 * Hook for filling many rects at once, used by the Hextile, RRE and
+	 * CoRRE decoders. The default fills them into frameBuffer, or passes
+	 * them on to GotFillRect one by one if the application has set that.
+	 */
+	GotFillRectsProc GotFillRects;
+
+	/**
+	 * Progressive updates: if set and bandHeight is above 0, this is
+	 * called whenever at least bandHeight more rows of a Raw, Hextile,
+	 * ZRLE or Tight rect are decoded while the rest is still on its way.
+	 * Rows come in the steps of the decoder, 16 for Hextile and 64 for
+	 * ZRLE. A rect reported in bands is reported completely, and
+	 * GotFrameBufferUpdate for all of it follows as before. Rects outside
+	 * the viewport are not reported in bands.
+	 */
+	GotFrameBufferBandProc GotFrameBufferBand;
+	int bandHeight;
+	/** For internal use only. */
+	int bandStart;
+
+	/** The writer thread's queue, see rfbClientStartSendThread(). */
+	rfbClientSendQueue *sendQueue;
+
+	/** The session recorder, see rfbClientStartRecording(). */
+	rfbClientRecorder *recorder;
+
+	/**
+	 * Custom transport: if ReadFromTransport, WriteToTransport and
+	 * WaitForTransport are set before rfbInitClient(), no connection is
+	 * made and the session runs through them instead of sock, which
+	 * stays invalid. That way a tunnel, like an SSH channel, feeds the
+	 * decoders directly rather than through a proxy on a loopback socket.
+	 * Applications then wait with WaitForMessage() and not on sock.
+	 * VeNCrypt works over a transport with GnuTLS only, SASL not at all.
+	 */
+	ReadFromTransportProc ReadFromTransport;
+	WriteToTransportProc WriteToTransport;
+	WaitForTransportProc WaitForTransport;
+
+	/** For internal use only: the port of this end of the connection
+	    and the updates received, for rfb/rfbtrace.h, and whether the
+	    -trace option started a trace that rfbClientCleanup() stops. */
+	uint32_t traceKey;
+	uint32_t traceUpdateSeq;
+	rfbBool traceStarted;
+
+	/**
+	 * Bytes from the start of one row of frameBuffer to the start of the
+	 * next, a multiple of the size of a pixel. 0, the default, and
+	 * anything less than width pixels mean the rows are packed. A
+	 * MallocFrameBuffer of the application can set it along with
+	 * frameBuffer, so that the decoders and the default GotBitmap,
+	 * GotFillRect and GotCopyRect draw right into a surface with padded
+	 * or aligned rows, or one it does not own. The default
+	 * MallocFrameBuffer sets it to 0.
+	 */
+	int frameBufferStride;
+	/** For internal use only: frameBufferStride while in viewportBuffer. */
+	int viewportFrameBufferStride;
+
+	/** For internal use only: while a rect crossing the border of the
+	    viewport is decoded, the application's hooks, which clipping ones
+	    stand in for, and the strip drawn into viewportBuffer. */
+	rfbBool viewportClipping;
+	rfbBool viewportInStrip;
+	rfbRectangle viewportStrip;
+	GotBitmapProc viewportGotBitmap;
+	GotFillRectProc viewportGotFillRect;
+	GotFillRectsProc viewportGotFillRects;
+	GotJpegProc viewportGotJpeg;
 } rfbClient;
 
+/**
+ * Bytes from the start of one row of client->frameBuffer to the next, see
+ * rfbClient::frameBufferStride.
+ */
+#define rfbClientFrameBufferStride(client) \
+    ((client)->frameBufferStride > 0 && \
+     (size_t)(client)->frameBufferStride > (size_t)(client)->width * ((client)->format.bitsPerPixel / 8) ? \
+     (size_t)(client)->frameBufferStride : (size_t)(client)->width * ((client)->format.bitsPerPixel / 8))
+
 /* cursor.c */
 /**
  * Handles XCursor and RichCursor shape updates from the server.
@@ -763,6 +950,108 @@ extern rfbBool SameMachine(rfbSocket sock);
  */
 extern int WaitForMessage(rfbClient* client,unsigned int usecs);
 
+/* viewport.c */
+/**
+ * Keeps only the given part of the remote desktop in client->frameBuffer
+ * and requests updates for that part only, see rfbClient.viewportMode.
+ * The viewport is moved inside the remote desktop if it does not fit and
+ * shrunk if the desktop is smaller. Can be called before rfbInitClient()
+ * or at any time later, which reallocates the framebuffer.
+ *
+ * Of rects that are not completely inside the viewport, GotBitmap,
+ * GotFillRect and GotFillRects only get the part inside it. GotJpeg is
+ * not called for them. ZRLE, TRLE and Tight decode their tiles that
+ * cross the border into a scratch buffer, so there the hooks may be
+ * called with client->frameBuffer, width and height pointing to that.
+ * @param client The client
+ * @param x,y,w,h The viewport in remote desktop coordinates, a width or
+ * height of 0 turns viewport mode off again
+ * @return true unless reallocating or requesting the framebuffer failed
+ */
+extern rfbBool rfbClientSetViewport(rfbClient* client, int x, int y, int w, int h);
+
+/* shm.c */
+/**
+ * Mirrors the framebuffer into a shared memory segment that other processes
+ * can map, see rfb/rfbshm.h for its layout. Every rectangle is copied there
+ * once it is decoded. This replaces client->MallocFrameBuffer, so it has to
+ * be called after setting that and before rfbInitClient(). The framebuffer
+ * must not be free()d by the application, it is freed by rfbClientCleanup().
+ * @param client The client whose framebuffer to export
+ * @param name NULL for an anonymous memfd to be passed to the readers with
+ * rfbClientGetExportFd(), or a POSIX shared memory name like "/vnc0" that
+ * must not exist yet. The name is unlinked again by rfbClientCleanup().
+ * @return true if the segment was created
+ */
+extern rfbBool rfbClientExportFrameBuffer(rfbClient* client, const char* name);
+/**
+ * Returns the file descriptor of the exported segment, -1 if there is none.
+ */
+extern int rfbClientGetExportFd(rfbClient* client);
+
+/* record.c */
+/**
+ * Records everything the server sends, in the vncrec format that "-play"
+ * replays, while a background thread writes it to the file. Passing
+ * "-record <file>" to rfbInitClient() does the same without compression.
+ * To be replayable the recording must start before rfbInitClient() and the
+ * session must not use TLS.
+ * @param client The client to record
+ * @param fileName The file to write, replaced if it exists
+ * @param compress true to gzip the file on the fly, which then needs to be
+ * uncompressed before replaying it
+ * @return true if the file could be created
+ */
+extern rfbBool rfbClientStartRecording(rfbClient* client, const char* fileName, rfbBool compress);
+/**
+ * Writes the rest of the recording and closes the file. rfbClientCleanup()
+ * does this as well.
+ * @param client The client being recorded
+ * @return true unless writing the file failed at some point
+ */
+extern rfbBool rfbClientStopRecording(rfbClient* client);
+
+/* sendqueue.c */
+/**
+ * Starts a thread that does all writing to the server from now on, so that
+ * SendPointerEvent(), SendKeyEvent() and the other Send functions may be
+ * called from any thread, also while another one is busy in
+ * HandleRFBServerMessage(). They queue their message without waiting for
+ * the socket and return true unless an earlier write has failed. Messages
+ * sent by one thread keep their order. Needs pthreads.
+ * @param client The client to send for
+ * @return true if the thread is running
+ */
+extern rfbBool rfbClientStartSendThread(rfbClient* client);
+/**
+ * Writes what is still queued and stops the thread again; no other thread
+ * may send meanwhile. rfbClientCleanup() does this as well.
+ * @param client The client whose thread to stop
+ */
+extern void rfbClientStopSendThread(rfbClient* client);
+
+/* stats.c */
+/**
+ * Returns the statistics collected for this client since it was created or
+ * rfbClientResetStats() was called last. NULL if none are kept.
+ */
+extern rfbClientStats* rfbClientGetStats(rfbClient* client);
+/**
+ * Returns the counters of one encoding, NULL if no rectangle of that
+ * encoding was received yet.
+ */
+extern rfbClientEncodingStats* rfbClientStatLookupEncoding(rfbClient* client, uint32_t encoding);
+/**
+ * Returns the value below which the given percentage of the recorded values
+ * lie, to the precision of the histogram buckets.
+ */
+extern uint64_t rfbClientStatPercentile(const rfbClientStatHistogram* histogram, int percent);
+extern void rfbClientResetStats(rfbClient* client);
+/**
+ * Logs a summary of the statistics using rfbClientLog().
+ */
+extern void rfbClientPrintStats(rfbClient* client);
+
 /* vncviewer.c */
 /**
  * Allocates and returns a pointer to an rfbClient structure. This will probably
@@ -825,7 +1114,8 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv);
  * Cleans up the client structure and releases the memory allocated for it. You
  * should call this when you're done with the rfbClient structure that you
  * allocated with rfbGetClient().
- * @note rfbClientCleanup() does not touch client->frameBuffer.
+ * @note rfbClientCleanup() does not touch client->frameBuffer, unless it
+ * was exported with rfbClientExportFrameBuffer().
  * @param client The client to clean up
  */
 void rfbClientCleanup(rfbClient* client);
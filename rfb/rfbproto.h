@@ -408,6 +408,8 @@ typedef struct {
 /* Modif sf@2002 */
 #define rfbResizeFrameBuffer 4
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+/* EndOfContinuousUpdates server -> client message */
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -435,6 +437,10 @@ typedef struct {
 #define rfbXvp 250
 /* SetDesktopSize client -> server message */
 #define rfbSetDesktopSize 251
+/* EnableContinuousUpdates client -> server message */
+#define rfbEnableContinuousUpdates 150
+/* Fence message - bidirectional */
+#define rfbFence 248
 #define rfbQemuEvent 255
 
 
@@ -516,6 +522,8 @@ typedef struct {
 #define rfbEncodingLastRect           0xFFFFFF20
 #define rfbEncodingNewFBSize          0xFFFFFF21
 #define rfbEncodingExtDesktopSize     0xFFFFFECC
+#define rfbEncodingFence              0xFFFFFEC8
+#define rfbEncodingContinuousUpdates  0xFFFFFEC7
 
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
@@ -951,6 +959,27 @@ typedef struct {
 #define rfbZRLETileHeight 64
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * H.264 - the rectangle as the next frame of an H.264 (Annex B) stream. The
+ * header is followed by length bytes of stream data, which may be empty.
+ * Every rectangle position and size is a stream of its own, the client
+ * keeps one decoder per rectangle. rfbH264FlagResetContext tells it to
+ * start over with the decoder of this rectangle, rfbH264FlagResetAllContexts
+ * to drop all of them first. This is the layout of the "Open H.264"
+ * encoding.
+ */
+
+typedef struct {
+    uint32_t length;
+    uint32_t flags;
+} rfbH264Header;
+
+#define sz_rfbH264Header 8
+
+#define rfbH264FlagResetContext 1
+#define rfbH264FlagResetAllContexts 2
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * ZLIBHEX - zlib compressed Hextile Encoding.  Essentially, this is the
  * hextile encoding with zlib compression on the tiles that can not be
@@ -1211,6 +1240,66 @@ typedef struct rfbSetDesktopSizeMsg {
 
 #define sz_rfbSetDesktopSizeMsg (8)
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates client -> server message
+ *
+ * Asks the server to send updates of the given area whenever it changes,
+ * without further FramebufferUpdateRequests, or to stop doing so. Only
+ * sent to servers which acknowledged the ContinuousUpdates pseudo-encoding
+ * with an EndOfContinuousUpdates message.
+ */
+
+typedef struct {
+    uint8_t type;                       /* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg (10)
+
+/*-----------------------------------------------------------------------------
+ * EndOfContinuousUpdates server -> client message
+ *
+ * Sent once when the client announces the ContinuousUpdates pseudo-encoding,
+ * and whenever continuous updates are switched off.
+ */
+
+typedef struct {
+    uint8_t type;                       /* always rfbEndOfContinuousUpdates */
+} rfbEndOfContinuousUpdatesMsg;
+
+#define sz_rfbEndOfContinuousUpdatesMsg (1)
+
+/*-----------------------------------------------------------------------------
+ * Fence message - bidirectional
+ *
+ * A request is answered with a response carrying the same payload, once
+ * everything sent before it has been dealt with. Flags the receiver does
+ * not support are cleared in the response.
+ */
+
+typedef struct {
+    uint8_t type;                       /* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;
+    /* Followed by char data[length], at most rfbFenceMaxLength */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg (9)
+
+#define rfbFenceMaxLength 64
+
+#define rfbFenceFlagBlockBefore 0x00000001
+#define rfbFenceFlagBlockAfter 0x00000002
+#define rfbFenceFlagSyncNext 0x00000004
+#define rfbFenceFlagRequest 0x80000000
+#define rfbFenceFlagsSupported (rfbFenceFlagBlockBefore | rfbFenceFlagBlockAfter | \
+                                rfbFenceFlagSyncNext | rfbFenceFlagRequest)
+
 
 /*-----------------------------------------------------------------------------
  * Modif sf@2002
@@ -1267,6 +1356,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbExtDesktopSizeMsg eds;
+	rfbEndOfContinuousUpdatesMsg eocu;
+	rfbFenceMsg f;
 } rfbServerToClientMsg;
 
 
@@ -1545,6 +1636,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbSetDesktopSizeMsg sdm;
+	rfbEnableContinuousUpdatesMsg ecu;
+	rfbFenceMsg f;
 } rfbClientToServerMsg;
 
 /* 
@@ -0,0 +1,177 @@
+#ifndef RFBSHM_H
+#define RFBSHM_H
+
+/**
+ * @defgroup rfbshm Shared memory framebuffer layout
+ * @{
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/**
+ * @file rfbshm.h
+ *
+ * Layout of a framebuffer shared between processes, as written by
+ * rfbClientExportFrameBuffer() and read by rfbShmImportFrameBuffer(). It
+ * only depends on <stdint.h>, so the other side does not need to link
+ * LibVNCClient or LibVNCServer.
+ *
+ * The segment starts with an rfbShmHeader, the pixels follow at offset
+ * headerSize, row after row, stride bytes apart. There is exactly one
+ * writer. It makes seq odd before it touches the framebuffer or the
+ * header and even again when it is done, so a reader does:
+ *
+ * @code
+ *   do {
+ *     s1 = header->seq;            // retry later if odd
+ *     read barrier
+ *     copy what is needed: the rects damage[i % RFB_SHM_DAMAGE_SLOTS] for
+ *     lastDamageCount <= i < damageCount, or the whole framebuffer if
+ *     damageCount - lastDamageCount > RFB_SHM_DAMAGE_SLOTS
+ *     read barrier
+ *     s2 = header->seq;
+ *   } while (s1 != s2 || (s1 & 1));
+ * @endcode
+ *
+ * If mapSize is bigger than the size the reader mapped, the framebuffer
+ * was resized and the segment has to be mapped again. The segment never
+ * shrinks, so reading the header of an old mapping is always safe.
+ */
+
+#include <stdint.h>
+
+#define RFB_SHM_MAGIC   0x4d534252  /* "RBSM" */
+#define RFB_SHM_VERSION 1
+
+/** Number of damage rects kept in the ring */
+#define RFB_SHM_DAMAGE_SLOTS 256
+
+/** The writer is gone, nothing will change any more */
+#define RFB_SHM_FLAG_CLOSED 1
+
+typedef struct {
+  uint16_t x, y, w, h;
+} rfbShmRect;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t headerSize;      /**< offset of the pixels from the segment start */
+  volatile uint32_t flags;
+  volatile uint32_t seq;    /**< seqlock, odd while the writer is busy */
+  uint32_t pad0;
+
+  /* Only consistent while seq is even and unchanged. */
+  uint64_t mapSize;         /**< size of the whole segment */
+  uint64_t frame;           /**< number of completed framebuffer updates */
+  uint64_t damageCount;     /**< number of rects ever put into the ring */
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;          /**< bytes per row */
+  uint8_t bitsPerPixel;
+  uint8_t depth;
+  uint8_t bigEndian;
+  uint8_t trueColour;
+  uint16_t redMax;
+  uint16_t greenMax;
+  uint16_t blueMax;
+  uint8_t redShift;
+  uint8_t greenShift;
+  uint8_t blueShift;
+  uint8_t pad1;
+  uint32_t pad2;
+  rfbShmRect damage[RFB_SHM_DAMAGE_SLOTS];
+} rfbShmHeader;
+
+/*
+ * The other direction: a producer process renders into a segment that
+ * LibVNCServer serves with rfbShmImportFrameBuffer(). The segment starts
+ * with an rfbShmImportHeader, which the producer fills in completely
+ * before handing over the file descriptor. The segment has to be a memfd
+ * created with MFD_ALLOW_SEALING and sealed with F_SEAL_SHRINK, and only
+ * the ring, head and overflows are read after the import. It holds two
+ * buffers of height rows each, at bufferOffset[0] and bufferOffset[1].
+ * The server shows buffer front, the producer draws into the other one:
+ *
+ * @code
+ *   back = 1 - header->front;
+ *   draw into buffer back, including what changed in the frame before,
+ *   as that went to the other buffer
+ *   for every rect r changed in this frame, then for the flip
+ *   { back, 0, 0, 0 }, which must not be dropped:
+ *     if (head - header->tail == RFB_SHM_RING_SLOTS)
+ *       wait for the server or, for a rect, header->overflows++ instead
+ *     header->ring[head % RFB_SHM_RING_SLOTS] = r;
+ *     write barrier
+ *     header->head = ++head;
+ *   write 1 to the eventfd
+ *   wait until header->front == back before drawing the next frame
+ * @endcode
+ *
+ * A flip to the buffer that is already in front only reports damage, so
+ * a producer that does not care about tearing can use a single buffer.
+ */
+
+#define RFB_SHM_IMPORT_MAGIC   0x494d4252  /* "RBMI" */
+#define RFB_SHM_IMPORT_VERSION 1
+
+/** Number of entries in the damage ring */
+#define RFB_SHM_RING_SLOTS 1024
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t headerSize;
+  volatile uint32_t flags;  /**< RFB_SHM_FLAG_CLOSED once the producer is gone */
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;          /**< bytes per row */
+  uint32_t pad0;
+  uint64_t bufferOffset[2]; /**< from the segment start */
+  uint8_t bitsPerPixel;     /**< 8, 16 or 32 */
+  uint8_t depth;
+  uint8_t bigEndian;
+  uint8_t trueColour;       /**< must be 1 */
+  uint16_t redMax;
+  uint16_t greenMax;
+  uint16_t blueMax;
+  uint8_t redShift;
+  uint8_t greenShift;
+  uint8_t blueShift;
+  uint8_t pad1;
+  uint16_t pad2;
+
+  /* Written by the producer only, on a cache line of their own. */
+  volatile uint32_t head;      /**< number of ring entries ever written */
+  volatile uint32_t overflows; /**< rects that did not fit into the ring */
+  uint32_t pad3[14];
+
+  /* Written by the server only. */
+  volatile uint32_t tail;      /**< number of ring entries ever consumed */
+  volatile uint32_t front;     /**< the buffer being shown */
+  uint32_t pad4[14];
+
+  /** changed rects, or { buffer, 0, 0, 0 } for a flip to buffer */
+  rfbShmRect ring[RFB_SHM_RING_SLOTS];
+} rfbShmImportHeader;
+
+/**
+ * @}
+ */
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef RFBTRACE_H
+#define RFBTRACE_H
+
+/**
+ * @defgroup rfbtrace Timeline traces of the update pipeline
+ * @{
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/**
+ * @file rfbtrace.h
+ *
+ * Both libraries can write what happens to each framebuffer update to a
+ * file in the Chrome trace event format, which chrome://tracing and
+ * https://ui.perfetto.dev open as a timeline:
+ *
+ * - LibVNCServer: "damage" when a region is marked as modified, "update"
+ *   for sending an update with an "encode" slice per rectangle, and
+ *   "write stall" while the socket does not take more.
+ * - LibVNCClient: "update" for receiving an update with a "decode" slice
+ *   per rectangle, "receive wait" while there is nothing to read and
+ *   "FinishedFrameBufferUpdate" around that callback.
+ *
+ * Every update gets an id from the port of the client's end of the
+ * connection and a count of the updates on it, which both ends work out
+ * the same, so the slices of one update are linked by flow arrows from
+ * the damage to the client's callback, also when a server and a client
+ * in different processes each write their own file and the files are
+ * loaded together.
+ *
+ * Each thread puts its events into a buffer of its own without taking a
+ * lock, a background thread writes them out, and a full buffer drops
+ * events rather than wait. While no trace runs, this costs a test of a
+ * flag per event. Tracing needs pthreads and GCC atomic builtins.
+ */
+
+#include <rfb/rfbproto.h>
+
+#if(defined __cplusplus)
+extern "C"
+{
+#endif
+
+/**
+ * Starts writing the trace to fileName, which is truncated. If a trace
+ * is running already, from this or the other library in the same
+ * process, this joins it, whatever fileName says, and the file is only
+ * finished once every rfbTraceStart() had its rfbTraceStop().
+ * @return FALSE if the file cannot be written or tracing is not supported
+ */
+rfbBool rfbTraceStart(const char *fileName);
+
+/** Stops and finishes the trace started with rfbTraceStart(). */
+void rfbTraceStop(void);
+
+#if(defined __cplusplus)
+}
+#endif
+
+/**
+ * @}
+ */
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Sends a large noisy picture as Raw, Hextile, ZRLE and Tight to clients
+ * asking for progressive updates, and checks that the bands arrive in
+ * order, cover their rects and are decoded already when reported.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#error "I need pthreads or win32 threads for that."
+#endif
+
+static const int width=320,height=480,bandHeight=16;
+static rfbScreenInfoPtr server;
+static int bands,differences;
+/* the rect currently reported in bands */
+static int bandRectY,bandEnd=-1,lastBandHeight;
+
+static void drawPicture(void)
+{
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+	uint32_t seed=1;
+	int i;
+
+	for(i=0;i<width*height;i++) {
+		seed=seed*1103515245+12345;
+		/* noisy, but not so noisy that nothing compresses */
+		fb[i]=((seed>>8)&0x3f3f3f) | (i/width%64==0 ? 0xc0c0c0 : 0);
+	}
+}
+
+static int countDifferences(rfbClient* client,int x,int y,int w,int h)
+{
+	uint32_t* a=(uint32_t*)server->frameBuffer;
+	uint32_t* b=(uint32_t*)client->frameBuffer;
+	int i,j,count=0;
+
+	for(j=y;j<y+h;j++)
+		for(i=x;i<x+w;i++)
+			if((a[j*width+i]^b[j*width+i])&0xffffff)
+				count++;
+	return count;
+}
+
+static void gotBand(rfbClient* client,int x,int y,int w,int h)
+{
+	if(bandEnd<0)
+		bandRectY=y;
+	/* only the last band of a rect may be lower */
+	else if(y!=bandEnd || lastBandHeight<bandHeight)
+		countError();
+	bandEnd=y+h;
+	lastBandHeight=h;
+	differences+=countDifferences(client,x,y,w,h);
+	bands++;
+}
+
+static void gotUpdate(rfbClient* client,int x,int y,int w,int h)
+{
+	if(bandEnd>=0 && (y!=bandRectY || y+h!=bandEnd))
+		countError();
+	bandEnd=-1;
+	differences+=countDifferences(client,x,y,w,h);
+}
+
+static void receive(const char* encoding)
+{
+	rfbClient* client;
+	char* clientArgv[]={"bandstest","localhost:8"};
+	int clientArgc=2,bandsBefore=bands;
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString=encoding;
+	client->appData.enableJPEG=FALSE;
+	client->GotFrameBufferUpdate=gotUpdate;
+	client->GotFrameBufferBand=gotBand;
+	client->bandHeight=bandHeight;
+	if(!rfbInitClient(client,&clientArgc,clientArgv)) {
+		countError();
+		return;
+	}
+
+	handleMessages(client,200000);
+	rfbClientLog("%s: %d bands\n",encoding,bands-bandsBefore);
+	if(bands-bandsBefore<2)
+		countError();
+
+	rfbClientCleanup(client);
+}
+
+int main(int argc,char** argv)
+{
+	server=newTestServer(&argc,argv,width,height,5908);
+	drawPicture();
+	runTestServer(server);
+
+	receive("raw");
+	receive("hextile");
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	receive("zrle");
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	receive("tight");
+#endif
+#endif
+
+	rfbClientLog("%d pixels differ, %d errors\n",differences,errors);
+
+	stopTestServer(server);
+
+	return differences>0 || errors>0;
+}
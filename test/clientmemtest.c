@@ -0,0 +1,94 @@
+/*
+ * Lets a Tight client go idle until the server frees its encoders, and
+ * checks that the memory goes away and that the next update, which needs
+ * fresh zlib streams on both sides, still decodes to the right picture.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#error "I need pthreads or win32 threads for that."
+#endif
+
+static const int width=320,height=240;
+
+/* a few colours on the left for the palette streams, gradients on the right */
+static void drawPicture(rfbScreenInfoPtr server,int n)
+{
+	int x,y;
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			if(x<width/2)
+				fb[y*width+x]=((x/8+y/8+n)&1)?0x00ff00*(n&1)+0x40:0x101010*(((x^y)>>4)&3);
+			else
+				fb[y*width+x]=((x*3+n*7)&0xff) | (((y*5+n)&0xff)<<8) | (((x*y+n)&0xff)<<16);
+	rfbMarkRectAsModified(server,0,0,width,height);
+}
+
+static int countDifferences(rfbScreenInfoPtr server,rfbClient* client)
+{
+	uint32_t* a=(uint32_t*)server->frameBuffer;
+	uint32_t* b=(uint32_t*)client->frameBuffer;
+	int i,count=0;
+
+	for(i=0;i<width*height;i++)
+		if((a[i]^b[i])&0xffffff)
+			count++;
+	return count;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	char* clientArgv[]={"clientmemtest","localhost:3"};
+	int clientArgc=2;
+	size_t busy,idle;
+	int n,differences=0;
+
+	server=newTestServer(&argc,argv,width,height,5903);
+	server->encoderIdleTimeout=300;
+	runTestServer(server);
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="tight";
+	client->appData.enableJPEG=FALSE;
+	client->appData.compressLevel=9;
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+
+	for(n=0;n<3;n++) {
+		/* busy */
+		drawPicture(server,2*n);
+		handleMessages(client,200000);
+		differences+=countDifferences(server,client);
+		busy=rfbClientMemoryUsage(server->clientHead);
+
+		/* idle */
+		handleMessages(client,1000000);
+		idle=rfbClientMemoryUsage(server->clientHead);
+		rfbClientLog("%lu bytes busy, %lu idle\n",(unsigned long)busy,(unsigned long)idle);
+		if(idle>=busy || server->clientHead->updateBuf!=NULL)
+			countError();
+
+		/* busy again, with fresh streams */
+		drawPicture(server,2*n+1);
+		handleMessages(client,200000);
+		differences+=countDifferences(server,client);
+	}
+
+	rfbClientLog("%d pixels differ, %d errors\n",differences,errors);
+
+	rfbClientCleanup(client);
+	stopTestServer(server);
+
+	return differences>0 || errors>0;
+}
@@ -0,0 +1,93 @@
+/*
+ * Counts the TCP segments it takes to send full screen raw updates over
+ * loopback with and without corking, and checks that corking does not
+ * take more of them and that the picture still arrives. Linux only, as
+ * it needs tcpi_segs_out.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+#ifdef __linux__
+#include <linux/tcp.h>
+#endif
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=320,height=240,updates=20;
+
+#ifdef __linux__
+
+static unsigned long segmentsSent(rfbClientPtr cl)
+{
+	struct tcp_info info;
+	socklen_t len=sizeof(info);
+
+	memset(&info,0,sizeof(info));
+	if(getsockopt(cl->sock,IPPROTO_TCP,TCP_INFO,&info,&len)<0)
+		return 0;
+	return info.tcpi_segs_out;
+}
+
+/* segments per update */
+static double run(rfbScreenInfoPtr server,rfbClient* client,rfbBool cork)
+{
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+	unsigned long before;
+	int n,i;
+
+	server->corkUpdates=cork;
+	handleMessages(client,100000);
+	before=segmentsSent(server->clientHead);
+	for(n=0;n<updates;n++) {
+		for(i=0;i<width*height;i++)
+			fb[i]=(i*7+n*13)&0xffffff;
+		rfbMarkRectAsModified(server,0,0,width,height);
+		handleMessages(client,100000);
+		if(memcmp(server->frameBuffer,client->frameBuffer,width*height*4))
+			countError();
+	}
+	return (double)(segmentsSent(server->clientHead)-before)/updates;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	char* clientArgv[]={"corktest","localhost:6"};
+	int clientArgc=2;
+	double plain,corked;
+
+	server=newTestServer(&argc,argv,width,height,5906);
+	runTestServer(server);
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="raw";
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+
+	plain=run(server,client,FALSE);
+	corked=run(server,client,TRUE);
+	rfbClientLog("%.1f segments per update without cork, %.1f with, %d errors\n",
+		plain,corked,errors);
+
+	rfbClientCleanup(client);
+	stopTestServer(server);
+
+	return corked>plain || errors>0;
+}
+
+#else
+
+int main(int argc,char** argv)
+{
+	rfbClientLog("no segment counts on this platform, skipped\n");
+	return 0;
+}
+
+#endif
@@ -115,9 +115,18 @@ typedef struct clientData {
 	int encodingIndex;
 	rfbScreenInfo* server;
 	char display[8];
+	/* what the callbacks saw, to hold the client's statistics against */
+	unsigned int updates,rects;
+	uint64_t area,bytesIfRaw;
+	rfbBool statisticsChecked;
 } clientData;
 
 static void update(rfbClient* client,int x,int y,int w,int h) {
+	clientData* cd = (clientData*)rfbClientGetClientData(client, clientLoop);
+
+	cd->rects++;
+	cd->area+=(uint64_t)w*h;
+	cd->bytesIfRaw+=sz_rfbFramebufferUpdateRectHeader+(uint64_t)w*h*4;
 #ifndef VERY_VERBOSE
 
 	static const char progress[]={'|','/','-','\\'};
@@ -126,16 +135,64 @@ static void update(rfbClient* client,int x,int y,int w,int h) {
 	if(++counter>=sizeof(progress)) counter=0;
 	fprintf(stderr,"%c\r",progress[counter]);
 #else
-	clientData* cd = (clientData*)rfbClientGetClientData(client, clientLoop);
 	rfbClientLog("Got update (encoding=%s): (%d,%d)-(%d,%d)\n",
 			testEncodings[cd->encodingIndex].str,
 			x,y,x+w,y+h);
 #endif
 }
 
+/*
+ * Holds the client's statistics against what the callbacks saw. The first
+ * update with rects is the whole framebuffer; the server may send it, and
+ * the next, before it knows the encoding, so raw may show up too.
+ */
+static rfbBool doStatisticsMatch(rfbClient* client,clientData* cd,rfbBool firstUpdate)
+{
+	rfbClientStats* stats=rfbClientGetStats(client);
+	rfbClientEncodingStats* ptr;
+	unsigned int rects=0;
+	uint64_t bytes=0,bytesIfRaw=0;
+	rfbBool ok=TRUE;
+
+	if(!stats) {
+		rfbClientErr("No statistics for %s\n",testEncodings[cd->encodingIndex].str);
+		return FALSE;
+	}
+	for(ptr=stats->encodings;ptr;ptr=ptr->next) {
+		rects+=ptr->rects;
+		bytes+=ptr->bytes;
+		bytesIfRaw+=ptr->bytesIfRaw;
+		ok&=ptr->rects>0 && ptr->bytes>0;
+		ok&=ptr->encoding==rfbEncodingRaw || ptr->encoding==testEncodings[cd->encodingIndex].id;
+		if(ptr->encoding==rfbEncodingRaw)
+			ok&=ptr->bytes==ptr->bytesIfRaw;
+		ok&=ptr->decodeNs.count==ptr->rects && ptr->decodeNs.min<=ptr->decodeNs.max &&
+			ptr->decodeNs.sum>=ptr->decodeNs.max;
+		ok&=rfbClientStatPercentile(&ptr->decodeNs,50)<=rfbClientStatPercentile(&ptr->decodeNs,99) &&
+			rfbClientStatPercentile(&ptr->decodeNs,99)<=ptr->decodeNs.max;
+	}
+	ok&=rects==cd->rects && bytesIfRaw==cd->bytesIfRaw;
+	ok&=bytes<=stats->bytesRcvd && stats->bytesSent>0 && stats->syscalls>0;
+
+	if(firstUpdate) {
+		ok&=cd->area>=(uint64_t)width*height;
+		ok&=stats->updates==cd->updates && stats->syscallsPerUpdate.count==cd->updates;
+		ok&=stats->updateLatencyNs.count>=1 && stats->updateLatencyNs.count<=cd->updates &&
+			stats->updateLatencyNs.sum>0;
+	}
+
+	if(!ok) {
+		rfbClientErr("Statistics of %s do not match: %u rects, %.0f bytes in raw seen\n",
+				testEncodings[cd->encodingIndex].str,cd->rects,(double)cd->bytesIfRaw);
+		rfbClientPrintStats(client);
+	}
+	return ok;
+}
+
 static void update_finished(rfbClient* client) {
 	clientData* cd = (clientData*)rfbClientGetClientData(client, clientLoop);
         int maxDelta=0;
+	rfbBool failed;
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 	if(testEncodings[cd->encodingIndex].id==rfbEncodingZYWRLE)
@@ -145,8 +202,14 @@ static void update_finished(rfbClient* client) {
 		maxDelta=5;
 #endif
 #endif
-	updateStatistics(cd->encodingIndex,
-			!doFramebuffersMatch(cd->server,client,maxDelta));
+	failed=!doFramebuffersMatch(cd->server,client,maxDelta);
+	cd->updates++;
+	if(cd->rects>0 && !cd->statisticsChecked) {
+		cd->statisticsChecked=TRUE;
+		if(!doStatisticsMatch(client,cd,TRUE))
+			failed=TRUE;
+	}
+	updateStatistics(cd->encodingIndex,failed);
 }
 
 static THREAD_ROUTINE_RETURN_TYPE clientLoop(void* data) {
@@ -173,6 +236,14 @@ static THREAD_ROUTINE_RETURN_TYPE clientLoop(void* data) {
 				break;
 	}
 
+	rfbClientPrintStats(client);
+	if(!doStatisticsMatch(client,cd,FALSE)) {
+		LOCK(statisticsMutex);
+		statistics[1][cd->encodingIndex]++;
+		totalFailed++;
+		UNLOCK(statisticsMutex);
+	}
+
 	if(client->frameBuffer)
 		free(client->frameBuffer);
 	rfbClientCleanup(client);
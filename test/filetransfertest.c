@@ -0,0 +1,354 @@
+/*
+ * Exercises the file list cache and the worker pool of the TightVNC file
+ * transfer without a viewer speaking its protocol:
+ *
+ * - a listing is served from the cache until its directory changes, and
+ *   changes elsewhere do not keep it from being cached;
+ * - inotify watches are only kept for listings in the cache, also when a
+ *   listing is not cached after all;
+ * - a download arrives complete over a socket pair, also while more
+ *   clients than there are workers do not read their downloads at all;
+ * - a file that cannot be read gets the failure reply and nothing else.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <rfb/rfb.h>
+#include "tightvnc-filetransfer/rfbtightproto.h"
+#include "tightvnc-filetransfer/filetransfermsg.h"
+#include "tightvnc-filetransfer/filelistcache.h"
+#include "tightvnc-filetransfer/filetransferpool.h"
+
+#define DIRS 40
+#define STALLED (FILE_TRANSFER_WORKERS + 1)
+#define FILE_SIZE (3 * 1024 * 1024 + 123)
+
+static char root[64];
+static int errors;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		rfbErr("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		errors++; \
+	} \
+} while(0)
+
+static void touch(const char* dir, const char* name)
+{
+	char path[PATH_MAX];
+	FILE* f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if((f = fopen(path, "w")) != NULL)
+		fclose(f);
+}
+
+/* the number of inotify watches of this process, -1 if unknown */
+static int countWatches(void)
+{
+#ifdef LIBVNCSERVER_HAVE_SYS_INOTIFY_H
+	DIR* fds = opendir("/proc/self/fd");
+	struct dirent* entry;
+	char path[PATH_MAX], target[64], line[256];
+	int count = -1;
+
+	if(fds == NULL)
+		return -1;
+	while((entry = readdir(fds)) != NULL) {
+		ssize_t n;
+		FILE* f;
+
+		snprintf(path, sizeof(path), "/proc/self/fd/%s", entry->d_name);
+		if((n = readlink(path, target, sizeof(target) - 1)) <= 0)
+			continue;
+		target[n] = '\0';
+		if(strcmp(target, "anon_inode:inotify") != 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/self/fdinfo/%s", entry->d_name);
+		if((f = fopen(path, "r")) == NULL)
+			continue;
+		count = 0;
+		while(fgets(line, sizeof(line), f))
+			if(strncmp(line, "inotify wd:", 11) == 0)
+				count++;
+		fclose(f);
+	}
+	closedir(fds);
+	return count;
+#else
+	return -1;
+#endif
+}
+
+static rfbBool isCached(char* dir)
+{
+	FileListCacheTicket ticket;
+	FileTransferMsg msg = GetCachedFileListMsg(dir, 0, &ticket);
+
+	if(msg.data == NULL) {
+		DropFileListCacheTicket(&ticket);
+		return FALSE;
+	}
+	FreeFileTransferMsg(msg);
+	return TRUE;
+}
+
+static void testCache(void)
+{
+	char dirs[DIRS][PATH_MAX];
+	FileTransferMsg first, second;
+	FileListCacheTicket ticket;
+	int i, watches;
+
+	for(i = 0; i < DIRS; i++) {
+		snprintf(dirs[i], sizeof(dirs[i]), "%s/dir%d", root, i);
+		mkdir(dirs[i], 0700);
+		touch(dirs[i], "a");
+	}
+
+	/* a listing comes from the cache until its directory changes */
+	first = GetFileListResponseMsg(dirs[0], 0);
+	CHECK(isCached(dirs[0]));
+	second = GetFileListResponseMsg(dirs[0], 0);
+	CHECK(first.length == second.length && memcmp(first.data, second.data, first.length) == 0);
+	FreeFileTransferMsg(second);
+	touch(dirs[0], "b");
+	CHECK(!isCached(dirs[0]));
+	second = GetFileListResponseMsg(dirs[0], 0);
+	CHECK(second.length > first.length);
+	FreeFileTransferMsg(first);
+	FreeFileTransferMsg(second);
+
+	if(countWatches() < 0) {
+		rfbLog("No inotify, skipping the checks of the watches\n");
+		FlushFileListCache();
+		return;
+	}
+
+	/* a change in another directory does not keep a listing from the cache */
+	CHECK(!isCached(dirs[1]));
+	first = GetCachedFileListMsg(dirs[1], 0, &ticket);
+	CHECK(first.data == NULL);
+	first.data = "listing";
+	first.length = 7;
+	touch(dirs[2], "b");
+	CacheFileListMsg(dirs[1], 0, &ticket, first);
+	CHECK(isCached(dirs[1]));
+
+	/* but one in its own does, and then its watch goes */
+	FlushFileListCache();
+	CHECK(countWatches() == 0);
+	GetCachedFileListMsg(dirs[1], 0, &ticket);
+	touch(dirs[1], "b");
+	CacheFileListMsg(dirs[1], 0, &ticket, first);
+	CHECK(!isCached(dirs[1]));
+	CHECK(countWatches() == 0);
+
+	/* the listings with and without hidden files share a watch */
+	GetCachedFileListMsg(dirs[3], 0, &ticket);
+	CacheFileListMsg(dirs[3], 0, &ticket, first);
+	GetCachedFileListMsg(dirs[3], 0x10, &ticket);
+	DropFileListCacheTicket(&ticket);
+	CHECK(countWatches() == 1);
+	CHECK(isCached(dirs[3]));
+	touch(dirs[3], "c");
+	CHECK(!isCached(dirs[3]));
+	CHECK(countWatches() == 0);
+
+	/* more directories than the cache holds: old watches go with their listings */
+	for(i = 0; i < DIRS; i++)
+		FreeFileTransferMsg(GetFileListResponseMsg(dirs[i], 0));
+	watches = countWatches();
+	CHECK(watches > 0 && watches < DIRS);
+	FlushFileListCache();
+	CHECK(countWatches() == 0);
+}
+
+typedef struct {
+	rfbClientPtr cl;
+	rfbTightClientPtr rtcp;
+	int peer;
+} Download;
+
+static void startDownload(Download* d, const char* file, int sndbuf)
+{
+	int sv[2];
+
+	d->cl = (rfbClientPtr)calloc(1, sizeof(rfbClientRec));
+	d->rtcp = (rfbTightClientPtr)calloc(1, sizeof(rfbTightClientRec));
+	if(!d->cl || !d->rtcp || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		rfbErr("Cannot set up a download\n");
+		exit(1);
+	}
+	if(sndbuf)
+		setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	d->cl->sock = sv[0];
+	d->peer = sv[1];
+	pthread_mutex_init(&d->cl->sendMutex, NULL);
+	pthread_mutex_init(&d->cl->outputMutex, NULL);
+	strcpy(d->rtcp->rcft.rcfd.fName, file);
+	d->rtcp->rcft.rcfd.downloadFD = -1;
+	d->rtcp->rcft.rcfd.mTime = 4711;
+	CHECK(QueueFileDownload(d->cl, d->rtcp));
+}
+
+static void stopDownload(Download* d)
+{
+	CloseUndoneFileDownload(d->cl, d->rtcp);
+	close(d->cl->sock);
+	close(d->peer);
+	pthread_mutex_destroy(&d->cl->sendMutex);
+	pthread_mutex_destroy(&d->cl->outputMutex);
+	free(d->rtcp);
+	free(d->cl);
+}
+
+static rfbBool readFully(int fd, char* buf, int len)
+{
+	while(len > 0) {
+		ssize_t n = read(fd, buf, len);
+
+		if(n <= 0)
+			return FALSE;
+		buf += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+/* reads the data messages of a download and compares them to contents */
+static void receiveDownload(Download* d, const char* contents)
+{
+	char buf[8192];
+	long received = 0;
+	uint32_t mTime = 0;
+
+	for(;;) {
+		rfbFileDownloadDataMsg msg;
+		uint16_t size;
+
+		if(!readFully(d->peer, (char*)&msg, sz_rfbFileDownloadDataMsg)) {
+			CHECK(!"download complete");
+			return;
+		}
+		CHECK(msg.type == rfbFileDownloadData);
+		size = Swap16IfLE(msg.compressedSize);
+		if(size == 0)
+			break;
+		if(size > sizeof(buf) || received + size > FILE_SIZE || !readFully(d->peer, buf, size)) {
+			CHECK(!"data message fits the file");
+			return;
+		}
+		CHECK(memcmp(buf, contents + received, size) == 0);
+		received += size;
+	}
+	CHECK(readFully(d->peer, (char*)&mTime, sizeof(mTime)) && mTime == 4711);
+	CHECK(received == FILE_SIZE);
+}
+
+/* reads the failure reply of a download and checks that nothing follows */
+static void receiveFailure(Download* d)
+{
+	rfbFileDownloadFailedMsg msg;
+	char reason[256];
+	uint16_t len;
+
+	if(!readFully(d->peer, (char*)&msg, sz_rfbFileDownloadFailedMsg)) {
+		CHECK(!"failure reply");
+		return;
+	}
+	CHECK(msg.type == rfbFileDownloadFailed);
+	len = Swap16IfLE(msg.reasonLen);
+	if(len >= sizeof(reason) || !readFully(d->peer, reason, len + 1)) {
+		CHECK(!"reason fits the reply");
+		return;
+	}
+	usleep(200000);
+	CHECK(recv(d->peer, reason, sizeof(reason), MSG_DONTWAIT) < 0);
+}
+
+static void testPool(void)
+{
+	Download stalled[STALLED], d;
+	char file[PATH_MAX];
+	char* contents = malloc(FILE_SIZE);
+	struct timeval start, end;
+	double seconds;
+	FILE* f;
+	int i;
+
+	snprintf(file, sizeof(file), "%s/file", root);
+	for(i = 0; i < FILE_SIZE; i++)
+		contents[i] = (char)(i * 7 + i / 4096);
+	f = fopen(file, "w");
+	if(f == NULL || fwrite(contents, 1, FILE_SIZE, f) != FILE_SIZE) {
+		rfbErr("Cannot write %s\n", file);
+		exit(1);
+	}
+	fclose(f);
+
+	startDownload(&d, file, 0);
+	receiveDownload(&d, contents);
+	stopDownload(&d);
+
+	/* root may open any file, but no one may read this one */
+	chmod(file, 0);
+	startDownload(&d, getuid() == 0 ? "/proc/self/mem" : file, 0);
+	receiveFailure(&d);
+	stopDownload(&d);
+	chmod(file, 0600);
+
+	/* more clients than workers that do not read must not hold up the others */
+	for(i = 0; i < STALLED; i++)
+		startDownload(&stalled[i], file, 16 * 1024);
+	usleep(200000);
+	gettimeofday(&start, NULL);
+	startDownload(&d, file, 0);
+	receiveDownload(&d, contents);
+	gettimeofday(&end, NULL);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	rfbLog("Download next to %d stalled ones took %.2f s\n", STALLED, seconds);
+	CHECK(seconds < 5);
+	stopDownload(&d);
+	for(i = 0; i < STALLED; i++)
+		stopDownload(&stalled[i]);
+
+	unlink(file);
+	free(contents);
+}
+
+static void removeTree(const char* dir)
+{
+	char command[PATH_MAX + 16];
+
+	snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+	if(system(command) != 0)
+		rfbErr("Cannot remove %s\n", dir);
+}
+
+int main(int argc, char** argv)
+{
+	strcpy(root, "/tmp/filetransfertest.XXXXXX");
+	if(mkdtemp(root) == NULL) {
+		rfbErr("Cannot create a directory to test in\n");
+		return 1;
+	}
+
+	testCache();
+	testPool();
+
+	removeTree(root);
+	rfbLog("%d errors\n", errors);
+	return errors > 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Sends a picture made of many small solid rects, with a few noisy spots,
+ * as Hextile, RRE and CoRRE and checks that it arrives unchanged, both
+ * through the default GotFillRects and through an application's own
+ * GotFillRect, which the default falls back to.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#error "I need pthreads or win32 threads for that."
+#endif
+
+static const int width=320,height=240;
+static int fillRectCalls;
+
+static void drawPicture(rfbScreenInfoPtr server)
+{
+	static const uint32_t colours[]={0x204080,0xffffff,0x000000,0x10c010};
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+	int x,y;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			if(x>=200 && x<232 && y>=100 && y<132)
+				fb[y*width+x]=(x*31+y*17)*2654435761u&0xffffff;
+			else
+				fb[y*width+x]=colours[((x/3)^(y/5))%4==0 ? 1+(x/7+y/11)%3 : 0];
+	rfbMarkRectAsModified(server,0,0,width,height);
+}
+
+/* an application's own single rect fill, writing into frameBuffer as well */
+static void countingFillRect(rfbClient* client,int x,int y,int w,int h,uint32_t colour)
+{
+	int i,j;
+
+	fillRectCalls++;
+	for(j=y;j<y+h;j++)
+		for(i=x;i<x+w;i++)
+			((uint32_t*)client->frameBuffer)[j*client->width+i]=colour;
+}
+
+static int countDifferences(rfbScreenInfoPtr server,rfbClient* client)
+{
+	uint32_t* a=(uint32_t*)server->frameBuffer;
+	uint32_t* b=(uint32_t*)client->frameBuffer;
+	int i,count=0;
+
+	for(i=0;i<width*height;i++)
+		if((a[i]^b[i])&0xffffff)
+			count++;
+	return count;
+}
+
+static int receive(rfbScreenInfoPtr server,const char* encoding,rfbBool ownFillRect)
+{
+	rfbClient* client;
+	char* clientArgv[]={"fillrectstest","localhost:7"};
+	int clientArgc=2,differences;
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString=encoding;
+	if(ownFillRect)
+		client->GotFillRect=countingFillRect;
+	if(!rfbInitClient(client,&clientArgc,clientArgv)) {
+		countError();
+		return 0;
+	}
+
+	fillRectCalls=0;
+	handleMessages(client,200000);
+	differences=countDifferences(server,client);
+	rfbClientLog("%s%s: %d pixels differ\n",encoding,ownFillRect?" with own GotFillRect":"",differences);
+	if(ownFillRect && fillRectCalls==0)
+		countError();
+
+	rfbClientCleanup(client);
+	return differences;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	static const char* encodings[]={"hextile","rre","corre"};
+	int i,differences=0;
+
+	server=newTestServer(&argc,argv,width,height,5907);
+	drawPicture(server);
+	runTestServer(server);
+
+	for(i=0;i<3;i++) {
+		differences+=receive(server,encodings[i],FALSE);
+		differences+=receive(server,encodings[i],TRUE);
+	}
+
+	rfbClientLog("%d pixels differ, %d errors\n",differences,errors);
+
+	stopTestServer(server);
+
+	return differences>0 || errors>0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Sends a noisy picture as Tight JPEG with focusQuality on and the
+ * pointer in one corner, and checks that the area around the pointer
+ * arrives lossless while the far side of the screen does not.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=320,height=240,radius=32,ptrX=40,ptrY=40;
+
+/* pixels of the rectangle that did not arrive as they are */
+static int differences(rfbClient* client,rfbScreenInfoPtr server,int x1,int y1,int x2,int y2)
+{
+	uint32_t* got=(uint32_t*)client->frameBuffer;
+	uint32_t* want=(uint32_t*)server->frameBuffer;
+	int x,y,n=0;
+
+	for(y=y1;y<y2;y++)
+		for(x=x1;x<x2;x++)
+			if((got[y*width+x]&0xffffff)!=want[y*width+x])
+				n++;
+	return n;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	char* clientArgv[]={"focustest","localhost:11"};
+	int clientArgc=2,i,near,far;
+	uint32_t* fb;
+
+	server=newTestServer(&argc,argv,width,height,5911);
+	server->focusQuality=TRUE;
+	server->focusRadius=radius;
+	runTestServer(server);
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="tight";
+	client->appData.enableJPEG=TRUE;
+	client->appData.qualityLevel=9;
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+	handleMessages(client,100000);
+
+	SendPointerEvent(client,ptrX,ptrY,0);
+	handleMessages(client,100000);
+
+	/* noise, which JPEG cannot get exactly right */
+	fb=(uint32_t*)server->frameBuffer;
+	srand(1);
+	for(i=0;i<width*height;i++)
+		fb[i]=(rand()&0xff)|(rand()&0xff)<<8|(rand()&0xff)<<16;
+	rfbMarkRectAsModified(server,0,0,width,height);
+	handleMessages(client,200000);
+
+	near=differences(client,server,ptrX-radius,ptrY-radius,ptrX+radius,ptrY+radius);
+	far=differences(client,server,width/2,0,width,height);
+	rfbClientLog("%d pixels differ near the pointer, %d far from it, %d errors\n",near,far,errors);
+
+	rfbClientCleanup(client);
+	stopTestServer(server);
+
+	return near!=0 || far==0 || errors>0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Plays a moving picture on a server with video region handling and checks
+ * that the H.264 rects the client gets decode with libavcodec, and that the
+ * client ends up with about the same picture as the server.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#error "I need pthreads or win32 threads for that."
+#endif
+
+static const int width=320,height=240;
+/* the moving part, a multiple of the damage tile size */
+static const int vx=64,vy=64,vw=160,vh=96;
+
+static AVCodecContext* decoder;
+static AVFrame* decodedFrame;
+static AVPacket* packet;
+static int h264Rects,h264Frames;
+
+static void drawFrame(rfbScreenInfoPtr server,int n)
+{
+	int x,y;
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+
+	/* smooth gradients, which H.264 copes well with */
+	for(y=vy;y<vy+vh;y++)
+		for(x=vx;x<vx+vw;x++)
+			fb[y*width+x]=((x*2+n*3)&0xff) | (((y*2+n)&0xff)<<8) | (((x+y+n*5)&0xff)<<16);
+	rfbMarkRectAsModified(server,vx,vy,vx+vw,vy+vh);
+}
+
+static void resetDecoder(void)
+{
+	const AVCodec* codec=avcodec_find_decoder(AV_CODEC_ID_H264);
+
+	avcodec_free_context(&decoder);
+	if(!codec || !(decoder=avcodec_alloc_context3(codec)) ||
+	   avcodec_open2(decoder,codec,NULL)<0) {
+		rfbClientErr("cannot open an H.264 decoder\n");
+		countError();
+	}
+}
+
+/* put the decoded picture into the client's framebuffer, which is RGB0 */
+static void copyFrame(rfbClient* client,rfbFramebufferUpdateRectHeader* rect)
+{
+	struct SwsContext* sws;
+	uint8_t* dst[1];
+	int dstStride[1];
+
+	if(decodedFrame->width!=rect->r.w || decodedFrame->height!=rect->r.h) {
+		rfbClientErr("decoded %dx%d for a %dx%d rect\n",decodedFrame->width,
+			decodedFrame->height,rect->r.w,rect->r.h);
+		countError();
+		return;
+	}
+	sws=sws_getContext(rect->r.w,rect->r.h,decodedFrame->format,
+		rect->r.w,rect->r.h,AV_PIX_FMT_RGB0,SWS_POINT,NULL,NULL,NULL);
+	dst[0]=client->frameBuffer+(rect->r.y*client->width+rect->r.x)*4;
+	dstStride[0]=client->width*4;
+	sws_scale(sws,(const uint8_t* const*)decodedFrame->data,decodedFrame->linesize,
+		0,rect->r.h,dst,dstStride);
+	sws_freeContext(sws);
+	h264Frames++;
+}
+
+static rfbBool handleH264(rfbClient* client,rfbFramebufferUpdateRectHeader* rect)
+{
+	rfbH264Header hdr;
+	uint8_t* data;
+
+	if(rect->encoding!=rfbEncodingH264)
+		return FALSE;
+
+	if(!ReadFromRFBServer(client,(char*)&hdr,sz_rfbH264Header))
+		return FALSE;
+	hdr.length=rfbClientSwap32IfLE(hdr.length);
+	hdr.flags=rfbClientSwap32IfLE(hdr.flags);
+	h264Rects++;
+
+	if(!decoder || (hdr.flags&(rfbH264FlagResetContext|rfbH264FlagResetAllContexts)))
+		resetDecoder();
+	if(hdr.length==0)
+		return TRUE;
+
+	data=(uint8_t*)av_malloc(hdr.length+AV_INPUT_BUFFER_PADDING_SIZE);
+	memset(data+hdr.length,0,AV_INPUT_BUFFER_PADDING_SIZE);
+	if(!ReadFromRFBServer(client,(char*)data,hdr.length)) {
+		av_free(data);
+		return FALSE;
+	}
+	if(!decoder) {
+		av_free(data);
+		return TRUE;
+	}
+
+	packet->data=data;
+	packet->size=hdr.length;
+	if(avcodec_send_packet(decoder,packet)<0) {
+		rfbClientErr("avcodec_send_packet failed\n");
+		countError();
+	}
+	while(avcodec_receive_frame(decoder,decodedFrame)==0)
+		copyFrame(client,rect);
+	av_free(data);
+	return TRUE;
+}
+
+static int h264Encodings[]={rfbEncodingH264,0};
+static rfbClientProtocolExtension h264Extension={
+	h264Encodings,	/* encodings */
+	handleH264,	/* handleEncoding */
+	NULL,		/* handleMessage */
+	NULL,		/* next extension */
+	NULL,		/* securityTypes */
+	NULL		/* handleAuthentication */
+};
+
+/* average difference per channel inside the moving part */
+static double averageDifference(rfbScreenInfoPtr server,rfbClient* client)
+{
+	unsigned long total=0;
+	int x,y,c;
+
+	for(y=vy;y<vy+vh;y++)
+		for(x=vx;x<vx+vw;x++)
+			for(c=0;c<3;c++) {
+				int a=server->frameBuffer[(y*width+x)*4+c];
+				int b=client->frameBuffer[(y*width+x)*4+c];
+				total+=a>b?a-b:b-a;
+			}
+	return (double)total/(vw*vh*3);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	char* clientArgv[]={"h264test","localhost:2"};
+	int clientArgc=2;
+	double difference;
+	int n;
+
+	/* Initialize server */
+	server=newTestServer(&argc,argv,width,height,5902);
+	server->handleVideoRegions=TRUE;
+	server->videoFrameRate=25;
+	server->videoQualityLevel=9;
+	runTestServer(server);
+
+	decodedFrame=av_frame_alloc();
+	packet=av_packet_alloc();
+	rfbClientRegisterExtension(&h264Extension);
+
+	/* Initialize client */
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="raw";
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+
+	/* a few seconds of motion, the region is video after about one */
+	for(n=0;n<100;n++) {
+		drawFrame(server,n);
+		handleMessages(client,40000);
+	}
+	/* the last frame is sent once the rate limit allows it */
+	handleMessages(client,500000);
+
+	difference=averageDifference(server,client);
+	rfbClientLog("%d H.264 rects, %d frames decoded, %d errors, average difference %.2f\n",
+		h264Rects,h264Frames,errors,difference);
+
+	rfbClientCleanup(client);
+	stopTestServer(server);
+	avcodec_free_context(&decoder);
+	av_frame_free(&decodedFrame);
+	av_packet_free(&packet);
+
+	if(h264Frames==0 || errors>0 || difference>8)
+		return 1;
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Records a session, plain and compressed, while the picture changes a few
+ * times, then plays both recordings back and checks that they end up with
+ * the server's last picture.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=320,height=240;
+
+static void draw(rfbScreenInfoPtr server,int round)
+{
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+	int x,y;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			fb[y*width+x]=((x/(8+round))*0x1f3b+(y/(4+round))*0x2c51+round*0x7654321)&0xffffff;
+	rfbMarkRectAsModified(server,0,0,width,height);
+}
+
+/* ZRLE's three byte pixels leave the fourth byte alone */
+static rfbBool samePicture(rfbClient* client,rfbScreenInfoPtr server)
+{
+	uint32_t* got=(uint32_t*)client->frameBuffer;
+	uint32_t* want=(uint32_t*)server->frameBuffer;
+	int i;
+
+	for(i=0;i<width*height;i++)
+		if((got[i]&0xffffff)!=want[i])
+			return FALSE;
+	return TRUE;
+}
+
+static void record(rfbScreenInfoPtr server,const char* fileName,rfbBool compress)
+{
+	rfbClient* client=rfbGetClient(8,3,4);
+	char* plainArgv[]={"recordtest","-record",(char*)fileName,"localhost:10"};
+	char* compressedArgv[]={"recordtest","localhost:10"};
+	int argc=compress?2:4,round;
+
+	client->appData.encodingsString="zrle raw";
+	if(compress && !rfbClientStartRecording(client,fileName,TRUE)) {
+		countError();
+		return;
+	}
+	if(!rfbInitClient(client,&argc,compress?compressedArgv:plainArgv)) {
+		countError();
+		return;
+	}
+	for(round=0;round<5;round++) {
+		draw(server,round);
+		handleMessages(client,50000);
+	}
+	if(!rfbClientStopRecording(client))
+		countError();
+	rfbClientCleanup(client);
+}
+
+static rfbBool gunzip(const char* from,const char* to)
+{
+	gzFile in=gzopen(from,"rb");
+	FILE* out=fopen(to,"wb");
+	char buf[65536];
+	int n=0;
+
+	if(in && out)
+		while((n=gzread(in,buf,sizeof(buf)))>0)
+			if(fwrite(buf,1,n,out)!=(size_t)n) {
+				n=-1;
+				break;
+			}
+	if(in)
+		gzclose(in);
+	if(out && fclose(out)!=0)
+		n=-1;
+	return in && out && n==0;
+}
+
+static void play(rfbScreenInfoPtr server,const char* fileName)
+{
+	rfbClient* client=rfbGetClient(8,3,4);
+	char* argv[]={"recordtest","-play",(char*)fileName};
+	int argc=3,messages=0;
+
+	if(!rfbInitClient(client,&argc,argv)) {
+		countError();
+		return;
+	}
+	/* a recording ends when its file does */
+	while(HandleRFBServerMessage(client))
+		messages++;
+	if(messages==0 || !samePicture(client,server)) {
+		rfbClientErr("playing %s: %d messages, picture %s\n",fileName,messages,
+			messages ? "differs" : "missing");
+		countError();
+	}
+	rfbClientCleanup(client);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	char plain[64],compressed[64],uncompressed[64];
+
+	server=newTestServer(&argc,argv,width,height,5910);
+	runTestServer(server);
+
+	sprintf(plain,"recordtest-%d.vnc",(int)getpid());
+	sprintf(compressed,"recordtest-%d.vnc.gz",(int)getpid());
+	sprintf(uncompressed,"recordtest-%d-gunzipped.vnc",(int)getpid());
+
+	record(server,plain,FALSE);
+	play(server,plain);
+
+	record(server,compressed,TRUE);
+	if(!gunzip(compressed,uncompressed))
+		countError();
+	play(server,uncompressed);
+
+	unlink(plain);
+	unlink(compressed);
+	unlink(uncompressed);
+
+	stopTestServer(server);
+
+	rfbClientLog("%d errors\n",errors);
+	return errors>0;
+}
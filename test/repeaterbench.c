@@ -0,0 +1,286 @@
+/*
+ * Benchmarks examples/vncrepeater.c with a thousand simulated server-viewer
+ * pairs over loopback: all of them connect and send their IDs, then each
+ * side of every pair streams a pattern to the other one at the same time,
+ * which is checked byte for byte, so that a mixed up pair or stream shows.
+ * After that the pairs are left alone until the repeater's idle timeout
+ * closes them, and the totals the repeater logs on SIGTERM have to match
+ * what was sent.
+ *
+ * Usage: repeaterbench <vncrepeater> [pairs [bytes per direction]]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define SERVER_PORT 5913
+#define VIEWER_PORT 5914
+#define IDLE_TIMEOUT 3
+#define ID_LEN 250
+#define CHUNK 65536
+
+typedef struct {
+  int fd;
+  unsigned int seed;          /* of what this end sends, the other end's is seed ^ 1 */
+  unsigned long sent, received;
+  int closed;
+} End;
+
+static unsigned char pattern[CHUNK + 256];
+
+
+static double seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int connectTo(int port)
+{
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+
+static int sendId(int fd, int i)
+{
+  char id[ID_LEN];
+
+  memset(id, 0, sizeof(id));
+  snprintf(id, sizeof(id), "ID:%d", 1000 + i);
+  return send(fd, id, sizeof(id), 0) == sizeof(id);
+}
+
+
+static int readAll(int fd, char *buf, int len)
+{
+  int n;
+
+  while (len > 0) {
+    n = recv(fd, buf, len, 0);
+    if (n <= 0)
+      return 0;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+  int pairs = argc > 2 ? atoi(argv[2]) : 1000;
+  unsigned long bytes = argc > 3 ? strtoul(argv[3], NULL, 0) : 256 * 1024;
+  struct epoll_event *events;
+  struct rlimit limit;
+  char greeting[12], logText[65536], *line;
+  unsigned long long toServers = 0, toViewers = 0, expected;
+  unsigned long loggedPairs = 0;
+  double start, setup, transfer;
+  int logPipe[2], epfd, i, n, done = 0, closed = 0, errors = 0, logLen = 0;
+  End *ends;
+  pid_t pid;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <vncrepeater> [pairs [bytes per direction]]\n", argv[0]);
+    return 1;
+  }
+
+  /* this side needs two descriptors per pair, the repeater six */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur != RLIM_INFINITY && (rlim_t)pairs * 6 + 64 > limit.rlim_cur) {
+      pairs = (int)((limit.rlim_cur - 64) / 6);
+      printf("Only %d pairs fit in the descriptor limit\n", pairs);
+    }
+  }
+
+  for (i = 0; i < (int)sizeof(pattern); i++)
+    pattern[i] = (unsigned char)i;
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pipe(logPipe) < 0)
+    return 1;
+  pid = fork();
+  if (pid < 0)
+    return 1;
+  if (pid == 0) {
+    char serverPort[16], viewerPort[16], idle[16];
+
+    snprintf(serverPort, sizeof(serverPort), "%d", SERVER_PORT);
+    snprintf(viewerPort, sizeof(viewerPort), "%d", VIEWER_PORT);
+    snprintf(idle, sizeof(idle), "%d", IDLE_TIMEOUT);
+    dup2(logPipe[1], 2);
+    close(logPipe[0]);
+    close(logPipe[1]);
+    execl(argv[1], argv[1], "-serverport", serverPort, "-viewerport", viewerPort,
+          "-idle", idle, "-quiet", (char *)NULL);
+    _exit(127);
+  }
+  close(logPipe[1]);
+
+  ends = (End *)calloc(2 * pairs, sizeof(End));
+  events = (struct epoll_event *)calloc(2 * pairs, sizeof(struct epoll_event));
+  epfd = epoll_create1(0);
+  if (ends == NULL || events == NULL || epfd < 0)
+    return 1;
+
+  /* wait for the repeater to listen */
+  for (i = 0; i < 50; i++) {
+    int fd = connectTo(VIEWER_PORT);
+
+    if (fd >= 0) {
+      close(fd);
+      break;
+    }
+    usleep(100000);
+  }
+
+  /* even ends are servers, odd ones viewers */
+  start = seconds();
+  for (i = 0; i < pairs; i++) {
+    End *server = &ends[2 * i], *viewer = &ends[2 * i + 1];
+
+    server->fd = connectTo(SERVER_PORT);
+    viewer->fd = connectTo(VIEWER_PORT);
+    if (server->fd < 0 || viewer->fd < 0 || !sendId(server->fd, i) ||
+        !readAll(viewer->fd, greeting, sizeof(greeting)) ||
+        memcmp(greeting, "RFB 000.000\n", sizeof(greeting)) != 0 || !sendId(viewer->fd, i)) {
+      fprintf(stderr, "Setting up pair %d failed\n", i);
+      kill(pid, SIGTERM);
+      return 1;
+    }
+    server->seed = 2 * i;
+    viewer->seed = 2 * i + 1;
+  }
+  setup = seconds() - start;
+
+  for (i = 0; i < 2 * pairs; i++) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &ends[i];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ends[i].fd, &ev);
+  }
+
+  start = seconds();
+  while (done < 2 * pairs && seconds() - start < 60) {
+    n = epoll_wait(epfd, events, 2 * pairs, 1000);
+    for (i = 0; i < n; i++) {
+      End *e = (End *)events[i].data.ptr;
+      unsigned char buf[CHUNK];
+      unsigned int other = e->seed ^ 1;
+      ssize_t len;
+      int k;
+
+      if ((events[i].events & EPOLLOUT) && e->sent < bytes) {
+        len = bytes - e->sent < CHUNK ? bytes - e->sent : CHUNK;
+        len = send(e->fd, pattern + ((e->sent + e->seed) & 0xff), len, MSG_DONTWAIT);
+        if (len > 0)
+          e->sent += len;
+        if (e->sent == bytes) {
+          struct epoll_event ev;
+
+          memset(&ev, 0, sizeof(ev));
+          ev.events = EPOLLIN;
+          ev.data.ptr = e;
+          epoll_ctl(epfd, EPOLL_CTL_MOD, e->fd, &ev);
+        }
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        len = recv(e->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len <= 0 && !(len < 0 && errno == EAGAIN)) {
+          fprintf(stderr, "Pair %d lost its %s\n", (int)(e - ends) / 2,
+                  (e - ends) % 2 ? "viewer" : "server");
+          kill(pid, SIGTERM);
+          return 1;
+        }
+        for (k = 0; k < len; k++)
+          if (buf[k] != (unsigned char)(e->received + k + other))
+            errors++;
+        if (len > 0) {
+          e->received += len;
+          if (e->received == bytes)
+            done++;
+        }
+      }
+    }
+  }
+  transfer = seconds() - start;
+
+  printf("%d pairs set up in %.2fs, %.1f MB relayed in %.2fs, %.1f MB/s, %d bytes wrong\n",
+         pairs, setup, 2.0 * pairs * bytes / 1e6, transfer,
+         2.0 * pairs * bytes / 1e6 / transfer, errors);
+  if (done < 2 * pairs) {
+    fprintf(stderr, "Only %d of %d streams arrived\n", done, 2 * pairs);
+    kill(pid, SIGTERM);
+    return 1;
+  }
+
+  /* now idle, the repeater has to close everything */
+  start = seconds();
+  while (closed < 2 * pairs && seconds() - start < IDLE_TIMEOUT + 5) {
+    n = epoll_wait(epfd, events, 2 * pairs, 1000);
+    for (i = 0; i < n; i++) {
+      End *e = (End *)events[i].data.ptr;
+      char c;
+
+      if (!e->closed && recv(e->fd, &c, 1, MSG_DONTWAIT) == 0) {
+        e->closed = 1;
+        closed++;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+      }
+    }
+  }
+  printf("%d of %d connections closed after %.1fs idle\n", closed, 2 * pairs, seconds() - start);
+
+  kill(pid, SIGTERM);
+  while ((n = read(logPipe[0], logText + logLen, sizeof(logText) - 1 - logLen)) > 0)
+    logLen += n;
+  logText[logLen] = '\0';
+  waitpid(pid, NULL, 0);
+  for (line = strtok(logText, "\n"); line; line = strtok(NULL, "\n"))
+    if (strstr(line, "bytes to the viewers"))
+      sscanf(strstr(line, "vncrepeater: "), "vncrepeater: %lu pairs, %llu bytes to the servers, %llu",
+             &loggedPairs, &toServers, &toViewers);
+  expected = (unsigned long long)pairs * bytes;
+  printf("The repeater counted %lu pairs, %llu bytes to the servers, %llu to the viewers\n",
+         loggedPairs, toServers, toViewers);
+
+  for (i = 0; i < 2 * pairs; i++)
+    close(ends[i].fd);
+  free(ends);
+  free(events);
+
+  return errors > 0 || closed < 2 * pairs || loggedPairs != (unsigned long)pairs ||
+         toServers != expected || toViewers != expected;
+}
@@ -0,0 +1,149 @@
+/*
+ * Sends pointer events and cut texts from several threads through the
+ * writer thread while the main thread keeps decoding updates, and checks
+ * on the server that all of them arrive, whole and in each thread's order,
+ * and on the client that the bytes and system calls to send add up.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+#define THREADS 4
+#define EVENTS 500
+#define CUT_TEXT_EVERY 50
+
+static const int width=640,height=480;
+static rfbClient* client;
+/* the server's side, only touched by its thread */
+static int nextEvent[THREADS],cutTexts;
+/* large enough to take more than one write() */
+static char texts[THREADS][100000];
+
+static void ptrAddEvent(int buttonMask,int x,int y,rfbClientPtr cl)
+{
+	if(y<0 || y>=THREADS || x!=nextEvent[y]) {
+		rfbLog("pointer event %d of thread %d out of order\n",x,y);
+		countError();
+		return;
+	}
+	nextEvent[y]++;
+}
+
+static void setXCutText(char* str,int len,rfbClientPtr cl)
+{
+	int thread,n,i;
+
+	if(sscanf(str,"%d %d",&thread,&n)!=2 || len!=sizeof(texts[0])) {
+		countError();
+		return;
+	}
+	for(i=20;i<len;i++)
+		if(str[i]!='a'+thread) {
+			countError();
+			return;
+		}
+	cutTexts++;
+}
+
+static void* sendEvents(void* arg)
+{
+	int thread=(int)(size_t)arg,n;
+	char* text=texts[thread];
+
+	for(n=0;n<EVENTS;n++) {
+		if(!SendPointerEvent(client,n,thread,0))
+			countError();
+		if(n%CUT_TEXT_EVERY==0) {
+			memset(text,'a'+thread,sizeof(texts[0]));
+			sprintf(text,"%d %d",thread,n);
+			text[strlen(text)]=' ';
+			if(!SendClientCutText(client,text,sizeof(texts[0])))
+				countError();
+		}
+	}
+	return NULL;
+}
+
+static int received(void)
+{
+	int i,n=0;
+
+	for(i=0;i<THREADS;i++)
+		n+=nextEvent[i];
+	return n;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	char* clientArgv[]={"sendqueuetest","localhost:9"};
+	int clientArgc=2,i;
+	pthread_t threads[THREADS];
+	rfbClientStats* stats;
+	uint64_t bytesSent,sendSyscalls,expected;
+	uint32_t updates;
+
+	server=newTestServer(&argc,argv,width,height,5909);
+	server->ptrAddEvent=ptrAddEvent;
+	server->setXCutText=setXCutText;
+	runTestServer(server);
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="raw";
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+	if(!rfbClientStartSendThread(client))
+		return 1;
+
+	stats=rfbClientGetStats(client);
+	bytesSent=stats->bytesSent;
+	sendSyscalls=stats->sendSyscalls;
+	updates=stats->updates;
+	for(i=0;i<THREADS;i++)
+		pthread_create(&threads[i],NULL,sendEvents,(void*)(size_t)i);
+	/* keep the main thread decoding meanwhile */
+	for(i=0;i<20;i++) {
+		rfbMarkRectAsModified(server,0,0,width,height);
+		handleMessages(client,20000);
+	}
+	for(i=0;i<THREADS;i++)
+		pthread_join(threads[i],NULL);
+	rfbClientStopSendThread(client);
+
+	/* the events, the cut texts and a request after each update */
+	expected=(uint64_t)THREADS*EVENTS*sz_rfbPointerEventMsg+
+		(uint64_t)THREADS*EVENTS/CUT_TEXT_EVERY*(sz_rfbClientCutTextMsg+sizeof(texts[0]))+
+		(uint64_t)(stats->updates-updates)*sz_rfbFramebufferUpdateRequestMsg;
+	if(stats->bytesSent-bytesSent!=expected) {
+		rfbClientErr("%.0f bytes sent, %.0f expected\n",(double)(stats->bytesSent-bytesSent),(double)expected);
+		countError();
+	}
+	if(stats->sendSyscalls-sendSyscalls<(uint64_t)THREADS*EVENTS) {
+		rfbClientErr("%.0f system calls to send %d messages\n",(double)(stats->sendSyscalls-sendSyscalls),THREADS*EVENTS);
+		countError();
+	}
+	if(stats->syscallsPerUpdate.sum>stats->syscalls) {
+		rfbClientErr("the system calls per update count more than those to receive\n");
+		countError();
+	}
+
+	for(i=0;i<50 && received()<THREADS*EVENTS;i++)
+		handleMessages(client,100000);
+
+	rfbClientLog("%d of %d pointer events, %d of %d cut texts, %d errors\n",
+		received(),THREADS*EVENTS,cutTexts,THREADS*EVENTS/CUT_TEXT_EVERY,errors);
+
+	rfbClientCleanup(client);
+	stopTestServer(server);
+
+	return received()!=THREADS*EVENTS || cutTexts!=THREADS*EVENTS/CUT_TEXT_EVERY || errors>0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Exports the framebuffer of a client whose connection only trickles in,
+ * lets another thread watch the seqlock of the segment while an update is
+ * arriving, and checks that it is never held for long and that the reader
+ * ends up with the picture the server has.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "testserver.h"
+#include <rfb/rfbshm.h>
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+/* raw, so that the first update is 300k and takes a while at 1k per ms */
+static const int width=320,height=240;
+#define CHUNK 1024
+
+static int fd=-1;
+static volatile int done;
+static long longestOddUsecs,oddSpans;
+static long lastRectUsecs;
+static struct timeval start;
+
+static long usecsSince(const struct timeval* t)
+{
+	struct timeval now;
+
+	gettimeofday(&now,NULL);
+	return (now.tv_sec-t->tv_sec)*1000000L+(now.tv_usec-t->tv_usec);
+}
+
+static int readFromTransport(rfbClient* client,char* buf,int len)
+{
+	usleep(1000);
+	return recv(fd,buf,len<CHUNK?len:CHUNK,MSG_DONTWAIT);
+}
+
+static int writeToTransport(rfbClient* client,const char* buf,int len)
+{
+	return send(fd,buf,len,0);
+}
+
+static int waitForTransport(rfbClient* client,unsigned int usecs)
+{
+	struct pollfd p;
+
+	p.fd=fd;
+	p.events=POLLIN;
+	return poll(&p,1,usecs/1000);
+}
+
+static void gotRect(rfbClient* client,int x,int y,int w,int h)
+{
+	lastRectUsecs=usecsSince(&start);
+}
+
+/* measures how long seq stays odd at a time */
+static void* watchSeqlock(void* arg)
+{
+	const rfbShmHeader* header=(const rfbShmHeader*)arg;
+	struct timeval oddSince;
+	int odd=0;
+
+	while(!done) {
+		if(header->seq&1) {
+			if(!odd) {
+				gettimeofday(&oddSince,NULL);
+				odd=1;
+				oddSpans++;
+			}
+		} else if(odd) {
+			long usecs=usecsSince(&oddSince);
+			if(usecs>longestOddUsecs)
+				longestOddUsecs=usecs;
+			odd=0;
+		}
+	}
+	return NULL;
+}
+
+/* the reader's side of rfb/rfbshm.h */
+static int readPicture(const rfbShmHeader* header,uint32_t* picture)
+{
+	uint32_t s1,s2;
+	int tries=0;
+
+	do {
+		if(++tries>1000)
+			return 0;
+		s1=header->seq;
+		__sync_synchronize();
+		memcpy(picture,(const char*)header+header->headerSize,(size_t)header->stride*header->height);
+		__sync_synchronize();
+		s2=header->seq;
+	} while(s1!=s2 || (s1&1));
+	return 1;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	struct sockaddr_in addr;
+	struct stat st;
+	rfbShmHeader* header;
+	pthread_t watcher;
+	uint32_t *fb,*picture;
+	int i,differences=0;
+
+	server=newTestServer(&argc,argv,width,height,5918);
+	fb=(uint32_t*)server->frameBuffer;
+	for(i=0;i<width*height;i++)
+		fb[i]=(i*2654435761u)&0xffffff;
+	runTestServer(server);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(5918);
+	addr.sin_addr.s_addr=inet_addr("127.0.0.1");
+	fd=socket(AF_INET,SOCK_STREAM,0);
+	if(fd<0 || connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return 1;
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="raw";
+	client->ReadFromTransport=readFromTransport;
+	client->WriteToTransport=writeToTransport;
+	client->WaitForTransport=waitForTransport;
+	client->GotFrameBufferUpdate=gotRect;
+	if(!rfbClientExportFrameBuffer(client,NULL))
+		return 1;
+	if(!rfbInitClient(client,NULL,NULL))
+		return 1;
+
+	if(fstat(rfbClientGetExportFd(client),&st)<0)
+		return 1;
+	header=(rfbShmHeader*)mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,rfbClientGetExportFd(client),0);
+	if(header==MAP_FAILED)
+		return 1;
+	picture=malloc((size_t)header->stride*header->height);
+	if(!picture)
+		return 1;
+	pthread_create(&watcher,NULL,watchSeqlock,header);
+
+	gettimeofday(&start,NULL);
+	handleMessages(client,500000);
+	done=1;
+	pthread_join(watcher,NULL);
+
+	if(!readPicture(header,picture))
+		countError();
+	else
+		for(i=0;i<width*height;i++)
+			if((picture[i]&0xffffff)!=fb[i])
+				differences++;
+	rfbClientLog("the picture took %ld ms, seq was odd %ld times for at most %ld us, %d pixels differ, %d errors\n",
+		lastRectUsecs/1000,oddSpans,longestOddUsecs,differences,errors);
+
+	/* the update has to be slow for this to mean anything */
+	if(lastRectUsecs<200000 || header->frame==0 || header->damageCount==0)
+		countError();
+	if(longestOddUsecs>50000)
+		countError();
+
+	munmap(header,st.st_size);
+	free(picture);
+	rfbClientCleanup(client);
+	close(fd);
+	stopTestServer(server);
+
+	return differences>0 || errors>0;
+}
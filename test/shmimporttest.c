@@ -0,0 +1,199 @@
+/*
+ * Lets a forked producer render a moving box into a double buffered memfd
+ * segment the server imports, reporting damage through the ring and an
+ * eventfd, and checks that the client ends up with the last frame. Also
+ * checks that a segment without F_SEAL_SHRINK is refused and that buffer
+ * offsets changed after the import are ignored.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create() */
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include "testserver.h"
+#include <rfb/rfbshm.h>
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=320,height=240,frames=40;
+/* rows are padded, and the format is not the one the client asks for */
+static const int stride=320*4+64;
+static const size_t headerSize=16384;
+
+static uint32_t background(int x,int y)
+{
+	return ((x*3)&0xff)<<16 | ((y*2)&0xff)<<8 | 0x40;
+}
+
+static void boxOf(int n,int* x,int* y)
+{
+	*x=10+n*6;
+	*y=20+n*4;
+}
+
+static uint32_t picture(int n,int x,int y)
+{
+	int bx,by;
+
+	boxOf(n,&bx,&by);
+	if(x>=bx && x<bx+40 && y>=by && y<by+30)
+		return 0x20e020+n;
+	return background(x,y);
+}
+
+static void pushEntry(rfbShmImportHeader* header,int x,int y,int w,int h)
+{
+	rfbShmRect* r;
+
+	while(header->head-header->tail==RFB_SHM_RING_SLOTS)
+		usleep(1000);
+	r=&header->ring[header->head%RFB_SHM_RING_SLOTS];
+	r->x=x; r->y=y; r->w=w; r->h=h;
+	__sync_synchronize();
+	header->head++;
+}
+
+static int produce(rfbShmImportHeader* header,int eventFd)
+{
+	uint64_t one=1;
+	int n,x,y,bx,by,back,wait;
+
+	for(n=1;n<=frames;n++) {
+		back=1-header->front;
+		for(y=0;y<height;y++) {
+			uint32_t* row=(uint32_t*)((char*)header+header->bufferOffset[back]+y*stride);
+			for(x=0;x<width;x++)
+				row[x]=picture(n,x,y);
+		}
+		/* where the box was and where it is */
+		boxOf(n-1,&bx,&by);
+		pushEntry(header,bx,by,40,30);
+		boxOf(n,&bx,&by);
+		pushEntry(header,bx,by,40,30);
+		pushEntry(header,back,0,0,0);
+		if(write(eventFd,&one,sizeof(one))!=sizeof(one))
+			return 1;
+		for(wait=0;header->front!=(uint32_t)back;wait++) {
+			if(wait==5000)
+				return 1;
+			usleep(1000);
+		}
+		usleep(10000);
+	}
+	return 0;
+}
+
+static uint32_t clientRGB(rfbClient* client,int x,int y)
+{
+	rfbPixelFormat* f=&client->format;
+	uint32_t p=((uint32_t*)client->frameBuffer)[y*width+x];
+
+	return ((p>>f->redShift)&f->redMax)<<16 | ((p>>f->greenShift)&f->greenMax)<<8 |
+		((p>>f->blueShift)&f->blueMax);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	char* clientArgv[]={"shmimporttest","localhost:5"};
+	int clientArgc=2;
+	rfbShmImportHeader* header;
+	size_t size=headerSize+2*(size_t)stride*height;
+	uint64_t one=1;
+	int fd,eventFd,x,y,status,differences=0;
+	pid_t producer;
+
+	fd=memfd_create("shmimporttest",MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	eventFd=eventfd(0,EFD_CLOEXEC);
+	if(fd<0 || eventFd<0 || ftruncate(fd,size)<0)
+		return 1;
+	header=(rfbShmImportHeader*)mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	if(header==MAP_FAILED)
+		return 1;
+	header->magic=RFB_SHM_IMPORT_MAGIC;
+	header->version=RFB_SHM_IMPORT_VERSION;
+	header->headerSize=headerSize;
+	header->width=width;
+	header->height=height;
+	header->stride=stride;
+	header->bufferOffset[0]=headerSize;
+	header->bufferOffset[1]=headerSize+(size_t)stride*height;
+	header->bitsPerPixel=32;
+	header->depth=24;
+	header->trueColour=1;
+	header->redMax=header->greenMax=header->blueMax=255;
+	header->redShift=16;
+	header->greenShift=8;
+	header->blueShift=0;
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			((uint32_t*)((char*)header+headerSize+y*stride))[x]=picture(0,x,y);
+
+	server=newTestServer(&argc,argv,width,height,5905);
+	if(rfbShmImportFrameBuffer(server,fd,eventFd)) {
+		rfbClientErr("a segment that can shrink was imported\n");
+		countError();
+	}
+	if(fcntl(fd,F_ADD_SEALS,F_SEAL_SHRINK)<0 || !rfbShmImportFrameBuffer(server,fd,eventFd))
+		return 1;
+	runTestServer(server);
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="raw";
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+	handleMessages(client,100000);
+
+	producer=fork();
+	if(producer<0)
+		return 1;
+	if(producer==0)
+		_exit(produce(header,eventFd));
+
+	while(waitpid(producer,&status,WNOHANG)==0)
+		handleMessages(client,10000);
+	handleMessages(client,300000);
+	if(!WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+		rfbClientErr("the producer failed\n");
+		countError();
+	}
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			if(clientRGB(client,x,y)!=picture(frames,x,y))
+				differences++;
+	if(header->front!=(frames&1)) {
+		rfbClientErr("the server does not show the last buffer\n");
+		countError();
+	}
+
+	/* a buffer offset far outside the segment, then a flip to it */
+	header->bufferOffset[0]=header->bufferOffset[1]=(uint64_t)1<<40;
+	pushEntry(header,0,0,width,height);
+	pushEntry(header,0,0,0,0);
+	if(write(eventFd,&one,sizeof(one))!=sizeof(one))
+		countError();
+	handleMessages(client,300000);
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			if(clientRGB(client,x,y)!=((uint32_t*)((char*)header+headerSize+y*stride))[x])
+				differences++;
+	rfbClientLog("%d frames, %d pixels differ, %d errors\n",frames,differences,errors);
+
+	rfbClientCleanup(client);
+	stopTestServer(server);
+	munmap(header,size);
+	close(fd);
+	close(eventFd);
+
+	return differences>0 || errors>0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Receives a picture in every lossless encoding into a framebuffer with
+ * padded rows, as an application with its own MallocFrameBuffer might
+ * hand over, then moves part of it on the server with CopyRect. The
+ * pixels have to arrive unchanged and the padding has to stay untouched,
+ * also in viewport mode, where rects outside the viewport are decoded
+ * elsewhere first.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#error "I need pthreads or win32 threads for that."
+#endif
+
+/* an odd number of pixels, so rows are neither packed nor nicely aligned */
+#define PADDING (13*4)
+#define CANARY 0xa5
+
+static const int width=160,height=120;
+static const int vx=30,vy=20,vw=90,vh=70;
+
+static void drawPicture(rfbScreenInfoPtr server)
+{
+	static const uint32_t colours[]={0x204080,0xffffff,0x000000,0x10c010};
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+	int x,y;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			if(x>=100 && x<140 && y>=50 && y<90)
+				fb[y*width+x]=(x*31+y*17)*2654435761u&0xffffff;
+			else
+				fb[y*width+x]=colours[((x/3)^(y/5))%4==0 ? 1+(x/7+y/11)%3 : 0];
+	rfbMarkRectAsModified(server,0,0,width,height);
+}
+
+static rfbBool paddedMallocFrameBuffer(rfbClient* client)
+{
+	size_t stride=(size_t)client->width*4+PADDING;
+
+	free(client->frameBuffer);
+	client->frameBuffer=malloc(stride*client->height);
+	if(!client->frameBuffer)
+		return FALSE;
+	memset(client->frameBuffer,CANARY,stride*client->height);
+	client->frameBufferStride=(int)stride;
+	return TRUE;
+}
+
+/* the client's framebuffer shows the server's from (ox,oy) on */
+static int countDifferences(rfbScreenInfoPtr server,rfbClient* client,int ox,int oy)
+{
+	uint32_t* a=(uint32_t*)server->frameBuffer;
+	size_t stride=rfbClientFrameBufferStride(client);
+	int x,y,count=0;
+
+	for(y=0;y<client->height;y++) {
+		uint32_t* b=(uint32_t*)(client->frameBuffer+y*stride);
+
+		for(x=0;x<client->width;x++)
+			if((a[(y+oy)*width+x+ox]^b[x])&0xffffff)
+				count++;
+	}
+	return count;
+}
+
+static void checkPadding(rfbClient* client)
+{
+	size_t stride=rfbClientFrameBufferStride(client);
+	int y,i;
+
+	for(y=0;y<client->height;y++)
+		for(i=client->width*4;i<(int)stride;i++)
+			if(client->frameBuffer[y*stride+i]!=CANARY) {
+				rfbClientErr("padding of row %d overwritten\n",y);
+				countError();
+				break;
+			}
+}
+
+/* handles updates until the client shows the server's picture, for at
+   most about 10 seconds, and returns how many pixels still differ */
+static int waitForPicture(rfbScreenInfoPtr server,rfbClient* client,int ox,int oy)
+{
+	int differences,tries=0;
+
+	do
+		handleMessages(client,10000);
+	while((differences=countDifferences(server,client,ox,oy))>0 && ++tries<1000);
+	checkPadding(client);
+	return differences;
+}
+
+static int receive(rfbScreenInfoPtr server,const char* encoding,rfbBool viewport)
+{
+	rfbClient* client;
+	char* clientArgv[]={"stridetest","localhost:17"};
+	int clientArgc=2,differences,ox=viewport ? vx : 0,oy=viewport ? vy : 0;
+
+	drawPicture(server);
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString=encoding;
+	client->appData.enableJPEG=FALSE;
+	/* the server has no cursor, and without this CopyRect looks at it */
+	client->appData.useRemoteCursor=TRUE;
+	client->MallocFrameBuffer=paddedMallocFrameBuffer;
+	if(viewport)
+		rfbClientSetViewport(client,vx,vy,vw,vh);
+	if(!rfbInitClient(client,&clientArgc,clientArgv)) {
+		countError();
+		return 0;
+	}
+	if(client->frameBufferStride!=client->width*4+PADDING)
+		countError();
+
+	differences=waitForPicture(server,client,ox,oy);
+
+	/* up and left, across the viewport's edge, then down and right */
+	rfbDoCopyRect(server,20,10,100,80,-12,-7);
+	differences+=waitForPicture(server,client,ox,oy);
+	rfbDoCopyRect(server,50,40,150,110,9,5);
+	differences+=waitForPicture(server,client,ox,oy);
+
+	rfbClientLog("%s%s: %d pixels differ\n",encoding,viewport?" in a viewport":"",differences);
+
+	free(client->frameBuffer);
+	rfbClientCleanup(client);
+	return differences;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	static const char* encodings[]={
+		"raw copyrect","hextile copyrect","rre copyrect","corre copyrect",
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+		"zlib copyrect","zrle copyrect",
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+		"tight copyrect",
+#endif
+#endif
+		"ultra copyrect"
+	};
+	int i,differences=0;
+
+	server=newTestServer(&argc,argv,width,height,5917);
+	runTestServer(server);
+
+	for(i=0;i<(int)(sizeof(encodings)/sizeof(encodings[0]));i++) {
+		differences+=receive(server,encodings[i],FALSE);
+		differences+=receive(server,encodings[i],TRUE);
+	}
+
+	rfbClientLog("%d pixels differ, %d errors\n",differences,errors);
+
+	stopTestServer(server);
+
+	return differences>0 || errors>0;
+}
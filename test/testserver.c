@@ -0,0 +1,79 @@
+/*
+ * See testserver.h.
+ */
+
+#include <stdlib.h>
+#include "testserver.h"
+
+int errors;
+/* the server's callbacks and the tests' own threads count errors, too */
+static MUTEX(errorsMutex);
+static rfbBool errorsMutexInitialised;
+
+/* there is only one server per test */
+static char* frameBuffer;
+
+/* called before the server or the test start any threads */
+static void initErrorsMutex(void)
+{
+	if(!errorsMutexInitialised) {
+		INIT_MUTEX(errorsMutex);
+		errorsMutexInitialised=TRUE;
+	}
+}
+
+void countError(void)
+{
+	if(!errorsMutexInitialised) {
+		errors++;
+		return;
+	}
+	LOCK(errorsMutex);
+	errors++;
+	UNLOCK(errorsMutex);
+}
+
+rfbScreenInfoPtr newTestServer(int* argc,char** argv,int width,int height,int port)
+{
+	rfbScreenInfoPtr server;
+
+	initErrorsMutex();
+	server=rfbGetScreen(argc,argv,width,height,8,3,4);
+	if(!server) {
+		rfbErr("Cannot create the server\n");
+		exit(1);
+	}
+	frameBuffer=server->frameBuffer=calloc((size_t)width*height,4);
+	if(!frameBuffer) {
+		rfbErr("Cannot allocate the framebuffer\n");
+		exit(1);
+	}
+	server->cursor=NULL;
+	server->port=port;
+	server->ipv6port=0;
+	return server;
+}
+
+void runTestServer(rfbScreenInfoPtr server)
+{
+	initErrorsMutex();
+	rfbInitServer(server);
+	rfbRunEventLoop(server,-1,TRUE);
+}
+
+void stopTestServer(rfbScreenInfoPtr server)
+{
+	rfbShutdownServer(server,TRUE);
+	rfbScreenCleanup(server);
+	free(frameBuffer);
+	frameBuffer=NULL;
+}
+
+void handleMessages(rfbClient* client,int usecs)
+{
+	while(WaitForMessage(client,usecs)>0)
+		if(!HandleRFBServerMessage(client)) {
+			countError();
+			break;
+		}
+}
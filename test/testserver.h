@@ -0,0 +1,29 @@
+#ifndef TESTSERVER_H
+#define TESTSERVER_H
+
+/*
+ * What the tests that talk to a server of their own over loopback share.
+ * Each test uses a port of its own, so that ctest can run them in
+ * parallel.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+/* the exit status, only to be read once the other threads are done */
+extern int errors;
+/* counts an error, from whichever thread */
+void countError(void);
+
+/* a screen with a zeroed 32 bit framebuffer and no cursor, listening on
+   port over IPv4 only; not running yet, so the test can set it up */
+rfbScreenInfoPtr newTestServer(int* argc,char** argv,int width,int height,int port);
+/* starts the event loop in the background */
+void runTestServer(rfbScreenInfoPtr server);
+/* shuts the server down, frees it and the framebuffer newTestServer() made */
+void stopTestServer(rfbScreenInfoPtr server);
+
+/* handles messages until none arrives for usecs */
+void handleMessages(rfbClient* client,int usecs);
+
+#endif
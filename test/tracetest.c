@@ -0,0 +1,166 @@
+/*
+ * A server and a client in one process trace to the same file, both
+ * started with -trace. The file has to hold the whole way of at least one
+ * update: the damage that started it, the server's update with its
+ * encoded rects, the client's update with its decoded ones and the
+ * FinishedFrameBufferUpdate callback, linked by flow events of one id.
+ * A screen whose arguments fail after -trace must not start the trace.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+#define MAX_IDS 4096
+
+static const int width=64,height=64;
+static const char* traceFile="tracetest.json";
+static volatile int stop,connected;
+static int finished;
+
+/* per flow id, which phases were seen */
+static unsigned long long ids[MAX_IDS];
+static int starts[MAX_IDS],steps[MAX_IDS],ends[MAX_IDS],encodes[MAX_IDS],decodes[MAX_IDS];
+static int nIds;
+
+static void finishedUpdate(rfbClient* client)
+{
+	finished++;
+}
+
+static void* runClient(void* arg)
+{
+	char* clientArgv[]={"tracetest","-trace",NULL,"-encodings","hextile","localhost:16"};
+	int clientArgc=6;
+	rfbClient* client=rfbGetClient(8,3,4);
+
+	clientArgv[2]=(char*)traceFile;
+	client->FinishedFrameBufferUpdate=finishedUpdate;
+	if(!rfbInitClient(client,&clientArgc,clientArgv)) {
+		countError();
+		connected=-1;
+		return NULL;
+	}
+	connected=1;
+	while(!stop) {
+		int n=WaitForMessage(client,100000);
+
+		if(n<0 || (n>0 && !HandleRFBServerMessage(client))) {
+			countError();
+			break;
+		}
+	}
+	rfbClientCleanup(client);
+	return NULL;
+}
+
+static int idIndex(unsigned long long id)
+{
+	int i;
+
+	for(i=0;i<nIds;i++)
+		if(ids[i]==id)
+			return i;
+	if(nIds==MAX_IDS)
+		return -1;
+	ids[nIds]=id;
+	return nIds++;
+}
+
+static unsigned long long number(const char* line,const char* key)
+{
+	const char* p=strstr(line,key);
+
+	return p ? strtoull(p+strlen(key),NULL,10) : 0;
+}
+
+int main(int argc,char** argv)
+{
+	char* serverArgv[]={"tracetest","-trace",NULL};
+	int serverArgc=3;
+	char* badArgv[]={"tracetest","-trace",NULL,"-rfbport"};
+	int badArgc=4;
+	rfbScreenInfoPtr server;
+	pthread_t thread;
+	FILE* f;
+	char line[1024];
+	int i,k,complete=0,lines=0,closed=0;
+
+	/* -rfbport lacks its port */
+	badArgv[2]=(char*)traceFile;
+	unlink(traceFile);
+	if(rfbGetScreen(&badArgc,badArgv,width,height,8,3,4)) {
+		rfbClientErr("a screen with bad arguments was made\n");
+		return 1;
+	}
+	if(access(traceFile,F_OK)==0) {
+		rfbClientErr("bad arguments started the trace\n");
+		countError();
+	}
+
+	serverArgv[2]=(char*)traceFile;
+	server=newTestServer(&serverArgc,serverArgv,width,height,5916);
+	runTestServer(server);
+
+	pthread_create(&thread,NULL,runClient,NULL);
+	while(!connected)
+		usleep(10000);
+
+	for(i=0;i<100 && connected>0;i++) {
+		for(k=0;k<width*height;k++)
+			((uint32_t*)server->frameBuffer)[k]=i*0x10101+k;
+		rfbMarkRectAsModified(server,i%width,0,width,height/2+i%(height/2));
+		usleep(10000);
+	}
+	stop=1;
+	pthread_join(thread,NULL);
+
+	stopTestServer(server);
+
+	/* the trace is finished now that both have stopped it */
+	f=fopen(traceFile,"r");
+	if(!f) {
+		rfbClientErr("No trace written\n");
+		return 1;
+	}
+	while(fgets(line,sizeof(line),f)) {
+		int j;
+
+		lines++;
+		if(lines==1 && strcmp(line,"[\n")!=0)
+			countError();
+		if(strcmp(line,"]\n")==0)
+			closed=1;
+		if(strstr(line,"\"ph\":\"s\"") && (j=idIndex(number(line,"\"id\":")))>=0)
+			starts[j]++;
+		if(strstr(line,"\"ph\":\"t\"") && (j=idIndex(number(line,"\"id\":")))>=0)
+			steps[j]++;
+		if(strstr(line,"\"ph\":\"f\"") && (j=idIndex(number(line,"\"id\":")))>=0)
+			ends[j]++;
+		if(strstr(line,"\"name\":\"encode\"") && (j=idIndex(number(line,"\"update\":")))>=0)
+			encodes[j]++;
+		if(strstr(line,"\"name\":\"decode\"") && (j=idIndex(number(line,"\"update\":")))>=0)
+			decodes[j]++;
+	}
+	fclose(f);
+	unlink(traceFile);
+
+	for(i=0;i<nIds;i++)
+		if(ids[i]>>32!=0 && starts[i]==1 && steps[i]==2 && ends[i]==1 &&
+		   encodes[i]>0 && decodes[i]==encodes[i])
+			complete++;
+
+	rfbClientLog("%d trace lines, %d update ids, %d traced all the way, %d updates finished, %d errors\n",
+		lines,nIds,complete,finished,errors);
+
+	return errors>0 || !closed || complete==0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Runs a session through the custom transport hooks, over a socket the
+ * test connects itself and libvncclient never sees, and checks that the
+ * picture arrives and that all of the traffic went through the hooks.
+ * Then the write hook fails: a hook that writes nothing has to end the
+ * write, one that keeps saying EAGAIN must not be retried in a busy loop.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=320,height=240;
+static int fd=-1;
+static long bytesRead,bytesWritten,waits;
+static long stalledWrites;
+static struct timeval stallStart;
+
+static int readFromTransport(rfbClient* client,char* buf,int len)
+{
+	int n=recv(fd,buf,len,MSG_DONTWAIT);
+
+	if(n>0)
+		bytesRead+=n;
+	return n;
+}
+
+static int writeToTransport(rfbClient* client,const char* buf,int len)
+{
+	int n=send(fd,buf,len,0);
+
+	if(n>0)
+		bytesWritten+=n;
+	return n;
+}
+
+static int writeNothing(rfbClient* client,const char* buf,int len)
+{
+	return 0;
+}
+
+/* EAGAIN for 20ms */
+static int writeAfterStall(rfbClient* client,const char* buf,int len)
+{
+	struct timeval now;
+
+	gettimeofday(&now,NULL);
+	if((now.tv_sec-stallStart.tv_sec)*1000000L+(now.tv_usec-stallStart.tv_usec)<20000) {
+		stalledWrites++;
+		errno=EAGAIN;
+		return -1;
+	}
+	return writeToTransport(client,buf,len);
+}
+
+static int waitForTransport(rfbClient* client,unsigned int usecs)
+{
+	struct pollfd p;
+
+	p.fd=fd;
+	p.events=POLLIN;
+	waits++;
+	return poll(&p,1,usecs/1000);
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	struct sockaddr_in addr;
+	uint32_t* fb;
+	int i,differences=0;
+
+	server=newTestServer(&argc,argv,width,height,5912);
+	runTestServer(server);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(5912);
+	addr.sin_addr.s_addr=inet_addr("127.0.0.1");
+	fd=socket(AF_INET,SOCK_STREAM,0);
+	if(fd<0 || connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0)
+		return 1;
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="zrle raw";
+	client->ReadFromTransport=readFromTransport;
+	client->WriteToTransport=writeToTransport;
+	client->WaitForTransport=waitForTransport;
+	if(!rfbInitClient(client,NULL,NULL))
+		return 1;
+	if(client->sock!=RFB_INVALID_SOCKET)
+		countError();
+
+	fb=(uint32_t*)server->frameBuffer;
+	for(i=0;i<width*height;i++)
+		fb[i]=(i*2654435761u)&0xffffff;
+	rfbMarkRectAsModified(server,0,0,width,height);
+	handleMessages(client,200000);
+
+	for(i=0;i<width*height;i++)
+		if((((uint32_t*)client->frameBuffer)[i]&0xffffff)!=fb[i])
+			differences++;
+
+	client->WriteToTransport=writeNothing;
+	if(SendFramebufferUpdateRequest(client,0,0,width,height,FALSE)) {
+		rfbClientErr("a write that wrote nothing succeeded\n");
+		countError();
+	}
+	client->WriteToTransport=writeAfterStall;
+	gettimeofday(&stallStart,NULL);
+	if(!SendFramebufferUpdateRequest(client,0,0,width,height,FALSE))
+		countError();
+	if(stalledWrites>100) {
+		rfbClientErr("%ld tries to write during a stall of 20ms\n",stalledWrites);
+		countError();
+	}
+
+	rfbClientLog("%ld bytes read, %ld written, %ld waits through the transport, %ld tries during a stall, %d pixels differ, %d errors\n",
+		bytesRead,bytesWritten,waits,stalledWrites,differences,errors);
+
+	rfbClientCleanup(client);
+	close(fd);
+	stopTestServer(server);
+
+	return differences>0 || bytesRead==0 || bytesWritten==0 || waits==0 || errors>0;
+}
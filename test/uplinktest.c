@@ -0,0 +1,117 @@
+/*
+ * Two clients keep asking for full screen raw updates of a screen with
+ * uplinkRate set, one of them with three times the weight of the other.
+ * Together they have to stay near the rate, and the heavier one has to
+ * get about three times as much.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=128,height=128,rate=2*1024*1024,seconds=3;
+static volatile int stop;
+static int connected;
+static volatile unsigned long received[2];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+static enum rfbNewClientAction newClient(rfbClientPtr cl)
+{
+	/* the first one to connect is the heavy one */
+	cl->uplinkWeight=connected++==0 ? 3 : 1;
+	return RFB_CLIENT_ACCEPT;
+}
+
+static void gotUpdate(rfbClient* client,int x,int y,int w,int h)
+{
+	int* index=(int*)rfbClientGetClientData(client,gotUpdate);
+
+	received[*index]+=w*h*4;
+}
+
+static void* runClient(void* arg)
+{
+	char* clientArgv[]={"uplinktest","localhost:15"};
+	int clientArgc=2;
+	rfbClient* client=rfbGetClient(8,3,4);
+
+	client->appData.encodingsString="raw";
+	client->GotFrameBufferUpdate=gotUpdate;
+	rfbClientSetClientData(client,gotUpdate,arg);
+	if(!rfbInitClient(client,&clientArgc,clientArgv)) {
+		countError();
+		return NULL;
+	}
+	while(!stop) {
+		int n=WaitForMessage(client,100000);
+
+		if(n<0 || (n>0 && !HandleRFBServerMessage(client))) {
+			countError();
+			break;
+		}
+	}
+	rfbClientCleanup(client);
+	return NULL;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	pthread_t threads[2];
+	int index[2]={0,1},i;
+	unsigned long total;
+	double start,elapsed,ratio;
+
+	server=newTestServer(&argc,argv,width,height,5915);
+	server->uplinkRate=rate;
+	server->newClientHook=newClient;
+	runTestServer(server);
+
+	for(i=0;i<2;i++) {
+		pthread_create(&threads[i],NULL,runClient,&index[i]);
+		while(connected<=i && !errors)
+			usleep(10000);
+	}
+
+	/* let both get going, then measure */
+	start=now();
+	while(now()-start<0.5) {
+		rfbMarkRectAsModified(server,0,0,width,height);
+		usleep(5000);
+	}
+	received[0]=received[1]=0;
+	start=now();
+	while(now()-start<seconds) {
+		rfbMarkRectAsModified(server,0,0,width,height);
+		usleep(5000);
+	}
+	elapsed=now()-start;
+	total=received[0]+received[1];
+	ratio=received[1]>0 ? (double)received[0]/received[1] : 0;
+	stop=1;
+	for(i=0;i<2;i++)
+		pthread_join(threads[i],NULL);
+
+	rfbClientLog("%lu and %lu bytes in %.1fs, %.0f bytes/s of %d, ratio %.2f, %d errors\n",
+		received[0],received[1],elapsed,total/elapsed,rate,ratio,errors);
+
+	stopTestServer(server);
+
+	return errors>0 || total/elapsed>rate*1.2 || total/elapsed<rate*0.6 ||
+		ratio<2.2 || ratio>4;
+}
@@ -0,0 +1,178 @@
+/*
+ * Marks a block of the screen and a single tile away from it as modified
+ * in every slot of 100ms, and checks that
+ *
+ * - nothing is tracked while handleVideoRegions is off;
+ * - the block is taken for video and the single tile is not;
+ * - the heat map counts the slots both changed in;
+ * - the output thread of a client whose next video frame is not due yet
+ *   waits for it instead of polling.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "testserver.h"
+#include <rfb/rfbregion.h>
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=320,height=240;
+#define COLS 10
+#define ROWS 8
+#define SLOTS 14
+/* the last slots, in which the block is video */
+#define VIDEO_SLOTS 5
+
+static int finished;
+static pthread_mutex_t finishedMutex=PTHREAD_MUTEX_INITIALIZER;
+
+static void displayFinished(rfbClientPtr cl,int result)
+{
+	pthread_mutex_lock(&finishedMutex);
+	finished++;
+	pthread_mutex_unlock(&finishedMutex);
+}
+
+static int getFinished(void)
+{
+	int n;
+
+	pthread_mutex_lock(&finishedMutex);
+	n=finished;
+	pthread_mutex_unlock(&finishedMutex);
+	return n;
+}
+
+static long msSince(const struct timeval* t)
+{
+	struct timeval now;
+
+	gettimeofday(&now,NULL);
+	return (now.tv_sec-t->tv_sec)*1000L+(now.tv_usec-t->tv_usec)/1000;
+}
+
+static void damage(rfbScreenInfoPtr server)
+{
+	/* tiles 2-6 x 2-5 */
+	rfbMarkRectAsModified(server,64,64,224,192);
+	/* tile 9 x 0 */
+	rfbMarkRectAsModified(server,290,4,294,8);
+}
+
+static void handleMessagesFor(rfbClient* client,int ms)
+{
+	struct timeval start;
+
+	gettimeofday(&start,NULL);
+	while(msSince(&start)<ms)
+		if(WaitForMessage(client,10000)>0 && !HandleRFBServerMessage(client)) {
+			countError();
+			break;
+		}
+}
+
+static rfbBool isVideo(sraRegionPtr video,int x1,int y1,int x2,int y2)
+{
+	sraRegionPtr rect=sraRgnCreateRect(x1,y1,x2,y2);
+	rfbBool result;
+
+	if(video)
+		sraRgnSubtract(rect,video);
+	result=sraRgnEmpty(rect);
+	sraRgnDestroy(rect);
+	return result;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	char* clientArgv[]={"videoregiontest","localhost:20"};
+	int clientArgc=2;
+	uint32_t counts[COLS*ROWS];
+	sraRegionPtr video;
+	int i,cols,rows,sends=0;
+
+	server=newTestServer(&argc,argv,width,height,5920);
+	server->displayFinishedHook=displayFinished;
+	server->videoFrameRate=1;
+	runTestServer(server);
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString="raw";
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+
+	/* off */
+	for(i=0;i<3;i++) {
+		damage(server);
+		handleMessagesFor(client,100);
+	}
+	video=rfbGetVideoRegion(server);
+	if(video) {
+		rfbErr("video found while handleVideoRegions is off\n");
+		sraRgnDestroy(video);
+		countError();
+	}
+	if(rfbStatGetDamageHeatmap(server,counts,COLS*ROWS,&cols,&rows)!=COLS*ROWS) {
+		rfbErr("heat map is not %dx%d\n",COLS,ROWS);
+		return 1;
+	}
+	for(i=0;i<COLS*ROWS;i++)
+		if(counts[i]) {
+			rfbErr("damage counted while handleVideoRegions is off\n");
+			countError();
+			break;
+		}
+
+	/* on */
+	server->handleVideoRegions=TRUE;
+	for(i=0;i<SLOTS;i++) {
+		if(i==SLOTS-VIDEO_SLOTS)
+			sends=getFinished();
+		damage(server);
+		handleMessagesFor(client,100);
+	}
+	sends=getFinished()-sends;
+
+	video=rfbGetVideoRegion(server);
+	if(!isVideo(video,64,64,224,192)) {
+		rfbErr("the block is not video\n");
+		countError();
+	}
+	if(isVideo(video,288,0,320,32)) {
+		rfbErr("the single tile is video\n");
+		countError();
+	}
+	if(video)
+		sraRgnDestroy(video);
+
+	rfbStatGetDamageHeatmap(server,counts,COLS*ROWS,&cols,&rows);
+	rfbPrintDamageHeatmap(server);
+	if(counts[2*COLS+2]<SLOTS-2 || counts[5*COLS+6]<SLOTS-2 || counts[9]<SLOTS-2 ||
+	   counts[0]!=0 || counts[7*COLS+9]!=0) {
+		rfbErr("the heat map is off\n");
+		countError();
+	}
+
+	/* one update per slot for the single tile, and at most a video frame */
+	rfbClientLog("%d updates in the last %d slots\n",sends,VIDEO_SLOTS);
+	if(sends>4*VIDEO_SLOTS) {
+		rfbClientErr("the output thread polls\n");
+		countError();
+	}
+
+	rfbClientLog("%d errors\n",errors);
+
+	free(client->frameBuffer);
+	rfbClientCleanup(client);
+	stopTestServer(server);
+
+	return errors>0;
+}
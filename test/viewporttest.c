@@ -0,0 +1,115 @@
+/*
+ * Asks for the whole of a big remote desktop while only a small viewport
+ * of it is kept, so that every encoding has to deliver rects that cross
+ * the viewport's border. Their visible part has to arrive, and the
+ * scratch memory for decoding them must stay far below their size.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "testserver.h"
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && !defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#error "I need pthreads or win32 threads for that."
+#endif
+
+static const int width=1024,height=768;
+static const int vx=400,vy=300,vw=200,vh=150;
+
+static void drawPicture(rfbScreenInfoPtr server)
+{
+	static const uint32_t colours[]={0x204080,0xffffff,0x000000,0x10c010};
+	uint32_t* fb=(uint32_t*)server->frameBuffer;
+	int x,y;
+
+	for(y=0;y<height;y++)
+		for(x=0;x<width;x++)
+			if(x>=550 && x<700 && y>=400 && y<500)
+				fb[y*width+x]=(x*31+y*17)*2654435761u&0xffffff;
+			else
+				fb[y*width+x]=colours[(x/64+y/48)%4];
+	for(y=280;y<320;y++)
+		for(x=380;x<440;x++)
+			fb[y*width+x]=colours[((x/3)^(y/5))%4];
+}
+
+static int countDifferences(rfbScreenInfoPtr server,rfbClient* client)
+{
+	uint32_t* a=(uint32_t*)server->frameBuffer;
+	uint32_t* b=(uint32_t*)client->frameBuffer;
+	int x,y,count=0;
+
+	for(y=0;y<vh;y++)
+		for(x=0;x<vw;x++)
+			if((a[(y+vy)*width+x+vx]^b[y*vw+x])&0xffffff)
+				count++;
+	return count;
+}
+
+static int receive(rfbScreenInfoPtr server,const char* encoding)
+{
+	rfbClient* client;
+	char* clientArgv[]={"viewporttest","localhost:19"};
+	int clientArgc=2,differences;
+	size_t rectSize=(size_t)width*height*4;
+
+	client=rfbGetClient(8,3,4);
+	client->appData.encodingsString=encoding;
+	client->appData.enableJPEG=FALSE;
+	client->appData.useRemoteCursor=TRUE;
+	rfbClientSetViewport(client,vx,vy,vw,vh);
+	if(!rfbInitClient(client,&clientArgc,clientArgv)) {
+		countError();
+		return 0;
+	}
+	handleMessages(client,200000);
+
+	memset(client->frameBuffer,0,(size_t)vw*vh*4);
+	if(!SendFramebufferUpdateRequest(client,0,0,width,height,FALSE))
+		countError();
+	handleMessages(client,200000);
+	differences=countDifferences(server,client);
+
+	rfbClientLog("%s: %d pixels differ, %lu bytes of scratch for rects of up to %lu\n",
+		encoding,differences,(unsigned long)client->viewportBufferSize,(unsigned long)rectSize);
+	if(client->viewportBufferSize>rectSize/8 || client->viewportClipping) {
+		rfbClientErr("%s: scratch buffer too big\n",encoding);
+		countError();
+	}
+
+	free(client->frameBuffer);
+	rfbClientCleanup(client);
+	return differences;
+}
+
+int main(int argc,char** argv)
+{
+	rfbScreenInfoPtr server;
+	static const char* encodings[]={
+		"raw","hextile","rre","corre",
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+		"zlib","zrle",
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+		"tight",
+#endif
+#endif
+		"ultra"
+	};
+	int i,differences=0;
+
+	server=newTestServer(&argc,argv,width,height,5919);
+	drawPicture(server);
+	runTestServer(server);
+
+	for(i=0;i<(int)(sizeof(encodings)/sizeof(encodings[0]));i++)
+		differences+=receive(server,encodings[i]);
+
+	rfbClientLog("%d pixels differ, %d errors\n",differences,errors);
+
+	stopTestServer(server);
+
+	return differences>0 || errors>0;
+}
@@ -167,27 +167,83 @@ static uint64_t run_test(struct ws_frame_test *ft, ws_ctx_t *ctx)
 }
 
 
-int main()
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/* permessage-deflate; these depend on zlib's output, so are built here */
+static struct ws_frame_test deflate_tests[2];
+
+static int put_frame(char *dst, unsigned char b0, const unsigned char *payload, int len)
 {
-  ws_ctx_t ctx;
-  int retall= 0;
+  static const unsigned char mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+  int n = 0, i;
+
+  dst[n++] = b0;
+  if (len < 126) {
+    dst[n++] = 0x80 | len;
+  } else {
+    dst[n++] = 0x80 | 126;
+    dst[n++] = len >> 8;
+    dst[n++] = len & 0xff;
+  }
+  memcpy(dst + n, mask, 4);
+  n += 4;
+  for (i = 0; i < len; i++)
+    dst[n++] = payload[i] ^ mask[i % 4];
+  return n;
+}
+
+/* the second message is sent in two frames and refers back to the first */
+static void build_deflate_tests(void)
+{
+  static const char *text[2] = {
+    "Compressed binary frame. Compressed binary frame. Compressed binary frame.",
+    "Compressed binary frame, compressed binary frame, compressed again."
+  };
+  unsigned char out[1024];
+  z_stream zs;
+  int i, len;
+
+  memset(&zs, 0, sizeof(zs));
+  deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  for (i = 0; i < 2; i++) {
+    struct ws_frame_test *ft = &deflate_tests[i];
+
+    zs.next_in = (Bytef *)text[i];
+    zs.avail_in = strlen(text[i]);
+    zs.next_out = out;
+    zs.avail_out = sizeof(out);
+    deflate(&zs, Z_SYNC_FLUSH);
+    /* without the trailing 00 00 ff ff */
+    len = sizeof(out) - zs.avail_out - 4;
+
+    if (i == 0) {
+      ft->frame_len = put_frame(ft->frame, 0xc2, out, len);
+      ft->descr = "Compressed binary frame";
+    } else {
+      ft->frame_len = put_frame(ft->frame, 0x42, out, len / 2);
+      ft->frame_len += put_frame(ft->frame + ft->frame_len, 0x80, out + len / 2, len - len / 2);
+      ft->descr = "Compressed fragmented binary frame with context takeover";
+    }
+    memcpy(ft->expectedDecodeBuf, text[i], strlen(text[i]));
+    ft->raw_payload_len = strlen(text[i]);
+  }
+  deflateEnd(&zs);
+}
+#endif
+
+
+static int run_tests(struct ws_frame_test *t, int n, ws_ctx_t *ctx)
+{
+  int retall = 0;
   int i;
-  srand(RND_SEED);
-  
-  hybiDecodeCleanupComplete(&ctx);
-  ctx.decode = webSocketsDecodeHybi;
-  ctx.ctxInfo.readFunc = emu_read;
-  rfbLog = logtest;
-  rfbErr = logtest;
 
-  for (i = 0; i < ARRAYSIZE(tests); i++) {
+  for (i = 0; i < n; i++) {
     int ret;
 
     /* reset output log buffer to begin */
     el_pos = el_log;
 
-    ret = run_test(&tests[i], &ctx);
-    printf("%s: \"%s\"\n", ret == 0 ? "PASS" : "FAIL", tests[i].descr);
+    ret = run_test(&t[i], ctx);
+    printf("%s: \"%s\"\n", ret == 0 ? "PASS" : "FAIL", t[i].descr);
     if (ret != 0) {
       *el_pos = '\0';
       printf("%s", el_log);
@@ -197,6 +253,34 @@ int main()
   return retall;
 }
 
+
+int main()
+{
+  ws_ctx_t ctx;
+  int retall= 0;
+  srand(RND_SEED);
+  
+  memset(&ctx, 0, sizeof(ctx));
+  hybiDecodeCleanupComplete(&ctx);
+  ctx.decode = webSocketsDecodeHybi;
+  ctx.ctxInfo.readFunc = emu_read;
+  rfbLog = logtest;
+  rfbErr = logtest;
+
+  retall = run_tests(tests, ARRAYSIZE(tests), &ctx);
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  build_deflate_tests();
+  ctx.deflate = 1;
+  inflateInit2(&ctx.inflateStream, -15);
+  if (run_tests(deflate_tests, ARRAYSIZE(deflate_tests), &ctx) != 0)
+    retall = -1;
+  inflateEnd(&ctx.inflateStream);
+  free(ctx.inflateBuf);
+#endif
+  return retall;
+}
+
 #else
 
 int main() {
@@ -0,0 +1,123 @@
+/*
+ * Draws on an X display, which has to be 320x240 at depth 24 like the one
+ * xvfb-run starts for it, and checks that the capture picks up every
+ * change, that a client gets the same picture and that the cursor is
+ * followed.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#endif
+#include <stdlib.h>
+#include "testserver.h"
+#include <X11/Xlib.h>
+
+#if !defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
+#error "I need pthreads for that."
+#endif
+
+static const int width=320,height=240;
+
+static uint32_t toRGB(rfbPixelFormat* f,uint32_t p)
+{
+	return ((p>>f->redShift)&f->redMax)<<16 | ((p>>f->greenShift)&f->greenMax)<<8 |
+		((p>>f->blueShift)&f->blueMax);
+}
+
+static uint32_t serverPixel(rfbScreenInfoPtr server,int x,int y)
+{
+	return toRGB(&server->serverFormat,
+		*(uint32_t*)(server->frameBuffer+y*server->paddedWidthInBytes+x*4));
+}
+
+static uint32_t clientPixel(rfbClient* client,int x,int y)
+{
+	return toRGB(&client->format,((uint32_t*)client->frameBuffer)[y*width+x]);
+}
+
+static void captureAndHandleMessages(rfbX11Capture* capture,rfbClient* client,int n)
+{
+	while(n-->0) {
+		if(!rfbX11CaptureProcessEvents(capture,10000))
+			countError();
+		handleMessages(client,10000);
+	}
+}
+
+int main(int argc,char** argv)
+{
+	rfbX11Capture* capture;
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	char* clientArgv[]={"x11capturetest","localhost:4"};
+	int clientArgc=2;
+	Display* dpy;
+	Window root;
+	GC gc;
+	int n,x,y,wrong=0,differences=0;
+
+	dpy=XOpenDisplay(NULL);
+	if(!dpy)
+		return 1;
+	root=DefaultRootWindow(dpy);
+	gc=XCreateGC(dpy,root,0,NULL);
+
+	capture=rfbX11CaptureNew(&argc,argv,NULL);
+	if(!capture)
+		return 1;
+	server=rfbX11CaptureGetScreen(capture);
+	if(server->width!=width || server->height!=height || server->serverFormat.bitsPerPixel!=32)
+		return 1;
+	server->port=5904;
+	server->ipv6port=0;
+	runTestServer(server);
+
+	client=rfbGetClient(8,3,4);
+	/* or the server draws the cursor into what it sends */
+	client->appData.useRemoteCursor=TRUE;
+	if(!rfbInitClient(client,&clientArgc,clientArgv))
+		return 1;
+	captureAndHandleMessages(capture,client,20);
+
+	for(n=0;n<4;n++) {
+		uint32_t colour=0x102030*(n+1)+0x400000*(n&1);
+		int rx=16+n*40,ry=8+n*30,rw=64+n*8,rh=48;
+
+		XSetForeground(dpy,gc,colour);
+		XFillRectangle(dpy,root,gc,rx,ry,rw,rh);
+		XSync(dpy,False);
+		captureAndHandleMessages(capture,client,30);
+
+		for(y=ry;y<ry+rh;y++)
+			for(x=rx;x<rx+rw;x++)
+				if(serverPixel(server,x,y)!=colour)
+					wrong++;
+		for(y=0;y<height;y++)
+			for(x=0;x<width;x++)
+				if(serverPixel(server,x,y)!=clientPixel(client,x,y))
+					differences++;
+	}
+
+	XWarpPointer(dpy,None,root,0,0,0,0,100,50);
+	XSync(dpy,False);
+	captureAndHandleMessages(capture,client,10);
+	if(server->cursorX!=100 || server->cursorY!=50) {
+		rfbClientErr("cursor at %d,%d\n",server->cursorX,server->cursorY);
+		countError();
+	}
+	if(!server->cursor || !server->cursor->richSource || !server->cursor->alphaSource) {
+		rfbClientErr("no cursor image\n");
+		countError();
+	}
+
+	rfbClientLog("%d pixels not captured, %d differ on the client, %d errors\n",
+		wrong,differences,errors);
+
+	rfbClientCleanup(client);
+	rfbShutdownServer(server,TRUE);
+	rfbX11CaptureFree(capture);
+	XFreeGC(dpy,gc);
+	XCloseDisplay(dpy);
+
+	return wrong>0 || differences>0 || errors>0;
+}